@@ -16,6 +16,7 @@
 //#include "../../tools/extract_features.cpp"
 //#include "../../tools/convert_imageset.cpp"
 //#include "../tools/compute_image_mean.cpp"
+//#include "../tools/decode_benchmark.cpp"
 
 //#include "../tools/predict.cpp"
 //#include "../examples/cpp_classification/classification.cpp"
@@ -1,11 +1,15 @@
 #ifndef CAFFE_DATA_LAYERS_HPP_
 #define CAFFE_DATA_LAYERS_HPP_
 
+#include <deque>
+#include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread.hpp"
 #include "hdf5.h"
 
 #include "caffe/blob.hpp"
@@ -16,7 +20,10 @@
 #include "caffe/layer.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
+#include "caffe/util/lru_cache.hpp"
 
 namespace caffe {
 
@@ -52,9 +59,57 @@ class BaseDataLayer : public Layer<Dtype> {
   bool output_labels_;
 };
 
+/**
+ * @brief Milliseconds a prefetching data layer spent in each stage, summed
+ *        over batches. Stages run by several threads add up each thread's
+ *        time; forward_wait is the time Forward blocked on the prefetch
+ *        thread and queue_wait the time finished batches sat unused.
+ */
+struct PrefetchStats {
+  PrefetchStats() : batches(0), read(0), decode(0), transform(0),
+      queue_wait(0), forward_wait(0) {}
+  void Add(const PrefetchStats& other);
+  // One line, per-batch averages, for the solver and `caffe time` logs.
+  string ToString() const;
+
+  int batches;
+  double read;
+  double decode;
+  double transform;
+  double queue_wait;
+  double forward_wait;
+};
+
+/**
+ * @brief Keeps the PrefetchStats of a layer that prefetches on a thread.
+ *
+ * The prefetch thread adds its stage times to batch_stats_ and calls
+ * BatchReady when done; Forward brackets the join with StartForwardWait and
+ * EndForwardWait, which fold batch_stats_ into the totals. The totals are
+ * only touched on the thread calling Forward.
+ */
+class PrefetchStatsRecorder {
+ public:
+  PrefetchStatsRecorder() {}
+  virtual ~PrefetchStatsRecorder() {}
+  const PrefetchStats& prefetch_stats() const { return prefetch_stats_; }
+  void ResetPrefetchStats() { prefetch_stats_ = PrefetchStats(); }
+
+ protected:
+  void BatchReady() { ready_timer_.Start(); }
+  void StartForwardWait() { wait_timer_.Start(); }
+  void EndForwardWait();
+
+  PrefetchStats batch_stats_;
+  PrefetchStats prefetch_stats_;
+  CPUTimer ready_timer_;
+  CPUTimer wait_timer_;
+};
+
 template <typename Dtype>
 class BasePrefetchingDataLayer :
-    public BaseDataLayer<Dtype>, public InternalThread {
+    public BaseDataLayer<Dtype>, public InternalThread,
+    public PrefetchStatsRecorder {
  public:
   explicit BasePrefetchingDataLayer(const LayerParameter& param)
       : BaseDataLayer<Dtype>(param) {}
@@ -81,11 +136,26 @@ class BasePrefetchingDataLayer :
   Blob<Dtype> transformed_data_;
 };
 
+/**
+ * @brief Provides data to the Net from a leveldb, lmdb or packed db.
+ *
+ * With data_param.cache_samples, the transformed samples of the first pass
+ * over the db are kept (in RAM or in a packed db at cache_file) and later
+ * epochs are copied from there. With data_param.echo_factor > 1, every
+ * batch is served that many times. In both cases mirroring, if on, is
+ * applied as each sample is served rather than when it is transformed.
+ * With data_param.bucket_window, images of different sizes are batched
+ * with others of about the same size (see LoadBucketedBatch). With
+ * data_param.num_shards, the layer reads only its shard's batches.
+ */
 template <typename Dtype>
 class DataLayer : public BasePrefetchingDataLayer<Dtype> {
  public:
   explicit DataLayer(const LayerParameter& param)
-      : BasePrefetchingDataLayer<Dtype>(param) {}
+      : BasePrefetchingDataLayer<Dtype>(param), skip_(0), mirror_(false),
+        cache_size_(0), cache_pos_(0), records_read_(0), cache_ready_(false),
+        echoes_left_(0), num_bucketed_(0), records_pulled_(0),
+        shard_pos_(0) {}
   virtual ~DataLayer();
   virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -97,9 +167,69 @@ class DataLayer : public BasePrefetchingDataLayer<Dtype> {
 
  protected:
   virtual void InternalThreadEntry();
+  // Fills the prefetch blobs with the next batch, from the db or the cache.
+  void LoadBatch();
+  // Serves the batch already in the prefetch blobs once more.
+  void EchoBatch();
+  // Parses the record under the cursor and, if it holds an encoded image,
+  // decodes it into cv_img. Adds the microseconds taken to the two times.
+  void ReadRecord(Datum* datum, cv::Mat* cv_img, double* read_time,
+      double* decode_time);
+  // Tops the buckets up to bucket_window batches of records, then takes a
+  // batch from the fullest bucket: the current one if it still holds a
+  // batch (sparing the net a reshape), or the one holding the oldest record
+  // once that has waited through two windows, so no size starves. A bucket
+  // short of a batch is completed from the buckets of the nearest sizes.
+  void LoadBucketedBatch();
+  // Moves the cursor to the next record, noting where the db wraps around.
+  void NextRecord();
+  void CacheSample(const Dtype* data, Dtype label);
+  void ReadCachedSample(Dtype* data, Dtype* label);
+  // Called once the cache holds every record: switches it to reading.
+  void FinishCache();
+  // Flips rows rows of width values left to right, like the
+  // DataTransformer mirrors a sample.
+  void MirrorSample(Dtype* data, int rows, int width);
 
   shared_ptr<db::DB> db_;
   shared_ptr<db::Cursor> cursor_;
+  // Smallest size encoded images may be decoded at; 0 decodes at full size.
+  int decode_min_size_;
+  // Records skipped by rand_skip before the first batch.
+  int skip_;
+  // With mirror_ set, LoadBatch and EchoBatch do the mirroring, drawing
+  // from mirror_rng_, and samples are transformed by sample_transformer_,
+  // which does not mirror. Otherwise data_transformer_ does it all.
+  bool mirror_;
+  shared_ptr<DataTransformer<Dtype> > sample_transformer_;
+  shared_ptr<Caffe::RNG> mirror_rng_;
+
+  // Sample cache. cache_size_ is the number of records in the db, known
+  // once the cursor first wraps around; the cache is ready when it holds
+  // that many samples, in the order they were first read.
+  int cache_size_;
+  int cache_pos_;
+  int records_read_;
+  bool cache_ready_;
+  vector<Dtype> cache_data_;
+  vector<Dtype> cache_label_;
+  shared_ptr<db::DB> cache_db_;
+  shared_ptr<db::Transaction> cache_txn_;
+  shared_ptr<db::Cursor> cache_cursor_;
+  int echoes_left_;
+
+  // Records waiting for bucketed batching, by height and width rounded up
+  // to bucket_step, in arrival order.
+  struct BucketedRecord;
+  typedef std::map<std::pair<int, int>,
+      std::deque<shared_ptr<BucketedRecord> > > BucketMap;
+  BucketMap buckets_;
+  int num_bucketed_;
+  int64_t records_pulled_;
+  std::pair<int, int> current_bucket_;
+  Blob<Dtype> bucketed_sample_;
+  // With data_param.num_shards, the records read of the current batch.
+  int shard_pos_;
 };
 
 /**
@@ -137,13 +267,16 @@ class DummyDataLayer : public Layer<Dtype> {
 /**
  * @brief Provides data to the Net from HDF5 files.
  *
- * TODO(dox): thorough documentation for Forward and proto params.
+ * Rows are streamed from the listed files one batch at a time, through
+ * hyperslab reads on a prefetch thread, so only a batch of rows is ever held
+ * in memory and the next file is opened without stalling Forward.
  */
 template <typename Dtype>
-class HDF5DataLayer : public Layer<Dtype> {
+class HDF5DataLayer : public Layer<Dtype>, public InternalThread,
+    public PrefetchStatsRecorder {
  public:
   explicit HDF5DataLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), file_id_(-1) {}
   virtual ~HDF5DataLayer();
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -164,25 +297,40 @@ class HDF5DataLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
-  virtual void LoadHDF5FileData(const char* filename);
+  virtual void InternalThreadEntry();
+  void CreatePrefetchThread();
+  void JoinPrefetchThread();
+  // Opens hdf_filenames_[current_file_] and its datasets, one per top.
+  virtual void OpenHDF5File();
+  virtual void CloseHDF5File();
+  // Reads num_rows rows, starting at current_row_, of every dataset into the
+  // prefetch blobs starting at row offset.
+  virtual void ReadRows(int num_rows, int offset);
 
   std::vector<std::string> hdf_filenames_;
   unsigned int num_files_;
   unsigned int current_file_;
   hsize_t current_row_;
-  std::vector<shared_ptr<Blob<Dtype> > > hdf_blobs_;
+  hsize_t file_rows_;
+  hid_t file_id_;
+  std::vector<hid_t> dataset_ids_;
+  std::vector<shared_ptr<Blob<Dtype> > > prefetch_blobs_;
 };
 
 /**
  * @brief Write blobs to disk as HDF5 files.
  *
- * TODO(dox): thorough documentation for Forward and proto params.
+ * Every Forward appends its rows to two chunked, extensible datasets, data
+ * and label. The rows are copied into a free slot and written (and
+ * optionally compressed) by a background thread, so Forward only blocks when
+ * queue_size batches are already waiting.
  */
 template <typename Dtype>
-class HDF5OutputLayer : public Layer<Dtype> {
+class HDF5OutputLayer : public Layer<Dtype>, public InternalThread {
  public:
   explicit HDF5OutputLayer(const LayerParameter& param)
-      : Layer<Dtype>(param), file_opened_(false) {}
+      : Layer<Dtype>(param), file_opened_(false), data_dataset_(-1),
+        label_dataset_(-1), rows_written_(0) {}
   virtual ~HDF5OutputLayer();
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -206,13 +354,25 @@ class HDF5OutputLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
-  virtual void SaveBlobs();
+  virtual void InternalThreadEntry();
+  // Appends the rows of slot to the datasets, creating them on first use.
+  virtual void SaveBlobs(int slot);
+  // Appends the rows of blob to dataset *dataset_id.
+  void AppendRows(const Blob<Dtype>& blob, const char* dataset_name,
+      hid_t* dataset_id);
 
   bool file_opened_;
   std::string file_name_;
   hid_t file_id_;
-  Blob<Dtype> data_blob_;
-  Blob<Dtype> label_blob_;
+  hid_t data_dataset_;
+  hid_t label_dataset_;
+  hsize_t rows_written_;
+  // Slot i holds data_blobs_[i] and label_blobs_[i]; slots move from
+  // free_slots_ to full_slots_ in Forward and back in the writer thread.
+  std::vector<shared_ptr<Blob<Dtype> > > data_blobs_;
+  std::vector<shared_ptr<Blob<Dtype> > > label_blobs_;
+  shared_ptr<BlockingQueue<int> > free_slots_;
+  shared_ptr<BlockingQueue<int> > full_slots_;
 };
 
 /**
@@ -237,9 +397,18 @@ class ImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
   shared_ptr<Caffe::RNG> prefetch_rng_;
   virtual void ShuffleImages();
   virtual void InternalThreadEntry();
+  // Reads, through the caches if enabled, the images filenames[i] for
+  // i = start, start + step, ... into the same slots of *images.
+  void LoadImages(const vector<string>& filenames, int start, int step,
+      vector<cv::Mat>* images);
+  cv::Mat LoadImage(const string& filename);
 
   vector<std::pair<std::string, int> > lines_;
   int lines_id_;
+  shared_ptr<LRUCache<cv::Mat> > image_cache_;
+  shared_ptr<LRUCache<string> > encoded_cache_;
+  // Smallest size JPEGs may be decoded at before resizing; 0 is full size.
+  int decode_min_height_, decode_min_width_;
 };
 
 /**
@@ -250,8 +419,24 @@ class ImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
 template <typename Dtype>
 class MemoryDataLayer : public BaseDataLayer<Dtype> {
  public:
+  /// Counters of the batch ring, for sizing it and spotting which side
+  /// waits on the other.
+  struct RingStats {
+    RingStats() : pushed(0), popped(0), producer_waits(0), consumer_waits(0),
+        timeouts(0) {}
+    int64_t pushed;
+    int64_t popped;
+    // Pushes that found every slot taken (backpressure on producers).
+    int64_t producer_waits;
+    // Forwards that found no batch ready.
+    int64_t consumer_waits;
+    // Forwards that waited pop_timeout_ms with no batch ready and served the
+    // last batch again.
+    int64_t timeouts;
+  };
+
   explicit MemoryDataLayer(const LayerParameter& param)
-      : BaseDataLayer<Dtype>(param), has_new_data_(false) {}
+      : BaseDataLayer<Dtype>(param), has_new_data_(false), ring_slot_(-1) {}
   virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
@@ -268,6 +453,24 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
   void Reset(Dtype* data, Dtype* label, int n);
   void set_batch_size(int new_size);
 
+  /**
+   * @brief In ring mode, copies one batch (batch_size rows of data and
+   *        labels) into a free slot. Safe to call from several threads.
+   *
+   * Blocks while every slot is taken, or at most timeout_ms milliseconds
+   * when timeout_ms >= 0; returns false if the batch was not queued.
+   */
+  bool PushBatch(const Dtype* data, const Dtype* labels, int timeout_ms = -1);
+  /**
+   * @brief As PushBatch, but transforms batch_size Mats on the calling
+   *        thread, with a DataTransformer of the layer's own for that thread.
+   */
+  bool PushMatBatch(const vector<cv::Mat>& mat_vector,
+      const vector<int>& labels, int timeout_ms = -1);
+  /// Number of batches pushed and not yet consumed by Forward.
+  int ready_batches() { return full_slots_ ? full_slots_->size() : 0; }
+  RingStats ring_stats();
+
   int batch_size() { return batch_size_; }
   int channels() { return channels_; }
   int height() { return height_; }
@@ -276,6 +479,10 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  // Takes a free ring slot, waiting as PushBatch describes.
+  bool AcquireSlot(int timeout_ms, int* slot);
+  // The DataTransformer of the calling producer thread.
+  DataTransformer<Dtype>* ProducerTransformer();
 
   int batch_size_, channels_, height_, width_, size_;
   Dtype* data_;
@@ -285,6 +492,21 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
   Blob<Dtype> added_data_;
   Blob<Dtype> added_label_;
   bool has_new_data_;
+
+  // Ring mode: slot i is ring_data_[i] and ring_labels_[i]. A slot moves
+  // from free_slots_ to a producer, then to full_slots_, and is the top of
+  // the net (ring_slot_) until the next Forward returns it.
+  vector<shared_ptr<Blob<Dtype> > > ring_data_;
+  vector<shared_ptr<Blob<Dtype> > > ring_labels_;
+  shared_ptr<BlockingQueue<int> > free_slots_;
+  shared_ptr<BlockingQueue<int> > full_slots_;
+  int ring_slot_;
+  // DataTransformer keeps its own RNG, so each producer thread gets one.
+  map<boost::thread::id, shared_ptr<DataTransformer<Dtype> > >
+      producer_transformers_;
+  boost::mutex producer_transformers_mutex_;
+  boost::mutex stats_mutex_;
+  RingStats ring_stats_;
 };
 
 /**
@@ -309,10 +531,25 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
  protected:
   virtual unsigned int PrefetchRand();
   virtual void InternalThreadEntry();
+  // Decodes the image at image_index, or takes it from image_cache_.
+  cv::Mat LoadImage(int image_index);
+  // Handles the windows of every num_workers-th image group, starting with
+  // group start; each group lists the batch items cut from one image. Adds
+  // the milliseconds spent loading images and warping windows to *times
+  // (two entries).
+  void WarpWindows(const vector<vector<int> >& groups, int start,
+      int num_workers, Dtype* top_data, double* times);
+  // Crops window (one of the NUM-field vectors below) out of cv_img, warps,
+  // pads and mirrors it, and writes it to item item_id of top_data.
+  void WarpWindow(const cv::Mat& cv_img, const vector<float>& window,
+      bool do_mirror, int item_id, Dtype* top_data);
 
   shared_ptr<Caffe::RNG> prefetch_rng_;
   vector<std::pair<std::string, vector<int> > > image_database_;
   enum WindowField { IMAGE_INDEX, LABEL, OVERLAP, X1, Y1, X2, Y2, NUM };
+  // The windows and mirror flags sampled for the batch being prefetched.
+  vector<vector<float> > batch_windows_;
+  vector<bool> batch_mirror_;
   vector<vector<float> > fg_windows_;
   vector<vector<float> > bg_windows_;
   Blob<Dtype> data_mean_;
@@ -321,6 +558,7 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
   bool has_mean_values_;
   bool cache_images_;
   vector<std::pair<std::string, Datum > > image_database_cache_;
+  shared_ptr<LRUCache<cv::Mat> > image_cache_;
 };
 
 }  // namespace caffe
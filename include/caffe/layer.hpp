@@ -289,6 +289,40 @@ class Layer {
     param_propagate_down_[param_id] = value;
   }
 
+  /**
+   * @brief Returns whether the diff of the param blob at param_id holds no
+   *        gradient yet, so Backward should overwrite it instead of adding
+   *        to it.
+   *
+   * Net only leaves a diff fresh for layers that return true from
+   * OverwritesFreshParamDiffs(); others see their diffs zeroed as before.
+   */
+  inline bool param_diff_fresh(const int param_id) const {
+    return (param_diff_fresh_.size() > param_id) ?
+        param_diff_fresh_[param_id] : false;
+  }
+  /**
+   * @brief Sets whether the diff of the param blob at param_id is fresh.
+   */
+  inline void set_param_diff_fresh(const int param_id, const bool value) {
+    if (param_diff_fresh_.size() <= param_id) {
+      param_diff_fresh_.resize(param_id + 1, false);
+    }
+    param_diff_fresh_[param_id] = value;
+  }
+  /**
+   * @brief Returns true if Backward writes, rather than accumulates, the
+   *        gradient of every param whose diff is fresh, saving the pass
+   *        that would otherwise zero it.
+   */
+  virtual inline bool OverwritesFreshParamDiffs() const { return false; }
+  /**
+   * @brief Returns true if Forward draws random numbers, e.g. the masks of
+   *        dropout in training. Net can draw them again to recompute the
+   *        layer on the CPU, but not on the GPU.
+   */
+  virtual inline bool ForwardDrawsRandomNumbers() const { return false; }
+
   virtual DiagonalAffineMap<Dtype> coord_map() {
     NOT_IMPLEMENTED;
     // suppress warnings
@@ -309,6 +343,8 @@ class Layer {
   vector<shared_ptr<Blob<Dtype> > > blobs_;
   /** Vector indicating whether to compute the diff of each param blob. */
   vector<bool> param_propagate_down_;
+  /** Vector indicating whether the diff of each param blob is fresh. */
+  vector<bool> param_diff_fresh_;
 
   /** The vector that indicates whether each top blob has a non-zero weight in
    *  the objective function. */
@@ -11,9 +11,12 @@
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/rng.hpp"
 
 namespace caffe {
 
+class RawProtoFile;
+
 /**
  * @brief Connects Layer%s together into a directed acyclic graph (DAG)
  *        specified by a NetParameter.
@@ -66,6 +69,16 @@ class Net {
   void BackwardFromTo(int start, int end);
   void BackwardFrom(int start);
   void BackwardTo(int end);
+  /**
+   * @brief Zero the diffs of all the learnable params, ahead of a Backward
+   *        that accumulates into them.
+   *
+   * The zeroing is deferred: each diff is marked fresh, and a layer that
+   * overwrites fresh diffs writes its first gradient without the extra pass.
+   * BackwardFromTo zeroes the fresh diffs of all other layers, including
+   * those it does not reach.
+   */
+  void ClearParamDiffs();
 
   /**
    * @brief Reshape all layers from bottom to top.
@@ -95,11 +108,20 @@ class Net {
   /**
    * @brief For an already initialized net, copies the pre-trained layers from
    *        another Net.
+   *
+   * If param is the header of a raw proto file, raw_file must be that file.
+   * The file name version reads both binary protos and raw proto files.
    */
-  void CopyTrainedLayersFrom(const NetParameter& param);
+  void CopyTrainedLayersFrom(const NetParameter& param,
+      const RawProtoFile* raw_file = NULL);
   void CopyTrainedLayersFrom(const string trained_filename);
-  /// @brief Writes the net to a proto.
-  void ToProto(NetParameter* param, bool write_diff = false) const;
+  /// @brief Copies the values of the pre-trained layers of another Net, so
+  ///        they stay fixed while the other Net trains on.
+  void CopyTrainedLayersFrom(const Net* other);
+  /// @brief Writes the net to a proto, with the param blobs unless
+  ///        write_blobs is false.
+  void ToProto(NetParameter* param, bool write_diff = false,
+      bool write_blobs = true) const;
 
   /// @brief returns the network name.
   inline const string& name() const { return name_; }
@@ -172,6 +194,29 @@ class Net {
 
   void set_debug_info(const bool value) { debug_info_ = value; }
 
+  /// @brief returns the first and last layer of each segment whose
+  ///        activations are recomputed in backward instead of kept
+  inline const vector<pair<int, int> >& recompute_segments() const {
+    return recompute_segments_;
+  }
+
+  /**
+   * @brief Code run between the layers of a pass, e.g. to send the param
+   *        diffs of the layers done so far while the others compute.
+   */
+  class Callback {
+   protected:
+    virtual void run(int layer) = 0;
+
+    template <typename T>
+    friend class Net;
+  };
+  /// @brief Runs value after the backward of each layer BackwardFromTo
+  ///        reaches, once the param diffs of that layer are final.
+  void add_after_backward(Callback* value) {
+    after_backward_.push_back(value);
+  }
+
   // Helpers for Init.
   /**
    * @brief Remove layers that the user specified should be excluded given the current
@@ -201,6 +246,8 @@ class Net {
   void InputDebugInfo(const int layer_id);
   /// @brief Helper for displaying debug info in Forward.
   void ForwardDebugInfo(const int layer_id);
+  /// @brief Zero the diff of a layer's param if it is still fresh.
+  void ZeroFreshParamDiff(const int layer_id, const int param_id);
   /// @brief Helper for displaying debug info in Backward.
   void BackwardDebugInfo(const int layer_id);
   /// @brief Helper for displaying debug info in Update.
@@ -208,6 +255,32 @@ class Net {
 
   /// @brief Get misc parameters, e.g. the LR multiplier and weight decay.
   void GetLearningRateAndWeightDecay();
+  /**
+   * @brief Reshapes a layer before its forward pass, unless it has bottoms
+   *        and none of its bottom or top shapes changed since its last
+   *        Reshape, e.g. while a data layer keeps producing batches of one
+   *        bucket shape.
+   */
+  void ReshapeLayerIfNeeded(const int layer_id);
+  /// @brief Records the bottom and top shapes a layer was just reshaped to.
+  void RecordLayerShapes(const int layer_id);
+  /**
+   * @brief Helper for Init: sets up the recomputed segments of a train net
+   *        and logs the memory they save.
+   */
+  void InitRecompute(const NetParameter& param);
+  /// @brief Frees the data and diffs of the blobs internal to a segment.
+  void ReleaseSegment(const int segment);
+  /**
+   * @brief Saves the random state a segment's forward starts from; CHECKs
+   *        that none of its layers draws random numbers on the GPU.
+   */
+  void SaveSegmentRng(const int segment);
+  /**
+   * @brief Runs the forward of a released segment again, with the random
+   *        numbers of its last forward.
+   */
+  void RecomputeSegment(const int segment);
 
   /// @brief The network name
   string name_;
@@ -255,6 +328,19 @@ class Net {
   size_t memory_used_;
   /// Whether to compute and display debug info for the net.
   bool debug_info_;
+  /// The bottom then top shapes of each layer at its last Reshape.
+  vector<vector<vector<int> > > layer_shapes_;
+  vector<Callback*> after_backward_;
+  /// The recomputed segments, the segment of each layer and blob (-1 for
+  /// none; a blob belongs to a segment if only its layers use it), whether
+  /// the blobs of each segment are released, whether a forward saved the
+  /// state of the random generator at its start, and that state.
+  vector<pair<int, int> > recompute_segments_;
+  vector<int> layer_segment_;
+  vector<int> blob_segment_;
+  vector<bool> segment_released_;
+  vector<bool> segment_rng_saved_;
+  vector<rng_t> segment_rng_states_;
 
   DISABLE_COPY_AND_ASSIGN(Net);
 };
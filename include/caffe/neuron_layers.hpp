@@ -171,6 +171,9 @@ class DropoutLayer : public NeuronLayer<Dtype> {
       const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "Dropout"; }
+  virtual inline bool ForwardDrawsRandomNumbers() const {
+    return this->phase_ == TRAIN;
+  }
 
  protected:
   /**
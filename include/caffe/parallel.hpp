@@ -0,0 +1,73 @@
+#ifndef CAFFE_PARALLEL_HPP_
+#define CAFFE_PARALLEL_HPP_
+
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/transport.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Averages the param diffs of a Net over the ranks of a Transport.
+ *
+ * Backward computes the diffs of the last layers first, so the params are
+ * grouped into buckets from the last layer down. Between Start and Finish,
+ * each bucket is sent on a background thread as soon as the backward pass
+ * has gone through all of its layers, while the pass goes on with the
+ * layers before them.
+ */
+template <typename Dtype>
+class GradientAllReducer : public Net<Dtype>::Callback,
+    public InternalThread {
+ public:
+  // Buckets hold about bucket_size values; a larger param is a bucket of
+  // its own.
+  GradientAllReducer(Net<Dtype>* net,
+      shared_ptr<Transport<Dtype> > transport, int bucket_size);
+  virtual ~GradientAllReducer();
+
+  inline const Transport<Dtype>& transport() const { return *transport_; }
+
+  // Makes the next backward pass of the net send the buckets it completes.
+  // Only in CPU mode; otherwise Finish sends all of them.
+  void Start();
+  // Sends the buckets not sent yet, and blocks until all of the diffs hold
+  // their averages.
+  void Finish();
+  // Copies the param data of rank 0 to the other ranks.
+  void BroadcastParams();
+
+ protected:
+  struct Bucket {
+    vector<int> param_ids;
+    // The lowest layer of the params, after whose backward all are final.
+    int layer;
+    int count;
+    // The diffs of the params, packed, for buckets of more than one.
+    vector<Dtype> values;
+  };
+
+  virtual void run(int layer);
+  virtual void InternalThreadEntry();
+  void Reduce(Bucket* bucket);
+
+  Net<Dtype>* net_;
+  shared_ptr<Transport<Dtype> > transport_;
+  vector<Bucket> buckets_;
+  bool started_;
+  // The number of buckets queued in this pass; they are queued in order.
+  int num_queued_;
+  // Buckets for the thread to reduce; -1 stops it.
+  BlockingQueue<int> queued_;
+  BlockingQueue<int> reduced_;
+
+  DISABLE_COPY_AND_ASSIGN(GradientAllReducer);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_PARALLEL_HPP_
@@ -4,10 +4,71 @@
 #include <string>
 #include <vector>
 
+#include "caffe/internal_thread.hpp"
 #include "caffe/net.hpp"
+#include "caffe/parallel.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+namespace boost { class thread_group; }
 
 namespace caffe {
 
+/**
+ * @brief A snapshot copied out of a Solver, ready to be written without
+ *        touching the Solver again.
+ */
+template <typename Dtype>
+struct PendingSnapshot {
+  // The net without its param blobs; blobs holds copies of those, in layer
+  // order, num_layer_blobs[i] of them for layer i.
+  NetParameter net_param;
+  vector<shared_ptr<Blob<Dtype> > > blobs;
+  vector<int> num_layer_blobs;
+  bool write_diff;
+  // Writes the model as a raw proto file rather than a binary proto.
+  bool raw_format;
+  // The solver state; history is added to it from the copies in history.
+  SolverState state;
+  vector<shared_ptr<Blob<Dtype> > > history;
+  string model_filename;
+  string state_filename;
+
+  // Converts the copies to protos and writes both files atomically.
+  void WriteFiles();
+};
+
+/**
+ * @brief Writes PendingSnapshot%s on a background thread.
+ *
+ * It owns max_pending snapshot buffers, which go around between the solver
+ * filling them and the thread writing them, so the copies of the params
+ * reuse their memory from one snapshot to the next.
+ */
+template <typename Dtype>
+class SnapshotWriter : public InternalThread {
+ public:
+  explicit SnapshotWriter(int max_pending);
+  // Finishes writing the pending snapshots.
+  virtual ~SnapshotWriter();
+
+  // Returns a buffer to fill, blocking while all of them are being written.
+  PendingSnapshot<Dtype>* Acquire();
+  // Queues a buffer from Acquire for writing.
+  void Write(PendingSnapshot<Dtype>* snapshot);
+  // Blocks until every snapshot queued so far is on disk.
+  void WaitForPending();
+
+ protected:
+  virtual void InternalThreadEntry();
+
+  const int max_pending_;
+  BlockingQueue<PendingSnapshot<Dtype>*> free_;
+  // Snapshots waiting to be written; NULL stops the thread.
+  BlockingQueue<PendingSnapshot<Dtype>*> full_;
+
+  DISABLE_COPY_AND_ASSIGN(SnapshotWriter);
+};
+
 /**
  * @brief An interface for classes that perform optimization on Net%s.
  *
@@ -30,34 +91,146 @@ class Solver {
   // The Restore function implements how one should restore the solver to a
   // previously snapshotted state. You should implement the RestoreSolverState()
   // function that restores the state from a SolverState protocol buffer.
+  // With a transport, every rank must call it, but only rank 0 reads the
+  // files; the other ranks receive the params and state from it.
   void Restore(const char* resume_file);
-  virtual ~Solver() {}
+  virtual ~Solver();
   inline shared_ptr<Net<Dtype> > net() { return net_; }
   inline const vector<shared_ptr<Net<Dtype> > >& test_nets() {
     return test_nets_;
   }
+  // The nets of the hogwild workers other than the first, whose is net().
+  inline const vector<shared_ptr<Net<Dtype> > >& hogwild_nets() {
+    return hogwild_nets_;
+  }
   int iter() { return iter_; }
+  // Trains together with the other ranks of transport, each running its own
+  // Solver: the param diffs are averaged over the ranks before each update.
+  // The params of rank 0 are copied to the others first, and only rank 0
+  // tests and snapshots. The solver's data_shard and num_data_shards should
+  // be the rank and the number of ranks, so the ranks read different data.
+  void set_transport(shared_ptr<Transport<Dtype> > transport);
 
  protected:
+  // Builds the train_threads - 1 replicas of the train net from net_param,
+  // the NetParameter of net_.
+  void InitReplicas(const NetParameter& net_param);
+  // Runs forward and backward over one batch, split over the replicas if
+  // there are any, and returns the loss.
+  Dtype ForwardBackward();
+  // Forward from layer start, then backward, of one replica.
+  void ReplicaForwardBackward(Net<Dtype>* net, const int start, Dtype* loss);
+  // Averages the param diffs of the replicas into those of net_.
+  void ReduceReplicaDiffs();
+  // Averages the slice-th of num_slices parts of every param diff.
+  void ReduceDiffSlice(const int slice, const int num_slices,
+      const vector<Dtype*>* diffs,
+      const vector<vector<const Dtype*> >* replica_diffs);
+  // The work ForwardBackward and ReduceReplicaDiffs hand to the threads of
+  // the replicas. The thread of replicas_[r] takes part r + 1, while the
+  // solver thread takes part 0 with net_.
+  struct ReplicaTask {
+    enum Kind { FORWARD_BACKWARD, REDUCE, STOP };
+    Kind kind;
+    // FORWARD_BACKWARD stores the loss of part r in losses[r].
+    Dtype* losses;
+    // REDUCE averages slice r of these diffs.
+    const vector<Dtype*>* diffs;
+    const vector<vector<const Dtype*> >* replica_diffs;
+  };
+  // Runs the tasks of replicas_[replica] until a STOP task, pushing to
+  // replica_done_ after each.
+  void ReplicaWorker(const int replica);
+  // Queues task for the thread of every replica.
+  void StartReplicaTasks(const ReplicaTask& task);
+  // Blocks until every replica has finished its last task.
+  void WaitForReplicaTasks();
+
+  // Builds the nets of the hogwild_threads - 1 other workers from net_param,
+  // sharing the param data of net_, the net of the first worker.
+  void InitHogwild(const NetParameter& net_param);
+  // Gives the Data layers of the train net of a hogwild worker (0 for net_)
+  // that set no rand_skip, skip or num_shards the worker's shard of the db.
+  void ShardDataLayers(const int worker, NetParameter* net_param) const;
+  // Step with hogwild workers: they run between the iterations that test,
+  // display or snapshot.
+  void HogwildStep(int iters);
+  // Runs iterations on the net of a worker until none are left to take.
+  void HogwildWorker(const int worker);
+  // Updates the shared params from the diffs of a worker's net, for
+  // iteration iter, without locking.
+  virtual void HogwildUpdate(Net<Dtype>* net, const int worker,
+      const int iter) {
+    LOG(FATAL) << "This solver does not support hogwild_threads";
+  }
+
   // Get the update value for the current iteration.
   virtual void ComputeUpdateValue() = 0;
+  // Updates the parameters of net_ from their diffs; by default with
+  // ComputeUpdateValue followed by Net::Update.
+  virtual void ApplyUpdate();
   // The Solver::Snapshot function implements the basic snapshotting utility
   // that stores the learned net. You should implement the SnapshotSolverState()
   // function that produces a SolverState protocol buffer that needs to be
   // written to disk together with the learned net.
   void Snapshot();
+  // Copies the blobs SnapshotSolverState would write to the history of the
+  // SolverState, so a snapshot can write them later. Returns false if the
+  // solver does not support this; SnapshotSolverState is then called
+  // right away.
+  virtual bool StageSolverHistory(
+      vector<shared_ptr<Blob<Dtype> > >* history) {
+    return false;
+  }
   // The test routine
   void TestAll();
   void Test(const int test_net_id = 0);
+  // Runs the test_iter passes of a test net with the weights it holds, and
+  // logs the scores as those of iteration iter.
+  void TestNet(const int test_net_id, const int iter);
+  // Evaluates test nets one after another, on a background thread.
+  void TestNets(const vector<int> test_net_ids, const int iter);
+  // Blocks until the background evaluation started by TestAll is done.
+  void WaitForTests();
   virtual void SnapshotSolverState(SolverState* state) = 0;
   virtual void RestoreSolverState(const SolverState& state) = 0;
+  // Copies the state RestoreSolverState restores from rank 0 of transport
+  // to the other ranks.
+  virtual void BroadcastSolverState(Transport<Dtype>* transport) = 0;
   void DisplayOutputBlobs(const int net_id);
+  // Logs and resets the PrefetchStats of the train net's data layers.
+  void DisplayDataStats();
 
   SolverParameter param_;
   int iter_;
   int current_step_;
   shared_ptr<Net<Dtype> > net_;
   vector<shared_ptr<Net<Dtype> > > test_nets_;
+  // The other replicas of net_ in data-parallel training, sharing its param
+  // data; net_ is the first replica.
+  vector<shared_ptr<Net<Dtype> > > replicas_;
+  // The number of leading layers of net_ whose tops the replicas split: the
+  // data layers and the splits of their tops.
+  int num_input_layers_;
+  // One thread per replica, started by InitReplicas and kept until the
+  // solver is destroyed, each fed through its own task queue.
+  shared_ptr<boost::thread_group> replica_workers_;
+  vector<shared_ptr<BlockingQueue<ReplicaTask> > > replica_tasks_;
+  BlockingQueue<int> replica_done_;
+  shared_ptr<SnapshotWriter<Dtype> > snapshot_writer_;
+  // The threads evaluating test nets, with test_threads > 0.
+  shared_ptr<boost::thread_group> test_threads_;
+  // The transport, if any, and what averages the param diffs over its
+  // ranks.
+  shared_ptr<Transport<Dtype> > transport_;
+  shared_ptr<GradientAllReducer<Dtype> > gradient_reducer_;
+  // The nets of the hogwild workers other than the first.
+  vector<shared_ptr<Net<Dtype> > > hogwild_nets_;
+  // Guards the iterations the workers take, and their summed loss.
+  boost::mutex hogwild_mutex_;
+  int hogwild_iter_;
+  int hogwild_stop_iter_;
+  Dtype hogwild_loss_;
 
   DISABLE_COPY_AND_ASSIGN(Solver);
 };
@@ -74,6 +247,7 @@ class SGDSolver : public Solver<Dtype> {
       : Solver<Dtype>(param) { PreSolve(); }
   explicit SGDSolver(const string& param_file)
       : Solver<Dtype>(param_file) { PreSolve(); }
+  virtual ~SGDSolver();
 
   const vector<shared_ptr<Blob<Dtype> > >& history() { return history_; }
 
@@ -83,12 +257,58 @@ class SGDSolver : public Solver<Dtype> {
   virtual void ComputeUpdateValue();
   virtual void ClipGradients();
   virtual void SnapshotSolverState(SolverState * state);
+  virtual bool StageSolverHistory(vector<shared_ptr<Blob<Dtype> > >* history);
   virtual void RestoreSolverState(const SolverState& state);
+  virtual void BroadcastSolverState(Transport<Dtype>* transport);
+
+  // A range of one parameter for the fused CPU update, with its data, diff
+  // and history pointers already advanced to the start of the range.
+  struct UpdateSlice {
+    int param_id;
+    int count;
+    Dtype* data;
+    const Dtype* diff;
+    Dtype* history;
+    // The second moment, for solvers that keep one per param after the
+    // first ones in history_; NULL otherwise.
+    Dtype* history2;
+  };
+  // On CPU, reads each diff once and writes the new weights and history in
+  // the same pass, on up to update_threads threads; nets with fewer than
+  // 32k values per thread use fewer threads. Falls back to the
+  // ComputeUpdateValue path on GPU, with shared parameters (whose updates
+  // Net::Update accumulates into their owners) or with debug_info.
+  virtual void ApplyUpdate();
+  // Runs the solver's fused kernel over one slice.
+  virtual void FusedUpdate(const UpdateSlice& slice, Dtype rate);
+  void FusedUpdateSlices(const vector<UpdateSlice>* slices, Dtype rate);
+  // The update threads other than the solver thread, started by the first
+  // update that needs them and kept until the solver is destroyed. Each
+  // pops a task from update_tasks_, runs it and then pushes to
+  // update_done_; a task with NULL slices stops the thread.
+  struct UpdateTask {
+    const vector<UpdateSlice>* slices;
+    Dtype rate;
+  };
+  void UpdateWorker();
+  shared_ptr<boost::thread_group> update_workers_;
+  BlockingQueue<UpdateTask> update_tasks_;
+  BlockingQueue<int> update_done_;
+  // Runs FusedUpdate over the params of a hogwild worker's net, with the
+  // history of that worker.
+  virtual void HogwildUpdate(Net<Dtype>* net, const int worker,
+      const int iter);
+
   // history maintains the historical momentum data.
   // update maintains update related data and is not needed in snapshots.
   // temp maintains other information that might be needed in computation
   //   of gradients/updates and is not needed in snapshots
   vector<shared_ptr<Blob<Dtype> > > history_, update_, temp_;
+  // The history of the hogwild workers other than the first, which uses
+  // history_. Snapshots store it after history_.
+  vector<vector<shared_ptr<Blob<Dtype> > > > hogwild_history_;
+  // history_ followed by the history of each hogwild worker.
+  vector<shared_ptr<Blob<Dtype> > > SnapshotHistory() const;
 
   DISABLE_COPY_AND_ASSIGN(SGDSolver);
 };
@@ -103,6 +323,8 @@ class NesterovSolver : public SGDSolver<Dtype> {
 
  protected:
   virtual void ComputeUpdateValue();
+  virtual void FusedUpdate(
+      const typename SGDSolver<Dtype>::UpdateSlice& slice, Dtype rate);
 
   DISABLE_COPY_AND_ASSIGN(NesterovSolver);
 };
@@ -117,6 +339,8 @@ class AdaGradSolver : public SGDSolver<Dtype> {
 
  protected:
   virtual void ComputeUpdateValue();
+  virtual void FusedUpdate(
+      const typename SGDSolver<Dtype>::UpdateSlice& slice, Dtype rate);
   void constructor_sanity_check() {
     CHECK_EQ(0, this->param_.momentum())
         << "Momentum cannot be used with AdaGrad.";
@@ -125,6 +349,56 @@ class AdaGradSolver : public SGDSolver<Dtype> {
   DISABLE_COPY_AND_ASSIGN(AdaGradSolver);
 };
 
+template <typename Dtype>
+class RMSPropSolver : public SGDSolver<Dtype> {
+ public:
+  explicit RMSPropSolver(const SolverParameter& param)
+      : SGDSolver<Dtype>(param) { constructor_sanity_check(); }
+  explicit RMSPropSolver(const string& param_file)
+      : SGDSolver<Dtype>(param_file) { constructor_sanity_check(); }
+
+ protected:
+  virtual void ComputeUpdateValue();
+  virtual void FusedUpdate(
+      const typename SGDSolver<Dtype>::UpdateSlice& slice, Dtype rate);
+  void constructor_sanity_check() {
+    CHECK_EQ(0, this->param_.momentum())
+        << "Momentum cannot be used with RMSProp.";
+    CHECK_GE(this->param_.rms_decay(), 0)
+        << "rms_decay should lie between 0 and 1.";
+    CHECK_LT(this->param_.rms_decay(), 1)
+        << "rms_decay should lie between 0 and 1.";
+  }
+
+  DISABLE_COPY_AND_ASSIGN(RMSPropSolver);
+};
+
+/**
+ * @brief Adam, with momentum and momentum2 decaying the estimates of the
+ *        first and second moments of the gradient.
+ *
+ * history_ holds the first moments of the params, then the second ones, so
+ * both are snapshotted and restored.
+ */
+template <typename Dtype>
+class AdamSolver : public SGDSolver<Dtype> {
+ public:
+  explicit AdamSolver(const SolverParameter& param)
+      : SGDSolver<Dtype>(param) { AdamPreSolve(); }
+  explicit AdamSolver(const string& param_file)
+      : SGDSolver<Dtype>(param_file) { AdamPreSolve(); }
+
+ protected:
+  void AdamPreSolve();
+  // The rate scaled by the bias corrections of the moments at iter_.
+  Dtype CorrectedRate(Dtype rate);
+  virtual void ComputeUpdateValue();
+  virtual void FusedUpdate(
+      const typename SGDSolver<Dtype>::UpdateSlice& slice, Dtype rate);
+
+  DISABLE_COPY_AND_ASSIGN(AdamSolver);
+};
+
 template <typename Dtype>
 Solver<Dtype>* GetSolver(const SolverParameter& param) {
   SolverParameter_SolverType type = param.solver_type();
@@ -136,6 +410,10 @@ Solver<Dtype>* GetSolver(const SolverParameter& param) {
       return new NesterovSolver<Dtype>(param);
   case SolverParameter_SolverType_ADAGRAD:
       return new AdaGradSolver<Dtype>(param);
+  case SolverParameter_SolverType_ADAM:
+      return new AdamSolver<Dtype>(param);
+  case SolverParameter_SolverType_RMSPROP:
+      return new RMSPropSolver<Dtype>(param);
   default:
       LOG(FATAL) << "Unknown SolverType: " << type;
   }
@@ -52,6 +52,9 @@ class SyncedMemory {
   const void* gpu_data();
   void* mutable_cpu_data();
   void* mutable_gpu_data();
+  // Frees the memory, which the next access allocates and zeroes again.
+  // Memory given with set_cpu_data is kept.
+  void release();
   enum SyncedHead { UNINITIALIZED, HEAD_AT_CPU, HEAD_AT_GPU, SYNCED };
   SyncedHead head() { return head_; }
   size_t size() { return size_; }
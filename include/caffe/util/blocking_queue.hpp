@@ -0,0 +1,91 @@
+#ifndef CAFFE_UTIL_BLOCKING_QUEUE_HPP_
+#define CAFFE_UTIL_BLOCKING_QUEUE_HPP_
+
+#include <queue>
+
+#include "boost/thread/condition_variable.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread_time.hpp"
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A FIFO queue for handing work between threads. push blocks while
+ *        the queue holds capacity items (0 means unbounded) and pop blocks
+ *        while it is empty.
+ */
+template <typename T>
+class BlockingQueue {
+ public:
+  explicit BlockingQueue(size_t capacity = 0) : capacity_(capacity) { }
+
+  void push(const T& t) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (capacity_ > 0 && queue_.size() >= capacity_) {
+      not_full_.wait(lock);
+    }
+    queue_.push(t);
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+
+  void pop(T* t) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (queue_.empty()) {
+      not_empty_.wait(lock);
+    }
+    *t = queue_.front();
+    queue_.pop();
+    lock.unlock();
+    not_full_.notify_one();
+  }
+
+  // Like pop, but gives up and returns false after timeout_ms milliseconds.
+  bool pop_for(T* t, int timeout_ms) {
+    const boost::system_time deadline = boost::get_system_time() +
+        boost::posix_time::milliseconds(timeout_ms);
+    boost::mutex::scoped_lock lock(mutex_);
+    while (queue_.empty()) {
+      if (!not_empty_.timed_wait(lock, deadline) && queue_.empty()) {
+        return false;
+      }
+    }
+    *t = queue_.front();
+    queue_.pop();
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  bool try_pop(T* t) {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (queue_.empty()) {
+      return false;
+    }
+    *t = queue_.front();
+    queue_.pop();
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  size_t size() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return queue_.size();
+  }
+
+ private:
+  const size_t capacity_;
+  std::queue<T> queue_;
+  boost::mutex mutex_;
+  boost::condition_variable not_empty_;
+  boost::condition_variable not_full_;
+
+  DISABLE_COPY_AND_ASSIGN(BlockingQueue);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BLOCKING_QUEUE_HPP_
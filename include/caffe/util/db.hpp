@@ -1,7 +1,10 @@
 #ifndef CAFFE_UTIL_DB_HPP
 #define CAFFE_UTIL_DB_HPP
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 
 #include "leveldb/db.h"
 #include "leveldb/write_batch.h"
@@ -181,6 +184,95 @@ class LMDB : public DB {
   MDB_dbi mdb_dbi_;
 };
 
+class PackedDB;
+
+class PackedCursor : public Cursor {
+ public:
+  explicit PackedCursor(const PackedDB* db) : db_(db), pos_(0) { }
+  virtual void SeekToFirst() { pos_ = 0; }
+  virtual void Next() { ++pos_; }
+  virtual string key();
+  virtual string value();
+  virtual bool valid();
+
+  /// @brief O(1) jump to the record at position index (insertion order).
+  void Seek(size_t index) { pos_ = index; }
+  size_t position() const { return pos_; }
+  size_t size() const;
+
+ private:
+  // The record under the cursor, after CHECKing it lies within the data
+  // file; sizes gets the lengths of its key and value.
+  const char* record(uint32_t sizes[2]) const;
+
+  const PackedDB* db_;
+  size_t pos_;
+};
+
+class PackedTransaction : public Transaction {
+ public:
+  explicit PackedTransaction(PackedDB* db) : db_(db) { CHECK_NOTNULL(db_); }
+  virtual void Put(const string& key, const string& value);
+  virtual void Commit();
+
+ private:
+  PackedDB* db_;
+  string buffer_;
+  vector<uint64_t> offsets_;
+
+  DISABLE_COPY_AND_ASSIGN(PackedTransaction);
+};
+
+/**
+ * @brief A flat, append-only record file for data that is written once and
+ *        read back sequentially (or shuffled by index).
+ *
+ * The database is a directory holding two files: data.bin, a sequence of
+ * records laid out as [uint32 key size][uint32 value size][key][value], and
+ * index.bin, an array of uint64 byte offsets, one per record. Records keep
+ * their insertion order (no key sorting). Reading maps both files read-only,
+ * so several processes can share one copy of the pages.
+ */
+class PackedDB : public DB {
+ public:
+  PackedDB() : mode_(READ), data_map_(NULL), data_size_(0), index_map_(NULL),
+      index_size_(0), data_handle_(NULL), index_handle_(NULL),
+      num_records_(0), end_offset_(0) { }
+  virtual ~PackedDB() { Close(); }
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close();
+  virtual PackedCursor* NewCursor();
+  virtual PackedTransaction* NewTransaction() {
+    CHECK_NE(mode_, READ) << "Cannot write to a packed db opened for READ";
+    return new PackedTransaction(this);
+  }
+
+  /// @brief Number of records available to cursors.
+  size_t num_records() const { return num_records_; }
+
+ private:
+  friend class PackedCursor;
+  friend class PackedTransaction;
+
+  // Appends a block of serialized records, and their offsets relative to the
+  // start of the block, to the data and index files.
+  void Append(const string& records, const vector<uint64_t>& offsets);
+  void MapFiles();
+  void UnmapFiles();
+
+  string source_;
+  Mode mode_;
+  const char* data_map_;
+  size_t data_size_;
+  const uint64_t* index_map_;
+  size_t index_size_;
+  // Platform file-mapping handles, kept opaque to avoid windows.h here.
+  void* data_handle_;
+  void* index_handle_;
+  size_t num_records_;
+  uint64_t end_offset_;
+};
+
 DB* GetDB(DataParameter::DB backend);
 DB* GetDB(const string& backend);
 
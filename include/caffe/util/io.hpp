@@ -4,6 +4,7 @@
 //#include <unistd.h>
 #include <io.h>
 #include <process.h>
+#include <stdint.h>
 #include <string>
 
 #include "google/protobuf/message.h"
@@ -16,6 +17,8 @@
 
 #define HDF5_NUM_DIMS 4
 
+namespace boost { class mutex; }
+
 namespace caffe {
 
 using ::google::protobuf::Message;
@@ -87,6 +90,80 @@ inline void WriteProtoToBinaryFile(
   WriteProtoToBinaryFile(proto, filename.c_str());
 }
 
+// Writes to filename.tmp, then renames that over filename, so a reader
+// never sees a partly written file.
+void WriteProtoToBinaryFileAtomically(const Message& proto,
+    const string& filename);
+
+// Maps a whole file read-only. Returns NULL for a missing or empty file.
+// sequential selects the OS readahead hint: aggressive readahead for data that
+// is streamed front to back, plain prefetch of the whole range otherwise.
+// Pass the returned size and handle to UnmapFile.
+const char* MapFileReadOnly(const string& filename, bool sequential,
+    size_t* size, void** handle);
+void UnmapFile(const char* addr, size_t size, void* handle);
+
+// A raw proto file is a small header proto followed by payloads of values
+// stored as-is, which load with a copy instead of a parse. It holds the magic
+// "CAFFERAW", the header size as a uint64, the header, and then the payloads,
+// each starting on a kRawPayloadAlignment boundary of the file. The header
+// refers to the payloads by their offsets, e.g. BlobProto::raw_data_offset.
+const int kRawPayloadAlignment = 64;
+
+struct RawPayload {
+  uint64_t offset;
+  const void* data;
+  size_t size;
+};
+
+// Places size bytes at data after the payloads so far and returns their
+// offset.
+uint64_t AddRawPayload(const void* data, size_t size,
+    vector<RawPayload>* payloads);
+
+// Writes a raw proto file the way WriteProtoToBinaryFileAtomically does.
+void WriteRawProtoFileAtomically(const Message& header,
+    const vector<RawPayload>& payloads, const string& filename);
+
+bool IsRawProtoFile(const string& filename);
+
+// Maps a raw proto file for as long as it lives.
+class RawProtoFile {
+ public:
+  // Maps filename and parses its header into header.
+  RawProtoFile(const string& filename, Message* header);
+  ~RawProtoFile();
+
+  // The size bytes at offset, which must lie within the payloads.
+  const char* payload(uint64_t offset, size_t size) const;
+
+ private:
+  string filename_;
+  const char* map_;
+  size_t size_;
+  void* handle_;
+  size_t payloads_begin_;
+
+  DISABLE_COPY_AND_ASSIGN(RawProtoFile);
+};
+
+// Writes the shape of blob to proto, and adds its data, and diff if
+// write_diff, to payloads. Both stay referenced until the file is written.
+template <typename Dtype>
+void BlobToRawProto(const Blob<Dtype>& blob, bool write_diff,
+    BlobProto* proto, vector<RawPayload>* payloads);
+
+// Blob::FromProto for a proto written by BlobToRawProto.
+template <typename Dtype>
+void BlobFromRawProto(const BlobProto& proto, const RawProtoFile& file,
+    bool reshape, Blob<Dtype>* blob);
+
+// Convert the blobs of a NetParameter between the two formats, for tools
+// working on weight files without a Net.
+void WriteNetParamsToRawFile(const NetParameter& param,
+    const string& filename);
+void ReadNetParamsFromRawFile(const string& filename, NetParameter* param);
+
 bool ReadFileToDatum(const string& filename, const int label, Datum* datum);
 
 inline bool ReadFileToDatum(const string& filename, Datum* datum) {
@@ -97,6 +174,11 @@ bool ReadImageToDatum(const string& filename, const int label,
     const int height, const int width, const bool is_color,
     const std::string & encoding, Datum* datum);
 
+// As ReadImageToDatum, for an image file already read into contents.
+bool DecodeImageToDatum(const string& contents, const string& filename,
+    const int label, const int height, const int width, const bool is_color,
+    const std::string & encoding, Datum* datum);
+
 inline bool ReadImageToDatum(const string& filename, const int label,
     const int height, const int width, const bool is_color, Datum* datum) {
   return ReadImageToDatum(filename, label, height, width, is_color,
@@ -137,11 +219,42 @@ cv::Mat ReadImageToCVMat(const string& filename,
 
 cv::Mat ReadImageToCVMat(const string& filename);
 
+// Variants that may decode JPEGs at a reduced (1/2, 1/4 or 1/8) resolution,
+// as long as the decoded image stays at least min_height x min_width.
+// The reduction needs a build with USE_LIBJPEG, or OpenCV 3 or later for
+// color and gray reads; otherwise, and for other formats, images decode at
+// full size.
+cv::Mat ReadImageToCVMat(const string& filename,
+    const int height, const int width, const bool is_color,
+    const int min_height, const int min_width);
+
 cv::Mat DecodeDatumToCVMatNative(const Datum& datum);
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color);
+cv::Mat DecodeDatumToCVMatNative(const Datum& datum,
+    const int min_height, const int min_width);
+cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color,
+    const int min_height, const int min_width);
+
+// Decodes an encoded image held in memory (e.g. the contents of a file).
+cv::Mat DecodeImageToCVMat(const string& buffer, const bool is_color,
+    const int min_height, const int min_width);
 
 void CVMatToDatum(const cv::Mat& cv_img, Datum* datum);
 
+// Number of values in an unencoded datum, whichever field holds them.
+int DatumValueCount(const Datum& datum);
+
+// Copies count values of an unencoded datum, starting at value index, to
+// dst, converting uint8, float16 or float_data values as needed.
+template <typename Dtype>
+void DatumToValues(const Datum& datum, const int index, const int count,
+    Dtype* dst);
+
+// Stores count values in datum->data as FLOAT16 or FLOAT32, clearing
+// float_data. FLOAT16 rounds to nearest, keeping about 3 decimal digits.
+void FloatsToDatum(const float* values, const int count,
+    const Datum_DataType type, Datum* datum);
+
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
@@ -156,6 +269,21 @@ template <typename Dtype>
 void hdf5_save_nd_dataset(
     const hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob);
 
+// The HDF5 memory type matching Dtype, for H5Dread/H5Dwrite.
+template <typename Dtype>
+hid_t hdf5_native_type();
+
+template <>
+hid_t hdf5_native_type<float>();
+
+template <>
+hid_t hdf5_native_type<double>();
+
+// HDF5 is usually built without its thread-safe option, so code that calls
+// into it from a background thread, or that may run alongside such a thread,
+// holds this lock around its HDF5 calls.
+boost::mutex& hdf5_mutex();
+
 }  // namespace caffe
 
 #endif   // CAFFE_UTIL_IO_H_
@@ -0,0 +1,109 @@
+#ifndef CAFFE_UTIL_LRU_CACHE_HPP_
+#define CAFFE_UTIL_LRU_CACHE_HPP_
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "boost/thread/mutex.hpp"
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A thread-safe, least-recently-used cache bounded by a byte budget.
+ *
+ * Values are copied in and out, so Value should be cheap to copy (e.g. a
+ * reference-counted cv::Mat) or small. The caller supplies the size of each
+ * entry on Put; entries larger than the whole budget are not kept.
+ */
+template <typename Value>
+class LRUCache {
+ public:
+  explicit LRUCache(size_t capacity_bytes)
+      : capacity_bytes_(capacity_bytes), size_bytes_(0), hits_(0),
+        misses_(0) { }
+
+  // Copies the value for key into *value and marks it most recently used.
+  bool Get(const string& key, Value* value) {
+    boost::mutex::scoped_lock lock(mutex_);
+    typename Index::iterator it = index_.find(key);
+    if (it == index_.end()) {
+      ++misses_;
+      return false;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    *value = it->second->value;
+    ++hits_;
+    return true;
+  }
+
+  // Inserts (or replaces) key, evicting least recently used entries until
+  // the cache fits in its budget again.
+  void Put(const string& key, const Value& value, size_t bytes) {
+    boost::mutex::scoped_lock lock(mutex_);
+    typename Index::iterator it = index_.find(key);
+    if (it != index_.end()) {
+      size_bytes_ -= it->second->bytes;
+      entries_.erase(it->second);
+      index_.erase(it);
+    }
+    if (bytes > capacity_bytes_) {
+      return;
+    }
+    while (size_bytes_ + bytes > capacity_bytes_) {
+      Entry& last = entries_.back();
+      size_bytes_ -= last.bytes;
+      index_.erase(last.key);
+      entries_.pop_back();
+    }
+    Entry entry;
+    entry.key = key;
+    entry.value = value;
+    entry.bytes = bytes;
+    entries_.push_front(entry);
+    index_[key] = entries_.begin();
+    size_bytes_ += bytes;
+  }
+
+  size_t size_bytes() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_bytes_;
+  }
+  size_t count() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.size();
+  }
+  size_t hits() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return hits_;
+  }
+  size_t misses() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return misses_;
+  }
+
+ private:
+  struct Entry {
+    string key;
+    Value value;
+    size_t bytes;
+  };
+  typedef std::list<Entry> Entries;
+  typedef std::map<string, typename Entries::iterator> Index;
+
+  const size_t capacity_bytes_;
+  size_t size_bytes_;
+  size_t hits_, misses_;
+  Entries entries_;
+  Index index_;
+  boost::mutex mutex_;
+
+  DISABLE_COPY_AND_ASSIGN(LRUCache);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_LRU_CACHE_HPP_
@@ -142,6 +142,43 @@ DEFINE_CAFFE_CPU_UNARY_FUNC(fabs, y[i] = std::fabs(x[i]));
 template <typename Dtype>
 void caffe_cpu_scale(const int n, const Dtype alpha, const Dtype *x, Dtype* y);
 
+// Fused solver updates: each makes one pass over a parameter, adding
+// l2_decay * w + l1_decay * sign(w) to the gradient, updating the history
+// and subtracting the step from the weights w in place.
+// SGD with momentum: h = momentum * h + rate * g; w -= h.
+template <typename Dtype>
+void caffe_cpu_sgd_update(const int n, const Dtype rate, const Dtype momentum,
+    const Dtype l2_decay, const Dtype l1_decay, const Dtype* diff,
+    Dtype* history, Dtype* data);
+
+// Nesterov: h' = momentum * h + rate * g; w -= (1 + momentum) * h' -
+// momentum * h.
+template <typename Dtype>
+void caffe_cpu_nesterov_update(const int n, const Dtype rate,
+    const Dtype momentum, const Dtype l2_decay, const Dtype l1_decay,
+    const Dtype* diff, Dtype* history, Dtype* data);
+
+// AdaGrad: h += g * g; w -= rate * g / (sqrt(h) + delta).
+template <typename Dtype>
+void caffe_cpu_adagrad_update(const int n, const Dtype rate,
+    const Dtype delta, const Dtype l2_decay, const Dtype l1_decay,
+    const Dtype* diff, Dtype* history, Dtype* data);
+
+// RMSProp: h = decay * h + (1 - decay) * g * g;
+// w -= rate * g / (sqrt(h) + delta).
+template <typename Dtype>
+void caffe_cpu_rmsprop_update(const int n, const Dtype rate,
+    const Dtype decay, const Dtype delta, const Dtype l2_decay,
+    const Dtype l1_decay, const Dtype* diff, Dtype* history, Dtype* data);
+
+// Adam, with the bias corrections folded into rate: m = beta1 * m +
+// (1 - beta1) * g; v = beta2 * v + (1 - beta2) * g * g;
+// w -= rate * m / (sqrt(v) + delta).
+template <typename Dtype>
+void caffe_cpu_adam_update(const int n, const Dtype rate, const Dtype beta1,
+    const Dtype beta2, const Dtype delta, const Dtype l2_decay,
+    const Dtype l1_decay, const Dtype* diff, Dtype* m, Dtype* v, Dtype* data);
+
 #ifndef CPU_ONLY  // GPU
 
 // Decaf gpu gemm provides an interface that is almost the same as the cpu
@@ -0,0 +1,56 @@
+#ifndef CAFFE_UTIL_TRANSPORT_HPP_
+#define CAFFE_UTIL_TRANSPORT_HPP_
+
+#include <string>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Moves values between the num_ranks processes of a synchronous
+ *        data-parallel training run.
+ *
+ * Every rank makes the same calls in the same order, each call returning
+ * once all ranks have made it. The results are the same, bit for bit, on
+ * every rank.
+ */
+template <typename Dtype>
+class Transport {
+ public:
+  Transport(int rank, int num_ranks);
+  virtual ~Transport() {}
+
+  inline int rank() const { return rank_; }
+  inline int num_ranks() const { return num_ranks_; }
+
+  // Replaces the count values at data with their sum over all ranks.
+  virtual void AllReduce(Dtype* data, int count) = 0;
+  // Copies the count values at data on rank root to data on the other ranks.
+  virtual void Broadcast(Dtype* data, int count, int root) = 0;
+
+ protected:
+  const int rank_;
+  const int num_ranks_;
+
+  DISABLE_COPY_AND_ASSIGN(Transport);
+};
+
+/**
+ * @brief Connects rank to the other ranks of a run through uri, which is
+ *        one of
+ *
+ * - shm://NAME: a shared memory segment NAME, for num_ranks processes on one
+ *   machine. NAME must not be in use by another run.
+ * - tcp://HOST:PORT,HOST:PORT,...: TCP connections in a ring, rank i
+ *   listening on the i-th endpoint. num_ranks is the number of endpoints
+ *   and may be passed as 0.
+ *
+ * Blocks until the other ranks have connected too.
+ */
+template <typename Dtype>
+Transport<Dtype>* GetTransport(const string& uri, int rank, int num_ranks);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_TRANSPORT_HPP_
@@ -33,19 +33,22 @@ class BaseConvolutionLayer : public Layer<Dtype> {
   virtual inline int MinBottomBlobs() const { return 1; }
   virtual inline int MinTopBlobs() const { return 1; }
   virtual inline bool EqualNumBottomTopBlobs() const { return true; }
+  virtual inline bool OverwritesFreshParamDiffs() const { return true; }
 
  protected:
   // Helper functions that abstract away the column buffer and gemm arguments.
   // The last argument in forward_cpu_gemm is so that we can skip the im2col if
-  // we just called weight_cpu_gemm with the same input.
+  // we just called weight_cpu_gemm with the same input. The weight and bias
+  // gradients accumulate into their outputs unless overwrite is set.
   void forward_cpu_gemm(const Dtype* input, const Dtype* weights,
       Dtype* output, bool skip_im2col = false);
   void forward_cpu_bias(Dtype* output, const Dtype* bias);
   void backward_cpu_gemm(const Dtype* input, const Dtype* weights,
       Dtype* output);
   void weight_cpu_gemm(const Dtype* input, const Dtype* output, Dtype*
-      weights);
-  void backward_cpu_bias(Dtype* bias, const Dtype* input);
+      weights, bool overwrite = false);
+  void backward_cpu_bias(Dtype* bias, const Dtype* input,
+      bool overwrite = false);
 
 #ifndef CPU_ONLY
   void forward_gpu_gemm(const Dtype* col_input, const Dtype* weights,
@@ -54,8 +57,9 @@ class BaseConvolutionLayer : public Layer<Dtype> {
   void backward_gpu_gemm(const Dtype* input, const Dtype* weights,
       Dtype* col_output);
   void weight_gpu_gemm(const Dtype* col_input, const Dtype* output, Dtype*
-      weights);
-  void backward_gpu_bias(Dtype* bias, const Dtype* input);
+      weights, bool overwrite = false);
+  void backward_gpu_bias(Dtype* bias, const Dtype* input,
+      bool overwrite = false);
 #endif
 
   // reverse_dimensions should return true iff we are implementing deconv, so
@@ -243,6 +247,8 @@ class CuDNNConvolutionLayer : public ConvolutionLayer<Dtype> {
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
   virtual ~CuDNNConvolutionLayer();
+  // The cuDNN filter and bias gradients always accumulate.
+  virtual inline bool OverwritesFreshParamDiffs() const { return false; }
 
  protected:
   virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
@@ -406,6 +412,10 @@ class PoolingLayer : public Layer<Dtype> {
     return (this->layer_param_.pooling_param().pool() ==
             PoolingParameter_PoolMethod_MAX) ? 2 : 1;
   }
+  virtual inline bool ForwardDrawsRandomNumbers() const {
+    return this->phase_ == TRAIN && this->layer_param_.pooling_param().pool()
+        == PoolingParameter_PoolMethod_STOCHASTIC;
+  }
   virtual inline DiagonalAffineMap<Dtype> coord_map() {
     return FilterMap<Dtype>(kernel_h_, kernel_w_, stride_h_, stride_w_,
         pad_h_, pad_w_).inv();
@@ -80,7 +80,13 @@ def datum_to_array(datum):
     """Converts a datum to an array. Note that the label is not returned,
     as one can easily get it by calling datum.label.
     """
-    if len(datum.data):
+    if datum.data_type == caffe_pb2.Datum.FLOAT16:
+        return np.fromstring(datum.data, dtype = '<f2').astype(float).reshape(
+            datum.channels, datum.height, datum.width)
+    elif datum.data_type == caffe_pb2.Datum.FLOAT32:
+        return np.fromstring(datum.data, dtype = '<f4').astype(float).reshape(
+            datum.channels, datum.height, datum.width)
+    elif len(datum.data):
         return np.fromstring(datum.data, dtype = np.uint8).reshape(
             datum.channels, datum.height, datum.width)
     else:
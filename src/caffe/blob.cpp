@@ -453,15 +453,17 @@ void Blob<Dtype>::FromProto(const BlobProto& proto, bool reshape) {
   } else {
     CHECK(ShapeEquals(proto)) << "shape mismatch (reshape not set)";
   }
-  // copy data
+  // copy data, reading the repeated fields as plain arrays
   Dtype* data_vec = mutable_cpu_data();
+  const float* proto_data = proto.data().data();
   for (int i = 0; i < count_; ++i) {
-    data_vec[i] = proto.data(i);
+    data_vec[i] = proto_data[i];
   }
   if (proto.diff_size() > 0) {
     Dtype* diff_vec = mutable_cpu_diff();
+    const float* proto_diff = proto.diff().data();
     for (int i = 0; i < count_; ++i) {
-      diff_vec[i] = proto.diff(i);
+      diff_vec[i] = proto_diff[i];
     }
   }
 }
@@ -474,14 +476,20 @@ void Blob<Dtype>::ToProto(BlobProto* proto, bool write_diff) const {
   }
   proto->clear_data();
   proto->clear_diff();
+  // Size the repeated fields once and fill them as plain arrays, rather
+  // than growing them a value at a time.
   const Dtype* data_vec = cpu_data();
+  proto->mutable_data()->Resize(count_, 0);
+  float* proto_data = proto->mutable_data()->mutable_data();
   for (int i = 0; i < count_; ++i) {
-    proto->add_data(data_vec[i]);
+    proto_data[i] = data_vec[i];
   }
   if (write_diff) {
     const Dtype* diff_vec = cpu_diff();
+    proto->mutable_diff()->Resize(count_, 0);
+    float* proto_diff = proto->mutable_diff()->mutable_data();
     for (int i = 0; i < count_; ++i) {
-      proto->add_diff(diff_vec[i]);
+      proto_diff[i] = diff_vec[i];
     }
   }
 }
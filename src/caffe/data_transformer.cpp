@@ -1,5 +1,7 @@
 #include <opencv2/core/core.hpp>
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -8,8 +10,71 @@
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
 
+// SSE2 is part of the x86-64 baseline, so it is always there on x64 builds.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CAFFE_TRANSFORM_SSE2
+#include <emmintrin.h>
+#endif
+
 namespace caffe {
 
+// Converts one row of width uint8 pixels to Dtype, computing
+// (pixel - mean) * scale and writing the row reversed if mirror is set.
+// mean points at a per-pixel mean row, or is NULL to use mean_value for the
+// whole row.
+template <typename Dtype>
+static void TransformUInt8Row(const uint8_t* src, const int width,
+    const Dtype* mean, const Dtype mean_value, const Dtype scale,
+    const bool mirror, Dtype* dst) {
+  for (int w = 0; w < width; ++w) {
+    const Dtype pixel_mean = mean ? mean[w] : mean_value;
+    dst[mirror ? width - 1 - w : w] =
+        (static_cast<Dtype>(src[w]) - pixel_mean) * scale;
+  }
+}
+
+#ifdef CAFFE_TRANSFORM_SSE2
+template <>
+void TransformUInt8Row<float>(const uint8_t* src, const int width,
+    const float* mean, const float mean_value, const float scale,
+    const bool mirror, float* dst) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 scale_v = _mm_set1_ps(scale);
+  const __m128 mean_value_v = _mm_set1_ps(mean_value);
+  int w = 0;
+  // 16 pixels per step: widen u8 -> u16 -> i32, convert, subtract, scale.
+  for (; w + 16 <= width; w += 16) {
+    const __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w));
+    const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    __m128 pixels[4];
+    pixels[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+    pixels[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+    pixels[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+    pixels[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+    for (int k = 0; k < 4; ++k) {
+      const int x = w + 4 * k;
+      const __m128 mean_v = mean ? _mm_loadu_ps(mean + x) : mean_value_v;
+      __m128 out = _mm_mul_ps(_mm_sub_ps(pixels[k], mean_v), scale_v);
+      if (mirror) {
+        // Reverse the 4 lanes and store them at the mirrored position.
+        out = _mm_shuffle_ps(out, out, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_ps(dst + width - x - 4, out);
+      } else {
+        _mm_storeu_ps(dst + x, out);
+      }
+    }
+  }
+  for (; w < width; ++w) {
+    const float pixel_mean = mean ? mean[w] : mean_value;
+    dst[mirror ? width - 1 - w : w] =
+        (static_cast<float>(src[w]) - pixel_mean) * scale;
+  }
+}
+#endif  // CAFFE_TRANSFORM_SSE2
+
 template<typename Dtype>
 DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
     Phase phase)
@@ -46,19 +111,20 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   const Dtype scale = param_.scale();
   const bool do_mirror = param_.mirror() && Rand(2);
   const bool has_mean_file = param_.has_mean_file();
-  const bool has_uint8 = data.size() > 0;
+  const bool has_uint8 = data.size() > 0 &&
+      datum.data_type() == Datum_DataType_UINT8;
   const bool has_mean_values = mean_values_.size() > 0;
 
   CHECK_GT(datum_channels, 0);
   CHECK_GE(datum_height, crop_size);
   CHECK_GE(datum_width, crop_size);
 
-  Dtype* mean = NULL;
+  const Dtype* mean = NULL;
   if (has_mean_file) {
     CHECK_EQ(datum_channels, data_mean_.channels());
     CHECK_EQ(datum_height, data_mean_.height());
     CHECK_EQ(datum_width, data_mean_.width());
-    mean = data_mean_.mutable_cpu_data();
+    mean = data_mean_.cpu_data();
   }
   if (has_mean_values) {
     CHECK(mean_values_.size() == 1 || mean_values_.size() == datum_channels) <<
@@ -89,10 +155,32 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
     }
   }
 
+  if (has_uint8) {
+    // Fast path: the mean/mirror variant is chosen once per image and each
+    // cropped row is converted, mean-subtracted and scaled in one pass.
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(data.data());
+    for (int c = 0; c < datum_channels; ++c) {
+      const Dtype mean_value = has_mean_values ? mean_values_[c] : Dtype(0);
+      for (int h = 0; h < height; ++h) {
+        const int data_index =
+            (c * datum_height + h_off + h) * datum_width + w_off;
+        TransformUInt8Row(src + data_index, width,
+            has_mean_file ? mean + data_index : NULL, mean_value, scale,
+            do_mirror, transformed_data + (c * height + h) * width);
+      }
+    }
+    return;
+  }
+
+  // float_data, or float16/float32 values packed in data: convert each
+  // cropped row once, straight from the datum.
+  vector<Dtype> row(width);
   Dtype datum_element;
   int top_index, data_index;
   for (int c = 0; c < datum_channels; ++c) {
     for (int h = 0; h < height; ++h) {
+      DatumToValues(datum, (c * datum_height + h_off + h) * datum_width + w_off,
+          width, &row[0]);
       for (int w = 0; w < width; ++w) {
         data_index = (c * datum_height + h_off + h) * datum_width + w_off + w;
         if (do_mirror) {
@@ -100,12 +188,7 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
         } else {
           top_index = (c * height + h) * width + w;
         }
-        if (has_uint8) {
-          datum_element =
-            static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-        } else {
-          datum_element = datum.float_data(data_index);
-        }
+        datum_element = row[w];
         if (has_mean_file) {
           transformed_data[top_index] =
             (datum_element - mean[data_index]) * scale;
@@ -222,12 +305,12 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
   CHECK_GE(img_height, crop_size);
   CHECK_GE(img_width, crop_size);
 
-  Dtype* mean = NULL;
+  const Dtype* mean = NULL;
   if (has_mean_file) {
     CHECK_EQ(img_channels, data_mean_.channels());
     CHECK_EQ(img_height, data_mean_.height());
     CHECK_EQ(img_width, data_mean_.width());
-    mean = data_mean_.mutable_cpu_data();
+    mean = data_mean_.cpu_data();
   }
   if (has_mean_values) {
     CHECK(mean_values_.size() == 1 || mean_values_.size() == img_channels) <<
@@ -264,33 +347,25 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
   CHECK(cv_cropped_img.data);
 
   Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-  int top_index;
+  // Interleaved rows are split into per-channel planes first so that every
+  // channel goes through the same vectorized row kernel as the Datum path.
+  vector<uint8_t> planes(img_channels > 1 ? img_channels * width : 0);
   for (int h = 0; h < height; ++h) {
-    const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
-    int img_index = 0;
-    for (int w = 0; w < width; ++w) {
-      for (int c = 0; c < img_channels; ++c) {
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        // int top_index = (c * height + h) * width + w;
-        Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
-        if (has_mean_file) {
-          int mean_index = (c * img_height + h_off + h) * img_width + w_off + w;
-          transformed_data[top_index] =
-            (pixel - mean[mean_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (pixel - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = pixel * scale;
-          }
+    const uint8_t* ptr = cv_cropped_img.ptr<uint8_t>(h);
+    if (img_channels > 1) {
+      for (int w = 0; w < width; ++w) {
+        for (int c = 0; c < img_channels; ++c) {
+          planes[c * width + w] = ptr[w * img_channels + c];
         }
       }
     }
+    for (int c = 0; c < img_channels; ++c) {
+      const uint8_t* src = img_channels > 1 ? &planes[c * width] : ptr;
+      const int mean_index = (c * img_height + h_off + h) * img_width + w_off;
+      TransformUInt8Row(src, width, has_mean_file ? mean + mean_index : NULL,
+          has_mean_values ? mean_values_[c] : Dtype(0), scale, do_mirror,
+          transformed_data + (c * height + h) * width);
+    }
   }
 }
 
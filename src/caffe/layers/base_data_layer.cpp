@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -7,6 +9,37 @@
 
 namespace caffe {
 
+void PrefetchStats::Add(const PrefetchStats& other) {
+  batches += other.batches;
+  read += other.read;
+  decode += other.decode;
+  transform += other.transform;
+  queue_wait += other.queue_wait;
+  forward_wait += other.forward_wait;
+}
+
+string PrefetchStats::ToString() const {
+  const double n = std::max(batches, 1);
+  std::ostringstream stream;
+  stream << batches << " batches, per batch: read " << read / n
+      << " ms, decode " << decode / n << " ms, transform " << transform / n
+      << " ms, queue wait " << queue_wait / n << " ms, Forward wait "
+      << forward_wait / n << " ms";
+  return stream.str();
+}
+
+void PrefetchStatsRecorder::EndForwardWait() {
+  const double wait = wait_timer_.MilliSeconds();
+  batch_stats_.batches = 1;
+  batch_stats_.forward_wait = wait;
+  // ready_timer_ runs from the end of the batch until now; whatever part of
+  // that came before Forward started is time the batch sat waiting.
+  batch_stats_.queue_wait =
+      std::max(0., static_cast<double>(ready_timer_.MilliSeconds()) - wait);
+  prefetch_stats_.Add(batch_stats_);
+  batch_stats_ = PrefetchStats();
+}
+
 template <typename Dtype>
 BaseDataLayer<Dtype>::BaseDataLayer(const LayerParameter& param)
     : Layer<Dtype>(param),
@@ -60,7 +93,9 @@ template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
   // First, join the thread
+  this->StartForwardWait();
   JoinPrefetchThread();
+  this->EndForwardWait();
   DLOG(INFO) << "Thread joined";
   // Reshape to loaded data.
   top[0]->Reshape(this->prefetch_data_.num(), this->prefetch_data_.channels(),
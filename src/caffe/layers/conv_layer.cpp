@@ -39,6 +39,9 @@ void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
   const Dtype* weight = this->blobs_[0]->cpu_data();
   Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
+  // The first image overwrites fresh diffs; the rest accumulate.
+  bool weight_fresh = this->param_diff_fresh(0);
+  bool bias_fresh = this->param_diff_fresh(1);
   for (int i = 0; i < top.size(); ++i) {
     const Dtype* top_diff = top[i]->cpu_diff();
     const Dtype* bottom_data = bottom[i]->cpu_data();
@@ -47,7 +50,9 @@ void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     if (this->bias_term_ && this->param_propagate_down_[1]) {
       Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
       for (int n = 0; n < this->num_; ++n) {
-        this->backward_cpu_bias(bias_diff, top_diff + top[i]->offset(n));
+        this->backward_cpu_bias(bias_diff, top_diff + top[i]->offset(n),
+            bias_fresh);
+        bias_fresh = false;
       }
     }
     if (this->param_propagate_down_[0] || propagate_down[i]) {
@@ -55,7 +60,9 @@ void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
         // gradient w.r.t. weight. Note that we will accumulate diffs.
         if (this->param_propagate_down_[0]) {
           this->weight_cpu_gemm(bottom_data + bottom[i]->offset(n),
-              top_diff + top[i]->offset(n), weight_diff);
+              top_diff + top[i]->offset(n), weight_diff,
+              weight_fresh);
+          weight_fresh = false;
         }
         // gradient w.r.t. bottom data, if necessary.
         if (propagate_down[i]) {
@@ -2,6 +2,10 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -16,6 +20,14 @@
 
 namespace caffe {
 
+// A record read and decoded ahead of the batch that will take it.
+template <typename Dtype>
+struct DataLayer<Dtype>::BucketedRecord {
+  Datum datum;
+  cv::Mat cv_img;
+  int64_t serial;
+};
+
 template <typename Dtype>
 DataLayer<Dtype>::~DataLayer<Dtype>() {
   this->JoinPrefetchThread();
@@ -29,13 +41,34 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   db_->Open(this->layer_param_.data_param().source(), db::READ);
   cursor_.reset(db_->NewCursor());
 
-  // Check if we should randomly skip a few data points
-  if (this->layer_param_.data_param().rand_skip()) {
-    unsigned int skip = caffe_rng_rand() %
-                        this->layer_param_.data_param().rand_skip();
+  // Check if we should skip a few data points, some of them at random
+  const DataParameter& data_param = this->layer_param_.data_param();
+  unsigned int skip = data_param.skip();
+  if (data_param.rand_skip()) {
+    skip += caffe_rng_rand() % data_param.rand_skip();
+  }
+  CHECK_GE(data_param.num_shards(), 1) << "num_shards must be positive";
+  CHECK_LT(data_param.shard_id(), data_param.num_shards())
+      << "shard_id must be less than num_shards";
+  if (data_param.num_shards() > 1) {
+    CHECK(!data_param.cache_samples())
+        << "cache_samples cannot be combined with num_shards";
+    // The shard's first batch follows the first batches of the shards
+    // before it.
+    skip += data_param.shard_id() * data_param.batch_size();
+  }
+  if (skip) {
     LOG(INFO) << "Skipping first " << skip << " data points.";
-    while (skip-- > 0) {
-      cursor_->Next();
+    skip_ = skip;
+    db::PackedCursor* packed_cursor =
+        dynamic_cast<db::PackedCursor*>(cursor_.get());
+    if (packed_cursor) {
+      // Packed dbs are indexed, so the skip is a single jump.
+      packed_cursor->Seek(skip);
+    } else {
+      while (skip-- > 0) {
+        cursor_->Next();
+      }
     }
   }
   // Read a data point, and use it to initialize the top blob.
@@ -49,6 +82,19 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   }
   // image
   int crop_size = this->layer_param_.transform_param().crop_size();
+  decode_min_size_ = 0;
+  if (this->layer_param_.transform_param().reduced_decode()) {
+    if (crop_size == 0) {
+      LOG(WARNING) << "reduced_decode needs a crop_size; decoding at full size.";
+    } else if (this->layer_param_.transform_param().has_mean_file()) {
+      LOG(WARNING) << "reduced_decode cannot be used with a mean_file; "
+          << "decoding at full size.";
+    } else {
+      decode_min_size_ = crop_size;
+      LOG(INFO) << "Decoding JPEGs at reduced resolution covering "
+          << crop_size << "x" << crop_size;
+    }
+  }
   if (crop_size > 0) {
     top[0]->Reshape(this->layer_param_.data_param().batch_size(),
         datum.channels(), crop_size, crop_size);
@@ -73,14 +119,69 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
     top[1]->Reshape(label_shape);
     this->prefetch_label_.Reshape(label_shape);
   }
+  // sample cache and echoing
+  CHECK_GE(data_param.echo_factor(), 1) << "echo_factor must be at least 1";
+  if (data_param.cache_samples()) {
+    CHECK(crop_size > 0 || data_param.batch_size() > 1)
+        << "cache_samples needs samples of a single shape; set a crop_size "
+        << "or a batch_size above 1";
+    if (this->phase_ == TRAIN && crop_size > 0) {
+      LOG(WARNING) << "cache_samples keeps the first random crop of every "
+          << "sample for the whole training.";
+    }
+    if (data_param.has_cache_file()) {
+      cache_db_.reset(db::GetDB(DataParameter_DB_PACKED));
+      cache_db_->Open(data_param.cache_file(), db::NEW);
+      cache_txn_.reset(cache_db_->NewTransaction());
+    }
+  }
+  if (data_param.bucket_window() > 0) {
+    CHECK_EQ(crop_size, 0) << "Bucketed batches keep the images uncropped";
+    CHECK(!this->layer_param_.transform_param().has_mean_file())
+        << "Bucketed batches of varying size cannot use a mean_file";
+    CHECK(!data_param.cache_samples())
+        << "cache_samples needs batches of one shape, not bucket_window";
+    CHECK_GT(data_param.bucket_step(), 0);
+    LOG(INFO) << "Bucketing images by size over " << data_param.bucket_window()
+        << " batches";
+  }
+  const TransformationParameter& transform_param =
+      this->layer_param_.transform_param();
+  mirror_ = transform_param.mirror() &&
+      (data_param.cache_samples() || data_param.echo_factor() > 1);
+  if (mirror_) {
+    TransformationParameter sample_param = transform_param;
+    sample_param.set_mirror(false);
+    sample_transformer_.reset(
+        new DataTransformer<Dtype>(sample_param, this->phase_));
+    sample_transformer_->InitRand();
+    mirror_rng_.reset(new Caffe::RNG(caffe_rng_rand()));
+  }
 }
 
 // This function is used to create a thread that prefetches the data.
 template <typename Dtype>
 void DataLayer<Dtype>::InternalThreadEntry() {
+  if (echoes_left_ > 0) {
+    --echoes_left_;
+    EchoBatch();
+  } else {
+    echoes_left_ = this->layer_param_.data_param().echo_factor() - 1;
+    if (this->layer_param_.data_param().bucket_window() > 0) {
+      LoadBucketedBatch();
+    } else {
+      LoadBatch();
+    }
+  }
+  this->BatchReady();
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::LoadBatch() {
   CPUTimer batch_timer;
   batch_timer.Start();
   double read_time = 0;
+  double decode_time = 0;
   double trans_time = 0;
   CPUTimer timer;
   CHECK(this->prefetch_data_.count());
@@ -112,52 +213,328 @@ void DataLayer<Dtype>::InternalThreadEntry() {
   if (this->output_labels_) {
     top_label = this->prefetch_label_.mutable_cpu_data();
   }
+  const bool cache_samples = this->layer_param_.data_param().cache_samples();
+  DataTransformer<Dtype>* transformer = mirror_ ?
+      sample_transformer_.get() : this->data_transformer_.get();
+  caffe::rng_t* mirror_rng = mirror_ ?
+      static_cast<caffe::rng_t*>(mirror_rng_->generator()) : NULL;
+  const int sample_rows =
+      this->prefetch_data_.channels() * this->prefetch_data_.height();
+  const int width = this->prefetch_data_.width();
   for (int item_id = 0; item_id < batch_size; ++item_id) {
+    Dtype* item_data = top_data + this->prefetch_data_.offset(item_id);
     timer.Start();
-    // get a blob
-    Datum datum;
-    datum.ParseFromString(cursor_->value());
-
-    cv::Mat cv_img;
-    if (datum.encoded()) {
-      if (force_color) {
-        cv_img = DecodeDatumToCVMat(datum, true);
-      } else {
-        cv_img = DecodeDatumToCVMatNative(datum);
+    if (cache_ready_) {
+      Dtype label;
+      ReadCachedSample(item_data, &label);
+      if (this->output_labels_) {
+        top_label[item_id] = label;
       }
-      if (cv_img.channels() != this->transformed_data_.channels()) {
-        LOG(WARNING) << "Your dataset contains encoded images with mixed "
-        << "channel sizes. Consider adding a 'force_color' flag to the "
-        << "model definition, or rebuild your dataset using "
-        << "convert_imageset.";
+      read_time += timer.MicroSeconds();
+      timer.Start();
+      if (mirror_ && (*mirror_rng)() % 2) {
+        MirrorSample(item_data, sample_rows, width);
       }
+      trans_time += timer.MicroSeconds();
+      continue;
     }
-    read_time += timer.MicroSeconds();
+    // get a blob
+    Datum datum;
+    cv::Mat cv_img;
+    ReadRecord(&datum, &cv_img, &read_time, &decode_time);
     timer.Start();
 
     // Apply data transformations (mirror, scale, crop...)
-    int offset = this->prefetch_data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(top_data + offset);
+    this->transformed_data_.set_cpu_data(item_data);
     if (datum.encoded()) {
-      this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
+      transformer->Transform(cv_img, &(this->transformed_data_));
     } else {
-      this->data_transformer_->Transform(datum, &(this->transformed_data_));
+      transformer->Transform(datum, &(this->transformed_data_));
     }
     if (this->output_labels_) {
       top_label[item_id] = datum.label();
     }
+    if (cache_samples) {
+      CacheSample(item_data, datum.label());
+    }
+    if (mirror_ && (*mirror_rng)() % 2) {
+      MirrorSample(item_data, sample_rows, width);
+    }
     trans_time += timer.MicroSeconds();
     // go to the next iter
-    cursor_->Next();
-    if (!cursor_->valid()) {
-      DLOG(INFO) << "Restarting data prefetching from start.";
-      cursor_->SeekToFirst();
-    }
+    NextRecord();
+  }
+  if (cache_txn_) {
+    cache_txn_->Commit();
   }
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
+  DLOG(INFO) << "   Decode time: " << decode_time / 1000 << " ms.";
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  this->batch_stats_.read += read_time / 1000;
+  this->batch_stats_.decode += decode_time / 1000;
+  this->batch_stats_.transform += trans_time / 1000;
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::ReadRecord(Datum* datum, cv::Mat* cv_img,
+    double* read_time, double* decode_time) {
+  CPUTimer timer;
+  timer.Start();
+  datum->ParseFromString(cursor_->value());
+  *read_time += timer.MicroSeconds();
+  timer.Start();
+  if (datum->encoded()) {
+    if (this->layer_param_.data_param().force_encoded_color()) {
+      *cv_img = DecodeDatumToCVMat(*datum, true,
+          decode_min_size_, decode_min_size_);
+    } else {
+      *cv_img = DecodeDatumToCVMatNative(*datum,
+          decode_min_size_, decode_min_size_);
+    }
+    if (cv_img->channels() != this->transformed_data_.channels()) {
+      LOG(WARNING) << "Your dataset contains encoded images with mixed "
+      << "channel sizes. Consider adding a 'force_color' flag to the "
+      << "model definition, or rebuild your dataset using "
+      << "convert_imageset.";
+    }
+  }
+  *decode_time += timer.MicroSeconds();
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::LoadBucketedBatch() {
+  CPUTimer timer;
+  double read_time = 0;
+  double decode_time = 0;
+  const DataParameter& data_param = this->layer_param_.data_param();
+  const int batch_size = data_param.batch_size();
+  const int step = data_param.bucket_step();
+  const int window = data_param.bucket_window() * batch_size;
+  while (num_bucketed_ < window) {
+    shared_ptr<BucketedRecord> record(new BucketedRecord());
+    ReadRecord(&record->datum, &record->cv_img, &read_time, &decode_time);
+    NextRecord();
+    const bool encoded = record->datum.encoded();
+    const int height = encoded ? record->cv_img.rows : record->datum.height();
+    const int width = encoded ? record->cv_img.cols : record->datum.width();
+    record->serial = records_pulled_++;
+    buckets_[std::make_pair((height + step - 1) / step,
+        (width + step - 1) / step)].push_back(record);
+    ++num_bucketed_;
+  }
+
+  typename BucketMap::iterator chosen = buckets_.find(current_bucket_);
+  typename BucketMap::iterator oldest = buckets_.begin();
+  typename BucketMap::iterator fullest = buckets_.begin();
+  for (typename BucketMap::iterator it = buckets_.begin();
+       it != buckets_.end(); ++it) {
+    if (it->second.front()->serial < oldest->second.front()->serial) {
+      oldest = it;
+    }
+    if (it->second.size() > fullest->second.size()) {
+      fullest = it;
+    }
+  }
+  if (records_pulled_ - oldest->second.front()->serial > 2 * window) {
+    chosen = oldest;
+  } else if (chosen == buckets_.end() || chosen->second.size() < batch_size) {
+    chosen = fullest;
+  }
+  current_bucket_ = chosen->first;
+  vector<shared_ptr<BucketedRecord> > batch;
+  while (batch.size() < batch_size) {
+    if (chosen == buckets_.end()) {
+      // Complete the batch from the bucket of the nearest size.
+      int best_distance = INT_MAX;
+      for (typename BucketMap::iterator it = buckets_.begin();
+           it != buckets_.end(); ++it) {
+        const int distance = abs(it->first.first - current_bucket_.first) +
+            abs(it->first.second - current_bucket_.second);
+        if (distance < best_distance) {
+          best_distance = distance;
+          chosen = it;
+        }
+      }
+    }
+    batch.push_back(chosen->second.front());
+    chosen->second.pop_front();
+    --num_bucketed_;
+    if (chosen->second.empty()) {
+      buckets_.erase(chosen);
+      chosen = buckets_.end();
+    }
+  }
+
+  // The batch takes the shape of its largest image.
+  timer.Start();
+  int channels = 0;
+  int height = 0;
+  int width = 0;
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    const BucketedRecord& record = *batch[item_id];
+    const bool encoded = record.datum.encoded();
+    channels = encoded ? record.cv_img.channels() : record.datum.channels();
+    height = std::max(height,
+        encoded ? record.cv_img.rows : record.datum.height());
+    width = std::max(width,
+        encoded ? record.cv_img.cols : record.datum.width());
+  }
+  this->prefetch_data_.Reshape(batch_size, channels, height, width);
+  Dtype* top_data = this->prefetch_data_.mutable_cpu_data();
+  caffe_set(this->prefetch_data_.count(),
+      static_cast<Dtype>(data_param.bucket_pad_value()), top_data);
+  Dtype* top_label = this->output_labels_ ?
+      this->prefetch_label_.mutable_cpu_data() : NULL;
+  DataTransformer<Dtype>* transformer = mirror_ ?
+      sample_transformer_.get() : this->data_transformer_.get();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    const BucketedRecord& record = *batch[item_id];
+    if (record.datum.encoded()) {
+      bucketed_sample_.Reshape(1, record.cv_img.channels(),
+          record.cv_img.rows, record.cv_img.cols);
+      transformer->Transform(record.cv_img, &bucketed_sample_);
+    } else {
+      bucketed_sample_.Reshape(1, record.datum.channels(),
+          record.datum.height(), record.datum.width());
+      transformer->Transform(record.datum, &bucketed_sample_);
+    }
+    CHECK_EQ(bucketed_sample_.channels(), channels)
+        << "Bucketed batches need images with one number of channels";
+    const int sample_height = bucketed_sample_.height();
+    const int sample_width = bucketed_sample_.width();
+    Dtype* sample = bucketed_sample_.mutable_cpu_data();
+    if (mirror_ && (*static_cast<caffe::rng_t*>(mirror_rng_->generator()))()
+        % 2) {
+      MirrorSample(sample, channels * sample_height, sample_width);
+    }
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < sample_height; ++h) {
+        caffe_copy(sample_width,
+            sample + (c * sample_height + h) * sample_width,
+            top_data + this->prefetch_data_.offset(item_id, c, h));
+      }
+    }
+    if (this->output_labels_) {
+      top_label[item_id] = record.datum.label();
+    }
+  }
+  this->batch_stats_.read += read_time / 1000;
+  this->batch_stats_.decode += decode_time / 1000;
+  this->batch_stats_.transform += timer.MicroSeconds() / 1000;
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::EchoBatch() {
+  CPUTimer timer;
+  timer.Start();
+  if (mirror_) {
+    caffe::rng_t* mirror_rng =
+        static_cast<caffe::rng_t*>(mirror_rng_->generator());
+    Dtype* top_data = this->prefetch_data_.mutable_cpu_data();
+    for (int item_id = 0; item_id < this->prefetch_data_.num(); ++item_id) {
+      if ((*mirror_rng)() % 2) {
+        MirrorSample(top_data + this->prefetch_data_.offset(item_id),
+            this->prefetch_data_.channels() * this->prefetch_data_.height(),
+            this->prefetch_data_.width());
+      }
+    }
+  }
+  this->batch_stats_.transform += timer.MicroSeconds() / 1000;
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::NextRecord() {
+  cursor_->Next();
+  const bool cache_samples = this->layer_param_.data_param().cache_samples();
+  if (cache_samples) {
+    ++records_read_;
+  }
+  if (!cursor_->valid()) {
+    DLOG(INFO) << "Restarting data prefetching from start.";
+    cursor_->SeekToFirst();
+    if (cache_samples && cache_size_ == 0) {
+      cache_size_ = skip_ + records_read_;
+    }
+  }
+  if (cache_samples && records_read_ == cache_size_) {
+    FinishCache();
+  }
+  // At the end of each of its batches, a shard steps over the batches of
+  // the other shards.
+  const DataParameter& data_param = this->layer_param_.data_param();
+  if (data_param.num_shards() > 1
+      && ++shard_pos_ == data_param.batch_size()) {
+    shard_pos_ = 0;
+    const int other_records =
+        (data_param.num_shards() - 1) * data_param.batch_size();
+    for (int i = 0; i < other_records; ++i) {
+      cursor_->Next();
+      if (!cursor_->valid()) {
+        cursor_->SeekToFirst();
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::CacheSample(const Dtype* data, Dtype label) {
+  const int dim = this->transformed_data_.count();
+  if (cache_txn_) {
+    // The cache is read back by position, so the record keys stay empty.
+    string value(reinterpret_cast<const char*>(data), dim * sizeof(Dtype));
+    value.append(reinterpret_cast<const char*>(&label), sizeof(Dtype));
+    cache_txn_->Put("", value);
+  } else {
+    cache_data_.insert(cache_data_.end(), data, data + dim);
+    cache_label_.push_back(label);
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::ReadCachedSample(Dtype* data, Dtype* label) {
+  const int dim = this->transformed_data_.count();
+  if (cache_cursor_) {
+    const string value = cache_cursor_->value();
+    CHECK_EQ(value.size(), (dim + 1) * sizeof(Dtype))
+        << "Corrupt sample cache "
+        << this->layer_param_.data_param().cache_file();
+    memcpy(data, value.data(), dim * sizeof(Dtype));
+    memcpy(label, value.data() + dim * sizeof(Dtype), sizeof(Dtype));
+    cache_cursor_->Next();
+    if (!cache_cursor_->valid()) {
+      cache_cursor_->SeekToFirst();
+    }
+  } else {
+    caffe_copy(dim, &cache_data_[cache_pos_ * dim], data);
+    *label = cache_label_[cache_pos_];
+    cache_pos_ = (cache_pos_ + 1) % cache_size_;
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::FinishCache() {
+  if (cache_db_) {
+    cache_txn_->Commit();
+    cache_txn_.reset();
+    cache_db_->Close();
+    cache_db_->Open(this->layer_param_.data_param().cache_file(), db::READ);
+    cache_cursor_.reset(cache_db_->NewCursor());
+  }
+  // The cursor is back at the first record read, which is the first sample
+  // in the cache.
+  cache_pos_ = 0;
+  cache_ready_ = true;
+  LOG(INFO) << "Cached " << cache_size_ << " samples; serving later epochs "
+      << "from the cache.";
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::MirrorSample(Dtype* data, int rows, int width) {
+  for (int row = 0; row < rows; ++row) {
+    std::reverse(data + row * width, data + (row + 1) * width);
+  }
 }
 
 INSTANTIATE_CLASS(DataLayer);
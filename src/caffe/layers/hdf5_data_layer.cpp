@@ -1,58 +1,124 @@
 /*
 TODO:
-- load file in a separate thread ("prefetch")
-- can be smarter about the memcpy call instead of doing it row-by-row
-  :: use util functions caffe_copy, and Blob->offset()
-  :: don't forget to update hdf5_daa_layer.cu accordingly
 - add ability to shuffle filenames if flag is set
 */
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
 
+#include "boost/thread/mutex.hpp"
 #include "hdf5.h"
 #include "hdf5_hl.h"
 #include "stdint.h"
 
 #include "caffe/layer.hpp"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
 
 template <typename Dtype>
-HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() { }
+HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() {
+  JoinPrefetchThread();
+  CloseHDF5File();
+}
 
-// Load data and label from HDF5 filename into the class property blobs.
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LoadHDF5FileData(const char* filename) {
-  DLOG(INFO) << "Loading HDF5 file: " << filename;
-  hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (file_id < 0) {
+void HDF5DataLayer<Dtype>::OpenHDF5File() {
+  const char* filename = hdf_filenames_[current_file_].c_str();
+  DLOG(INFO) << "Opening HDF5 file: " << filename;
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  file_id_ = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (file_id_ < 0) {
     LOG(FATAL) << "Failed opening HDF5 file: " << filename;
   }
-
-  int top_size = this->layer_param_.top_size();
-  hdf_blobs_.resize(top_size);
-
-  const int MIN_DATA_DIM = 1;
-  const int MAX_DATA_DIM = INT_MAX;
-
+  const int top_size = this->layer_param_.top_size();
+  dataset_ids_.resize(top_size);
   for (int i = 0; i < top_size; ++i) {
-    hdf_blobs_[i] = shared_ptr<Blob<Dtype> >(new Blob<Dtype>());
-    hdf5_load_nd_dataset(file_id, this->layer_param_.top(i).c_str(),
-        MIN_DATA_DIM, MAX_DATA_DIM, hdf_blobs_[i].get());
+    const char* dataset_name = this->layer_param_.top(i).c_str();
+    CHECK(H5LTfind_dataset(file_id_, dataset_name))
+        << "Failed to find HDF5 dataset " << dataset_name;
+    dataset_ids_[i] = H5Dopen2(file_id_, dataset_name, H5P_DEFAULT);
+    CHECK_GE(dataset_ids_[i], 0) << "Failed to open HDF5 dataset "
+        << dataset_name;
+    hid_t type_id = H5Dget_type(dataset_ids_[i]);
+    CHECK_EQ(H5Tget_class(type_id), H5T_FLOAT)
+        << "Expected float or double data";
+    H5Tclose(type_id);
+    hid_t space_id = H5Dget_space(dataset_ids_[i]);
+    const int ndims = H5Sget_simple_extent_ndims(space_id);
+    CHECK_GE(ndims, 1);
+    vector<hsize_t> dims(ndims);
+    H5Sget_simple_extent_dims(space_id, dims.data(), NULL);
+    H5Sclose(space_id);
+    if (i == 0) {
+      file_rows_ = dims[0];
+    } else {
+      CHECK_EQ(dims[0], file_rows_);
+    }
+    // Every file must have the row shape the tops were set up with.
+    if (prefetch_blobs_.size() > i) {
+      CHECK_EQ(ndims, prefetch_blobs_[i]->num_axes()) << dataset_name;
+      for (int j = 1; j < ndims; ++j) {
+        CHECK_EQ(dims[j], prefetch_blobs_[i]->shape(j)) << dataset_name;
+      }
+    } else {
+      const int batch_size =
+          this->layer_param_.hdf5_data_param().batch_size();
+      vector<int> shape(dims.begin(), dims.end());
+      shape[0] = batch_size;
+      prefetch_blobs_.push_back(
+          shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
+    }
   }
+  CHECK_GT(file_rows_, 0) << "No rows in HDF5 file: " << filename;
+  DLOG(INFO) << "HDF5 file has " << file_rows_ << " rows";
+}
 
-  herr_t status = H5Fclose(file_id);
-  CHECK_GE(status, 0) << "Failed to close HDF5 file: " << filename;
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::CloseHDF5File() {
+  if (file_id_ < 0) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  for (int i = 0; i < dataset_ids_.size(); ++i) {
+    H5Dclose(dataset_ids_[i]);
+  }
+  dataset_ids_.clear();
+  herr_t status = H5Fclose(file_id_);
+  CHECK_GE(status, 0) << "Failed to close HDF5 file: "
+      << hdf_filenames_[current_file_];
+  file_id_ = -1;
+}
 
-  // MinTopBlobs==1 guarantees at least one top blob
-  int num = hdf_blobs_[0]->num();
-  for (int i = 1; i < top_size; ++i) {
-    CHECK_EQ(hdf_blobs_[i]->num(), num);
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::ReadRows(int num_rows, int offset) {
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  for (int i = 0; i < dataset_ids_.size(); ++i) {
+    Blob<Dtype>* blob = prefetch_blobs_[i].get();
+    const int ndims = blob->num_axes();
+    vector<hsize_t> start(ndims, 0);
+    vector<hsize_t> count(ndims);
+    for (int j = 0; j < ndims; ++j) {
+      count[j] = blob->shape(j);
+    }
+    start[0] = current_row_;
+    count[0] = num_rows;
+    hid_t file_space = H5Dget_space(dataset_ids_[i]);
+    herr_t status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET,
+        start.data(), NULL, count.data(), NULL);
+    CHECK_GE(status, 0) << "Failed to select HDF5 rows";
+    hid_t mem_space = H5Screate_simple(ndims, count.data(), NULL);
+    const int row_dim = blob->count(1);
+    status = H5Dread(dataset_ids_[i], hdf5_native_type<Dtype>(), mem_space,
+        file_space, H5P_DEFAULT, blob->mutable_cpu_data() + offset * row_dim);
+    CHECK_GE(status, 0) << "Failed to read HDF5 dataset "
+        << this->layer_param_.top(i);
+    H5Sclose(mem_space);
+    H5Sclose(file_space);
   }
-  DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->num() << " rows";
 }
 
 template <typename Dtype>
@@ -61,6 +127,9 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // Refuse transformation parameters since HDF5 is totally generic.
   CHECK(!this->layer_param_.has_transform_param()) <<
       this->type() << " does not transform data.";
+  // Release the state of any earlier SetUp.
+  JoinPrefetchThread();
+  CloseHDF5File();
   // Read the source to parse the filenames.
   const string& source = this->layer_param_.hdf5_data_param().source();
   LOG(INFO) << "Loading list of HDF5 filenames from: " << source;
@@ -81,47 +150,72 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_GE(num_files_, 1) << "Must have at least 1 HDF5 filename listed in "
     << source;
 
-  // Load the first HDF5 file and initialize the line counter.
-  LoadHDF5FileData(hdf_filenames_[current_file_].c_str());
+  // Open the first HDF5 file, which also shapes the prefetch blobs.
+  prefetch_blobs_.clear();
+  OpenHDF5File();
   current_row_ = 0;
 
   // Reshape blobs.
-  const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
   const int top_size = this->layer_param_.top_size();
-  vector<int> top_shape;
   for (int i = 0; i < top_size; ++i) {
-    top_shape.resize(hdf_blobs_[i]->num_axes());
-    top_shape[0] = batch_size;
-    for (int j = 1; j < top_shape.size(); ++j) {
-      top_shape[j] = hdf_blobs_[i]->shape(j);
-    }
-    top[i]->Reshape(top_shape);
+    top[i]->ReshapeLike(*prefetch_blobs_[i]);
+    // Allocate on this thread before the prefetch thread writes to it.
+    prefetch_blobs_[i]->mutable_cpu_data();
   }
+  CreatePrefetchThread();
 }
 
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {
+void HDF5DataLayer<Dtype>::CreatePrefetchThread() {
+  CHECK(StartInternalThread()) << "Thread execution failed";
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::JoinPrefetchThread() {
+  CHECK(WaitForInternalThreadToExit()) << "Thread joining failed";
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::InternalThreadEntry() {
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  for (int i = 0; i < batch_size; ++i, ++current_row_) {
-    if (current_row_ == hdf_blobs_[0]->num()) {
+  CPUTimer timer;
+  timer.Start();
+  int filled = 0;
+  while (filled < batch_size) {
+    if (current_row_ == file_rows_) {
       if (num_files_ > 1) {
+        CloseHDF5File();
         ++current_file_;
         if (current_file_ == num_files_) {
           current_file_ = 0;
           DLOG(INFO) << "Looping around to first file.";
         }
-        LoadHDF5FileData(hdf_filenames_[current_file_].c_str());
+        OpenHDF5File();
       }
       current_row_ = 0;
     }
-    for (int j = 0; j < this->layer_param_.top_size(); ++j) {
-      int data_dim = top[j]->count() / top[j]->num();
-      caffe_copy(data_dim,
-          &hdf_blobs_[j]->cpu_data()[current_row_ * data_dim],
-          &top[j]->mutable_cpu_data()[i * data_dim]);
-    }
+    const int num_rows = std::min<hsize_t>(batch_size - filled,
+                                           file_rows_ - current_row_);
+    ReadRows(num_rows, filled);
+    current_row_ += num_rows;
+    filled += num_rows;
+  }
+  // H5Dread converts to Dtype while reading, so it is all read time.
+  batch_stats_.read += timer.MilliSeconds();
+  BatchReady();
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  StartForwardWait();
+  JoinPrefetchThread();
+  EndForwardWait();
+  for (int i = 0; i < this->layer_param_.top_size(); ++i) {
+    caffe_copy(prefetch_blobs_[i]->count(), prefetch_blobs_[i]->cpu_data(),
+        top[i]->mutable_cpu_data());
   }
+  CreatePrefetchThread();
 }
 
 #ifdef CPU_ONLY
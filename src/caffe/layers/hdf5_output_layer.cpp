@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <vector>
 
+#include "boost/thread/mutex.hpp"
 #include "hdf5.h"
 #include "hdf5_hl.h"
 
@@ -14,30 +16,130 @@ namespace caffe {
 template <typename Dtype>
 void HDF5OutputLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  file_name_ = this->layer_param_.hdf5_output_param().file_name();
-  file_id_ = H5Fcreate(file_name_.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
-                       H5P_DEFAULT);
-  CHECK_GE(file_id_, 0) << "Failed to open HDF5 file" << file_name_;
+  const HDF5OutputParameter& param = this->layer_param_.hdf5_output_param();
+  file_name_ = param.file_name();
+  CHECK_LE(param.compression_level(), 9) << "gzip levels are 0 to 9";
+  {
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    file_id_ = H5Fcreate(file_name_.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
+                         H5P_DEFAULT);
+    CHECK_GE(file_id_, 0) << "Failed to open HDF5 file" << file_name_;
+  }
   file_opened_ = true;
+  const int num_slots = std::max<int>(1, param.queue_size());
+  free_slots_.reset(new BlockingQueue<int>());
+  full_slots_.reset(new BlockingQueue<int>());
+  for (int i = 0; i < num_slots; ++i) {
+    data_blobs_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    label_blobs_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    free_slots_->push(i);
+  }
+  if (param.queue_size() > 0) {
+    CHECK(StartInternalThread()) << "Thread execution failed";
+  }
 }
 
 template <typename Dtype>
 HDF5OutputLayer<Dtype>::~HDF5OutputLayer<Dtype>() {
+  if (is_started()) {
+    // Let the writer drain the queue, then stop it.
+    full_slots_->push(-1);
+    CHECK(WaitForInternalThreadToExit()) << "Thread joining failed";
+  }
   if (file_opened_) {
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    if (data_dataset_ >= 0) {
+      H5Dclose(data_dataset_);
+    }
+    if (label_dataset_ >= 0) {
+      H5Dclose(label_dataset_);
+    }
     herr_t status = H5Fclose(file_id_);
     CHECK_GE(status, 0) << "Failed to close HDF5 file " << file_name_;
   }
 }
 
 template <typename Dtype>
-void HDF5OutputLayer<Dtype>::SaveBlobs() {
-  // TODO: no limit on the number of blobs
-  LOG(INFO) << "Saving HDF5 file " << file_name_;
-  CHECK_EQ(data_blob_.num(), label_blob_.num()) <<
+void HDF5OutputLayer<Dtype>::InternalThreadEntry() {
+  while (true) {
+    int slot;
+    full_slots_->pop(&slot);
+    if (slot < 0) {
+      break;
+    }
+    SaveBlobs(slot);
+    free_slots_->push(slot);
+  }
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::AppendRows(const Blob<Dtype>& blob,
+    const char* dataset_name, hid_t* dataset_id) {
+  hsize_t dims[HDF5_NUM_DIMS];
+  dims[0] = blob.num();
+  dims[1] = blob.channels();
+  dims[2] = blob.height();
+  dims[3] = blob.width();
+  herr_t status;
+  if (*dataset_id < 0) {
+    // Start with no rows and let the first dimension grow without limit.
+    hsize_t initial_dims[HDF5_NUM_DIMS] = {0, dims[1], dims[2], dims[3]};
+    hsize_t max_dims[HDF5_NUM_DIMS] =
+        {H5S_UNLIMITED, dims[1], dims[2], dims[3]};
+    hsize_t chunk_dims[HDF5_NUM_DIMS] = {dims[0], dims[1], dims[2], dims[3]};
+    const HDF5OutputParameter& param = this->layer_param_.hdf5_output_param();
+    if (param.chunk_rows() > 0) {
+      chunk_dims[0] = param.chunk_rows();
+    }
+    hid_t space = H5Screate_simple(HDF5_NUM_DIMS, initial_dims, max_dims);
+    hid_t create_plist = H5Pcreate(H5P_DATASET_CREATE);
+    status = H5Pset_chunk(create_plist, HDF5_NUM_DIMS, chunk_dims);
+    CHECK_GE(status, 0) << "Failed to set the chunk size of " << dataset_name;
+    if (param.compression_level() > 0) {
+      status = H5Pset_deflate(create_plist, param.compression_level());
+      CHECK_GE(status, 0) << "Failed to enable compression of "
+          << dataset_name;
+    }
+    *dataset_id = H5Dcreate2(file_id_, dataset_name, hdf5_native_type<Dtype>(),
+        space, H5P_DEFAULT, create_plist, H5P_DEFAULT);
+    H5Pclose(create_plist);
+    H5Sclose(space);
+    CHECK_GE(*dataset_id, 0) << "Failed to create dataset " << dataset_name;
+  }
+  hid_t file_space = H5Dget_space(*dataset_id);
+  hsize_t file_dims[HDF5_NUM_DIMS];
+  H5Sget_simple_extent_dims(file_space, file_dims, NULL);
+  H5Sclose(file_space);
+  for (int i = 1; i < HDF5_NUM_DIMS; ++i) {
+    CHECK_EQ(file_dims[i], dims[i]) << "Row shape of " << dataset_name
+        << " changed between batches";
+  }
+  file_dims[0] = rows_written_ + dims[0];
+  status = H5Dset_extent(*dataset_id, file_dims);
+  CHECK_GE(status, 0) << "Failed to extend dataset " << dataset_name;
+  file_space = H5Dget_space(*dataset_id);
+  hsize_t offset[HDF5_NUM_DIMS] = {rows_written_, 0, 0, 0};
+  H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset, NULL, dims, NULL);
+  hid_t mem_space = H5Screate_simple(HDF5_NUM_DIMS, dims, NULL);
+  status = H5Dwrite(*dataset_id, hdf5_native_type<Dtype>(), mem_space,
+      file_space, H5P_DEFAULT, blob.cpu_data());
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+  CHECK_GE(status, 0) << "Failed to write to dataset " << dataset_name;
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::SaveBlobs(int slot) {
+  const Blob<Dtype>& data_blob = *data_blobs_[slot];
+  const Blob<Dtype>& label_blob = *label_blobs_[slot];
+  DLOG(INFO) << "Saving HDF5 file " << file_name_;
+  CHECK_EQ(data_blob.num(), label_blob.num()) <<
       "data blob and label blob must have the same batch size";
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_DATASET_NAME, data_blob_);
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_LABEL_NAME, label_blob_);
-  LOG(INFO) << "Successfully saved " << data_blob_.num() << " rows";
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  AppendRows(data_blob, HDF5_DATA_DATASET_NAME, &data_dataset_);
+  AppendRows(label_blob, HDF5_DATA_LABEL_NAME, &label_dataset_);
+  rows_written_ += data_blob.num();
+  DLOG(INFO) << "Successfully saved " << data_blob.num() << " rows";
 }
 
 template <typename Dtype>
@@ -45,20 +147,25 @@ void HDF5OutputLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   CHECK_GE(bottom.size(), 2);
   CHECK_EQ(bottom[0]->num(), bottom[1]->num());
-  data_blob_.Reshape(bottom[0]->num(), bottom[0]->channels(),
+  int slot;
+  free_slots_->pop(&slot);
+  Blob<Dtype>* data_blob = data_blobs_[slot].get();
+  Blob<Dtype>* label_blob = label_blobs_[slot].get();
+  data_blob->Reshape(bottom[0]->num(), bottom[0]->channels(),
                      bottom[0]->height(), bottom[0]->width());
-  label_blob_.Reshape(bottom[1]->num(), bottom[1]->channels(),
-                     bottom[1]->height(), bottom[1]->width());
-  const int data_datum_dim = bottom[0]->count() / bottom[0]->num();
-  const int label_datum_dim = bottom[1]->count() / bottom[1]->num();
-
-  for (int i = 0; i < bottom[0]->num(); ++i) {
-    caffe_copy(data_datum_dim, &bottom[0]->cpu_data()[i * data_datum_dim],
-        &data_blob_.mutable_cpu_data()[i * data_datum_dim]);
-    caffe_copy(label_datum_dim, &bottom[1]->cpu_data()[i * label_datum_dim],
-        &label_blob_.mutable_cpu_data()[i * label_datum_dim]);
+  label_blob->Reshape(bottom[1]->num(), bottom[1]->channels(),
+                      bottom[1]->height(), bottom[1]->width());
+  // cpu_data() also brings GPU bottoms over, so Forward_gpu shares this path.
+  caffe_copy(bottom[0]->count(), bottom[0]->cpu_data(),
+      data_blob->mutable_cpu_data());
+  caffe_copy(bottom[1]->count(), bottom[1]->cpu_data(),
+      label_blob->mutable_cpu_data());
+  if (is_started()) {
+    full_slots_->push(slot);
+  } else {
+    SaveBlobs(slot);
+    free_slots_->push(slot);
   }
-  SaveBlobs();
 }
 
 template <typename Dtype>
@@ -1,11 +1,15 @@
 #include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <iostream>  // NOLINT(readability/streams)
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "boost/thread.hpp"
+
 #include "caffe/data_layers.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/benchmark.hpp"
@@ -68,6 +72,22 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // image
   const int crop_size = this->layer_param_.transform_param().crop_size();
   const int batch_size = this->layer_param_.image_data_param().batch_size();
+  decode_min_height_ = decode_min_width_ = 0;
+  if (this->layer_param_.transform_param().reduced_decode()) {
+    if (new_height > 0) {
+      // The image is resized afterwards, so only the resize target matters.
+      decode_min_height_ = new_height;
+      decode_min_width_ = new_width;
+    } else if (crop_size == 0) {
+      LOG(WARNING) << "reduced_decode needs new_height/new_width or a "
+          << "crop_size; decoding at full size.";
+    } else if (this->layer_param_.transform_param().has_mean_file()) {
+      LOG(WARNING) << "reduced_decode cannot be used with a mean_file "
+          << "without new_height/new_width; decoding at full size.";
+    } else {
+      decode_min_height_ = decode_min_width_ = crop_size;
+    }
+  }
   if (crop_size > 0) {
     top[0]->Reshape(batch_size, channels, crop_size, crop_size);
     this->prefetch_data_.Reshape(batch_size, channels, crop_size, crop_size);
@@ -80,6 +100,19 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   LOG(INFO) << "output data size: " << top[0]->num() << ","
       << top[0]->channels() << "," << top[0]->height() << ","
       << top[0]->width();
+  const size_t cache_bytes =
+      static_cast<size_t>(this->layer_param_.image_data_param().cache_mb())
+      << 20;
+  if (cache_bytes > 0) {
+    if (this->layer_param_.image_data_param().cache_encoded()) {
+      encoded_cache_.reset(new LRUCache<string>(cache_bytes));
+    } else {
+      image_cache_.reset(new LRUCache<cv::Mat>(cache_bytes));
+    }
+    LOG(INFO) << "Caching up to "
+        << this->layer_param_.image_data_param().cache_mb() << " MB of "
+        << (encoded_cache_ ? "encoded" : "decoded") << " images";
+  }
   // label
   vector<int> label_shape(1, batch_size);
   top[1]->Reshape(label_shape);
@@ -108,13 +141,11 @@ void ImageDataLayer<Dtype>::InternalThreadEntry() {
   const int new_height = image_data_param.new_height();
   const int new_width = image_data_param.new_width();
   const int crop_size = this->layer_param_.transform_param().crop_size();
-  const bool is_color = image_data_param.is_color();
   string root_folder = image_data_param.root_folder();
 
   // Reshape on single input batches for inputs of varying dimension.
   if (batch_size == 1 && crop_size == 0 && new_height == 0 && new_width == 0) {
-    cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
-        0, 0, is_color);
+    cv::Mat cv_img = LoadImage(root_folder + lines_[lines_id_].first);
     this->prefetch_data_.Reshape(1, cv_img.channels(),
         cv_img.rows, cv_img.cols);
     this->transformed_data_.Reshape(1, cv_img.channels(),
@@ -124,23 +155,12 @@ void ImageDataLayer<Dtype>::InternalThreadEntry() {
   Dtype* prefetch_data = this->prefetch_data_.mutable_cpu_data();
   Dtype* prefetch_label = this->prefetch_label_.mutable_cpu_data();
 
-  // datum scales
+  // Take the batch's files and labels first, so the reads can run in parallel.
   const int lines_size = lines_.size();
+  vector<string> filenames(batch_size);
   for (int item_id = 0; item_id < batch_size; ++item_id) {
-    // get a blob
-    timer.Start();
     CHECK_GT(lines_size, lines_id_);
-    cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
-        new_height, new_width, is_color);
-    CHECK(cv_img.data) << "Could not load " << lines_[lines_id_].first;
-    read_time += timer.MicroSeconds();
-    timer.Start();
-    // Apply transformations (mirror, crop...) to the image
-    int offset = this->prefetch_data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(prefetch_data + offset);
-    this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
-    trans_time += timer.MicroSeconds();
-
+    filenames[item_id] = root_folder + lines_[lines_id_].first;
     prefetch_label[item_id] = lines_[lines_id_].second;
     // go to the next iter
     lines_id_++;
@@ -153,10 +173,89 @@ void ImageDataLayer<Dtype>::InternalThreadEntry() {
       }
     }
   }
+
+  timer.Start();
+  vector<cv::Mat> images(batch_size);
+  const int num_readers = std::min<int>(
+      std::max<int>(image_data_param.num_readers(), 1), batch_size);
+  if (num_readers == 1) {
+    LoadImages(filenames, 0, 1, &images);
+  } else {
+    boost::thread_group readers;
+    for (int i = 0; i < num_readers; ++i) {
+      readers.create_thread(boost::bind(&ImageDataLayer<Dtype>::LoadImages,
+          this, boost::cref(filenames), i, num_readers, &images));
+    }
+    readers.join_all();
+  }
+  read_time += timer.MicroSeconds();
+
+  // Apply transformations (mirror, crop...) to the images. This stays serial:
+  // the transformer draws crops and mirrors from a single RNG.
+  timer.Start();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    CHECK(images[item_id].data) << "Could not load " << filenames[item_id];
+    int offset = this->prefetch_data_.offset(item_id);
+    this->transformed_data_.set_cpu_data(prefetch_data + offset);
+    this->data_transformer_->Transform(images[item_id],
+        &(this->transformed_data_));
+  }
+  trans_time += timer.MicroSeconds();
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  // The readers load and decode each file in one go; that counts as decode.
+  this->batch_stats_.decode += read_time / 1000;
+  this->batch_stats_.transform += trans_time / 1000;
+  this->BatchReady();
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::LoadImages(const vector<string>& filenames,
+    int start, int step, vector<cv::Mat>* images) {
+  for (int i = start; i < filenames.size(); i += step) {
+    (*images)[i] = LoadImage(filenames[i]);
+  }
+}
+
+template <typename Dtype>
+cv::Mat ImageDataLayer<Dtype>::LoadImage(const string& filename) {
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  const int new_height = image_data_param.new_height();
+  const int new_width = image_data_param.new_width();
+  const bool is_color = image_data_param.is_color();
+  cv::Mat cv_img;
+  if (image_cache_ && image_cache_->Get(filename, &cv_img)) {
+    return cv_img;
+  }
+  if (encoded_cache_) {
+    string buffer;
+    if (!encoded_cache_->Get(filename, &buffer)) {
+      Datum datum;
+      if (!ReadFileToDatum(filename, 0, &datum)) {
+        LOG(ERROR) << "Could not open or find file " << filename;
+        return cv_img;
+      }
+      buffer = datum.data();
+      encoded_cache_->Put(filename, buffer, buffer.size());
+    }
+    cv::Mat cv_img_origin = DecodeImageToCVMat(buffer, is_color,
+        decode_min_height_, decode_min_width_);
+    if (cv_img_origin.data && new_height > 0 && new_width > 0) {
+      cv::resize(cv_img_origin, cv_img, cv::Size(new_width, new_height));
+    } else {
+      cv_img = cv_img_origin;
+    }
+    return cv_img;
+  }
+  cv_img = ReadImageToCVMat(filename, new_height, new_width, is_color,
+      decode_min_height_, decode_min_width_);
+  if (image_cache_ && cv_img.data) {
+    image_cache_->Put(filename, cv_img, cv_img.total() * cv_img.elemSize());
+  }
+  return cv_img;
 }
 
 INSTANTIATE_CLASS(ImageDataLayer);
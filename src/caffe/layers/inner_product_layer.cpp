@@ -99,15 +99,16 @@ void InnerProductLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   if (this->param_propagate_down_[0]) {
     const Dtype* top_diff = top[0]->cpu_diff();
     const Dtype* bottom_data = bottom[0]->cpu_data();
-    // Gradient with respect to weight
+    // Gradient with respect to weight, overwriting a fresh diff
     caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, N_, K_, M_, (Dtype)1.,
-        top_diff, bottom_data, (Dtype)1., this->blobs_[0]->mutable_cpu_diff());
+        top_diff, bottom_data, (Dtype)(this->param_diff_fresh(0) ? 0 : 1),
+        this->blobs_[0]->mutable_cpu_diff());
   }
   if (bias_term_ && this->param_propagate_down_[1]) {
     const Dtype* top_diff = top[0]->cpu_diff();
     // Gradient with respect to bias
     caffe_cpu_gemv<Dtype>(CblasTrans, M_, N_, (Dtype)1., top_diff,
-        bias_multiplier_.cpu_data(), (Dtype)1.,
+        bias_multiplier_.cpu_data(), (Dtype)(this->param_diff_fresh(1) ? 0 : 1),
         this->blobs_[1]->mutable_cpu_diff());
   }
   if (propagate_down[0]) {
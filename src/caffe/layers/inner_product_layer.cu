@@ -31,15 +31,16 @@ void InnerProductLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
   if (this->param_propagate_down_[0]) {
     const Dtype* top_diff = top[0]->gpu_diff();
     const Dtype* bottom_data = bottom[0]->gpu_data();
-    // Gradient with respect to weight
+    // Gradient with respect to weight, overwriting a fresh diff
     caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, N_, K_, M_, (Dtype)1.,
-        top_diff, bottom_data, (Dtype)1., this->blobs_[0]->mutable_gpu_diff());
+        top_diff, bottom_data, (Dtype)(this->param_diff_fresh(0) ? 0 : 1),
+        this->blobs_[0]->mutable_gpu_diff());
   }
   if (bias_term_ && this->param_propagate_down_[1]) {
     const Dtype* top_diff = top[0]->gpu_diff();
     // Gradient with respect to bias
     caffe_gpu_gemv<Dtype>(CblasTrans, M_, N_, (Dtype)1., top_diff,
-        bias_multiplier_.gpu_data(), (Dtype)1.,
+        bias_multiplier_.gpu_data(), (Dtype)(this->param_diff_fresh(1) ? 0 : 1),
         this->blobs_[1]->mutable_gpu_diff());
   }
   if (propagate_down[0]) {
@@ -5,6 +5,7 @@
 #include "caffe/data_layers.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
@@ -28,6 +29,25 @@ void MemoryDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   labels_ = NULL;
   added_data_.cpu_data();
   added_label_.cpu_data();
+  const int ring_size = this->layer_param_.memory_data_param().ring_size();
+  if (this->layer_param_.memory_data_param().reuse_batch_on_timeout()) {
+    CHECK_GE(ring_size, 2) << "reuse_batch_on_timeout holds a slot while "
+        << "waiting, so it needs ring_size of at least 2";
+  }
+  if (ring_size > 0) {
+    free_slots_.reset(new BlockingQueue<int>());
+    full_slots_.reset(new BlockingQueue<int>());
+    for (int i = 0; i < ring_size; ++i) {
+      ring_data_.push_back(shared_ptr<Blob<Dtype> >(
+          new Blob<Dtype>(batch_size_, channels_, height_, width_)));
+      ring_labels_.push_back(shared_ptr<Blob<Dtype> >(
+          new Blob<Dtype>(label_shape)));
+      // Allocate now rather than on a producer thread.
+      ring_data_[i]->mutable_cpu_data();
+      ring_labels_[i]->mutable_cpu_data();
+      free_slots_->push(i);
+    }
+  }
 }
 
 template <typename Dtype>
@@ -79,6 +99,7 @@ void MemoryDataLayer<Dtype>::AddMatVector(const vector<cv::Mat>& mat_vector,
 
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::Reset(Dtype* data, Dtype* labels, int n) {
+  CHECK(!free_slots_) << "Use PushBatch or PushMatBatch when ring_size is set";
   CHECK(data);
   CHECK(labels);
   CHECK_EQ(n % batch_size_, 0) << "n must be a multiple of batch size";
@@ -95,6 +116,7 @@ void MemoryDataLayer<Dtype>::Reset(Dtype* data, Dtype* labels, int n) {
 
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::set_batch_size(int new_size) {
+  CHECK(!free_slots_) << "Can't change batch_size when ring_size is set.";
   CHECK(!has_new_data_) <<
       "Can't change batch_size until current data has been consumed.";
   batch_size_ = new_size;
@@ -102,9 +124,131 @@ void MemoryDataLayer<Dtype>::set_batch_size(int new_size) {
   added_label_.Reshape(batch_size_, 1, 1, 1);
 }
 
+template <typename Dtype>
+bool MemoryDataLayer<Dtype>::AcquireSlot(int timeout_ms, int* slot) {
+  CHECK(free_slots_) << "PushBatch needs ring_size in memory_data_param";
+  if (free_slots_->try_pop(slot)) {
+    return true;
+  }
+  {
+    boost::mutex::scoped_lock lock(stats_mutex_);
+    ++ring_stats_.producer_waits;
+  }
+  if (timeout_ms < 0) {
+    free_slots_->pop(slot);
+    return true;
+  }
+  return free_slots_->pop_for(slot, timeout_ms);
+}
+
+template <typename Dtype>
+bool MemoryDataLayer<Dtype>::PushBatch(const Dtype* data, const Dtype* labels,
+    int timeout_ms) {
+  int slot;
+  if (!AcquireSlot(timeout_ms, &slot)) {
+    return false;
+  }
+  caffe_copy(batch_size_ * size_, data, ring_data_[slot]->mutable_cpu_data());
+  caffe_copy(batch_size_, labels, ring_labels_[slot]->mutable_cpu_data());
+  full_slots_->push(slot);
+  boost::mutex::scoped_lock lock(stats_mutex_);
+  ++ring_stats_.pushed;
+  return true;
+}
+
+template <typename Dtype>
+DataTransformer<Dtype>* MemoryDataLayer<Dtype>::ProducerTransformer() {
+  boost::mutex::scoped_lock lock(producer_transformers_mutex_);
+  shared_ptr<DataTransformer<Dtype> >& transformer =
+      producer_transformers_[boost::this_thread::get_id()];
+  if (!transformer) {
+    transformer.reset(new DataTransformer<Dtype>(this->transform_param_,
+        this->phase_));
+    transformer->InitRand();
+  }
+  return transformer.get();
+}
+
+template <typename Dtype>
+bool MemoryDataLayer<Dtype>::PushMatBatch(const vector<cv::Mat>& mat_vector,
+    const vector<int>& labels, int timeout_ms) {
+  CHECK_EQ(mat_vector.size(), batch_size_) <<
+      "PushMatBatch takes exactly one batch of mats";
+  CHECK_EQ(labels.size(), batch_size_);
+  DataTransformer<Dtype>* transformer = ProducerTransformer();
+  int slot;
+  if (!AcquireSlot(timeout_ms, &slot)) {
+    return false;
+  }
+  transformer->Transform(mat_vector, ring_data_[slot].get());
+  Dtype* top_label = ring_labels_[slot]->mutable_cpu_data();
+  for (int item_id = 0; item_id < batch_size_; ++item_id) {
+    top_label[item_id] = labels[item_id];
+  }
+  full_slots_->push(slot);
+  boost::mutex::scoped_lock lock(stats_mutex_);
+  ++ring_stats_.pushed;
+  return true;
+}
+
+template <typename Dtype>
+typename MemoryDataLayer<Dtype>::RingStats
+MemoryDataLayer<Dtype>::ring_stats() {
+  boost::mutex::scoped_lock lock(stats_mutex_);
+  return ring_stats_;
+}
+
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (free_slots_) {
+    const MemoryDataParameter& param = this->layer_param_.memory_data_param();
+    const int timeout_ms = param.pop_timeout_ms();
+    const bool reuse = param.reuse_batch_on_timeout();
+    // The batch the net just used is done with; give its slot back, unless
+    // it may have to be served again.
+    if (ring_slot_ >= 0 && !reuse) {
+      free_slots_->push(ring_slot_);
+      ring_slot_ = -1;
+    }
+    int slot;
+    bool popped = full_slots_->try_pop(&slot);
+    if (!popped) {
+      {
+        boost::mutex::scoped_lock lock(stats_mutex_);
+        ++ring_stats_.consumer_waits;
+      }
+      if (timeout_ms < 0) {
+        full_slots_->pop(&slot);
+        popped = true;
+      } else {
+        popped = full_slots_->pop_for(&slot, timeout_ms);
+      }
+    }
+    boost::mutex::scoped_lock lock(stats_mutex_);
+    if (popped) {
+      if (ring_slot_ >= 0) {
+        free_slots_->push(ring_slot_);
+      }
+      ++ring_stats_.popped;
+      ring_slot_ = slot;
+    } else {
+      if (!reuse || ring_slot_ < 0) {
+        LOG(FATAL) << "No batch pushed to " << this->layer_param_.name()
+                   << " within pop_timeout_ms (" << timeout_ms << " ms)";
+      }
+      LOG(WARNING) << "No batch pushed to " << this->layer_param_.name()
+                   << " within " << timeout_ms << " ms; serving the last "
+                   << "batch again";
+      ++ring_stats_.timeouts;
+      slot = ring_slot_;
+    }
+    top[0]->Reshape(batch_size_, channels_, height_, width_);
+    top[1]->Reshape(batch_size_, 1, 1, 1);
+    top[0]->set_cpu_data(ring_data_[slot]->mutable_cpu_data());
+    top[1]->set_cpu_data(ring_labels_[slot]->mutable_cpu_data());
+    return;
+  }
   CHECK(data_) << "MemoryDataLayer needs to be initalized by calling Reset";
   top[0]->Reshape(batch_size_, channels_, height_, width_);
   top[1]->Reshape(batch_size_, 1, 1, 1);
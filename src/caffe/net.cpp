@@ -12,6 +12,7 @@
 #include "caffe/util/insert_splits.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
 #include "caffe/util/upgrade_proto.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -215,6 +216,11 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
   }
   GetLearningRateAndWeightDecay();
   debug_info_ = param.debug_info();
+  layer_shapes_.resize(layers_.size());
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    RecordLayerShapes(layer_id);
+  }
+  InitRecompute(param);
   LOG(INFO) << "Network initialization done.";
   LOG(INFO) << "Memory required for data: " << memory_used_ * sizeof(Dtype);
 }
@@ -469,12 +475,38 @@ Dtype Net<Dtype>::ForwardFromTo(int start, int end) {
       InputDebugInfo(i);
     }
   }
+  // Starting inside a segment that is released, or that no forward ran from
+  // its first layer yet, needs the blobs of its layers before start. Those
+  // layers run from the saved random state, and the rest of the forward goes
+  // on from there, so a later recompute draws the same random numbers.
+  const int start_segment = layer_segment_[start];
+  if (start_segment >= 0 && start > recompute_segments_[start_segment].first
+      && (segment_released_[start_segment] ||
+          !segment_rng_saved_[start_segment])) {
+    if (segment_rng_saved_[start_segment]) {
+      *caffe_rng() = segment_rng_states_[start_segment];
+    } else {
+      SaveSegmentRng(start_segment);
+    }
+    for (int i = recompute_segments_[start_segment].first; i < start; ++i) {
+      ReshapeLayerIfNeeded(i);
+      layers_[i]->Forward(bottom_vecs_[i], top_vecs_[i]);
+    }
+    segment_released_[start_segment] = false;
+  }
   for (int i = start; i <= end; ++i) {
     // LOG(ERROR) << "Forwarding " << layer_names_[i];
-    layers_[i]->Reshape(bottom_vecs_[i], top_vecs_[i]);
+    const int segment = layer_segment_[i];
+    if (segment >= 0 && i == recompute_segments_[segment].first) {
+      SaveSegmentRng(segment);
+    }
+    ReshapeLayerIfNeeded(i);
     Dtype layer_loss = layers_[i]->Forward(bottom_vecs_[i], top_vecs_[i]);
     loss += layer_loss;
     if (debug_info_) { ForwardDebugInfo(i); }
+    if (segment >= 0 && i == recompute_segments_[segment].second) {
+      ReleaseSegment(segment);
+    }
   }
   return loss;
 }
@@ -535,12 +567,75 @@ void Net<Dtype>::BackwardFromTo(int start, int end) {
   CHECK_GE(end, 0);
   CHECK_LT(start, layers_.size());
   for (int i = start; i >= end; --i) {
+    const int segment = layer_segment_[i];
+    if (segment >= 0 && segment_released_[segment]) {
+      RecomputeSegment(segment);
+    }
     if (layer_need_backward_[i]) {
-      layers_[i]->Backward(
+      Layer<Dtype>* layer = layers_[i].get();
+      const int num_params = layer->blobs().size();
+      if (!layer->OverwritesFreshParamDiffs()) {
+        for (int j = 0; j < num_params; ++j) {
+          ZeroFreshParamDiff(i, j);
+        }
+      }
+      layer->Backward(
           top_vecs_[i], bottom_need_backward_[i], bottom_vecs_[i]);
+      for (int j = 0; j < num_params; ++j) {
+        if (layer->param_propagate_down(j)) {
+          layer->set_param_diff_fresh(j, false);
+        }
+      }
       if (debug_info_) { BackwardDebugInfo(i); }
     }
+    if (after_backward_.size()) {
+      for (int j = 0; j < layers_[i]->blobs().size(); ++j) {
+        ZeroFreshParamDiff(i, j);
+      }
+      for (int c = 0; c < after_backward_.size(); ++c) {
+        after_backward_[c]->run(i);
+      }
+    }
+    if (segment >= 0 && i == recompute_segments_[segment].first) {
+      ReleaseSegment(segment);
+    }
+  }
+  // Diffs no layer wrote this time must still read as zero.
+  for (int i = 0; i < layers_.size(); ++i) {
+    for (int j = 0; j < layers_[i]->blobs().size(); ++j) {
+      ZeroFreshParamDiff(i, j);
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ClearParamDiffs() {
+  for (int i = 0; i < layers_.size(); ++i) {
+    for (int j = 0; j < layers_[i]->blobs().size(); ++j) {
+      layers_[i]->set_param_diff_fresh(j, true);
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ZeroFreshParamDiff(const int layer_id, const int param_id) {
+  Layer<Dtype>* layer = layers_[layer_id].get();
+  if (!layer->param_diff_fresh(param_id)) { return; }
+  Blob<Dtype>* blob = layer->blobs()[param_id].get();
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    caffe_set(blob->count(), static_cast<Dtype>(0), blob->mutable_cpu_diff());
+    break;
+  case Caffe::GPU:
+#ifndef CPU_ONLY
+    caffe_gpu_set(blob->count(), static_cast<Dtype>(0),
+        blob->mutable_gpu_diff());
+#else
+    NO_GPU;
+#endif
+    break;
   }
+  layer->set_param_diff_fresh(param_id, false);
 }
 
 template <typename Dtype>
@@ -682,11 +777,240 @@ template <typename Dtype>
 void Net<Dtype>::Reshape() {
   for (int i = 0; i < layers_.size(); ++i) {
     layers_[i]->Reshape(bottom_vecs_[i], top_vecs_[i]);
+    RecordLayerShapes(i);
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ReshapeLayerIfNeeded(const int layer_id) {
+  const vector<Blob<Dtype>*>& bottom = bottom_vecs_[layer_id];
+  const vector<Blob<Dtype>*>& top = top_vecs_[layer_id];
+  const vector<vector<int> >& shapes = layer_shapes_[layer_id];
+  // Layers without bottoms (data layers) may reshape for other reasons.
+  bool changed = bottom.empty() ||
+      shapes.size() != bottom.size() + top.size();
+  for (int i = 0; !changed && i < bottom.size(); ++i) {
+    changed = bottom[i]->shape() != shapes[i];
+  }
+  for (int i = 0; !changed && i < top.size(); ++i) {
+    changed = top[i]->shape() != shapes[bottom.size() + i];
+  }
+  if (changed) {
+    layers_[layer_id]->Reshape(bottom, top);
+    RecordLayerShapes(layer_id);
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::RecordLayerShapes(const int layer_id) {
+  vector<vector<int> >& shapes = layer_shapes_[layer_id];
+  shapes.clear();
+  for (int i = 0; i < bottom_vecs_[layer_id].size(); ++i) {
+    shapes.push_back(bottom_vecs_[layer_id][i]->shape());
+  }
+  for (int i = 0; i < top_vecs_[layer_id].size(); ++i) {
+    shapes.push_back(top_vecs_[layer_id][i]->shape());
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::InitRecompute(const NetParameter& param) {
+  recompute_segments_.clear();
+  layer_segment_.assign(layers_.size(), -1);
+  blob_segment_.assign(blobs_.size(), -1);
+  // Test nets have no backward to recompute for.
+  if (phase_ != TRAIN || param.recompute_size() == 0) {
+    return;
+  }
+  for (int s = 0; s < param.recompute_size(); ++s) {
+    const RecomputeParameter& range = param.recompute(s);
+    CHECK(layer_names_index_.count(range.first_layer()))
+        << "Unknown first_layer " << range.first_layer()
+        << " of a recomputed segment";
+    CHECK(layer_names_index_.count(range.last_layer()))
+        << "Unknown last_layer " << range.last_layer()
+        << " of a recomputed segment";
+    const int first = layer_names_index_[range.first_layer()];
+    const int last = layer_names_index_[range.last_layer()];
+    CHECK_LE(first, last) << "Layer " << range.last_layer()
+        << " comes before " << range.first_layer() << " in the net";
+    for (int i = first; i <= last; ++i) {
+      CHECK_LT(layer_segment_[i], 0)
+          << "Recomputed segments overlap at layer " << layer_names_[i];
+      CHECK_GT(bottom_vecs_[i].size(), 0) << "Layer " << layer_names_[i]
+          << " has no bottoms to be recomputed from";
+      layer_segment_[i] = s;
+    }
+    recompute_segments_.push_back(make_pair(first, last));
+  }
+  // A blob belongs to the segment of the layer first writing it, unless a
+  // layer outside the segment reads it or it is an output of the net.
+  for (int i = layers_.size() - 1; i >= 0; --i) {
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      blob_segment_[top_id_vecs_[i][j]] = layer_segment_[i];
+    }
+  }
+  for (int i = 0; i < layers_.size(); ++i) {
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      const int blob_id = top_id_vecs_[i][j];
+      CHECK(layer_segment_[i] < 0 ||
+            blob_segment_[blob_id] == layer_segment_[i])
+          << "Layer " << layer_names_[i] << " of a recomputed segment "
+          << "computes in place on " << blob_names_[blob_id]
+          << ", which comes from outside the segment";
+    }
+  }
+  for (int i = 0; i < layers_.size(); ++i) {
+    for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+      const int blob_id = bottom_id_vecs_[i][j];
+      if (blob_segment_[blob_id] != layer_segment_[i]) {
+        blob_segment_[blob_id] = -1;
+      }
+    }
+  }
+  for (int i = 0; i < blobs_.size(); ++i) {
+    if (blob_loss_weights_.size() > i && blob_loss_weights_[i] != 0) {
+      blob_segment_[i] = -1;
+    }
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    blob_segment_[net_output_blob_indices_[i]] = -1;
+  }
+  segment_released_.assign(recompute_segments_.size(), false);
+  segment_rng_saved_.assign(recompute_segments_.size(), false);
+  segment_rng_states_.resize(recompute_segments_.size());
+  // Only one segment at a time holds its blobs, while backward goes
+  // through it. As in ReleaseSegment, memory shared by blobs in and out of a
+  // segment is kept, and shared memory, e.g. of a Split top and its bottom,
+  // counts once.
+  map<SyncedMemory*, pair<int, size_t> > memory_segment_bytes;
+  for (int i = 0; i < blobs_.size(); ++i) {
+    if (!blobs_[i]->count()) {
+      continue;
+    }
+    SyncedMemory* memory[] = { blobs_[i]->data().get(),
+                               blobs_[i]->diff().get() };
+    for (int j = 0; j < 2; ++j) {
+      const size_t bytes = (j == 0 || blob_need_backward_[i]) ?
+          blobs_[i]->count() * sizeof(Dtype) : 0;
+      map<SyncedMemory*, pair<int, size_t> >::iterator it =
+          memory_segment_bytes.find(memory[j]);
+      if (it == memory_segment_bytes.end()) {
+        memory_segment_bytes[memory[j]] = make_pair(blob_segment_[i], bytes);
+      } else {
+        if (it->second.first != blob_segment_[i]) {
+          it->second.first = -1;
+        }
+        it->second.second = std::max(it->second.second, bytes);
+      }
+    }
   }
+  size_t kept_bytes = 0;
+  vector<size_t> segment_bytes(recompute_segments_.size(), 0);
+  for (map<SyncedMemory*, pair<int, size_t> >::const_iterator it =
+       memory_segment_bytes.begin(); it != memory_segment_bytes.end(); ++it) {
+    if (it->second.first < 0) {
+      kept_bytes += it->second.second;
+    } else {
+      segment_bytes[it->second.first] += it->second.second;
+    }
+  }
+  size_t total_bytes = kept_bytes;
+  for (int i = 0; i < segment_bytes.size(); ++i) {
+    total_bytes += segment_bytes[i];
+  }
+  LOG(INFO) << "Recomputing " << recompute_segments_.size()
+            << " segments: peak memory for data and diffs "
+            << kept_bytes + *std::max_element(segment_bytes.begin(),
+                                              segment_bytes.end())
+            << " instead of " << total_bytes;
 }
 
 template <typename Dtype>
-void Net<Dtype>::CopyTrainedLayersFrom(const NetParameter& param) {
+void Net<Dtype>::ReleaseSegment(const int segment) {
+  // Memory the segment's blobs share with others, e.g. through a Split or
+  // Flatten layer, stays.
+  set<SyncedMemory*> kept;
+  for (int i = 0; i < blobs_.size(); ++i) {
+    if (blob_segment_[i] != segment && blobs_[i]->count()) {
+      kept.insert(blobs_[i]->data().get());
+      kept.insert(blobs_[i]->diff().get());
+    }
+  }
+  for (int i = 0; i < blobs_.size(); ++i) {
+    if (blob_segment_[i] == segment && blobs_[i]->count()) {
+      if (!kept.count(blobs_[i]->data().get())) {
+        blobs_[i]->data()->release();
+      }
+      if (!kept.count(blobs_[i]->diff().get())) {
+        blobs_[i]->diff()->release();
+      }
+    }
+  }
+  segment_released_[segment] = true;
+}
+
+template <typename Dtype>
+void Net<Dtype>::SaveSegmentRng(const int segment) {
+  // The GPU layers draw from the device generator, whose state cannot be
+  // saved.
+  if (Caffe::mode() == Caffe::GPU) {
+    for (int i = recompute_segments_[segment].first;
+         i <= recompute_segments_[segment].second; ++i) {
+      CHECK(!layers_[i]->ForwardDrawsRandomNumbers()) << "Layer "
+          << layer_names_[i] << " draws random numbers on the GPU, which "
+          << "cannot be drawn again to recompute its segment";
+    }
+  }
+  segment_rng_states_[segment] = *caffe_rng();
+  segment_rng_saved_[segment] = true;
+}
+
+template <typename Dtype>
+void Net<Dtype>::RecomputeSegment(const int segment) {
+  // Draw the random numbers of the forward again, e.g. the same dropout
+  // masks, then go on with the generator where it was.
+  const rng_t rng_state = *caffe_rng();
+  *caffe_rng() = segment_rng_states_[segment];
+  for (int i = recompute_segments_[segment].first;
+       i <= recompute_segments_[segment].second; ++i) {
+    layers_[i]->Forward(bottom_vecs_[i], top_vecs_[i]);
+  }
+  *caffe_rng() = rng_state;
+  segment_released_[segment] = false;
+}
+
+template <typename Dtype>
+void Net<Dtype>::CopyTrainedLayersFrom(const Net* other) {
+  int num_source_layers = other->layers().size();
+  for (int i = 0; i < num_source_layers; ++i) {
+    Layer<Dtype>* source_layer = other->layers()[i].get();
+    const string& source_layer_name = other->layer_names()[i];
+    int target_layer_id = 0;
+    while (target_layer_id != layer_names_.size() &&
+        layer_names_[target_layer_id] != source_layer_name) {
+      ++target_layer_id;
+    }
+    if (target_layer_id == layer_names_.size()) {
+      DLOG(INFO) << "Ignoring source layer " << source_layer_name;
+      continue;
+    }
+    DLOG(INFO) << "Copying source layer " << source_layer_name;
+    vector<shared_ptr<Blob<Dtype> > >& target_blobs =
+        layers_[target_layer_id]->blobs();
+    CHECK_EQ(target_blobs.size(), source_layer->blobs().size())
+        << "Incompatible number of blobs for layer " << source_layer_name;
+    for (int j = 0; j < target_blobs.size(); ++j) {
+      Blob<Dtype>* source_blob = source_layer->blobs()[j].get();
+      CHECK(target_blobs[j]->shape() == source_blob->shape());
+      target_blobs[j]->CopyFrom(*source_blob);
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::CopyTrainedLayersFrom(const NetParameter& param,
+    const RawProtoFile* raw_file) {
   int num_source_layers = param.layer_size();
   for (int i = 0; i < num_source_layers; ++i) {
     const LayerParameter& source_layer = param.layer(i);
@@ -707,7 +1031,12 @@ void Net<Dtype>::CopyTrainedLayersFrom(const NetParameter& param) {
         << "Incompatible number of blobs for layer " << source_layer_name;
     for (int j = 0; j < target_blobs.size(); ++j) {
       const bool kReshape = false;
-      target_blobs[j]->FromProto(source_layer.blobs(j), kReshape);
+      if (raw_file) {
+        BlobFromRawProto(source_layer.blobs(j), *raw_file, kReshape,
+            target_blobs[j].get());
+      } else {
+        target_blobs[j]->FromProto(source_layer.blobs(j), kReshape);
+      }
     }
   }
 }
@@ -715,12 +1044,19 @@ void Net<Dtype>::CopyTrainedLayersFrom(const NetParameter& param) {
 template <typename Dtype>
 void Net<Dtype>::CopyTrainedLayersFrom(const string trained_filename) {
   NetParameter param;
+  if (IsRawProtoFile(trained_filename)) {
+    // The values are copied straight out of the mapped file.
+    RawProtoFile raw_file(trained_filename, &param);
+    CopyTrainedLayersFrom(param, &raw_file);
+    return;
+  }
   ReadNetParamsFromBinaryFileOrDie(trained_filename, &param);
   CopyTrainedLayersFrom(param);
 }
 
 template <typename Dtype>
-void Net<Dtype>::ToProto(NetParameter* param, bool write_diff) const {
+void Net<Dtype>::ToProto(NetParameter* param, bool write_diff,
+    bool write_blobs) const {
   param->Clear();
   param->set_name(name_);
   // Add bottom and top
@@ -736,7 +1072,12 @@ void Net<Dtype>::ToProto(NetParameter* param, bool write_diff) const {
     for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
       layer_param->add_top(blob_names_[top_id_vecs_[i][j]]);
     }
-    layers_[i]->ToProto(layer_param, write_diff);
+    if (write_blobs) {
+      layers_[i]->ToProto(layer_param, write_diff);
+    } else {
+      layer_param->CopyFrom(layers_[i]->layer_param());
+      layer_param->clear_blobs();
+    }
   }
 }
 
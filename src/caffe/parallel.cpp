@@ -0,0 +1,136 @@
+#include <vector>
+
+#include "caffe/parallel.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+GradientAllReducer<Dtype>::GradientAllReducer(Net<Dtype>* net,
+    shared_ptr<Transport<Dtype> > transport, int bucket_size)
+    : net_(net), transport_(transport), started_(false), num_queued_(0) {
+  CHECK_GT(bucket_size, 0);
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net->layers();
+  vector<int> param_layers;
+  for (int i = 0; i < layers.size(); ++i) {
+    param_layers.insert(param_layers.end(), layers[i]->blobs().size(), i);
+  }
+  const vector<shared_ptr<Blob<Dtype> > >& params = net->params();
+  CHECK_EQ(param_layers.size(), params.size());
+  for (int i = params.size() - 1; i >= 0; --i) {
+    if (buckets_.empty() || buckets_.back().count >= bucket_size) {
+      buckets_.push_back(Bucket());
+      buckets_.back().count = 0;
+    }
+    Bucket& bucket = buckets_.back();
+    bucket.param_ids.push_back(i);
+    bucket.layer = param_layers[i];
+    bucket.count += params[i]->count();
+  }
+  for (int i = 0; i < buckets_.size(); ++i) {
+    if (buckets_[i].param_ids.size() > 1) {
+      buckets_[i].values.resize(buckets_[i].count);
+    }
+  }
+  LOG(INFO) << "Averaging param diffs over " << transport->num_ranks()
+            << " ranks in " << buckets_.size() << " buckets";
+  CHECK(StartInternalThread()) << "Thread execution failed";
+}
+
+template <typename Dtype>
+GradientAllReducer<Dtype>::~GradientAllReducer() {
+  queued_.push(-1);
+  CHECK(WaitForInternalThreadToExit()) << "Thread joining failed";
+}
+
+template <typename Dtype>
+void GradientAllReducer<Dtype>::Start() {
+  // Other threads can only reach the diffs of CPU params.
+  started_ = Caffe::mode() == Caffe::CPU;
+}
+
+template <typename Dtype>
+void GradientAllReducer<Dtype>::run(int layer) {
+  if (!started_) {
+    return;
+  }
+  while (num_queued_ < buckets_.size()
+         && buckets_[num_queued_].layer >= layer) {
+    queued_.push(num_queued_++);
+  }
+}
+
+template <typename Dtype>
+void GradientAllReducer<Dtype>::Finish() {
+  if (started_) {
+    while (num_queued_ < buckets_.size()) {
+      queued_.push(num_queued_++);
+    }
+    for (int i = 0; i < buckets_.size(); ++i) {
+      int id;
+      reduced_.pop(&id);
+    }
+  } else {
+    for (int i = 0; i < buckets_.size(); ++i) {
+      Reduce(&buckets_[i]);
+    }
+  }
+  started_ = false;
+  num_queued_ = 0;
+}
+
+template <typename Dtype>
+void GradientAllReducer<Dtype>::InternalThreadEntry() {
+  while (true) {
+    int id;
+    queued_.pop(&id);
+    if (id < 0) {
+      break;
+    }
+    Reduce(&buckets_[id]);
+    reduced_.push(id);
+  }
+}
+
+template <typename Dtype>
+void GradientAllReducer<Dtype>::Reduce(Bucket* bucket) {
+  const vector<shared_ptr<Blob<Dtype> > >& params = net_->params();
+  const Dtype scale = Dtype(1) / transport_->num_ranks();
+  if (bucket->param_ids.size() == 1) {
+    Blob<Dtype>* param = params[bucket->param_ids[0]].get();
+    transport_->AllReduce(param->mutable_cpu_diff(), param->count());
+    caffe_scal(param->count(), scale, param->mutable_cpu_diff());
+    return;
+  }
+  Dtype* values = &bucket->values[0];
+  int offset = 0;
+  for (int i = 0; i < bucket->param_ids.size(); ++i) {
+    const Blob<Dtype>& param = *params[bucket->param_ids[i]];
+    caffe_copy(param.count(), param.cpu_diff(), values + offset);
+    offset += param.count();
+  }
+  transport_->AllReduce(values, bucket->count);
+  offset = 0;
+  for (int i = 0; i < bucket->param_ids.size(); ++i) {
+    Blob<Dtype>* param = params[bucket->param_ids[i]].get();
+    caffe_cpu_scale(param->count(), scale, values + offset,
+        param->mutable_cpu_diff());
+    offset += param->count();
+  }
+}
+
+template <typename Dtype>
+void GradientAllReducer<Dtype>::BroadcastParams() {
+  const vector<shared_ptr<Blob<Dtype> > >& params = net_->params();
+  for (int i = 0; i < params.size(); ++i) {
+    // Shared params get the data of their owner.
+    if (net_->param_owners()[i] < 0) {
+      transport_->Broadcast(params[i]->mutable_cpu_data(), params[i]->count(),
+          0);
+    }
+  }
+}
+
+INSTANTIATE_CLASS(GradientAllReducer);
+
+}  // namespace caffe
@@ -1,18 +1,36 @@
 #include <cstdio>
 
 #include <algorithm>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "boost/bind.hpp"
+#include "boost/thread.hpp"
+
+#include "caffe/data_layers.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
 #include "caffe/util/upgrade_proto.hpp"
 
 namespace caffe {
 
+// Copies a blob to host memory for a snapshot, reusing staged's buffers.
+template <typename Dtype>
+static void StageBlob(const Blob<Dtype>& source, bool copy_diff,
+    Blob<Dtype>* staged) {
+  staged->ReshapeLike(source);
+  caffe_copy(source.count(), source.cpu_data(), staged->mutable_cpu_data());
+  if (copy_diff) {
+    caffe_copy(source.count(), source.cpu_diff(), staged->mutable_cpu_diff());
+  }
+}
+
 template <typename Dtype>
 Solver<Dtype>::Solver(const SolverParameter& param)
     : net_() {
@@ -27,6 +45,34 @@ Solver<Dtype>::Solver(const string& param_file)
   Init(param);
 }
 
+template <typename Dtype>
+Solver<Dtype>::~Solver() {
+  WaitForTests();
+  if (replica_workers_) {
+    ReplicaTask stop = { ReplicaTask::STOP, NULL, NULL, NULL };
+    StartReplicaTasks(stop);
+    replica_workers_->join_all();
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::set_transport(shared_ptr<Transport<Dtype> > transport) {
+  CHECK(!gradient_reducer_) << "The solver already has a transport";
+  CHECK(hogwild_nets_.empty())
+      << "hogwild_threads cannot be combined with a transport";
+  LOG(INFO) << "Training as rank " << transport->rank() << " of "
+            << transport->num_ranks();
+  LOG_IF(WARNING, param_.num_data_shards() != transport->num_ranks())
+      << "The train data is split into " << param_.num_data_shards()
+      << " shards (num_data_shards) for " << transport->num_ranks()
+      << " ranks";
+  transport_ = transport;
+  gradient_reducer_.reset(new GradientAllReducer<Dtype>(net_.get(),
+      transport, param_.gradient_bucket_size()));
+  net_->add_after_backward(gradient_reducer_.get());
+  gradient_reducer_->BroadcastParams();
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Init(const SolverParameter& param) {
   LOG(INFO) << "Initializing solver from parameters: " << std::endl
@@ -79,7 +125,91 @@ void Solver<Dtype>::InitTrainNet() {
   net_state.MergeFrom(net_param.state());
   net_state.MergeFrom(param_.train_state());
   net_param.mutable_state()->CopyFrom(net_state);
-  net_.reset(new Net<Dtype>(net_param));
+  NetParameter first_worker_param(net_param);
+  ShardDataLayers(0, &first_worker_param);
+  net_.reset(new Net<Dtype>(first_worker_param));
+  if (param_.train_threads() > 1 || param_.hogwild_threads() > 1) {
+    // Recomputing replays the random numbers of the forward from Caffe's
+    // generator, which the other threads draw from meanwhile.
+    CHECK_EQ(net_->recompute_segments().size(), 0)
+        << "recompute cannot be combined with train_threads or "
+        << "hogwild_threads";
+  }
+  replicas_.clear();
+  num_input_layers_ = 0;
+  if (param_.train_threads() > 1) {
+    InitReplicas(net_param);
+  }
+  hogwild_nets_.clear();
+  if (param_.hogwild_threads() > 1) {
+    InitHogwild(net_param);
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::InitReplicas(const NetParameter& net_param) {
+  CHECK(Caffe::mode() == Caffe::CPU) << "train_threads needs CPU mode";
+  const int num_replicas = param_.train_threads();
+  LOG(INFO) << "Splitting each batch over " << num_replicas
+            << " replicas of the training net.";
+  // The replicas take their part of the batch as inputs in place of the
+  // data layers, which only net_ runs.
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net_->layers();
+  std::set<string> data_layer_names;
+  NetParameter replica_param;
+  for (num_input_layers_ = 0; num_input_layers_ < layers.size();
+       ++num_input_layers_) {
+    const int i = num_input_layers_;
+    if (!net_->bottom_vecs()[i].empty()) {
+      if (layers[i]->type() != string("Split")) {
+        break;
+      }
+      continue;
+    }
+    data_layer_names.insert(net_->layer_names()[i]);
+    for (int j = 0; j < net_->top_vecs()[i].size(); ++j) {
+      BlobShape* shape = replica_param.add_input_shape();
+      const Blob<Dtype>& top = *net_->top_vecs()[i][j];
+      CHECK_EQ(top.shape(0) % num_replicas, 0) << "The batch size of "
+          << layers[i]->layer_param().top(j) << " must be divisible by "
+          << "train_threads";
+      shape->add_dim(top.shape(0) / num_replicas);
+      for (int k = 1; k < top.num_axes(); ++k) {
+        shape->add_dim(top.shape(k));
+      }
+      replica_param.add_input(layers[i]->layer_param().top(j));
+    }
+  }
+  CHECK(!data_layer_names.empty())
+      << "train_threads needs a train net starting with data layers";
+  NetParameter filtered_param;
+  Net<Dtype>::FilterNet(net_param, &filtered_param);
+  CHECK_EQ(filtered_param.input_size(), 0)
+      << "train_threads needs a train net without inputs";
+  replica_param.set_name(filtered_param.name());
+  replica_param.set_force_backward(filtered_param.force_backward());
+  replica_param.mutable_state()->CopyFrom(filtered_param.state());
+  for (int i = 0; i < filtered_param.layer_size(); ++i) {
+    if (!data_layer_names.count(filtered_param.layer(i).name())) {
+      replica_param.add_layer()->CopyFrom(filtered_param.layer(i));
+    }
+  }
+  // Put back the random numbers the replicas' fillers use up, so training
+  // draws the same ones whatever the number of replicas.
+  const rng_t rng_state = *caffe_rng();
+  for (int i = 1; i < num_replicas; ++i) {
+    replicas_.push_back(
+        shared_ptr<Net<Dtype> >(new Net<Dtype>(replica_param)));
+    replicas_.back()->ShareTrainedLayersWith(net_.get());
+  }
+  *caffe_rng() = rng_state;
+  replica_workers_.reset(new boost::thread_group());
+  for (int r = 0; r < replicas_.size(); ++r) {
+    replica_tasks_.push_back(shared_ptr<BlockingQueue<ReplicaTask> >(
+        new BlockingQueue<ReplicaTask>()));
+    replica_workers_->create_thread(
+        boost::bind(&Solver<Dtype>::ReplicaWorker, this, r));
+  }
 }
 
 template <typename Dtype>
@@ -159,8 +289,133 @@ void Solver<Dtype>::InitTestNets() {
 }
 
 template <typename Dtype>
-void Solver<Dtype>::Step(int iters) {
+void Solver<Dtype>::InitHogwild(const NetParameter& net_param) {
+  CHECK(Caffe::mode() == Caffe::CPU) << "hogwild_threads needs CPU mode";
+  CHECK_LE(param_.train_threads(), 1)
+      << "hogwild_threads and train_threads cannot be combined";
+  CHECK_LT(param_.clip_gradients(), 0)
+      << "hogwild_threads does not support clip_gradients";
+  for (int i = 0; i < net_->param_owners().size(); ++i) {
+    CHECK_LT(net_->param_owners()[i], 0)
+        << "hogwild_threads does not support shared params";
+  }
+  LOG(INFO) << "Training with " << param_.hogwild_threads()
+            << " hogwild workers";
+  LOG_IF(WARNING, param_.hogwild_rand_skip())
+      << "hogwild_rand_skip is deprecated and ignored; the workers read "
+      << "disjoint shards of the data";
+  for (int i = 1; i < param_.hogwild_threads(); ++i) {
+    NetParameter worker_param(net_param);
+    ShardDataLayers(i, &worker_param);
+    hogwild_nets_.push_back(
+        shared_ptr<Net<Dtype> >(new Net<Dtype>(worker_param)));
+    hogwild_nets_.back()->ShareTrainedLayersWith(net_.get());
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::ShardDataLayers(const int worker,
+    NetParameter* net_param) const {
+  // Each process's shard is split again over its hogwild workers.
+  CHECK_GE(param_.num_data_shards(), 1) << "num_data_shards must be positive";
+  CHECK_GE(param_.data_shard(), 0) << "data_shard must not be negative";
+  CHECK_LT(param_.data_shard(), param_.num_data_shards())
+      << "data_shard must be less than num_data_shards";
+  const int num_workers = std::max(param_.hogwild_threads(), 1);
+  const int num_shards = param_.num_data_shards() * num_workers;
+  if (num_shards <= 1) {
+    return;
+  }
+  for (int i = 0; i < net_param->layer_size(); ++i) {
+    DataParameter* data_param =
+        net_param->mutable_layer(i)->mutable_data_param();
+    if (net_param->layer(i).type() != "Data" || data_param->rand_skip()
+        || data_param->skip() || data_param->num_shards() > 1) {
+      continue;
+    }
+    // Worker i reads batches i, i + N, i + 2N, ..., so together the workers
+    // read the db in order, each batch once.
+    data_param->set_num_shards(num_shards);
+    data_param->set_shard_id(param_.data_shard() * num_workers + worker);
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::HogwildStep(int iters) {
+  const int stop_iter = iter_ + iters;
+  while (iter_ < stop_iter) {
+    if (param_.test_interval() && iter_ % param_.test_interval() == 0
+        && (iter_ > 0 || param_.test_initialization())) {
+      TestAll();
+    }
+    const int start_iter = iter_;
+    hogwild_iter_ = iter_;
+    hogwild_stop_iter_ = stop_iter;
+    const int intervals[] =
+        { param_.display(), param_.test_interval(), param_.snapshot() };
+    for (int i = 0; i < 3; ++i) {
+      if (intervals[i] > 0) {
+        hogwild_stop_iter_ = std::min(hogwild_stop_iter_,
+            (iter_ / intervals[i] + 1) * intervals[i]);
+      }
+    }
+    hogwild_loss_ = 0;
+    CPUTimer timer;
+    timer.Start();
+    boost::thread_group workers;
+    for (int i = 1; i <= hogwild_nets_.size(); ++i) {
+      workers.create_thread(
+          boost::bind(&Solver<Dtype>::HogwildWorker, this, i));
+    }
+    HogwildWorker(0);
+    workers.join_all();
+    timer.Stop();
+    const int num_iters = hogwild_stop_iter_ - start_iter;
+    if (param_.display() && start_iter % param_.display() == 0) {
+      LOG(INFO) << "Iteration " << start_iter << ", loss = "
+                << hogwild_loss_ / num_iters;
+      LOG(INFO) << "    " << num_iters / timer.Seconds()
+                << " iterations/s over iterations " << start_iter << " to "
+                << hogwild_stop_iter_ - 1;
+    }
+    iter_ = hogwild_stop_iter_ - 1;
+    if (param_.snapshot() && (iter_ + 1) % param_.snapshot() == 0) {
+      Snapshot();
+    }
+    ++iter_;
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::HogwildWorker(const int worker) {
+  Net<Dtype>* net = worker ? hogwild_nets_[worker - 1].get() : net_.get();
   vector<Blob<Dtype>*> bottom_vec;
+  while (true) {
+    int iter;
+    {
+      boost::mutex::scoped_lock lock(hogwild_mutex_);
+      if (hogwild_iter_ == hogwild_stop_iter_) {
+        return;
+      }
+      iter = hogwild_iter_++;
+    }
+    net->ClearParamDiffs();
+    Dtype loss = 0;
+    for (int i = 0; i < param_.iter_size(); ++i) {
+      loss += net->ForwardBackward(bottom_vec);
+    }
+    HogwildUpdate(net, worker, iter);
+    boost::mutex::scoped_lock lock(hogwild_mutex_);
+    hogwild_loss_ += loss / param_.iter_size();
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::Step(int iters) {
+  if (!hogwild_nets_.empty()) {
+    HogwildStep(iters);
+    return;
+  }
   const int start_iter = iter_;
   const int stop_iter = iter_ + iters;
   int average_loss = this->param_.average_loss();
@@ -168,23 +423,11 @@ void Solver<Dtype>::Step(int iters) {
   Dtype smoothed_loss = 0;
 
   for (; iter_ < stop_iter; ++iter_) {
-    // zero-init the params
-    for (int i = 0; i < net_->params().size(); ++i) {
-      shared_ptr<Blob<Dtype> > blob = net_->params()[i];
-      switch (Caffe::mode()) {
-      case Caffe::CPU:
-        caffe_set(blob->count(), static_cast<Dtype>(0),
-            blob->mutable_cpu_diff());
-        break;
-      case Caffe::GPU:
-#ifndef CPU_ONLY
-        caffe_gpu_set(blob->count(), static_cast<Dtype>(0),
-            blob->mutable_gpu_diff());
-#else
-        NO_GPU;
-#endif
-        break;
-      }
+    // zero-init the params; layers that can overwrite their first
+    // gradient skip the zeroing pass
+    net_->ClearParamDiffs();
+    for (int i = 0; i < replicas_.size(); ++i) {
+      replicas_[i]->ClearParamDiffs();
     }
 
     if (param_.test_interval() && iter_ % param_.test_interval() == 0
@@ -197,7 +440,13 @@ void Solver<Dtype>::Step(int iters) {
     // accumulate the loss and gradient
     Dtype loss = 0;
     for (int i = 0; i < param_.iter_size(); ++i) {
-      loss += net_->ForwardBackward(bottom_vec);
+      // Send the diffs to the other ranks while the last backward pass
+      // computes the rest.
+      if (gradient_reducer_ && i == param_.iter_size() - 1
+          && replicas_.empty() && !param_.debug_info()) {
+        gradient_reducer_->Start();
+      }
+      loss += ForwardBackward();
     }
     loss /= param_.iter_size();
     // average the loss across iterations for smoothed reporting
@@ -231,9 +480,15 @@ void Solver<Dtype>::Step(int iters) {
               << result_vec[k] << loss_msg_stream.str();
         }
       }
+      if (param_.display_data_stats()) {
+        DisplayDataStats();
+      }
+    }
+    ReduceReplicaDiffs();
+    if (gradient_reducer_) {
+      gradient_reducer_->Finish();
     }
-    ComputeUpdateValue();
-    net_->Update();
+    ApplyUpdate();
 
     // Save a snapshot if needed.
     if (param_.snapshot() && (iter_ + 1) % param_.snapshot() == 0) {
@@ -242,6 +497,156 @@ void Solver<Dtype>::Step(int iters) {
   }
 }
 
+template <typename Dtype>
+Dtype Solver<Dtype>::ForwardBackward() {
+  if (replicas_.empty()) {
+    vector<Blob<Dtype>*> bottom_vec;
+    return net_->ForwardBackward(bottom_vec);
+  }
+  const int num_replicas = replicas_.size() + 1;
+  net_->ForwardFromTo(0, num_input_layers_ - 1);
+  // Copy the other parts of the batch to the replicas, and shrink the
+  // inputs of net_ to the first part. Their memory stays allocated, so
+  // they keep the whole batch when they grow back.
+  vector<Blob<Dtype>*> inputs;
+  vector<vector<int> > batch_shapes;
+  int input_id = 0;
+  for (int i = 0; i < num_input_layers_; ++i) {
+    const bool is_data = net_->bottom_vecs()[i].empty();
+    for (int j = 0; j < net_->top_vecs()[i].size(); ++j) {
+      Blob<Dtype>* top = net_->top_vecs()[i][j];
+      vector<int> part_shape = top->shape();
+      batch_shapes.push_back(part_shape);
+      inputs.push_back(top);
+      CHECK_EQ(part_shape[0] % num_replicas, 0) << "The batch size of "
+          << net_->layer_names()[i] << " must be divisible by train_threads";
+      part_shape[0] /= num_replicas;
+      if (is_data) {
+        const int part_count = top->count() / num_replicas;
+        for (int r = 0; r < replicas_.size(); ++r) {
+          Blob<Dtype>* input = replicas_[r]->input_blobs()[input_id];
+          input->Reshape(part_shape);
+          caffe_copy(part_count, top->cpu_data() + (r + 1) * part_count,
+              input->mutable_cpu_data());
+        }
+        ++input_id;
+      }
+    }
+  }
+  for (int i = 0; i < inputs.size(); ++i) {
+    vector<int> part_shape = batch_shapes[i];
+    part_shape[0] /= num_replicas;
+    inputs[i]->Reshape(part_shape);
+  }
+  vector<Dtype> losses(num_replicas);
+  ReplicaTask task = { ReplicaTask::FORWARD_BACKWARD, &losses[0], NULL, NULL };
+  StartReplicaTasks(task);
+  ReplicaForwardBackward(net_.get(), num_input_layers_, &losses[0]);
+  WaitForReplicaTasks();
+  for (int i = 0; i < inputs.size(); ++i) {
+    inputs[i]->Reshape(batch_shapes[i]);
+  }
+  Dtype loss = 0;
+  for (int r = 0; r < num_replicas; ++r) {
+    loss += losses[r];
+  }
+  return loss / num_replicas;
+}
+
+template <typename Dtype>
+void Solver<Dtype>::ReplicaForwardBackward(Net<Dtype>* net, const int start,
+    Dtype* loss) {
+  *loss = net->ForwardFrom(start);
+  net->Backward();
+}
+
+template <typename Dtype>
+void Solver<Dtype>::ReduceReplicaDiffs() {
+  if (replicas_.empty()) {
+    return;
+  }
+  // Fetch the pointers up front, so the threads only touch the values.
+  const vector<shared_ptr<Blob<Dtype> > >& params = net_->params();
+  vector<Dtype*> diffs(params.size());
+  vector<vector<const Dtype*> > replica_diffs(params.size());
+  for (int i = 0; i < params.size(); ++i) {
+    diffs[i] = params[i]->mutable_cpu_diff();
+    for (int r = 0; r < replicas_.size(); ++r) {
+      replica_diffs[i].push_back(replicas_[r]->params()[i]->cpu_diff());
+    }
+  }
+  // Each thread reduces its own slice of every param, reading it from all
+  // the replicas, so no two threads write the same memory.
+  ReplicaTask task = { ReplicaTask::REDUCE, NULL, &diffs, &replica_diffs };
+  StartReplicaTasks(task);
+  ReduceDiffSlice(0, replicas_.size() + 1, &diffs, &replica_diffs);
+  WaitForReplicaTasks();
+}
+
+template <typename Dtype>
+void Solver<Dtype>::ReplicaWorker(const int replica) {
+  const int part = replica + 1;
+  while (true) {
+    ReplicaTask task;
+    replica_tasks_[replica]->pop(&task);
+    if (task.kind == ReplicaTask::STOP) {
+      break;
+    }
+    if (task.kind == ReplicaTask::FORWARD_BACKWARD) {
+      ReplicaForwardBackward(replicas_[replica].get(), 0,
+          task.losses + part);
+    } else {
+      ReduceDiffSlice(part, replicas_.size() + 1, task.diffs,
+          task.replica_diffs);
+    }
+    replica_done_.push(replica);
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::StartReplicaTasks(const ReplicaTask& task) {
+  for (int r = 0; r < replica_tasks_.size(); ++r) {
+    replica_tasks_[r]->push(task);
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::WaitForReplicaTasks() {
+  for (int r = 0; r < replica_tasks_.size(); ++r) {
+    int replica;
+    replica_done_.pop(&replica);
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::ReduceDiffSlice(const int slice, const int num_slices,
+    const vector<Dtype*>* diffs,
+    const vector<vector<const Dtype*> >* replica_diffs) {
+  // Each replica's loss is normalized by its part of the batch, so the mean
+  // of their gradients is the gradient over the whole batch.
+  const Dtype scale = Dtype(1) / (replicas_.size() + 1);
+  const vector<shared_ptr<Blob<Dtype> > >& params = net_->params();
+  for (int i = 0; i < params.size(); ++i) {
+    const int count = params[i]->count();
+    const int begin = static_cast<int64_t>(count) * slice / num_slices;
+    const int end = static_cast<int64_t>(count) * (slice + 1) / num_slices;
+    if (begin == end) {
+      continue;
+    }
+    Dtype* diff = (*diffs)[i] + begin;
+    for (int r = 0; r < replicas_.size(); ++r) {
+      caffe_axpy(end - begin, Dtype(1), (*replica_diffs)[i][r] + begin, diff);
+    }
+    caffe_scal(end - begin, scale, diff);
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::ApplyUpdate() {
+  ComputeUpdateValue();
+  net_->Update();
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Solve(const char* resume_file) {
   LOG(INFO) << "Solving " << net_->name();
@@ -261,6 +666,9 @@ void Solver<Dtype>::Solve(const char* resume_file) {
       && (!param_.snapshot() || iter_ % param_.snapshot() != 0)) {
     Snapshot();
   }
+  if (snapshot_writer_) {
+    snapshot_writer_->WaitForPending();
+  }
   // After the optimization is done, run an additional train and test pass to
   // display the train and test loss/outputs if appropriate (based on the
   // display and test_interval settings, respectively).  Unlike in the rest of
@@ -275,23 +683,83 @@ void Solver<Dtype>::Solve(const char* resume_file) {
   if (param_.test_interval() && iter_ % param_.test_interval() == 0) {
     TestAll();
   }
+  WaitForTests();
   LOG(INFO) << "Optimization Done.";
 }
 
 
+template <typename Dtype>
+void Solver<Dtype>::DisplayDataStats() {
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net_->layers();
+  for (int i = 0; i < layers.size(); ++i) {
+    PrefetchStatsRecorder* recorder =
+        dynamic_cast<PrefetchStatsRecorder*>(layers[i].get());
+    if (recorder) {
+      LOG(INFO) << "    Data layer " << layers[i]->layer_param().name()
+          << ": " << recorder->prefetch_stats().ToString();
+      recorder->ResetPrefetchStats();
+    }
+  }
+}
+
+// Keeps the scores of one test net together in the log when several are
+// evaluated at once.
+static boost::mutex test_log_mutex;
+
 template <typename Dtype>
 void Solver<Dtype>::TestAll() {
+  if (gradient_reducer_ && gradient_reducer_->transport().rank() != 0) {
+    return;
+  }
+  // The test nets may still be busy with the previous evaluation.
+  WaitForTests();
+  if (param_.test_threads() > 0 && Caffe::mode() == Caffe::CPU) {
+    const int num_threads =
+        std::min<int>(param_.test_threads(), test_nets_.size());
+    vector<vector<int> > thread_test_net_ids(num_threads);
+    for (int test_net_id = 0; test_net_id < test_nets_.size(); ++test_net_id) {
+      // Copy rather than share the weights, so training can go on updating
+      // them during the evaluation.
+      CHECK_NOTNULL(test_nets_[test_net_id].get())->
+          CopyTrainedLayersFrom(net_.get());
+      thread_test_net_ids[test_net_id % num_threads].push_back(test_net_id);
+    }
+    test_threads_.reset(new boost::thread_group());
+    for (int i = 0; i < num_threads; ++i) {
+      test_threads_->create_thread(boost::bind(&Solver<Dtype>::TestNets,
+          this, thread_test_net_ids[i], iter_));
+    }
+    return;
+  }
   for (int test_net_id = 0; test_net_id < test_nets_.size(); ++test_net_id) {
     Test(test_net_id);
   }
 }
 
+template <typename Dtype>
+void Solver<Dtype>::WaitForTests() {
+  if (test_threads_) {
+    test_threads_->join_all();
+    test_threads_.reset();
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::TestNets(const vector<int> test_net_ids, const int iter) {
+  for (int i = 0; i < test_net_ids.size(); ++i) {
+    TestNet(test_net_ids[i], iter);
+  }
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Test(const int test_net_id) {
-  LOG(INFO) << "Iteration " << iter_
-            << ", Testing net (#" << test_net_id << ")";
   CHECK_NOTNULL(test_nets_[test_net_id].get())->
       ShareTrainedLayersWith(net_.get());
+  TestNet(test_net_id, iter_);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::TestNet(const int test_net_id, const int iter) {
   vector<Dtype> test_score;
   vector<int> test_score_output_id;
   vector<Blob<Dtype>*> bottom_vec;
@@ -322,6 +790,9 @@ void Solver<Dtype>::Test(const int test_net_id) {
       }
     }
   }
+  boost::mutex::scoped_lock lock(test_log_mutex);
+  LOG(INFO) << "Iteration " << iter
+            << ", Testing net (#" << test_net_id << ")";
   if (param_.test_compute_loss()) {
     loss /= param_.test_iter(test_net_id);
     LOG(INFO) << "Test loss: " << loss;
@@ -345,41 +816,185 @@ void Solver<Dtype>::Test(const int test_net_id) {
 
 template <typename Dtype>
 void Solver<Dtype>::Snapshot() {
-  NetParameter net_param;
+  if (gradient_reducer_ && gradient_reducer_->transport().rank() != 0) {
+    return;
+  }
+  PendingSnapshot<Dtype> local_snapshot;
+  PendingSnapshot<Dtype>* snapshot = &local_snapshot;
+  if (param_.max_pending_snapshots() > 0) {
+    if (!snapshot_writer_) {
+      snapshot_writer_.reset(
+          new SnapshotWriter<Dtype>(param_.max_pending_snapshots()));
+    }
+    snapshot = snapshot_writer_->Acquire();
+  }
+  // Copy the params out of the net; the protos are built when writing.
   // For intermediate results, we will also dump the gradient values.
-  net_->ToProto(&net_param, param_.snapshot_diff());
+  snapshot->write_diff = param_.snapshot_diff();
+  snapshot->raw_format =
+      param_.snapshot_format() == SolverParameter_SnapshotFormat_RAW;
+  net_->ToProto(&snapshot->net_param, snapshot->write_diff, false);
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net_->layers();
+  snapshot->num_layer_blobs.clear();
+  int num_blobs = 0;
+  for (int i = 0; i < layers.size(); ++i) {
+    const vector<shared_ptr<Blob<Dtype> > >& blobs = layers[i]->blobs();
+    snapshot->num_layer_blobs.push_back(blobs.size());
+    for (int j = 0; j < blobs.size(); ++j, ++num_blobs) {
+      if (snapshot->blobs.size() <= num_blobs) {
+        snapshot->blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+      }
+      StageBlob(*blobs[j], snapshot->write_diff,
+          snapshot->blobs[num_blobs].get());
+    }
+  }
+  snapshot->blobs.resize(num_blobs);
+
   string filename(param_.snapshot_prefix());
-  string model_filename, snapshot_filename;
   const int kBufferSize = 20;
   char iter_str_buffer[kBufferSize];
   // Add one to iter_ to get the number of iterations that have completed.
   snprintf(iter_str_buffer, kBufferSize, "_iter_%d", iter_ + 1);
   filename += iter_str_buffer;
-  model_filename = filename + ".caffemodel";
-  LOG(INFO) << "Snapshotting to " << model_filename;
-  WriteProtoToBinaryFile(net_param, model_filename.c_str());
-  SolverState state;
-  SnapshotSolverState(&state);
-  state.set_iter(iter_ + 1);
-  state.set_learned_net(model_filename);
-  state.set_current_step(current_step_);
-  snapshot_filename = filename + ".solverstate";
-  LOG(INFO) << "Snapshotting solver state to " << snapshot_filename;
-  WriteProtoToBinaryFile(state, snapshot_filename.c_str());
+  snapshot->model_filename = filename + ".caffemodel";
+  LOG(INFO) << "Snapshotting to " << snapshot->model_filename;
+  snapshot->state.Clear();
+  if (!StageSolverHistory(&snapshot->history)) {
+    snapshot->history.clear();
+    SnapshotSolverState(&snapshot->state);
+  }
+  snapshot->state.set_iter(iter_ + 1);
+  snapshot->state.set_learned_net(snapshot->model_filename);
+  snapshot->state.set_current_step(current_step_);
+  if (!hogwild_nets_.empty()) {
+    snapshot->state.set_hogwild_threads(hogwild_nets_.size() + 1);
+  }
+  snapshot->state_filename = filename + ".solverstate";
+  LOG(INFO) << "Snapshotting solver state to " << snapshot->state_filename;
+  if (snapshot == &local_snapshot) {
+    snapshot->WriteFiles();
+  } else {
+    snapshot_writer_->Write(snapshot);
+  }
+}
+
+template <typename Dtype>
+void PendingSnapshot<Dtype>::WriteFiles() {
+  int blob_id = 0;
+  vector<RawPayload> payloads;
+  for (int i = 0; i < net_param.layer_size(); ++i) {
+    LayerParameter* layer_param = net_param.mutable_layer(i);
+    for (int j = 0; j < num_layer_blobs[i]; ++j) {
+      if (raw_format) {
+        BlobToRawProto(*blobs[blob_id++], write_diff,
+            layer_param->add_blobs(), &payloads);
+      } else {
+        blobs[blob_id++]->ToProto(layer_param->add_blobs(), write_diff);
+      }
+    }
+  }
+  if (raw_format) {
+    WriteRawProtoFileAtomically(net_param, payloads, model_filename);
+  } else {
+    WriteProtoToBinaryFileAtomically(net_param, model_filename);
+  }
+  // Free the proto copy of the params.
+  net_param.Clear();
+  for (int i = 0; i < history.size(); ++i) {
+    history[i]->ToProto(state.add_history());
+  }
+  WriteProtoToBinaryFileAtomically(state, state_filename);
+  state.Clear();
+}
+
+template <typename Dtype>
+SnapshotWriter<Dtype>::SnapshotWriter(int max_pending)
+    : max_pending_(max_pending) {
+  CHECK_GT(max_pending_, 0);
+  for (int i = 0; i < max_pending_; ++i) {
+    free_.push(new PendingSnapshot<Dtype>());
+  }
+  CHECK(StartInternalThread()) << "Thread execution failed";
+}
+
+template <typename Dtype>
+SnapshotWriter<Dtype>::~SnapshotWriter() {
+  full_.push(NULL);
+  CHECK(WaitForInternalThreadToExit()) << "Thread joining failed";
+  for (int i = 0; i < max_pending_; ++i) {
+    PendingSnapshot<Dtype>* snapshot;
+    free_.pop(&snapshot);
+    delete snapshot;
+  }
+}
+
+template <typename Dtype>
+PendingSnapshot<Dtype>* SnapshotWriter<Dtype>::Acquire() {
+  PendingSnapshot<Dtype>* snapshot;
+  free_.pop(&snapshot);
+  return snapshot;
+}
+
+template <typename Dtype>
+void SnapshotWriter<Dtype>::Write(PendingSnapshot<Dtype>* snapshot) {
+  full_.push(snapshot);
+}
+
+template <typename Dtype>
+void SnapshotWriter<Dtype>::WaitForPending() {
+  vector<PendingSnapshot<Dtype>*> snapshots(max_pending_);
+  for (int i = 0; i < max_pending_; ++i) {
+    free_.pop(&snapshots[i]);
+  }
+  for (int i = 0; i < max_pending_; ++i) {
+    free_.push(snapshots[i]);
+  }
+}
+
+template <typename Dtype>
+void SnapshotWriter<Dtype>::InternalThreadEntry() {
+  while (true) {
+    PendingSnapshot<Dtype>* snapshot;
+    full_.pop(&snapshot);
+    if (snapshot == NULL) {
+      break;
+    }
+    snapshot->WriteFiles();
+    LOG(INFO) << "Snapshot " << snapshot->state_filename << " written";
+    free_.push(snapshot);
+  }
 }
 
 template <typename Dtype>
 void Solver<Dtype>::Restore(const char* state_file) {
-  SolverState state;
-  NetParameter net_param;
-  ReadProtoFromBinaryFile(state_file, &state);
-  if (state.has_learned_net()) {
-    ReadProtoFromBinaryFile(state.learned_net().c_str(), &net_param);
-    net_->CopyTrainedLayersFrom(net_param);
+  // With a transport, only rank 0 reads the snapshot, which it then sends
+  // to the other ranks.
+  if (!transport_ || transport_->rank() == 0) {
+    SolverState state;
+    ReadProtoFromBinaryFile(state_file, &state);
+    if (state.has_learned_net()) {
+      // Reads either snapshot format.
+      net_->CopyTrainedLayersFrom(state.learned_net());
+    }
+    iter_ = state.iter();
+    current_step_ = state.current_step();
+    RestoreSolverState(state);
+  }
+  if (transport_) {
+    // A Dtype holds integers exactly only up to 2^24, so the counters go in
+    // halves of 16 bits.
+    Dtype counters[4] = {
+        static_cast<Dtype>(iter_ >> 16), static_cast<Dtype>(iter_ & 0xffff),
+        static_cast<Dtype>(current_step_ >> 16),
+        static_cast<Dtype>(current_step_ & 0xffff)};
+    transport_->Broadcast(counters, 4, 0);
+    iter_ = (static_cast<int>(counters[0]) << 16)
+        | static_cast<int>(counters[1]);
+    current_step_ = (static_cast<int>(counters[2]) << 16)
+        | static_cast<int>(counters[3]);
+    gradient_reducer_->BroadcastParams();
+    BroadcastSolverState(transport_.get());
   }
-  iter_ = state.iter();
-  current_step_ = state.current_step();
-  RestoreSolverState(state);
 }
 
 
@@ -450,6 +1065,14 @@ void SGDSolver<Dtype>::PreSolve() {
     update_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
     temp_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
   }
+  hogwild_history_.resize(this->hogwild_nets_.size());
+  for (int i = 0; i < hogwild_history_.size(); ++i) {
+    hogwild_history_[i].clear();
+    for (int j = 0; j < net_params.size(); ++j) {
+      hogwild_history_[i].push_back(
+          shared_ptr<Blob<Dtype> >(new Blob<Dtype>(net_params[j]->shape())));
+    }
+  }
 }
 
 template <typename Dtype>
@@ -574,29 +1197,229 @@ void SGDSolver<Dtype>::ComputeUpdateValue() {
   }
 }
 
+template <typename Dtype>
+void SGDSolver<Dtype>::ApplyUpdate() {
+  const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
+  const vector<int>& param_owners = this->net_->param_owners();
+  bool fused = Caffe::mode() == Caffe::CPU && !this->param_.debug_info();
+  for (int i = 0; i < param_owners.size(); ++i) {
+    fused = fused && param_owners[i] < 0;
+  }
+  if (!fused) {
+    Solver<Dtype>::ApplyUpdate();
+    return;
+  }
+  Dtype rate = GetLearningRate();
+  if (this->param_.display() && this->iter_ % this->param_.display() == 0) {
+    LOG(INFO) << "Iteration " << this->iter_ << ", lr = " << rate;
+  }
+  ClipGradients();
+  const string& regularization_type = this->param_.regularization_type();
+  CHECK(regularization_type == "L2" || regularization_type == "L1")
+      << "Unknown regularization type: " << regularization_type;
+
+  // Split the parameters into one run of about equal size per thread; a
+  // thread only gets a share of a large parameter when there is enough work.
+  const int kMinValuesPerThread = 1 << 15;
+  int total = 0;
+  for (int i = 0; i < net_params.size(); ++i) {
+    total += net_params[i]->count();
+  }
+  const int num_threads = std::max(1, std::min(this->param_.update_threads(),
+      (total + kMinValuesPerThread - 1) / kMinValuesPerThread));
+  const int per_thread = (total + num_threads - 1) / num_threads;
+  vector<vector<UpdateSlice> > slices(num_threads);
+  int thread_id = 0;
+  int thread_left = per_thread;
+  for (int param_id = 0; param_id < net_params.size(); ++param_id) {
+    Blob<Dtype>* param = net_params[param_id].get();
+    Dtype* data = param->mutable_cpu_data();
+    const Dtype* diff = param->cpu_diff();
+    Dtype* history = history_[param_id]->mutable_cpu_data();
+    Dtype* history2 = history_.size() > net_params.size() ?
+        history_[net_params.size() + param_id]->mutable_cpu_data() : NULL;
+    for (int offset = 0; offset < param->count(); ) {
+      UpdateSlice slice;
+      slice.param_id = param_id;
+      slice.count = std::min(param->count() - offset, thread_left);
+      slice.data = data + offset;
+      slice.diff = diff + offset;
+      slice.history = history + offset;
+      slice.history2 = history2 ? history2 + offset : NULL;
+      slices[thread_id].push_back(slice);
+      offset += slice.count;
+      thread_left -= slice.count;
+      if (thread_left == 0 && thread_id + 1 < num_threads) {
+        ++thread_id;
+        thread_left = per_thread;
+      }
+    }
+  }
+  if (num_threads == 1) {
+    FusedUpdateSlices(&slices[0], rate);
+  } else {
+    if (!update_workers_) {
+      update_workers_.reset(new boost::thread_group());
+    }
+    while (update_workers_->size() < num_threads - 1) {
+      update_workers_->create_thread(
+          boost::bind(&SGDSolver<Dtype>::UpdateWorker, this));
+    }
+    for (int i = 1; i < num_threads; ++i) {
+      UpdateTask task = { &slices[i], rate };
+      update_tasks_.push(task);
+    }
+    FusedUpdateSlices(&slices[0], rate);
+    for (int i = 1; i < num_threads; ++i) {
+      int done;
+      update_done_.pop(&done);
+    }
+  }
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::UpdateWorker() {
+  UpdateTask task;
+  for (update_tasks_.pop(&task); task.slices; update_tasks_.pop(&task)) {
+    FusedUpdateSlices(task.slices, task.rate);
+    update_done_.push(0);
+  }
+}
+
+template <typename Dtype>
+SGDSolver<Dtype>::~SGDSolver() {
+  if (update_workers_) {
+    for (int i = 0; i < update_workers_->size(); ++i) {
+      UpdateTask stop = { NULL, Dtype(0) };
+      update_tasks_.push(stop);
+    }
+    update_workers_->join_all();
+  }
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::FusedUpdateSlices(const vector<UpdateSlice>* slices,
+    Dtype rate) {
+  for (int i = 0; i < slices->size(); ++i) {
+    FusedUpdate((*slices)[i], rate);
+  }
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::FusedUpdate(const UpdateSlice& slice, Dtype rate) {
+  const Dtype local_rate = rate * this->net_->params_lr()[slice.param_id]
+      / this->param_.iter_size();
+  const Dtype local_decay = this->param_.weight_decay() *
+      this->net_->params_weight_decay()[slice.param_id];
+  const bool l1 = this->param_.regularization_type() == "L1";
+  caffe_cpu_sgd_update(slice.count, local_rate,
+      Dtype(this->param_.momentum()), l1 ? Dtype(0) : local_decay,
+      l1 ? local_decay : Dtype(0), slice.diff, slice.history, slice.data);
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::HogwildUpdate(Net<Dtype>* net, const int worker,
+    const int iter) {
+  Dtype rate;
+  {
+    // GetLearningRate reads iter_, and may move current_step_ on.
+    boost::mutex::scoped_lock lock(this->hogwild_mutex_);
+    const int solver_iter = this->iter_;
+    this->iter_ = iter;
+    rate = GetLearningRate();
+    this->iter_ = solver_iter;
+  }
+  const vector<shared_ptr<Blob<Dtype> > >& history =
+      worker ? hogwild_history_[worker - 1] : history_;
+  const vector<shared_ptr<Blob<Dtype> > >& net_params = net->params();
+  for (int param_id = 0; param_id < net_params.size(); ++param_id) {
+    Blob<Dtype>* param = net_params[param_id].get();
+    UpdateSlice slice;
+    slice.param_id = param_id;
+    slice.count = param->count();
+    // All workers write the shared data at once; hogwild lets the updates
+    // of different workers race.
+    slice.data = param->mutable_cpu_data();
+    slice.diff = param->cpu_diff();
+    slice.history = history[param_id]->mutable_cpu_data();
+    slice.history2 = NULL;
+    FusedUpdate(slice, rate);
+  }
+}
+
+template <typename Dtype>
+vector<shared_ptr<Blob<Dtype> > > SGDSolver<Dtype>::SnapshotHistory() const {
+  vector<shared_ptr<Blob<Dtype> > > history(history_);
+  for (int i = 0; i < hogwild_history_.size(); ++i) {
+    history.insert(history.end(), hogwild_history_[i].begin(),
+        hogwild_history_[i].end());
+  }
+  return history;
+}
+
 template <typename Dtype>
 void SGDSolver<Dtype>::SnapshotSolverState(SolverState* state) {
+  const vector<shared_ptr<Blob<Dtype> > > snapshot_history = SnapshotHistory();
   state->clear_history();
-  for (int i = 0; i < history_.size(); ++i) {
+  for (int i = 0; i < snapshot_history.size(); ++i) {
     // Add history
     BlobProto* history_blob = state->add_history();
-    history_[i]->ToProto(history_blob);
+    snapshot_history[i]->ToProto(history_blob);
+  }
+}
+
+template <typename Dtype>
+bool SGDSolver<Dtype>::StageSolverHistory(
+    vector<shared_ptr<Blob<Dtype> > >* history) {
+  const vector<shared_ptr<Blob<Dtype> > > snapshot_history = SnapshotHistory();
+  history->resize(snapshot_history.size());
+  for (int i = 0; i < snapshot_history.size(); ++i) {
+    if (!(*history)[i]) {
+      (*history)[i].reset(new Blob<Dtype>());
+    }
+    StageBlob(*snapshot_history[i], false, (*history)[i].get());
   }
+  return true;
 }
 
 template <typename Dtype>
 void SGDSolver<Dtype>::RestoreSolverState(const SolverState& state) {
-  CHECK_EQ(state.history_size(), history_.size())
-      << "Incorrect length of history blobs.";
+  // A hogwild snapshot holds history_ and then one history per other
+  // worker; it may be restored with a different number of workers.
+  const int num_history = history_.size();
+  if (state.hogwild_threads() > 1) {
+    CHECK_EQ(state.history_size(), state.hogwild_threads() * num_history)
+        << "Incorrect length of history blobs.";
+  } else if (this->param_.hogwild_threads() > 1) {
+    CHECK(num_history > 0 && state.history_size() % num_history == 0)
+        << "Incorrect length of history blobs.";
+  } else {
+    CHECK_EQ(state.history_size(), num_history)
+        << "Incorrect length of history blobs.";
+  }
   LOG(INFO) << "SGDSolver: restoring history";
-  for (int i = 0; i < history_.size(); ++i) {
-    history_[i]->FromProto(state.history(i));
+  const vector<shared_ptr<Blob<Dtype> > > snapshot_history = SnapshotHistory();
+  const int num_restored =
+      std::min<int>(state.history_size(), snapshot_history.size());
+  if (num_restored < snapshot_history.size()) {
+    LOG(INFO) << "Some hogwild workers start with zero history";
+  }
+  for (int i = 0; i < num_restored; ++i) {
+    snapshot_history[i]->FromProto(state.history(i));
   }
 }
 
 template <typename Dtype>
-void NesterovSolver<Dtype>::ComputeUpdateValue() {
-  const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
+void SGDSolver<Dtype>::BroadcastSolverState(Transport<Dtype>* transport) {
+  for (int i = 0; i < history_.size(); ++i) {
+    transport->Broadcast(history_[i]->mutable_cpu_data(), history_[i]->count(),
+        0);
+  }
+}
+
+template <typename Dtype>
+void NesterovSolver<Dtype>::ComputeUpdateValue() {
+  const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
   const vector<float>& net_params_lr = this->net_->params_lr();
   const vector<float>& net_params_weight_decay =
       this->net_->params_weight_decay();
@@ -711,6 +1534,18 @@ void NesterovSolver<Dtype>::ComputeUpdateValue() {
   }
 }
 
+template <typename Dtype>
+void NesterovSolver<Dtype>::FusedUpdate(
+    const typename SGDSolver<Dtype>::UpdateSlice& slice, Dtype rate) {
+  const Dtype local_rate = rate * this->net_->params_lr()[slice.param_id];
+  const Dtype local_decay = this->param_.weight_decay() *
+      this->net_->params_weight_decay()[slice.param_id];
+  const bool l1 = this->param_.regularization_type() == "L1";
+  caffe_cpu_nesterov_update(slice.count, local_rate,
+      Dtype(this->param_.momentum()), l1 ? Dtype(0) : local_decay,
+      l1 ? local_decay : Dtype(0), slice.diff, slice.history, slice.data);
+}
+
 template <typename Dtype>
 void AdaGradSolver<Dtype>::ComputeUpdateValue() {
   const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
@@ -846,9 +1681,348 @@ void AdaGradSolver<Dtype>::ComputeUpdateValue() {
   }
 }
 
+template <typename Dtype>
+void AdaGradSolver<Dtype>::FusedUpdate(
+    const typename SGDSolver<Dtype>::UpdateSlice& slice, Dtype rate) {
+  const Dtype local_rate = rate * this->net_->params_lr()[slice.param_id];
+  const Dtype local_decay = this->param_.weight_decay() *
+      this->net_->params_weight_decay()[slice.param_id];
+  const bool l1 = this->param_.regularization_type() == "L1";
+  caffe_cpu_adagrad_update(slice.count, local_rate,
+      Dtype(this->param_.delta()), l1 ? Dtype(0) : local_decay,
+      l1 ? local_decay : Dtype(0), slice.diff, slice.history, slice.data);
+}
+
+template <typename Dtype>
+void RMSPropSolver<Dtype>::ComputeUpdateValue() {
+  const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
+  const vector<float>& net_params_lr = this->net_->params_lr();
+  const vector<float>& net_params_weight_decay =
+      this->net_->params_weight_decay();
+  // get the learning rate
+  Dtype rate = this->GetLearningRate();
+  Dtype delta = this->param_.delta();
+  if (this->param_.display() && this->iter_ % this->param_.display() == 0) {
+    LOG(INFO) << "Iteration " << this->iter_ << ", lr = " << rate;
+  }
+  SGDSolver<Dtype>::ClipGradients();
+  Dtype weight_decay = this->param_.weight_decay();
+  string regularization_type = this->param_.regularization_type();
+  Dtype rms_decay = this->param_.rms_decay();
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    for (int param_id = 0; param_id < net_params.size(); ++param_id) {
+      Dtype local_rate = rate * net_params_lr[param_id];
+      Dtype local_decay = weight_decay * net_params_weight_decay[param_id];
+
+      if (local_decay) {
+        if (regularization_type == "L2") {
+          // add weight decay
+          caffe_axpy(net_params[param_id]->count(),
+              local_decay,
+              net_params[param_id]->cpu_data(),
+              net_params[param_id]->mutable_cpu_diff());
+        } else if (regularization_type == "L1") {
+          caffe_cpu_sign(net_params[param_id]->count(),
+              net_params[param_id]->cpu_data(),
+              this->temp_[param_id]->mutable_cpu_data());
+          caffe_axpy(net_params[param_id]->count(),
+              local_decay,
+              this->temp_[param_id]->cpu_data(),
+              net_params[param_id]->mutable_cpu_diff());
+        } else {
+          LOG(FATAL) << "Unknown regularization type: " << regularization_type;
+        }
+      }
+
+      // compute square of gradient in update
+      caffe_powx(net_params[param_id]->count(),
+          net_params[param_id]->cpu_diff(), Dtype(2),
+          this->update_[param_id]->mutable_cpu_data());
+
+      // update history
+      caffe_cpu_axpby(net_params[param_id]->count(), Dtype(1) - rms_decay,
+          this->update_[param_id]->cpu_data(), rms_decay,
+          this->history_[param_id]->mutable_cpu_data());
+
+      // prepare update
+      caffe_powx(net_params[param_id]->count(),
+                this->history_[param_id]->cpu_data(), Dtype(0.5),
+                this->update_[param_id]->mutable_cpu_data());
+
+      caffe_add_scalar(net_params[param_id]->count(),
+                delta, this->update_[param_id]->mutable_cpu_data());
+
+      caffe_div(net_params[param_id]->count(),
+                net_params[param_id]->cpu_diff(),
+                this->update_[param_id]->cpu_data(),
+                this->update_[param_id]->mutable_cpu_data());
+
+      // scale and copy
+      caffe_cpu_axpby(net_params[param_id]->count(), local_rate,
+          this->update_[param_id]->cpu_data(), Dtype(0),
+          net_params[param_id]->mutable_cpu_diff());
+    }
+    break;
+  case Caffe::GPU:
+#ifndef CPU_ONLY
+    for (int param_id = 0; param_id < net_params.size(); ++param_id) {
+      Dtype local_rate = rate * net_params_lr[param_id];
+      Dtype local_decay = weight_decay * net_params_weight_decay[param_id];
+
+      if (local_decay) {
+        if (regularization_type == "L2") {
+          // add weight decay
+          caffe_gpu_axpy(net_params[param_id]->count(),
+              local_decay,
+              net_params[param_id]->gpu_data(),
+              net_params[param_id]->mutable_gpu_diff());
+        } else if (regularization_type == "L1") {
+          caffe_gpu_sign(net_params[param_id]->count(),
+              net_params[param_id]->gpu_data(),
+              this->temp_[param_id]->mutable_gpu_data());
+          caffe_gpu_axpy(net_params[param_id]->count(),
+              local_decay,
+              this->temp_[param_id]->gpu_data(),
+              net_params[param_id]->mutable_gpu_diff());
+        } else {
+          LOG(FATAL) << "Unknown regularization type: " << regularization_type;
+        }
+      }
+
+      // compute square of gradient in update
+      caffe_gpu_powx(net_params[param_id]->count(),
+          net_params[param_id]->gpu_diff(), Dtype(2),
+          this->update_[param_id]->mutable_gpu_data());
+
+      // update history
+      caffe_gpu_axpby(net_params[param_id]->count(), Dtype(1) - rms_decay,
+          this->update_[param_id]->gpu_data(), rms_decay,
+          this->history_[param_id]->mutable_gpu_data());
+
+      // prepare update
+      caffe_gpu_powx(net_params[param_id]->count(),
+                this->history_[param_id]->gpu_data(), Dtype(0.5),
+                this->update_[param_id]->mutable_gpu_data());
+
+      caffe_gpu_add_scalar(net_params[param_id]->count(),
+                delta, this->update_[param_id]->mutable_gpu_data());
+
+      caffe_gpu_div(net_params[param_id]->count(),
+                net_params[param_id]->gpu_diff(),
+                this->update_[param_id]->gpu_data(),
+                this->update_[param_id]->mutable_gpu_data());
+
+      // scale and copy
+      caffe_gpu_axpby(net_params[param_id]->count(), local_rate,
+          this->update_[param_id]->gpu_data(), Dtype(0),
+          net_params[param_id]->mutable_gpu_diff());
+    }
+#else
+    NO_GPU;
+#endif
+    break;
+  default:
+    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+  }
+}
+
+template <typename Dtype>
+void RMSPropSolver<Dtype>::FusedUpdate(
+    const typename SGDSolver<Dtype>::UpdateSlice& slice, Dtype rate) {
+  const Dtype local_rate = rate * this->net_->params_lr()[slice.param_id];
+  const Dtype local_decay = this->param_.weight_decay() *
+      this->net_->params_weight_decay()[slice.param_id];
+  const bool l1 = this->param_.regularization_type() == "L1";
+  caffe_cpu_rmsprop_update(slice.count, local_rate,
+      Dtype(this->param_.rms_decay()), Dtype(this->param_.delta()),
+      l1 ? Dtype(0) : local_decay, l1 ? local_decay : Dtype(0), slice.diff,
+      slice.history, slice.data);
+}
+
+template <typename Dtype>
+void AdamSolver<Dtype>::AdamPreSolve() {
+  // The hogwild workers would each need the step count of their own moments.
+  CHECK_LE(this->param_.hogwild_threads(), 1)
+      << "Adam cannot be used with hogwild training.";
+  // Add the second moments after the first ones.
+  const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
+  for (int i = 0; i < net_params.size(); ++i) {
+    this->history_.push_back(shared_ptr<Blob<Dtype> >(
+        new Blob<Dtype>(net_params[i]->shape())));
+  }
+}
+
+template <typename Dtype>
+Dtype AdamSolver<Dtype>::CorrectedRate(Dtype rate) {
+  const Dtype t = this->iter_ + 1;
+  return rate * std::sqrt(Dtype(1) - pow(Dtype(this->param_.momentum2()), t))
+      / (Dtype(1) - pow(Dtype(this->param_.momentum()), t));
+}
+
+template <typename Dtype>
+void AdamSolver<Dtype>::ComputeUpdateValue() {
+  const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
+  const vector<float>& net_params_lr = this->net_->params_lr();
+  const vector<float>& net_params_weight_decay =
+      this->net_->params_weight_decay();
+  // get the learning rate
+  Dtype rate = this->GetLearningRate();
+  Dtype delta = this->param_.delta();
+  if (this->param_.display() && this->iter_ % this->param_.display() == 0) {
+    LOG(INFO) << "Iteration " << this->iter_ << ", lr = " << rate;
+  }
+  SGDSolver<Dtype>::ClipGradients();
+  Dtype weight_decay = this->param_.weight_decay();
+  string regularization_type = this->param_.regularization_type();
+  Dtype beta1 = this->param_.momentum();
+  Dtype beta2 = this->param_.momentum2();
+  Dtype corrected_rate = CorrectedRate(rate);
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    for (int param_id = 0; param_id < net_params.size(); ++param_id) {
+      Dtype local_rate = corrected_rate * net_params_lr[param_id];
+      Dtype local_decay = weight_decay * net_params_weight_decay[param_id];
+
+      if (local_decay) {
+        if (regularization_type == "L2") {
+          // add weight decay
+          caffe_axpy(net_params[param_id]->count(),
+              local_decay,
+              net_params[param_id]->cpu_data(),
+              net_params[param_id]->mutable_cpu_diff());
+        } else if (regularization_type == "L1") {
+          caffe_cpu_sign(net_params[param_id]->count(),
+              net_params[param_id]->cpu_data(),
+              this->temp_[param_id]->mutable_cpu_data());
+          caffe_axpy(net_params[param_id]->count(),
+              local_decay,
+              this->temp_[param_id]->cpu_data(),
+              net_params[param_id]->mutable_cpu_diff());
+        } else {
+          LOG(FATAL) << "Unknown regularization type: " << regularization_type;
+        }
+      }
+
+      Blob<Dtype>* m = this->history_[param_id].get();
+      Blob<Dtype>* v = this->history_[net_params.size() + param_id].get();
+
+      // update the first moment
+      caffe_cpu_axpby(net_params[param_id]->count(), Dtype(1) - beta1,
+          net_params[param_id]->cpu_diff(), beta1, m->mutable_cpu_data());
+
+      // update the second moment from the square of gradient in update
+      caffe_mul(net_params[param_id]->count(),
+          net_params[param_id]->cpu_diff(), net_params[param_id]->cpu_diff(),
+          this->update_[param_id]->mutable_cpu_data());
+      caffe_cpu_axpby(net_params[param_id]->count(), Dtype(1) - beta2,
+          this->update_[param_id]->cpu_data(), beta2, v->mutable_cpu_data());
+
+      // prepare update
+      caffe_powx(net_params[param_id]->count(), v->cpu_data(), Dtype(0.5),
+          this->update_[param_id]->mutable_cpu_data());
+
+      caffe_add_scalar(net_params[param_id]->count(),
+          delta, this->update_[param_id]->mutable_cpu_data());
+
+      caffe_div(net_params[param_id]->count(), m->cpu_data(),
+          this->update_[param_id]->cpu_data(),
+          this->update_[param_id]->mutable_cpu_data());
+
+      // scale and copy
+      caffe_cpu_axpby(net_params[param_id]->count(), local_rate,
+          this->update_[param_id]->cpu_data(), Dtype(0),
+          net_params[param_id]->mutable_cpu_diff());
+    }
+    break;
+  case Caffe::GPU:
+#ifndef CPU_ONLY
+    for (int param_id = 0; param_id < net_params.size(); ++param_id) {
+      Dtype local_rate = corrected_rate * net_params_lr[param_id];
+      Dtype local_decay = weight_decay * net_params_weight_decay[param_id];
+
+      if (local_decay) {
+        if (regularization_type == "L2") {
+          // add weight decay
+          caffe_gpu_axpy(net_params[param_id]->count(),
+              local_decay,
+              net_params[param_id]->gpu_data(),
+              net_params[param_id]->mutable_gpu_diff());
+        } else if (regularization_type == "L1") {
+          caffe_gpu_sign(net_params[param_id]->count(),
+              net_params[param_id]->gpu_data(),
+              this->temp_[param_id]->mutable_gpu_data());
+          caffe_gpu_axpy(net_params[param_id]->count(),
+              local_decay,
+              this->temp_[param_id]->gpu_data(),
+              net_params[param_id]->mutable_gpu_diff());
+        } else {
+          LOG(FATAL) << "Unknown regularization type: " << regularization_type;
+        }
+      }
+
+      Blob<Dtype>* m = this->history_[param_id].get();
+      Blob<Dtype>* v = this->history_[net_params.size() + param_id].get();
+
+      // update the first moment
+      caffe_gpu_axpby(net_params[param_id]->count(), Dtype(1) - beta1,
+          net_params[param_id]->gpu_diff(), beta1, m->mutable_gpu_data());
+
+      // update the second moment from the square of gradient in update
+      caffe_gpu_mul(net_params[param_id]->count(),
+          net_params[param_id]->gpu_diff(), net_params[param_id]->gpu_diff(),
+          this->update_[param_id]->mutable_gpu_data());
+      caffe_gpu_axpby(net_params[param_id]->count(), Dtype(1) - beta2,
+          this->update_[param_id]->gpu_data(), beta2, v->mutable_gpu_data());
+
+      // prepare update
+      caffe_gpu_powx(net_params[param_id]->count(), v->gpu_data(), Dtype(0.5),
+          this->update_[param_id]->mutable_gpu_data());
+
+      caffe_gpu_add_scalar(net_params[param_id]->count(),
+          delta, this->update_[param_id]->mutable_gpu_data());
+
+      caffe_gpu_div(net_params[param_id]->count(), m->gpu_data(),
+          this->update_[param_id]->gpu_data(),
+          this->update_[param_id]->mutable_gpu_data());
+
+      // scale and copy
+      caffe_gpu_axpby(net_params[param_id]->count(), local_rate,
+          this->update_[param_id]->gpu_data(), Dtype(0),
+          net_params[param_id]->mutable_gpu_diff());
+    }
+#else
+    NO_GPU;
+#endif
+    break;
+  default:
+    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+  }
+}
+
+template <typename Dtype>
+void AdamSolver<Dtype>::FusedUpdate(
+    const typename SGDSolver<Dtype>::UpdateSlice& slice, Dtype rate) {
+  const Dtype local_rate =
+      CorrectedRate(rate) * this->net_->params_lr()[slice.param_id];
+  const Dtype local_decay = this->param_.weight_decay() *
+      this->net_->params_weight_decay()[slice.param_id];
+  const bool l1 = this->param_.regularization_type() == "L1";
+  caffe_cpu_adam_update(slice.count, local_rate,
+      Dtype(this->param_.momentum()), Dtype(this->param_.momentum2()),
+      Dtype(this->param_.delta()), l1 ? Dtype(0) : local_decay,
+      l1 ? local_decay : Dtype(0), slice.diff, slice.history, slice.history2,
+      slice.data);
+}
+
+template struct PendingSnapshot<float>;
+template struct PendingSnapshot<double>;
+INSTANTIATE_CLASS(SnapshotWriter);
 INSTANTIATE_CLASS(Solver);
 INSTANTIATE_CLASS(SGDSolver);
 INSTANTIATE_CLASS(NesterovSolver);
 INSTANTIATE_CLASS(AdaGradSolver);
+INSTANTIATE_CLASS(RMSPropSolver);
+INSTANTIATE_CLASS(AdamSolver);
 
 }  // namespace caffe
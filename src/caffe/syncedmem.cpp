@@ -83,6 +83,24 @@ void SyncedMemory::set_cpu_data(void* data) {
   own_cpu_data_ = false;
 }
 
+void SyncedMemory::release() {
+  if (cpu_ptr_ && !own_cpu_data_) {
+    return;
+  }
+  if (cpu_ptr_) {
+    CaffeFreeHost(cpu_ptr_);
+    cpu_ptr_ = NULL;
+    own_cpu_data_ = false;
+  }
+#ifndef CPU_ONLY
+  if (gpu_ptr_) {
+    CUDA_CHECK(cudaFree(gpu_ptr_));
+    gpu_ptr_ = NULL;
+  }
+#endif  // CPU_ONLY
+  head_ = UNINITIALIZED;
+}
+
 const void* SyncedMemory::gpu_data() {
 #ifndef CPU_ONLY
   to_gpu();
@@ -0,0 +1,58 @@
+#include "boost/thread.hpp"
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class BlockingQueueTest : public ::testing::Test {
+ protected:
+  static void Produce(BlockingQueue<int>* queue, int count) {
+    for (int i = 0; i < count; ++i) {
+      queue->push(i);
+    }
+  }
+};
+
+TEST_F(BlockingQueueTest, TestPushPop) {
+  BlockingQueue<int> queue;
+  int value;
+  EXPECT_FALSE(queue.try_pop(&value));
+  queue.push(1);
+  queue.push(2);
+  EXPECT_EQ(2u, queue.size());
+  queue.pop(&value);
+  EXPECT_EQ(1, value);
+  EXPECT_TRUE(queue.try_pop(&value));
+  EXPECT_EQ(2, value);
+  EXPECT_EQ(0u, queue.size());
+}
+
+TEST_F(BlockingQueueTest, TestBoundedProducer) {
+  // The producer blocks on the small capacity until the consumer catches up;
+  // items still arrive in order.
+  BlockingQueue<int> queue(2);
+  const int count = 1000;
+  boost::thread producer(&BlockingQueueTest::Produce, &queue, count);
+  for (int i = 0; i < count; ++i) {
+    int value;
+    queue.pop(&value);
+    EXPECT_EQ(i, value);
+    EXPECT_LE(queue.size(), 2u);
+  }
+  producer.join();
+}
+
+TEST_F(BlockingQueueTest, TestPopTimeout) {
+  BlockingQueue<int> queue;
+  int value;
+  EXPECT_FALSE(queue.pop_for(&value, 1));
+  queue.push(3);
+  EXPECT_TRUE(queue.pop_for(&value, 1));
+  EXPECT_EQ(3, value);
+}
+
+}  // namespace caffe
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -104,6 +106,67 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     }
   }
 
+  void TestSkip() {
+    const int skip = 2;
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_skip(skip);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    for (int iter = 0; iter < 10; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ((i + skip) % 5, blob_top_label_->cpu_data()[i]);
+      }
+    }
+  }
+
+  void TestShards() {
+    // Two shards of batches of two records: at each step they read the next
+    // four records of the db, the first two going to shard 0.
+    const int num_shards = 2;
+    const int batch_size = 2;
+    vector<shared_ptr<DataLayer<Dtype> > > layers;
+    vector<shared_ptr<Blob<Dtype> > > blobs;
+    vector<vector<Blob<Dtype>*> > top_vecs(num_shards);
+    for (int shard = 0; shard < num_shards; ++shard) {
+      LayerParameter param;
+      param.set_phase(TRAIN);
+      DataParameter* data_param = param.mutable_data_param();
+      data_param->set_batch_size(batch_size);
+      data_param->set_source(filename_->c_str());
+      data_param->set_backend(backend_);
+      data_param->set_num_shards(num_shards);
+      data_param->set_shard_id(shard);
+      for (int i = 0; i < 2; ++i) {
+        blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+        top_vecs[shard].push_back(blobs.back().get());
+      }
+      layers.push_back(
+          shared_ptr<DataLayer<Dtype> >(new DataLayer<Dtype>(param)));
+      layers.back()->SetUp(blob_bottom_vec_, top_vecs[shard]);
+    }
+    for (int iter = 0; iter < 10; ++iter) {
+      std::set<int> labels;
+      for (int shard = 0; shard < num_shards; ++shard) {
+        layers[shard]->Forward(blob_bottom_vec_, top_vecs[shard]);
+        for (int i = 0; i < batch_size; ++i) {
+          const int label = top_vecs[shard][1]->cpu_data()[i];
+          EXPECT_EQ(((iter * num_shards + shard) * batch_size + i) % 5, label)
+              << "debug: iter " << iter << " shard " << shard << " i " << i;
+          labels.insert(label);
+        }
+      }
+      // No two shards read the same record.
+      EXPECT_EQ(num_shards * batch_size, static_cast<int>(labels.size()));
+    }
+  }
+
   void TestReshape(DataParameter_DB backend) {
     const int num_inputs = 5;
     // Save data of varying shapes.
@@ -335,6 +398,157 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     }
   }
 
+  void TestCacheSamples(bool spill) {
+    const Dtype scale = 3;
+    const int batch_size = 3;
+    LayerParameter param;
+    param.set_phase(TEST);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(batch_size);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_cache_samples(true);
+    string cache_file;
+    if (spill) {
+      MakeTempDir(&cache_file);
+      cache_file += "/cache";
+      data_param->set_cache_file(cache_file);
+    }
+    param.mutable_transform_param()->set_scale(scale);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    // Batches of 3 out of 5 records straddle the epochs, and the cache is
+    // complete in the middle of the second batch.
+    for (int iter = 0; iter < 20; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      for (int i = 0; i < batch_size; ++i) {
+        const int record = (iter * batch_size + i) % 5;
+        EXPECT_EQ(record, blob_top_label_->cpu_data()[i]);
+        for (int j = 0; j < 24; ++j) {
+          EXPECT_EQ(scale * record, blob_top_data_->cpu_data()[i * 24 + j])
+              << "debug: iter " << iter << " i " << i << " j " << j;
+        }
+      }
+    }
+    if (spill) {
+      db::PackedDB cache_db;
+      cache_db.Open(cache_file, db::READ);
+      EXPECT_EQ(5u, cache_db.num_records());
+    }
+  }
+
+  void TestEcho() {
+    const int echo_factor = 2;
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(3);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_echo_factor(echo_factor);
+    param.mutable_transform_param()->set_mirror(true);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    int num_mirrored = 0;
+    for (int iter = 0; iter < 20; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      // Each batch comes echo_factor times before the db moves on.
+      const int batch = iter / echo_factor;
+      for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ((batch * 3 + i) % 5, blob_top_label_->cpu_data()[i]);
+        // Pixels hold their index within the image, so every row of a
+        // sample is either in order or reversed.
+        const Dtype* data = blob_top_data_->cpu_data() + i * 24;
+        const bool mirrored = data[0] != 0;
+        num_mirrored += mirrored;
+        for (int row = 0; row < 6; ++row) {
+          for (int w = 0; w < 4; ++w) {
+            EXPECT_EQ(row * 4 + (mirrored ? 3 - w : w), data[row * 4 + w]);
+          }
+        }
+      }
+    }
+    EXPECT_GT(num_mirrored, 0);
+    EXPECT_LT(num_mirrored, 60);
+  }
+
+  // Even records are 3 or 4 rows high, odd ones 7, and every pixel holds
+  // the label.
+  static int BucketedHeight(int label) {
+    return label % 2 ? 7 : 3 + (label / 2) % 2;
+  }
+
+  void FillBucketed() {
+    backend_ = DataParameter_DB_PACKED;
+    scoped_ptr<db::DB> db(db::GetDB(backend_));
+    db->Open(*filename_, db::NEW);
+    scoped_ptr<db::Transaction> txn(db->NewTransaction());
+    for (int i = 0; i < 8; ++i) {
+      Datum datum;
+      datum.set_label(i);
+      datum.set_channels(1);
+      datum.set_height(BucketedHeight(i));
+      datum.set_width(4);
+      datum.mutable_data()->assign(BucketedHeight(i) * 4,
+          static_cast<char>(i));
+      stringstream ss;
+      ss << i;
+      string out;
+      CHECK(datum.SerializeToString(&out));
+      txn->Put(ss.str(), out);
+    }
+    txn->Commit();
+    db->Close();
+  }
+
+  void TestBucketed() {
+    const int batch_size = 2;
+    const Dtype pad_value = -1;
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(batch_size);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_bucket_window(2);
+    data_param->set_bucket_step(4);
+    data_param->set_bucket_pad_value(pad_value);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    vector<int> seen(8, 0);
+    for (int iter = 0; iter < 16; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      EXPECT_EQ(batch_size, blob_top_data_->num());
+      EXPECT_EQ(4, blob_top_data_->width());
+      // Short and tall records never share a batch, and the batch is as
+      // high as its highest image.
+      const int first = blob_top_label_->cpu_data()[0];
+      int max_height = 0;
+      for (int i = 0; i < batch_size; ++i) {
+        const int label = blob_top_label_->cpu_data()[i];
+        EXPECT_EQ(first % 2, label % 2);
+        max_height = std::max(max_height, BucketedHeight(label));
+        ++seen[label];
+      }
+      ASSERT_EQ(max_height, blob_top_data_->height());
+      for (int i = 0; i < batch_size; ++i) {
+        const int label = blob_top_label_->cpu_data()[i];
+        for (int h = 0; h < max_height; ++h) {
+          for (int w = 0; w < 4; ++w) {
+            EXPECT_EQ(h < BucketedHeight(label) ? label : pad_value,
+                blob_top_data_->data_at(i, 0, h, w));
+          }
+        }
+      }
+    }
+    for (int i = 0; i < 8; ++i) {
+      EXPECT_GE(seen[i], 3) << "record " << i;
+    }
+  }
+
   virtual ~DataLayerTest() { delete blob_top_data_; delete blob_top_label_; }
 
   DataParameter_DB backend_;
@@ -424,4 +638,45 @@ TYPED_TEST(DataLayerTest, TestReadCropTestLMDB) {
   this->TestReadCrop(TEST);
 }
 
+TYPED_TEST(DataLayerTest, TestReadPacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestRead();
+}
+
+TYPED_TEST(DataLayerTest, TestSkipPacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestSkip();
+}
+
+TYPED_TEST(DataLayerTest, TestShardsPacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestShards();
+}
+
+TYPED_TEST(DataLayerTest, TestCacheSamplesPacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestCacheSamples(false);
+}
+
+TYPED_TEST(DataLayerTest, TestCacheSamplesSpillPacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestCacheSamples(true);
+}
+
+TYPED_TEST(DataLayerTest, TestEchoMirrorPacked) {
+  const bool unique_pixels = true;  // all images the same; pixels different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestEcho();
+}
+
+TYPED_TEST(DataLayerTest, TestBucketedBatchesPacked) {
+  this->FillBucketed();
+  this->TestBucketed();
+}
+
 }  // namespace caffe
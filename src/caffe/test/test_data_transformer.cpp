@@ -3,6 +3,7 @@
 
 #include "gtest/gtest.h"
 #include "leveldb/db.h"
+#include "opencv2/core/core.hpp"
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
@@ -352,4 +353,147 @@ TYPED_TEST(DataTransformTest, TestMeanFile) {
   }
 }
 
+TYPED_TEST(DataTransformTest, TestMirrorMeanValuesWide) {
+  // Rows wider than one vector step exercise both the vectorized body and
+  // the scalar tail of the row kernel.
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;  // pixels are consecutive ints [0,size]
+  const int label = 0;
+  const int channels = 3;
+  const int height = 2;
+  const int width = 37;
+  const TypeParam scale = 0.5;
+
+  transform_param.set_mirror(true);
+  transform_param.set_scale(scale);
+  transform_param.add_mean_value(1);
+  transform_param.add_mean_value(2);
+  transform_param.add_mean_value(3);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  Blob<TypeParam>* blob = new Blob<TypeParam>(1, channels, height, width);
+  DataTransformer<TypeParam>* transformer =
+      new DataTransformer<TypeParam>(transform_param, TRAIN);
+  Caffe::set_random_seed(this->seed_);
+  transformer->InitRand();
+  for (int iter = 0; iter < this->num_iter_; ++iter) {
+    transformer->Transform(datum, blob);
+    const TypeParam* data = blob->cpu_data();
+    // The whole image is either mirrored or not.
+    const bool mirrored = data[0] != (0 - 1) * scale;
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < height; ++h) {
+        for (int w = 0; w < width; ++w) {
+          const int pixel = static_cast<uint8_t>(
+              (c * height + h) * width + (mirrored ? width - 1 - w : w));
+          EXPECT_EQ(data[blob->offset(0, c, h, w)], (pixel - (c + 1)) * scale);
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestPackedValues) {
+  TransformationParameter transform_param;
+  transform_param.set_crop_size(3);
+  transform_param.add_mean_value(2);
+  transform_param.set_scale(0.5);
+  const int channels = 2;
+  const int height = 4;
+  const int width = 5;
+  const int size = channels * height * width;
+  // Halves of small integers survive float16 exactly.
+  vector<float> values(size);
+  Datum float_datum;
+  float_datum.set_channels(channels);
+  float_datum.set_height(height);
+  float_datum.set_width(width);
+  for (int j = 0; j < size; ++j) {
+    values[j] = j * 0.5f - 3;
+    float_datum.add_float_data(values[j]);
+  }
+  DataTransformer<TypeParam> transformer(transform_param, TEST);
+  transformer.InitRand();
+  Blob<TypeParam> expected(1, channels, 3, 3);
+  transformer.Transform(float_datum, &expected);
+  for (int type = Datum_DataType_FLOAT16; type <= Datum_DataType_FLOAT32;
+       ++type) {
+    Datum datum = float_datum;
+    FloatsToDatum(&values[0], size, static_cast<Datum_DataType>(type),
+        &datum);
+    Blob<TypeParam> blob(1, channels, 3, 3);
+    transformer.Transform(datum, &blob);
+    for (int j = 0; j < blob.count(); ++j) {
+      EXPECT_EQ(expected.cpu_data()[j], blob.cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestMatMatchesScalarPath) {
+  // A uint8 cv::Mat goes through the vectorized row kernel, while a Datum
+  // holding float_data takes the scalar loop; both must agree exactly.
+  const int channels = 3;
+  const int height = 24;
+  const int width = 37;
+  const int crop_size = 21;
+  const int size = channels * height * width;
+  cv::Mat cv_img(height, width, CV_8UC3);
+  Datum datum;
+  datum.set_channels(channels);
+  datum.set_height(height);
+  datum.set_width(width);
+  for (int c = 0; c < channels; ++c) {
+    for (int h = 0; h < height; ++h) {
+      for (int w = 0; w < width; ++w) {
+        const uint8_t pixel = static_cast<uint8_t>((h * 31 + w * 7 + c) * 5);
+        cv_img.ptr<uint8_t>(h)[w * channels + c] = pixel;
+        datum.add_float_data(pixel);
+      }
+    }
+  }
+  string mean_file;
+  MakeTempFilename(&mean_file);
+  BlobProto blob_mean;
+  blob_mean.set_num(1);
+  blob_mean.set_channels(channels);
+  blob_mean.set_height(height);
+  blob_mean.set_width(width);
+  for (int j = 0; j < size; ++j) {
+    blob_mean.add_data((j % 11) * 1.5);
+  }
+  WriteProtoToBinaryFile(blob_mean, mean_file);
+
+  for (int config = 0; config < 4; ++config) {
+    TransformationParameter transform_param;
+    transform_param.set_crop_size(crop_size);
+    transform_param.set_scale(0.25);
+    transform_param.set_mirror(true);
+    if (config % 2 == 0) {
+      transform_param.add_mean_value(10);
+      transform_param.add_mean_value(20);
+      transform_param.add_mean_value(30);
+    } else {
+      transform_param.set_mean_file(mean_file);
+    }
+    const Phase phase = config < 2 ? TRAIN : TEST;
+    DataTransformer<TypeParam> mat_transformer(transform_param, phase);
+    DataTransformer<TypeParam> datum_transformer(transform_param, phase);
+    Blob<TypeParam> mat_blob(1, channels, crop_size, crop_size);
+    Blob<TypeParam> datum_blob(1, channels, crop_size, crop_size);
+    for (int iter = 0; iter < this->num_iter_; ++iter) {
+      // Same seed, so both draw the same mirror and crop.
+      Caffe::set_random_seed(this->seed_ + iter);
+      mat_transformer.InitRand();
+      mat_transformer.Transform(cv_img, &mat_blob);
+      Caffe::set_random_seed(this->seed_ + iter);
+      datum_transformer.InitRand();
+      datum_transformer.Transform(datum, &datum_blob);
+      for (int j = 0; j < mat_blob.count(); ++j) {
+        EXPECT_EQ(datum_blob.cpu_data()[j], mat_blob.cpu_data()[j])
+            << "config " << config << " iter " << iter << " index " << j;
+      }
+    }
+  }
+}
+
 }  // namespace caffe
@@ -56,8 +56,13 @@ struct TypeLMDB {
 };
 DataParameter_DB TypeLMDB::backend = DataParameter_DB_LMDB;
 
+struct TypePacked {
+  static DataParameter_DB backend;
+};
+DataParameter_DB TypePacked::backend = DataParameter_DB_PACKED;
+
 // typedef ::testing::Types<TypeLmdb> TestTypes;
-typedef ::testing::Types<TypeLevelDB, TypeLMDB> TestTypes;
+typedef ::testing::Types<TypeLevelDB, TypeLMDB, TypePacked> TestTypes;
 
 TYPED_TEST_CASE(DBTest, TestTypes);
 
@@ -131,4 +136,43 @@ TYPED_TEST(DBTest, TestWrite) {
   txn->Commit();
 }
 
+class PackedDBTest : public DBTest<TypePacked> {};
+
+TEST_F(PackedDBTest, TestSeek) {
+  db::PackedDB db;
+  db.Open(this->source_, db::READ);
+  EXPECT_EQ(db.num_records(), 2u);
+  scoped_ptr<db::PackedCursor> cursor(db.NewCursor());
+  EXPECT_EQ(cursor->size(), 2u);
+  cursor->Seek(1);
+  EXPECT_TRUE(cursor->valid());
+  EXPECT_EQ(cursor->key(), "fish-bike.jpg");
+  cursor->Seek(0);
+  EXPECT_TRUE(cursor->valid());
+  EXPECT_EQ(cursor->key(), "cat.jpg");
+  cursor->Seek(2);
+  EXPECT_FALSE(cursor->valid());
+}
+
+TEST_F(PackedDBTest, TestAppend) {
+  scoped_ptr<db::DB> db(db::GetDB("packed"));
+  db->Open(this->source_, db::WRITE);
+  scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  txn->Put("third", "value");
+  txn->Commit();
+  db->Close();
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  int count = 0;
+  string last_key, last_value;
+  for (; cursor->valid(); cursor->Next()) {
+    last_key = cursor->key();
+    last_value = cursor->value();
+    ++count;
+  }
+  EXPECT_EQ(count, 3);
+  EXPECT_EQ(last_key, "third");
+  EXPECT_EQ(last_value, "value");
+}
+
 }  // namespace caffe
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <utility>
 #include <vector>
@@ -10,6 +11,7 @@
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
+#include "caffe/util/io.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -23,12 +25,20 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
 
  protected:
   GradientBasedSolverTest() :
-      seed_(1701), num_(5), channels_(3), height_(10), width_(10) {}
+      seed_(1701), num_(5), channels_(3), height_(10), width_(10),
+      snapshot_(0), max_pending_snapshots_(1),
+      snapshot_format_(SolverParameter_SnapshotFormat_BINARYPROTO) {}
 
   shared_ptr<SGDSolver<Dtype> > solver_;
   int seed_;
   int num_, channels_, height_, width_;
-  Dtype delta_;  // Stability constant for AdaGrad.
+  // Snapshot every snapshot_ iterations to snapshot_prefix_, if positive.
+  int snapshot_, max_pending_snapshots_;
+  SolverParameter_SnapshotFormat snapshot_format_;
+  string snapshot_prefix_;
+  Dtype delta_;  // Stability constant for AdaGrad, Adam and RMSProp.
+  Dtype momentum2_;  // Decay of the second moment for Adam.
+  Dtype rms_decay_;  // Decay of the mean squared gradient for RMSProp.
 
   virtual SolverParameter_SolverType solver_type() = 0;
   virtual void InitSolver(const SolverParameter& param) = 0;
@@ -51,8 +61,11 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
         LOG(FATAL) << "Unknown Caffe mode: " << Caffe::mode();
     }
     InitSolver(param);
-    delta_ = (solver_type() == SolverParameter_SolverType_ADAGRAD) ?
-         param.delta() : 0;
+    delta_ = (solver_type() == SolverParameter_SolverType_SGD ||
+        solver_type() == SolverParameter_SolverType_NESTEROV) ?
+         0 : param.delta();
+    momentum2_ = param.momentum2();
+    rms_decay_ = param.rms_decay();
   }
 
   void RunLeastSquaresSolver(const Dtype learning_rate,
@@ -113,6 +126,13 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
     if (momentum != 0) {
       proto << "momentum: " << momentum << " ";
     }
+    if (snapshot_ > 0) {
+      proto << "snapshot: " << snapshot_ << " "
+            << "snapshot_prefix: '" << snapshot_prefix_ << "' "
+            << "max_pending_snapshots: " << max_pending_snapshots_ << " "
+            << "snapshot_format: "
+            << SolverParameter_SnapshotFormat_Name(snapshot_format_) << " ";
+    }
     Caffe::set_random_seed(this->seed_);
     this->InitSolverFromProtoString(proto.str());
     this->solver_->Solve();
@@ -189,7 +209,9 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
           ((i == D) ? bias.cpu_data()[0] : weights.cpu_data()[i]);
       // Finally, compute update.
       const vector<shared_ptr<Blob<Dtype> > >& history = solver_->history();
-      ASSERT_EQ(2, history.size());  // 1 blob for weights, 1 for bias
+      // 1 blob for weights, 1 for bias; Adam adds their second moments.
+      ASSERT_EQ(solver_type() == SolverParameter_SolverType_ADAM ? 4 : 2,
+                history.size());
       Dtype update_value = learning_rate * grad;
       const Dtype history_value = (i == D) ?
             history[1]->cpu_data()[0] : history[0]->cpu_data()[i];
@@ -206,6 +228,20 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
       case SolverParameter_SolverType_ADAGRAD:
         update_value /= std::sqrt(history_value + grad * grad) + delta_;
         break;
+      case SolverParameter_SolverType_RMSPROP:
+        update_value /= std::sqrt(rms_decay_ * history_value +
+            (1 - rms_decay_) * grad * grad) + delta_;
+        break;
+      case SolverParameter_SolverType_ADAM: {
+        const Dtype t = solver_->iter() + 1;
+        const Dtype m = momentum * history_value + (1 - momentum) * grad;
+        const Dtype v_history = (i == D) ?
+            history[3]->cpu_data()[0] : history[2]->cpu_data()[i];
+        const Dtype v = momentum2_ * v_history + (1 - momentum2_) * grad * grad;
+        update_value = learning_rate * std::sqrt(1 - pow(momentum2_, t)) /
+            (1 - pow(momentum, t)) * m / (std::sqrt(v) + delta_);
+        break;
+      }
       default:
         LOG(FATAL) << "Unknown solver type: " << solver_type();
       }
@@ -322,6 +358,62 @@ class SGDSolverTest : public GradientBasedSolverTest<TypeParam> {
 
 TYPED_TEST_CASE(SGDSolverTest, TestDtypesAndDevices);
 
+TYPED_TEST(SGDSolverTest, TestSnapshotRestore) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  // Both with the snapshots written on the solver's thread and in the
+  // background, in both formats.
+  for (int i = 0; i < 6; ++i) {
+    const int max_pending = i % 3;
+    const bool raw = i >= 3;
+    MakeTempFilename(&this->snapshot_prefix_);
+    this->snapshot_ = 2;
+    this->max_pending_snapshots_ = max_pending;
+    this->snapshot_format_ = raw ? SolverParameter_SnapshotFormat_RAW :
+        SolverParameter_SnapshotFormat_BINARYPROTO;
+    this->RunLeastSquaresSolver(kLearningRate, 0, kMomentum, kNumIters);
+    vector<shared_ptr<Blob<Dtype> > > params, history;
+    const vector<shared_ptr<Blob<Dtype> > >& net_params =
+        this->solver_->net()->params();
+    for (int j = 0; j < net_params.size(); ++j) {
+      params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+      params[j]->CopyFrom(*net_params[j], false, true);
+      history.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+      history[j]->CopyFrom(*this->solver_->history()[j], false, true);
+    }
+    // A fresh solver restored from the last snapshot has the same params
+    // and history.
+    this->RunLeastSquaresSolver(kLearningRate, 0, kMomentum, 0);
+    const string state_file = this->snapshot_prefix_ + "_iter_4.solverstate";
+    this->solver_->Restore(state_file.c_str());
+    EXPECT_EQ(kNumIters, this->solver_->iter());
+    EXPECT_EQ(raw,
+        IsRawProtoFile(this->snapshot_prefix_ + "_iter_4.caffemodel"));
+    for (int j = 0; j < params.size(); ++j) {
+      const Blob<Dtype>& param = *this->solver_->net()->params()[j];
+      const Blob<Dtype>& param_history = *this->solver_->history()[j];
+      ASSERT_EQ(params[j]->count(), param.count());
+      // BlobProto holds floats, so doubles come back rounded unless the
+      // params were stored raw.
+      for (int k = 0; k < param.count(); ++k) {
+        const Dtype value = params[j]->cpu_data()[k];
+        EXPECT_EQ(raw ? value : static_cast<float>(value),
+                  param.cpu_data()[k]);
+        EXPECT_EQ(static_cast<float>(history[j]->cpu_data()[k]),
+                  param_history.cpu_data()[k]);
+      }
+    }
+    // Each file was renamed into place.
+    std::ifstream tmp_file((state_file + ".tmp").c_str());
+    EXPECT_FALSE(tmp_file.good());
+    std::ifstream first_state(
+        (this->snapshot_prefix_ + "_iter_2.solverstate").c_str());
+    EXPECT_TRUE(first_state.good());
+  }
+}
+
 TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdate) {
   this->TestLeastSquaresUpdate();
 }
@@ -482,4 +574,113 @@ TYPED_TEST(NesterovSolverTest, TestNesterovLeastSquaresUpdateWithEverything) {
   }
 }
 
+
+template <typename TypeParam>
+class RMSPropSolverTest : public GradientBasedSolverTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  virtual void InitSolver(const SolverParameter& param) {
+    this->solver_.reset(new RMSPropSolver<Dtype>(param));
+  }
+  virtual SolverParameter_SolverType solver_type() {
+    return SolverParameter_SolverType_RMSPROP;
+  }
+};
+
+TYPED_TEST_CASE(RMSPropSolverTest, TestDtypesAndDevices);
+
+TYPED_TEST(RMSPropSolverTest, TestRMSPropLeastSquaresUpdate) {
+  this->TestLeastSquaresUpdate();
+}
+
+TYPED_TEST(RMSPropSolverTest, TestRMSPropLeastSquaresUpdateWithWeightDecay) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 1.0;
+  const Dtype kWeightDecay = 0.5;
+  this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay);
+}
+
+TYPED_TEST(RMSPropSolverTest, TestRMSPropLeastSquaresUpdateWithEverything) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.1;
+  const Dtype kMomentum = 0.0;
+  const int kNumIters = 4;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+
+template <typename TypeParam>
+class AdamSolverTest : public GradientBasedSolverTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  virtual void InitSolver(const SolverParameter& param) {
+    this->solver_.reset(new AdamSolver<Dtype>(param));
+  }
+  virtual SolverParameter_SolverType solver_type() {
+    return SolverParameter_SolverType_ADAM;
+  }
+};
+
+TYPED_TEST_CASE(AdamSolverTest, TestDtypesAndDevices);
+
+TYPED_TEST(AdamSolverTest, TestAdamLeastSquaresUpdate) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.0;
+  const Dtype kMomentum = 0.9;
+  this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum);
+}
+
+TYPED_TEST(AdamSolverTest, TestAdamLeastSquaresUpdateWithWeightDecay) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum);
+}
+
+TYPED_TEST(AdamSolverTest, TestAdamLeastSquaresUpdateWithEverything) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.1;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(AdamSolverTest, TestAdamSnapshotRestore) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  MakeTempFilename(&this->snapshot_prefix_);
+  this->snapshot_ = 2;
+  this->RunLeastSquaresSolver(kLearningRate, 0, kMomentum, kNumIters);
+  vector<shared_ptr<Blob<Dtype> > > history;
+  for (int i = 0; i < this->solver_->history().size(); ++i) {
+    history.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    history[i]->CopyFrom(*this->solver_->history()[i], false, true);
+  }
+  // A fresh solver restored from the last snapshot has both moments back.
+  this->RunLeastSquaresSolver(kLearningRate, 0, kMomentum, 0);
+  this->solver_->Restore(
+      (this->snapshot_prefix_ + "_iter_4.solverstate").c_str());
+  ASSERT_EQ(history.size(), this->solver_->history().size());
+  for (int i = 0; i < history.size(); ++i) {
+    const Blob<Dtype>& moment = *this->solver_->history()[i];
+    ASSERT_EQ(history[i]->count(), moment.count());
+    for (int j = 0; j < moment.count(); ++j) {
+      EXPECT_EQ(static_cast<float>(history[i]->cpu_data()[j]),
+                moment.cpu_data()[j]);
+    }
+  }
+}
+
 }  // namespace caffe
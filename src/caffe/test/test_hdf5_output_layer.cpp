@@ -117,4 +117,60 @@ TYPED_TEST(HDF5OutputLayerTest, TestForward) {
       this->output_file_name_;
 }
 
+TYPED_TEST(HDF5OutputLayerTest, TestForwardAppendCompressed) {
+  typedef typename TypeParam::Dtype Dtype;
+  hid_t file_id = H5Fopen(this->input_file_name_.c_str(), H5F_ACC_RDONLY,
+                          H5P_DEFAULT);
+  ASSERT_GE(file_id, 0)<< "Failed to open HDF5 file" <<
+      this->input_file_name_;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4,
+                       this->blob_data_);
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4,
+                       this->blob_label_);
+  H5Fclose(file_id);
+  this->blob_bottom_vec_.push_back(this->blob_data_);
+  this->blob_bottom_vec_.push_back(this->blob_label_);
+
+  // Three batches appended through the writer thread into chunked, gzipped
+  // datasets whose chunks do not line up with the batches.
+  const int num_batches = 3;
+  LayerParameter param;
+  HDF5OutputParameter* hdf5_output_param =
+      param.mutable_hdf5_output_param();
+  hdf5_output_param->set_file_name(this->output_file_name_);
+  hdf5_output_param->set_chunk_rows(2);
+  hdf5_output_param->set_compression_level(1);
+  hdf5_output_param->set_queue_size(2);
+  {
+    HDF5OutputLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < num_batches; ++i) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    }
+  }
+  file_id = H5Fopen(this->output_file_name_.c_str(), H5F_ACC_RDONLY,
+                    H5P_DEFAULT);
+  ASSERT_GE(file_id, 0)<< "Failed to open HDF5 file" <<
+      this->output_file_name_;
+  Blob<Dtype> blob_data, blob_label;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4, &blob_data);
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4, &blob_label);
+  H5Fclose(file_id);
+  const int num = this->blob_data_->num();
+  ASSERT_EQ(num_batches * num, blob_data.num());
+  ASSERT_EQ(num_batches * num, blob_label.num());
+  const int data_dim = this->blob_data_->count() / num;
+  const int label_dim = this->blob_label_->count() / num;
+  for (int i = 0; i < num_batches; ++i) {
+    for (int j = 0; j < num * data_dim; ++j) {
+      EXPECT_EQ(this->blob_data_->cpu_data()[j],
+                blob_data.cpu_data()[i * num * data_dim + j]);
+    }
+    for (int j = 0; j < num * label_dim; ++j) {
+      EXPECT_EQ(this->blob_label_->cpu_data()[j],
+                blob_label.cpu_data()[i * num * label_dim + j]);
+    }
+  }
+}
+
 }  // namespace caffe
@@ -132,4 +132,37 @@ TYPED_TEST(HDF5DataLayerTest, TestRead) {
   }
 }
 
+TYPED_TEST(HDF5DataLayerTest, TestReadAcrossFiles) {
+  typedef typename TypeParam::Dtype Dtype;
+  // With 10 rows per file, batches of 3 straddle the file boundaries.
+  LayerParameter param;
+  param.add_top("data");
+  param.add_top("label");
+  param.add_top("label2");
+  HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+  const int batch_size = 3;
+  hdf5_data_param->set_batch_size(batch_size);
+  hdf5_data_param->set_source(*(this->filename));
+  HDF5DataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_data_->num(), batch_size);
+
+  const int num_rows = 10;
+  const int data_size = 8 * 6 * 5;
+  for (int iter = 0; iter < 15; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < batch_size; ++i) {
+      const int row = iter * batch_size + i;
+      const int file_offset = ((row / num_rows) % 2) ? 2400 : 0;
+      EXPECT_EQ(1 + row % num_rows, this->blob_top_label_->cpu_data()[i]);
+      EXPECT_EQ(2 + row % num_rows, this->blob_top_label2_->cpu_data()[i]);
+      for (int j = 0; j < data_size; ++j) {
+        EXPECT_EQ(file_offset + (row % num_rows) * data_size + j,
+            this->blob_top_data_->cpu_data()[i * data_size + j])
+            << "debug: iter " << iter << " i " << i << " j " << j;
+      }
+    }
+  }
+}
+
 }  // namespace caffe
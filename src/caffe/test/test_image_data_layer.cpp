@@ -115,6 +115,40 @@ TYPED_TEST(ImageDataLayerTest, TestResize) {
   }
 }
 
+TYPED_TEST(ImageDataLayerTest, TestReadParallelCached) {
+  typedef typename TypeParam::Dtype Dtype;
+  for (int encoded = 0; encoded < 2; ++encoded) {
+    LayerParameter param;
+    ImageDataParameter* image_data_param = param.mutable_image_data_param();
+    image_data_param->set_batch_size(5);
+    image_data_param->set_source(this->filename_.c_str());
+    image_data_param->set_new_height(64);
+    image_data_param->set_new_width(48);
+    image_data_param->set_shuffle(false);
+    ImageDataLayer<Dtype> reference_layer(param);
+    reference_layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    reference_layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    Blob<Dtype> reference;
+    reference.CopyFrom(*this->blob_top_data_, false, true);
+
+    image_data_param->set_num_readers(3);
+    image_data_param->set_cache_mb(1);
+    image_data_param->set_cache_encoded(encoded);
+    ImageDataLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    // The first pass fills the cache, the later ones read from it.
+    for (int iter = 0; iter < 3; ++iter) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ(i, this->blob_top_label_->cpu_data()[i]);
+      }
+      for (int i = 0; i < reference.count(); ++i) {
+        EXPECT_EQ(reference.cpu_data()[i], this->blob_top_data_->cpu_data()[i]);
+      }
+    }
+  }
+}
+
 TYPED_TEST(ImageDataLayerTest, TestReshape) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter param;
@@ -3,7 +3,9 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <limits>
 #include <string>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -419,4 +421,171 @@ TEST_F(IOTest, TestDecodeDatumToCVMatContentNative) {
   }
 }
 
+TEST_F(IOTest, TestDecodeDatumToCVMatReduced) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  Datum datum;
+  EXPECT_TRUE(ReadFileToDatum(filename, &datum));
+  cv::Mat cv_img = DecodeDatumToCVMat(datum, true, 100, 100);
+  EXPECT_EQ(cv_img.channels(), 3);
+#if defined(USE_LIBJPEG) || CV_MAJOR_VERSION >= 3
+  // 480x360 at 1/4 is 120x90, too small, so 1/2 is the smallest that fits.
+  EXPECT_EQ(cv_img.rows, 180);
+  EXPECT_EQ(cv_img.cols, 240);
+#else
+  EXPECT_EQ(cv_img.rows, 360);
+  EXPECT_EQ(cv_img.cols, 480);
+#endif
+}
+
+TEST_F(IOTest, TestDecodeDatumToCVMatNativeReducedGray) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat_gray.jpg";
+  Datum datum;
+  EXPECT_TRUE(ReadFileToDatum(filename, &datum));
+  cv::Mat cv_img = DecodeDatumToCVMatNative(datum, 40, 40);
+  EXPECT_EQ(cv_img.channels(), 1);
+  EXPECT_GE(cv_img.rows, 40);
+  EXPECT_GE(cv_img.cols, 40);
+#ifdef USE_LIBJPEG
+  EXPECT_EQ(cv_img.rows, 45);
+  EXPECT_EQ(cv_img.cols, 60);
+#endif
+}
+
+TEST_F(IOTest, TestReadImageToCVMatReducedResize) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  cv::Mat cv_img = ReadImageToCVMat(filename, 100, 200, true, 100, 200);
+  EXPECT_EQ(cv_img.channels(), 3);
+  EXPECT_EQ(cv_img.rows, 100);
+  EXPECT_EQ(cv_img.cols, 200);
+}
+
+TEST_F(IOTest, TestFloatsToDatumFloat32) {
+  const float values[] = {0.f, 1.f, -2.5f, 3.14159f, 1e-30f, -1e30f};
+  const int count = sizeof(values) / sizeof(values[0]);
+  Datum datum;
+  datum.add_float_data(7.f);
+  FloatsToDatum(values, count, Datum_DataType_FLOAT32, &datum);
+  EXPECT_EQ(0, datum.float_data_size());
+  EXPECT_EQ(count * sizeof(float), datum.data().size());
+  EXPECT_EQ(count, DatumValueCount(datum));
+  vector<float> decoded(count);
+  DatumToValues(datum, 0, count, &decoded[0]);
+  for (int i = 0; i < count; ++i) {
+    EXPECT_EQ(values[i], decoded[i]);
+  }
+}
+
+TEST_F(IOTest, TestFloatsToDatumFloat16) {
+  const float inf = std::numeric_limits<float>::infinity();
+  // exactly representable: zero, normals, the largest half, a denormal
+  const float exact[] = {0.f, 1.f, -2.5f, 65504.f, 0.00006103515625f,
+      -0.000000059604644775390625f, inf};
+  const int count = sizeof(exact) / sizeof(exact[0]);
+  Datum datum;
+  FloatsToDatum(exact, count, Datum_DataType_FLOAT16, &datum);
+  EXPECT_EQ(count * 2u, datum.data().size());
+  EXPECT_EQ(count, DatumValueCount(datum));
+  vector<double> decoded(count);
+  DatumToValues(datum, 0, count, &decoded[0]);
+  for (int i = 0; i < count; ++i) {
+    EXPECT_EQ(exact[i], decoded[i]);
+  }
+  // rounded to nearest, within half a unit in the last place; overflow and
+  // underflow go to infinity and zero
+  const float rounded[] = {0.1f, 3.14159f, -1000.3f, 1e-6f, 70000.f, 1e-9f};
+  FloatsToDatum(rounded, 6, Datum_DataType_FLOAT16, &datum);
+  DatumToValues(datum, 0, 6, &decoded[0]);
+  EXPECT_NEAR(0.1, decoded[0], 0.1 / 2048);
+  EXPECT_NEAR(3.14159, decoded[1], 3.14159 / 2048);
+  EXPECT_NEAR(-1000.3, decoded[2], 1000.3 / 2048);
+  EXPECT_NEAR(1e-6, decoded[3], 0.0000000298);
+  EXPECT_EQ(inf, decoded[4]);
+  EXPECT_EQ(0, decoded[5]);
+  // a part of the values
+  DatumToValues(datum, 1, 2, &decoded[0]);
+  EXPECT_NEAR(3.14159, decoded[0], 3.14159 / 2048);
+}
+
+TEST_F(IOTest, TestNetParamsRawRoundTrip) {
+  NetParameter param;
+  param.set_name("raw");
+  LayerParameter* layer = param.add_layer();
+  layer->set_name("ip");
+  layer->set_type("InnerProduct");
+  BlobProto* weights = layer->add_blobs();
+  weights->mutable_shape()->add_dim(2);
+  weights->mutable_shape()->add_dim(3);
+  for (int i = 0; i < 6; ++i) {
+    weights->add_data(i * 0.5f - 1.f);
+    weights->add_diff(i);
+  }
+  BlobProto* bias = layer->add_blobs();
+  bias->mutable_shape()->add_dim(2);
+  bias->add_data(7.f);
+  bias->add_data(-7.f);
+  string filename;
+  MakeTempFilename(&filename);
+  WriteNetParamsToRawFile(param, filename);
+  EXPECT_TRUE(IsRawProtoFile(filename));
+
+  NetParameter header;
+  {
+    // The payloads are aligned in the file, and the blobs load from them.
+    RawProtoFile file(filename, &header);
+    const BlobProto& raw_weights = header.layer(0).blobs(0);
+    EXPECT_EQ(0, raw_weights.data_size());
+    EXPECT_EQ(0, raw_weights.raw_data_offset() % kRawPayloadAlignment);
+    EXPECT_EQ(0, raw_weights.raw_diff_offset() % kRawPayloadAlignment);
+    EXPECT_EQ(0, header.layer(0).blobs(1).raw_data_offset() %
+        kRawPayloadAlignment);
+    Blob<double> blob;
+    BlobFromRawProto(raw_weights, file, true, &blob);
+    ASSERT_EQ(6, blob.count());
+    EXPECT_EQ(3, blob.shape(1));
+    for (int i = 0; i < 6; ++i) {
+      EXPECT_EQ(weights->data(i), blob.cpu_data()[i]);
+      EXPECT_EQ(weights->diff(i), blob.cpu_diff()[i]);
+    }
+  }
+
+  NetParameter read_param;
+  ReadNetParamsFromRawFile(filename, &read_param);
+  EXPECT_EQ(param.DebugString(), read_param.DebugString());
+}
+
+TEST_F(IOTest, TestNetParamsRawLegacyDims) {
+  // Blobs of upgraded V0/V1 models only have the deprecated 4D dimensions.
+  NetParameter param;
+  LayerParameter* layer = param.add_layer();
+  layer->set_name("conv");
+  BlobProto* weights = layer->add_blobs();
+  weights->set_num(2);
+  weights->set_channels(1);
+  weights->set_height(2);
+  weights->set_width(3);
+  for (int i = 0; i < 12; ++i) {
+    weights->add_data(i - 4.f);
+  }
+  string filename;
+  MakeTempFilename(&filename);
+  WriteNetParamsToRawFile(param, filename);
+
+  NetParameter header;
+  {
+    RawProtoFile file(filename, &header);
+    Blob<float> blob;
+    BlobFromRawProto(header.layer(0).blobs(0), file, true, &blob);
+    ASSERT_EQ(12, blob.count());
+    EXPECT_EQ(2, blob.num());
+    EXPECT_EQ(3, blob.width());
+    for (int i = 0; i < 12; ++i) {
+      EXPECT_EQ(weights->data(i), blob.cpu_data()[i]);
+    }
+  }
+
+  NetParameter read_param;
+  ReadNetParamsFromRawFile(filename, &read_param);
+  EXPECT_EQ(param.DebugString(), read_param.DebugString());
+}
+
 }  // namespace caffe
@@ -0,0 +1,50 @@
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/lru_cache.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class LRUCacheTest : public ::testing::Test {};
+
+TEST_F(LRUCacheTest, TestGetPut) {
+  LRUCache<string> cache(100);
+  string value;
+  EXPECT_FALSE(cache.Get("a", &value));
+  cache.Put("a", "apple", 5);
+  EXPECT_TRUE(cache.Get("a", &value));
+  EXPECT_EQ("apple", value);
+  cache.Put("a", "avocado", 7);
+  EXPECT_TRUE(cache.Get("a", &value));
+  EXPECT_EQ("avocado", value);
+  EXPECT_EQ(1u, cache.count());
+  EXPECT_EQ(7u, cache.size_bytes());
+  EXPECT_EQ(2u, cache.hits());
+  EXPECT_EQ(1u, cache.misses());
+}
+
+TEST_F(LRUCacheTest, TestEviction) {
+  LRUCache<int> cache(30);
+  cache.Put("a", 1, 10);
+  cache.Put("b", 2, 10);
+  cache.Put("c", 3, 10);
+  int value;
+  // Touch "a" so that "b" is the least recently used.
+  EXPECT_TRUE(cache.Get("a", &value));
+  cache.Put("d", 4, 10);
+  EXPECT_FALSE(cache.Get("b", &value));
+  EXPECT_TRUE(cache.Get("a", &value));
+  EXPECT_TRUE(cache.Get("c", &value));
+  EXPECT_TRUE(cache.Get("d", &value));
+  EXPECT_EQ(30u, cache.size_bytes());
+  // An entry larger than the whole budget is not kept.
+  cache.Put("e", 5, 31);
+  EXPECT_FALSE(cache.Get("e", &value));
+  EXPECT_EQ(3u, cache.count());
+}
+
+}  // namespace caffe
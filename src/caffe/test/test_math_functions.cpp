@@ -3,6 +3,7 @@
 #include <climits>
 #include <cmath>  // for std::fabs
 #include <cstdlib>  // for rand_r
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -144,6 +145,66 @@ TYPED_TEST(MathFunctionsTest, TestCopyCPU) {
   }
 }
 
+TYPED_TEST(MathFunctionsTest, TestSgdUpdateCPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.1, momentum = 0.9, l2_decay = 0.01;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  caffe_copy(n, diff, this->blob_top_->mutable_cpu_diff());
+  TypeParam* history = this->blob_top_->mutable_cpu_diff();
+  vector<TypeParam> data(this->blob_bottom_->cpu_data(),
+      this->blob_bottom_->cpu_data() + n);
+  caffe_cpu_sgd_update<TypeParam>(n, rate, momentum, l2_decay, 0, diff,
+      history, &data[0]);
+  const TypeParam* w = this->blob_bottom_->cpu_data();
+  for (int i = 0; i < n; ++i) {
+    const TypeParam h = momentum * diff[i] + rate * (diff[i] + l2_decay * w[i]);
+    EXPECT_NEAR(h, history[i], 1e-5);
+    EXPECT_NEAR(w[i] - h, data[i], 1e-5);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestNesterovUpdateCPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.1, momentum = 0.9, l2_decay = 0.01,
+      l1_decay = 0.001;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  caffe_cpu_scale(n, TypeParam(0.5), diff, this->blob_top_->mutable_cpu_diff());
+  TypeParam* history = this->blob_top_->mutable_cpu_diff();
+  const vector<TypeParam> history_prev(history, history + n);
+  vector<TypeParam> data(this->blob_bottom_->cpu_data(),
+      this->blob_bottom_->cpu_data() + n);
+  caffe_cpu_nesterov_update<TypeParam>(n, rate, momentum, l2_decay, l1_decay,
+      diff, history, &data[0]);
+  const TypeParam* w = this->blob_bottom_->cpu_data();
+  for (int i = 0; i < n; ++i) {
+    const TypeParam g = diff[i] + l2_decay * w[i] +
+        l1_decay * (w[i] > 0 ? 1 : -1);
+    const TypeParam h = momentum * history_prev[i] + rate * g;
+    EXPECT_NEAR(h, history[i], 1e-5);
+    EXPECT_NEAR(w[i] - ((1 + momentum) * h - momentum * history_prev[i]),
+        data[i], 1e-5);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestAdaGradUpdateCPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.1, delta = 1e-8, l1_decay = 0.01;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  TypeParam* history = this->blob_top_->mutable_cpu_diff();
+  caffe_set(n, TypeParam(1), history);
+  vector<TypeParam> data(this->blob_bottom_->cpu_data(),
+      this->blob_bottom_->cpu_data() + n);
+  caffe_cpu_adagrad_update<TypeParam>(n, rate, delta, 0, l1_decay, diff,
+      history, &data[0]);
+  const TypeParam* w = this->blob_bottom_->cpu_data();
+  for (int i = 0; i < n; ++i) {
+    const TypeParam g = diff[i] + l1_decay * (w[i] > 0 ? 1 : -1);
+    EXPECT_NEAR(1 + g * g, history[i], 1e-5);
+    EXPECT_NEAR(w[i] - rate * g / (std::sqrt(1 + g * g) + delta), data[i],
+        1e-5);
+  }
+}
+
 #ifndef CPU_ONLY
 
 // TODO: Fix caffe_gpu_hamming_distance and re-enable this test.
@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 
+#include "boost/thread.hpp"
+
 #include "caffe/data_layers.hpp"
 #include "caffe/filler.hpp"
 
@@ -10,6 +12,42 @@
 
 namespace caffe {
 
+// Pushes every batch of data and labels into the layer's ring.
+template <typename Dtype>
+void PushBatches(MemoryDataLayer<Dtype>* layer, const Blob<Dtype>* data,
+    const Blob<Dtype>* labels, int batch_size) {
+  const int batch_count = data->offset(1) * batch_size;
+  for (int i = 0; i < data->num() / batch_size; ++i) {
+    CHECK(layer->PushBatch(data->cpu_data() + batch_count * i,
+                           labels->cpu_data() + batch_size * i));
+  }
+}
+
+// Waits, then pushes one batch of data and labels into the layer's ring.
+template <typename Dtype>
+void PushBatchAfter(MemoryDataLayer<Dtype>* layer, const Dtype* data,
+    const Dtype* labels, int delay_ms) {
+  boost::this_thread::sleep(boost::posix_time::milliseconds(delay_ms));
+  CHECK(layer->PushBatch(data, labels));
+}
+
+// Pushes the batches first_batch, first_batch + step, ... of mats, with
+// each label the index of its mat, into the layer's ring.
+template <typename Dtype>
+void PushMatBatches(MemoryDataLayer<Dtype>* layer,
+    const vector<cv::Mat>* mat_vector, int first_batch, int step) {
+  const int batch_size = layer->batch_size();
+  for (int i = first_batch; i * batch_size < mat_vector->size(); i += step) {
+    vector<cv::Mat> batch(mat_vector->begin() + i * batch_size,
+                          mat_vector->begin() + (i + 1) * batch_size);
+    vector<int> labels(batch_size);
+    for (int j = 0; j < batch_size; ++j) {
+      labels[j] = i * batch_size + j;
+    }
+    CHECK(layer->PushMatBatch(batch, labels));
+  }
+}
+
 template <typename TypeParam>
 class MemoryDataLayerTest : public MultiDeviceTest<TypeParam> {
   typedef typename TypeParam::Dtype Dtype;
@@ -293,4 +331,174 @@ TYPED_TEST(MemoryDataLayerTest, TestSetBatchSize) {
   }
 }
 
+TYPED_TEST(MemoryDataLayerTest, TestRingPushForward) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  memory_data_param->set_ring_size(2);
+  MemoryDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // A producer thread pushes every batch while the test consumes them; with
+  // only two slots it has to wait for Forward to hand slots back.
+  boost::thread producer(&PushBatches<Dtype>, &layer, this->data_,
+      this->labels_, this->batch_size_);
+  const int batch_count = this->data_->offset(1) * this->batch_size_;
+  for (int batch_num = 0; batch_num < this->batches_; ++batch_num) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    ASSERT_EQ(this->batch_size_, this->data_blob_->num());
+    for (int j = 0; j < this->data_blob_->count(); ++j) {
+      EXPECT_EQ(this->data_->cpu_data()[batch_count * batch_num + j],
+                this->data_blob_->cpu_data()[j]);
+    }
+    for (int j = 0; j < this->label_blob_->count(); ++j) {
+      EXPECT_EQ(this->labels_->cpu_data()[this->batch_size_ * batch_num + j],
+                this->label_blob_->cpu_data()[j]);
+    }
+  }
+  producer.join();
+  typename MemoryDataLayer<Dtype>::RingStats stats = layer.ring_stats();
+  EXPECT_EQ(this->batches_, stats.pushed);
+  EXPECT_EQ(this->batches_, stats.popped);
+  EXPECT_EQ(0, stats.timeouts);
+  EXPECT_EQ(0, layer.ready_batches());
+}
+
+TYPED_TEST(MemoryDataLayerTest, TestRingPushMatBatch) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  memory_data_param->set_ring_size(2);
+  MemoryDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const int num_mats = this->batch_size_ * this->batches_;
+  vector<cv::Mat> mat_vector(num_mats);
+  for (int i = 0; i < num_mats; ++i) {
+    mat_vector[i] = cv::Mat(this->height_, this->width_, CV_8UC4);
+    cv::randu(mat_vector[i], cv::Scalar::all(0), cv::Scalar::all(255));
+  }
+  // Two producer threads transform every other batch each; the batches come
+  // out in any order, so the labels tell which mats each one holds.
+  boost::thread producer0(&PushMatBatches<Dtype>, &layer, &mat_vector, 0, 2);
+  boost::thread producer1(&PushMatBatches<Dtype>, &layer, &mat_vector, 1, 2);
+  vector<bool> seen(num_mats, false);
+  const int count = this->channels_ * this->height_ * this->width_;
+  for (int batch_num = 0; batch_num < this->batches_; ++batch_num) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    ASSERT_EQ(this->batch_size_, this->data_blob_->num());
+    const Dtype* data = this->data_blob_->cpu_data();
+    for (int i = 0; i < this->batch_size_; ++i) {
+      const int mat_id = static_cast<int>(this->label_blob_->cpu_data()[i]);
+      ASSERT_GE(mat_id, 0);
+      ASSERT_LT(mat_id, num_mats);
+      EXPECT_FALSE(seen[mat_id]);
+      seen[mat_id] = true;
+      for (int h = 0; h < this->height_; ++h) {
+        const unsigned char* ptr_mat = mat_vector[mat_id].ptr<uchar>(h);
+        int index = 0;
+        for (int w = 0; w < this->width_; ++w) {
+          for (int c = 0; c < this->channels_; ++c) {
+            const int data_index =
+                (i * count) + (c * this->height_ + h) * this->width_ + w;
+            EXPECT_EQ(static_cast<Dtype>(ptr_mat[index++]),
+                      data[data_index]);
+          }
+        }
+      }
+    }
+  }
+  producer0.join();
+  producer1.join();
+  typename MemoryDataLayer<Dtype>::RingStats stats = layer.ring_stats();
+  EXPECT_EQ(this->batches_, stats.pushed);
+  EXPECT_EQ(this->batches_, stats.popped);
+  EXPECT_EQ(0, layer.ready_batches());
+}
+
+TYPED_TEST(MemoryDataLayerTest, TestRingTimeouts) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  memory_data_param->set_ring_size(2);
+  memory_data_param->set_pop_timeout_ms(10000);
+  MemoryDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Forward waits for a batch that arrives within its timeout.
+  const Dtype* data = this->data_->cpu_data();
+  const Dtype* labels = this->labels_->cpu_data();
+  boost::thread producer(&PushBatchAfter<Dtype>, &layer, data, labels, 50);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  producer.join();
+  EXPECT_EQ(this->batch_size_, this->data_blob_->num());
+  EXPECT_EQ(labels[0], this->label_blob_->cpu_data()[0]);
+  typename MemoryDataLayer<Dtype>::RingStats stats = layer.ring_stats();
+  EXPECT_EQ(1, stats.consumer_waits);
+  EXPECT_EQ(0, stats.timeouts);
+  // The net holds one slot until the next Forward, so once the other is
+  // full a push times out.
+  EXPECT_TRUE(layer.PushBatch(data, labels, 0));
+  EXPECT_FALSE(layer.PushBatch(data, labels, 1));
+  EXPECT_EQ(1, layer.ready_batches());
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->batch_size_, this->data_blob_->num());
+  stats = layer.ring_stats();
+  EXPECT_EQ(2, stats.pushed);
+  EXPECT_EQ(2, stats.popped);
+  EXPECT_EQ(1, stats.producer_waits);
+}
+
+TYPED_TEST(MemoryDataLayerTest, TestRingReuseOnTimeout) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  memory_data_param->set_ring_size(2);
+  memory_data_param->set_pop_timeout_ms(1);
+  memory_data_param->set_reuse_batch_on_timeout(true);
+  MemoryDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const int batch_count = this->data_->offset(1) * this->batch_size_;
+  const Dtype* data = this->data_->cpu_data();
+  const Dtype* labels = this->labels_->cpu_data();
+  EXPECT_TRUE(layer.PushBatch(data, labels));
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // With no new batch, Forward times out and serves the same one again.
+  for (int i = 0; i < 2; ++i) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int j = 0; j < this->data_blob_->count(); ++j) {
+      EXPECT_EQ(data[j], this->data_blob_->cpu_data()[j]);
+    }
+    EXPECT_EQ(labels[0], this->label_blob_->cpu_data()[0]);
+  }
+  typename MemoryDataLayer<Dtype>::RingStats stats = layer.ring_stats();
+  EXPECT_EQ(1, stats.popped);
+  EXPECT_EQ(2, stats.timeouts);
+  // The reused batch keeps its slot, and a new batch replaces it.
+  EXPECT_TRUE(layer.PushBatch(data + batch_count, labels + this->batch_size_,
+      0));
+  EXPECT_FALSE(layer.PushBatch(data, labels, 1));
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int j = 0; j < this->data_blob_->count(); ++j) {
+    EXPECT_EQ(data[batch_count + j], this->data_blob_->cpu_data()[j]);
+  }
+  EXPECT_TRUE(layer.PushBatch(data, labels, 0));
+  stats = layer.ring_stats();
+  EXPECT_EQ(2, stats.popped);
+  EXPECT_EQ(2, stats.timeouts);
+}
+
 }  // namespace caffe
@@ -8,7 +8,9 @@
 
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/layer_factory.hpp"
 #include "caffe/net.hpp"
+#include "caffe/neuron_layers.hpp"
 #include "caffe/util/math_functions.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -16,6 +18,42 @@
 
 namespace caffe {
 
+// Copies its bottom to its top, counting the calls to Reshape.
+template <typename Dtype>
+class ReshapeCountingLayer : public NeuronLayer<Dtype> {
+ public:
+  explicit ReshapeCountingLayer(const LayerParameter& param)
+      : NeuronLayer<Dtype>(param) {}
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    ++num_reshapes_;
+    NeuronLayer<Dtype>::Reshape(bottom, top);
+  }
+
+  virtual inline const char* type() const { return "ReshapeCounting"; }
+
+  static int num_reshapes_;
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    caffe_copy(bottom[0]->count(), bottom[0]->cpu_data(),
+        top[0]->mutable_cpu_data());
+  }
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    if (propagate_down[0]) {
+      caffe_copy(top[0]->count(), top[0]->cpu_diff(),
+          bottom[0]->mutable_cpu_diff());
+    }
+  }
+};
+
+template <typename Dtype>
+int ReshapeCountingLayer<Dtype>::num_reshapes_ = 0;
+
+REGISTER_LAYER_CLASS(ReshapeCounting);
+
 template <typename TypeParam>
 class NetTest : public MultiDeviceTest<TypeParam> {
   typedef typename TypeParam::Dtype Dtype;
@@ -1215,6 +1253,79 @@ TYPED_TEST(NetTest, TestParamPropagateDown) {
   }
 }
 
+TYPED_TEST(NetTest, TestClearParamDiffs) {
+  typedef typename TypeParam::Dtype Dtype;
+  const string& proto =
+      "name: 'FreshDiffNetwork' "
+      "layer { "
+      "  name: 'data' "
+      "  type: 'DummyData' "
+      "  dummy_data_param { "
+      "    shape { dim: 2 dim: 3 dim: 5 dim: 5 } "
+      "    shape { dim: 2 dim: 4 } "
+      "    data_filler { type: 'gaussian' } "
+      "  } "
+      "  top: 'data' "
+      "  top: 'target' "
+      "} "
+      "layer { "
+      "  name: 'conv' "
+      "  type: 'Convolution' "
+      "  convolution_param { "
+      "    num_output: 2 "
+      "    kernel_size: 3 "
+      "    weight_filler { type: 'gaussian' } "
+      "    bias_filler { type: 'gaussian' } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'conv' "
+      "} "
+      "layer { "
+      "  name: 'ip' "
+      "  type: 'InnerProduct' "
+      "  inner_product_param { "
+      "    num_output: 4 "
+      "    weight_filler { type: 'gaussian' } "
+      "    bias_filler { type: 'gaussian' } "
+      "  } "
+      "  param { lr_mult: 1 } "
+      "  param { lr_mult: 0 } "
+      "  bottom: 'conv' "
+      "  top: 'ip' "
+      "} "
+      "layer { "
+      "  name: 'loss' "
+      "  type: 'EuclideanLoss' "
+      "  bottom: 'ip' "
+      "  bottom: 'target' "
+      "} ";
+  this->InitNetFromProtoString(proto);
+  // Stale values in the diffs must not leak into the gradients, whether a
+  // layer overwrites the fresh diffs or does not compute them at all (the
+  // ip bias).
+  const vector<shared_ptr<Blob<Dtype> > >& params = this->net_->params();
+  for (int i = 0; i < params.size(); ++i) {
+    caffe_set(params[i]->count(), Dtype(7), params[i]->mutable_cpu_diff());
+  }
+  this->net_->ClearParamDiffs();
+  this->net_->ForwardPrefilled();
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > fresh_diffs;
+  for (int i = 0; i < params.size(); ++i) {
+    fresh_diffs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    fresh_diffs[i]->CopyFrom(*params[i], true, true);
+    caffe_set(params[i]->count(), Dtype(0), params[i]->mutable_cpu_diff());
+  }
+  this->net_->Backward();
+  for (int i = 0; i < params.size(); ++i) {
+    for (int j = 0; j < params[i]->count(); ++j) {
+      EXPECT_EQ(params[i]->cpu_diff()[j], fresh_diffs[i]->cpu_diff()[j])
+          << "param " << i << " index " << j;
+    }
+  }
+  EXPECT_EQ(0, caffe_cpu_asum(params[3]->count(), fresh_diffs[3]->cpu_diff()));
+}
+
 TYPED_TEST(NetTest, TestFromTo) {
   typedef typename TypeParam::Dtype Dtype;
   this->InitTinyNet();
@@ -1249,6 +1360,146 @@ TYPED_TEST(NetTest, TestFromTo) {
   }
 }
 
+TYPED_TEST(NetTest, TestRecompute) {
+  typedef typename TypeParam::Dtype Dtype;
+  // On GPU, dropout masks come from the device generator, which the net
+  // CHECKs a recomputed segment does not use.
+  const string dropout = Caffe::mode() == Caffe::GPU ? "" :
+      "layer { "
+      "  name: 'drop1' "
+      "  type: 'Dropout' "
+      "  bottom: 'ip1' "
+      "  top: 'ip1' "
+      "} ";
+  const string proto =
+      "name: 'RecomputeNetwork' "
+      "state { phase: TRAIN } "
+      "force_backward: true "
+      "layer { "
+      "  name: 'data' "
+      "  type: 'DummyData' "
+      "  dummy_data_param { "
+      "    shape { dim: 4 dim: 6 } "
+      "    shape { dim: 4 dim: 3 } "
+      "    data_filler { type: 'gaussian' } "
+      "  } "
+      "  top: 'data' "
+      "  top: 'target' "
+      "} "
+      "layer { "
+      "  name: 'ip1' "
+      "  type: 'InnerProduct' "
+      "  inner_product_param { "
+      "    num_output: 8 "
+      "    weight_filler { type: 'gaussian' } "
+      "    bias_filler { type: 'gaussian' } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'ip1' "
+      "} "
+      "layer { "
+      "  name: 'relu1' "
+      "  type: 'ReLU' "
+      "  bottom: 'ip1' "
+      "  top: 'ip1' "
+      "} " + dropout +
+      "layer { "
+      "  name: 'ip2' "
+      "  type: 'InnerProduct' "
+      "  inner_product_param { "
+      "    num_output: 5 "
+      "    weight_filler { type: 'gaussian' } "
+      "    bias_filler { type: 'gaussian' } "
+      "  } "
+      "  bottom: 'ip1' "
+      "  top: 'ip2' "
+      "} "
+      "layer { "
+      "  name: 'sig' "
+      "  type: 'Sigmoid' "
+      "  bottom: 'ip2' "
+      "  top: 'sig' "
+      "} "
+      "layer { "
+      "  name: 'ip3' "
+      "  type: 'InnerProduct' "
+      "  inner_product_param { "
+      "    num_output: 3 "
+      "    weight_filler { type: 'gaussian' } "
+      "    bias_filler { type: 'gaussian' } "
+      "  } "
+      "  bottom: 'sig' "
+      "  top: 'ip3' "
+      "} "
+      "layer { "
+      "  name: 'loss' "
+      "  type: 'EuclideanLoss' "
+      "  bottom: 'ip3' "
+      "  bottom: 'target' "
+      "  top: 'loss' "
+      "} ";
+  // Two iterations of the net keeping its activations.
+  vector<Dtype> losses;
+  vector<shared_ptr<Blob<Dtype> > > params, blobs;
+  Caffe::set_random_seed(this->seed_);
+  this->InitNetFromProtoString(proto);
+  for (int i = 0; i < 2; ++i) {
+    Dtype loss;
+    this->net_->ForwardPrefilled(&loss);
+    this->net_->Backward();
+    losses.push_back(loss);
+  }
+  this->CopyNetParams(true, &params);
+  this->CopyNetBlobs(true, &blobs);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitNetFromProtoString(proto +
+      "recompute { first_layer: 'ip1' last_layer: 'sig' } ");
+  ASSERT_EQ(1, this->net_->recompute_segments().size());
+  const Blob<Dtype>& ip1 = *this->net_->blob_by_name("ip1");
+  const Blob<Dtype>& ip2 = *this->net_->blob_by_name("ip2");
+  for (int i = 0; i < 2; ++i) {
+    Dtype loss;
+    this->net_->ForwardPrefilled(&loss);
+    EXPECT_EQ(losses[i], loss);
+    // Only the blobs no layer after the segment reads are released.
+    EXPECT_EQ(SyncedMemory::UNINITIALIZED, ip1.data()->head());
+    EXPECT_EQ(SyncedMemory::UNINITIALIZED, ip2.data()->head());
+    EXPECT_NE(SyncedMemory::UNINITIALIZED,
+              this->net_->blob_by_name("sig")->data()->head());
+    this->net_->Backward();
+    EXPECT_EQ(SyncedMemory::UNINITIALIZED, ip1.data()->head());
+    EXPECT_EQ(SyncedMemory::UNINITIALIZED, ip2.diff()->head());
+  }
+  const vector<shared_ptr<Blob<Dtype> > >& net_params =
+      this->net_->params();
+  ASSERT_EQ(params.size(), net_params.size());
+  for (int i = 0; i < net_params.size(); ++i) {
+    for (int j = 0; j < net_params[i]->count(); ++j) {
+      EXPECT_EQ(params[i]->cpu_diff()[j], net_params[i]->cpu_diff()[j])
+          << "param " << i << " index " << j;
+    }
+  }
+  const Blob<Dtype>& data = *this->net_->blob_by_name("data");
+  for (int j = 0; j < data.count(); ++j) {
+    EXPECT_EQ(blobs[0]->cpu_diff()[j], data.cpu_diff()[j]);
+  }
+  // Forward from inside the segment recomputes the layers before.
+  const Dtype* loss_ptr = this->net_->output_blobs()[0]->cpu_data();
+  const Dtype loss = *loss_ptr;
+  this->net_->ForwardFrom(this->net_->layers().size() - 3);
+  EXPECT_EQ(loss, *loss_ptr);
+  // So does a first forward from inside the segment, which saves the random
+  // state there for the later recomputes.
+  Caffe::set_random_seed(this->seed_);
+  this->InitNetFromProtoString(proto +
+      "recompute { first_layer: 'ip1' last_layer: 'sig' } ");
+  const int sig = this->net_->layers().size() - 3;
+  const Dtype first_loss = this->net_->ForwardFrom(sig);
+  this->net_->Backward();
+  EXPECT_EQ(first_loss, this->net_->ForwardFrom(sig));
+}
+
 class FilterNetTest : public ::testing::Test {
  protected:
   void RunFilterNetTest(
@@ -2166,6 +2417,65 @@ TEST_F(FilterNetTest, TestFilterInOutByExcludeMultiRule) {
   this->RunFilterNetTest(input_proto_test, output_proto_test);
 }
 
+TYPED_TEST(NetTest, TestReshapeOnlyIfNeeded) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Two layers read the flattened input through a Split.
+  const string& proto =
+      "name: 'ReshapeIfNeededNetwork' "
+      "input: 'data' "
+      "input_dim: 2 "
+      "input_dim: 3 "
+      "input_dim: 4 "
+      "input_dim: 5 "
+      "layer { "
+      "  name: 'flatten' "
+      "  type: 'Flatten' "
+      "  bottom: 'data' "
+      "  top: 'flat' "
+      "} "
+      "layer { "
+      "  name: 'count1' "
+      "  type: 'ReshapeCounting' "
+      "  bottom: 'flat' "
+      "  top: 'count1' "
+      "} "
+      "layer { "
+      "  name: 'count2' "
+      "  type: 'ReshapeCounting' "
+      "  bottom: 'flat' "
+      "  top: 'count2' "
+      "} ";
+  this->InitNetFromProtoString(proto);
+  ASSERT_EQ(4, this->net_->layers().size());
+  EXPECT_STREQ("Split", this->net_->layers()[1]->type());
+  int& num_reshapes = ReshapeCountingLayer<Dtype>::num_reshapes_;
+  num_reshapes = 0;
+  Blob<Dtype>* input_blob = this->net_->input_blobs()[0];
+  const Blob<Dtype>& count1 = *this->net_->blob_by_name("count1");
+  // Unchanged bottom shapes skip Reshape.
+  this->net_->ForwardPrefilled();
+  this->net_->ForwardPrefilled();
+  EXPECT_EQ(0, num_reshapes);
+  // So does an input reshape that the Flatten absorbs.
+  input_blob->Reshape(2, 3, 5, 4);
+  this->net_->ForwardPrefilled();
+  EXPECT_EQ(0, num_reshapes);
+  // A new batch size reaches both layers after the Split.
+  input_blob->Reshape(3, 3, 4, 5);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(input_blob);
+  this->net_->ForwardPrefilled();
+  EXPECT_EQ(2, num_reshapes);
+  ASSERT_EQ(3, count1.num());
+  EXPECT_EQ(60, count1.count(1));
+  for (int i = 0; i < input_blob->count(); ++i) {
+    EXPECT_EQ(input_blob->cpu_data()[i], count1.cpu_data()[i]);
+  }
+  this->net_->ForwardPrefilled();
+  EXPECT_EQ(2, num_reshapes);
+}
+
 TYPED_TEST(NetTest, TestReshape) {
   typedef typename TypeParam::Dtype Dtype;
   // We set up bottom blobs of two different sizes, switch between
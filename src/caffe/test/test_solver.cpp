@@ -1,13 +1,21 @@
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
+#include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "google/protobuf/text_format.h"
 #include "gtest/gtest.h"
 
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/transport.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -37,6 +45,44 @@ class SolverTest : public MultiDeviceTest<TypeParam> {
     solver_.reset(new SGDSolver<Dtype>(param));
   }
 
+  // Writes a packed db of num_records records of two values, each labelled
+  // with its position, and returns a net_param reading it in batches of
+  // batch_size.
+  string MakeDataNetProto(const int num_records, const int batch_size) {
+    string source;
+    MakeTempDir(&source);
+    source += "/db";
+    boost::scoped_ptr<db::DB> db(db::GetDB(DataParameter_DB_PACKED));
+    db->Open(source, db::NEW);
+    boost::scoped_ptr<db::Transaction> txn(db->NewTransaction());
+    for (int i = 0; i < num_records; ++i) {
+      Datum datum;
+      datum.set_label(i);
+      datum.set_channels(1);
+      datum.set_height(1);
+      datum.set_width(2);
+      datum.add_float_data(i);
+      datum.add_float_data(-i);
+      string out;
+      CHECK(datum.SerializeToString(&out));
+      txn->Put("", out);
+    }
+    txn->Commit();
+    db->Close();
+    ostringstream proto;
+    proto << "net_param { name: 'TestNetwork' "
+          << "  layer { name: 'data' type: 'Data' top: 'data' top: 'label' "
+          << "    data_param { source: '" << source << "' backend: PACKED "
+          << "      batch_size: " << batch_size << " } } "
+          << "  layer { name: 'innerprod' type: 'InnerProduct' "
+          << "    inner_product_param { num_output: " << num_records << " } "
+          << "    bottom: 'data' top: 'innerprod' } "
+          << "  layer { name: 'loss' type: 'SoftmaxWithLoss' "
+          << "    bottom: 'innerprod' bottom: 'label' } "
+          << "} ";
+    return proto.str();
+  }
+
   shared_ptr<Solver<Dtype> > solver_;
 };
 
@@ -105,4 +151,548 @@ TYPED_TEST(SolverTest, TestInitTrainTestNets) {
   EXPECT_TRUE(this->solver_->test_nets()[1]->has_layer("accuracy"));
 }
 
+TYPED_TEST(SolverTest, TestBackgroundTesting) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Background testing only runs in CPU mode; on GPU the test nets share
+  // the trained weights.
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  const string& proto =
+     "base_lr: 0.1 "
+     "lr_policy: 'fixed' "
+     "max_iter: 4 "
+     "snapshot_after_train: false "
+     "test_interval: 2 "
+     "test_threads: 2 "
+     "test_iter: 3 "
+     "test_state: {} "
+     "test_iter: 3 "
+     "test_state: {} "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 5 dim: 2 dim: 3 dim: 4 } "
+     "      shape { dim: 5 } "
+     "      data_filler { type: 'gaussian' } "
+     "      data_filler { type: 'constant' value: 1 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 10 "
+     "      weight_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->InitSolverFromProtoString(proto);
+  this->solver_->Solve();
+  // The last evaluation, after the final update, worked on copies of the
+  // trained weights.
+  const vector<shared_ptr<Blob<Dtype> > >& params =
+      this->solver_->net()->params();
+  for (int i = 0; i < this->solver_->test_nets().size(); ++i) {
+    const vector<shared_ptr<Blob<Dtype> > >& test_params =
+        this->solver_->test_nets()[i]->params();
+    ASSERT_EQ(params.size(), test_params.size());
+    for (int j = 0; j < params.size(); ++j) {
+      ASSERT_EQ(params[j]->count(), test_params[j]->count());
+      EXPECT_NE(params[j]->cpu_data(), test_params[j]->cpu_data());
+      for (int k = 0; k < params[j]->count(); ++k) {
+        EXPECT_EQ(params[j]->cpu_data()[k], test_params[j]->cpu_data()[k]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(SolverTest, TestDataParallelTraining) {
+  typedef typename TypeParam::Dtype Dtype;
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  // Splitting each batch over replicas trains the same weights as one net
+  // on the whole batch. The label feeds two layers, so the data layer is
+  // followed by a split.
+  const string& net_proto =
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 6 dim: 2 dim: 3 dim: 4 } "
+     "      shape { dim: 6 } "
+     "      data_filler { type: 'gaussian' } "
+     "      data_filler { type: 'constant' value: 1 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 10 "
+     "      weight_filler { type: 'gaussian' } "
+     "      bias_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'accuracy' "
+     "    type: 'Accuracy' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "    top: 'accuracy' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  vector<vector<Dtype> > trained_params;
+  const int train_threads[] = {1, 2, 3};
+  for (int i = 0; i < 3; ++i) {
+    ostringstream proto;
+    proto << "base_lr: 0.1 lr_policy: 'fixed' momentum: 0.9 max_iter: 5 "
+          << "iter_size: 2 random_seed: 1701 snapshot_after_train: false "
+          << "train_threads: " << train_threads[i] << " " << net_proto;
+    this->InitSolverFromProtoString(proto.str());
+    EXPECT_EQ(6, this->solver_->net()->blob_by_name("data")->num());
+    this->solver_->Solve();
+    const vector<shared_ptr<Blob<Dtype> > >& params =
+        this->solver_->net()->params();
+    vector<Dtype> values;
+    for (int j = 0; j < params.size(); ++j) {
+      values.insert(values.end(), params[j]->cpu_data(),
+          params[j]->cpu_data() + params[j]->count());
+    }
+    trained_params.push_back(values);
+  }
+  for (int i = 1; i < trained_params.size(); ++i) {
+    ASSERT_EQ(trained_params[0].size(), trained_params[i].size());
+    for (int j = 0; j < trained_params[0].size(); ++j) {
+      EXPECT_NEAR(trained_params[0][j], trained_params[i][j], 1e-4);
+    }
+  }
+}
+
+template <typename Dtype>
+static void SolveAsRank(Solver<Dtype>* solver, const string uri, int rank,
+    int num_ranks, const string resume_file) {
+  solver->set_transport(shared_ptr<Transport<Dtype> >(
+      GetTransport<Dtype>(uri, rank, num_ranks)));
+  solver->Solve(resume_file.empty() ? NULL : resume_file.c_str());
+}
+
+TYPED_TEST(SolverTest, TestMultiRankTraining) {
+  typedef typename TypeParam::Dtype Dtype;
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  // With the same data on every rank, the averaged diffs are those of each
+  // rank, and training matches a single solver's. Each solver resets the
+  // random generator to the same seed, so all start with the same weights.
+  const string& net_proto =
+     "random_seed: 1701 "
+     "base_lr: 0.1 "
+     "lr_policy: 'fixed' "
+     "momentum: 0.9 "
+     "max_iter: 4 "
+     "snapshot_after_train: false "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 4 dim: 2 dim: 3 dim: 4 } "
+     "      shape { dim: 4 } "
+     "      data_filler { type: 'constant' value: 0.5 } "
+     "      data_filler { type: 'constant' value: 1 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod1' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 5 "
+     "      weight_filler { type: 'gaussian' } "
+     "      bias_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod1' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod2' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 10 "
+     "      weight_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'innerprod1' "
+     "    top: 'innerprod2' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'innerprod2' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->InitSolverFromProtoString(net_proto);
+  this->solver_->Solve();
+  const vector<shared_ptr<Blob<Dtype> > >& params =
+      this->solver_->net()->params();
+  // One bucket per param, then buckets of several.
+  const int bucket_sizes[] = {8, 40};
+  const int num_ranks = 2;
+  for (int i = 0; i < 2; ++i) {
+    ostringstream proto;
+    proto << "gradient_bucket_size: " << bucket_sizes[i] << " " << net_proto;
+    SolverParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto.str(), &param));
+    param.set_solver_mode(SolverParameter_SolverMode_CPU);
+    vector<shared_ptr<Solver<Dtype> > > solvers;
+    for (int rank = 0; rank < num_ranks; ++rank) {
+      solvers.push_back(shared_ptr<Solver<Dtype> >(
+          new SGDSolver<Dtype>(param)));
+    }
+    ostringstream uri;
+    uri << "shm://caffe_test_solver_" << caffe_rng_rand() % 20000;
+    boost::thread_group threads;
+    for (int rank = 0; rank < num_ranks; ++rank) {
+      threads.create_thread(boost::bind(&SolveAsRank<Dtype>,
+          solvers[rank].get(), uri.str(), rank, num_ranks, string()));
+    }
+    threads.join_all();
+    for (int rank = 0; rank < num_ranks; ++rank) {
+      const vector<shared_ptr<Blob<Dtype> > >& rank_params =
+          solvers[rank]->net()->params();
+      ASSERT_EQ(params.size(), rank_params.size());
+      for (int j = 0; j < params.size(); ++j) {
+        for (int k = 0; k < params[j]->count(); ++k) {
+          EXPECT_NEAR(params[j]->cpu_data()[k], rank_params[j]->cpu_data()[k],
+              1e-5);
+        }
+      }
+    }
+  }
+  // Reading a db instead, rank r trains on batches r, r + 2, ..., so the
+  // ranks see different records.
+  const int batch_size = 2;
+  vector<shared_ptr<Solver<Dtype> > > solvers;
+  for (int rank = 0; rank < num_ranks; ++rank) {
+    ostringstream proto;
+    proto << "random_seed: 1701 base_lr: 0.1 lr_policy: 'fixed' max_iter: 2 "
+          << "snapshot_after_train: false data_shard: " << rank
+          << " num_data_shards: " << num_ranks << " "
+          << this->MakeDataNetProto(12, batch_size);
+    SolverParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto.str(), &param));
+    param.set_solver_mode(SolverParameter_SolverMode_CPU);
+    solvers.push_back(shared_ptr<Solver<Dtype> >(new SGDSolver<Dtype>(param)));
+  }
+  ostringstream uri;
+  uri << "shm://caffe_test_solver_" << caffe_rng_rand() % 20000;
+  boost::thread_group threads;
+  for (int rank = 0; rank < num_ranks; ++rank) {
+    threads.create_thread(boost::bind(&SolveAsRank<Dtype>,
+        solvers[rank].get(), uri.str(), rank, num_ranks, string()));
+  }
+  threads.join_all();
+  // After two iterations, the next batch of rank r is batch 4 + r.
+  std::set<int> labels;
+  for (int rank = 0; rank < num_ranks; ++rank) {
+    solvers[rank]->net()->ForwardTo(0);
+    const Dtype* label =
+        solvers[rank]->net()->blob_by_name("label")->cpu_data();
+    for (int i = 0; i < batch_size; ++i) {
+      EXPECT_EQ((2 * num_ranks + rank) * batch_size + i, label[i])
+          << "debug: rank " << rank;
+      EXPECT_TRUE(labels.insert(label[i]).second);
+    }
+  }
+}
+
+TYPED_TEST(SolverTest, TestMultiRankRestore) {
+  typedef typename TypeParam::Dtype Dtype;
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  string snapshot_prefix;
+  MakeTempFilename(&snapshot_prefix);
+  const string net_proto =
+     "base_lr: 0.1 "
+     "lr_policy: 'fixed' "
+     "momentum: 0.9 "
+     "max_iter: 2 "
+     "snapshot: 2 "
+     "snapshot_after_train: false "
+     "snapshot_prefix: '" + snapshot_prefix + "' "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 4 dim: 2 dim: 3 dim: 4 } "
+     "      shape { dim: 4 } "
+     "      data_filler { type: 'gaussian' } "
+     "      data_filler { type: 'constant' value: 1 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 10 "
+     "      weight_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->InitSolverFromProtoString(net_proto);
+  this->solver_->Solve();
+  const string state_file = snapshot_prefix + "_iter_2.solverstate";
+  // Only rank 0 is given a snapshot that exists; the other ranks get the
+  // params, the history and the iteration from it.
+  const int num_ranks = 2;
+  SolverParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(net_proto, &param));
+  param.set_solver_mode(SolverParameter_SolverMode_CPU);
+  vector<shared_ptr<Solver<Dtype> > > solvers;
+  for (int rank = 0; rank < num_ranks; ++rank) {
+    solvers.push_back(shared_ptr<Solver<Dtype> >(new SGDSolver<Dtype>(param)));
+  }
+  ostringstream uri;
+  uri << "shm://caffe_test_solver_" << caffe_rng_rand() % 20000;
+  boost::thread_group threads;
+  for (int rank = 0; rank < num_ranks; ++rank) {
+    threads.create_thread(boost::bind(&SolveAsRank<Dtype>,
+        solvers[rank].get(), uri.str(), rank, num_ranks,
+        rank ? snapshot_prefix + "_missing" : state_file));
+  }
+  threads.join_all();
+  const vector<shared_ptr<Blob<Dtype> > >& params =
+      this->solver_->net()->params();
+  const vector<shared_ptr<Blob<Dtype> > >& history =
+      static_cast<SGDSolver<Dtype>*>(this->solver_.get())->history();
+  for (int rank = 0; rank < num_ranks; ++rank) {
+    EXPECT_EQ(2, solvers[rank]->iter());
+    const vector<shared_ptr<Blob<Dtype> > >& rank_params =
+        solvers[rank]->net()->params();
+    const vector<shared_ptr<Blob<Dtype> > >& rank_history =
+        static_cast<SGDSolver<Dtype>*>(solvers[rank].get())->history();
+    ASSERT_EQ(params.size(), rank_params.size());
+    ASSERT_EQ(history.size(), rank_history.size());
+    // The snapshot holds the values as floats.
+    for (int j = 0; j < params.size(); ++j) {
+      for (int k = 0; k < params[j]->count(); ++k) {
+        EXPECT_NEAR(params[j]->cpu_data()[k], rank_params[j]->cpu_data()[k],
+            1e-5);
+        EXPECT_NEAR(history[j]->cpu_data()[k],
+            rank_history[j]->cpu_data()[k], 1e-5);
+      }
+    }
+  }
+}
+
+TYPED_TEST(SolverTest, TestHogwildTraining) {
+  typedef typename TypeParam::Dtype Dtype;
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  const string& proto =
+     "base_lr: 0.1 "
+     "lr_policy: 'fixed' "
+     "max_iter: 40 "
+     "display: 7 "
+     "snapshot_after_train: false "
+     "hogwild_threads: 3 "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 5 dim: 2 dim: 3 dim: 4 } "
+     "      shape { dim: 5 } "
+     "      data_filler { type: 'constant' value: 0.5 } "
+     "      data_filler { type: 'constant' value: 1 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 10 "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->InitSolverFromProtoString(proto);
+  vector<Blob<Dtype>*> bottom_vec;
+  Dtype initial_loss;
+  this->solver_->net()->Forward(bottom_vec, &initial_loss);
+  this->solver_->Solve();
+  // The workers took every iteration, between displays too, and trained the
+  // params they share.
+  EXPECT_EQ(40, this->solver_->iter());
+  Dtype loss;
+  this->solver_->net()->Forward(bottom_vec, &loss);
+  EXPECT_LT(loss, initial_loss / 10);
+}
+
+TYPED_TEST(SolverTest, TestHogwildShards) {
+  typedef typename TypeParam::Dtype Dtype;
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  const int num_workers = 3;
+  const int batch_size = 2;
+  ostringstream proto;
+  proto << "base_lr: 0.1 lr_policy: 'fixed' max_iter: 4 "
+        << "snapshot_after_train: false hogwild_threads: " << num_workers
+        << " " << this->MakeDataNetProto(12, batch_size);
+  this->InitSolverFromProtoString(proto.str());
+  vector<shared_ptr<Net<Dtype> > > nets(1, this->solver_->net());
+  nets.insert(nets.end(), this->solver_->hogwild_nets().begin(),
+      this->solver_->hogwild_nets().end());
+  ASSERT_EQ(num_workers, static_cast<int>(nets.size()));
+  // Worker i reads batches i, i + 3, ..., so between them the workers read
+  // each record once per pass over the db.
+  for (int pass = 0; pass < 2; ++pass) {
+    std::set<int> labels;
+    for (int step = 0; step < 2; ++step) {
+      for (int worker = 0; worker < num_workers; ++worker) {
+        nets[worker]->ForwardTo(0);
+        const Dtype* label = nets[worker]->blob_by_name("label")->cpu_data();
+        for (int i = 0; i < batch_size; ++i) {
+          EXPECT_EQ((step * num_workers + worker) * batch_size + i, label[i])
+              << "debug: pass " << pass << " step " << step
+              << " worker " << worker;
+          EXPECT_TRUE(labels.insert(label[i]).second);
+        }
+      }
+    }
+    EXPECT_EQ(12, static_cast<int>(labels.size()));
+  }
+}
+
+TYPED_TEST(SolverTest, TestHogwildSnapshot) {
+  typedef typename TypeParam::Dtype Dtype;
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  string snapshot_prefix;
+  MakeTempFilename(&snapshot_prefix);
+  const string net_proto =
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 5 dim: 2 dim: 3 dim: 4 } "
+     "      shape { dim: 5 } "
+     "      data_filler { type: 'gaussian' } "
+     "      data_filler { type: 'constant' value: 1 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 10 "
+     "      weight_filler { type: 'gaussian' } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  const string solver_proto =
+     "base_lr: 0.01 "
+     "lr_policy: 'fixed' "
+     "momentum: 0.9 "
+     "max_iter: 4 "
+     "snapshot: 4 "
+     "snapshot_prefix: '" + snapshot_prefix + "' ";
+  this->InitSolverFromProtoString(
+      solver_proto + "hogwild_threads: 3 " + net_proto);
+  this->solver_->Solve();
+  // The snapshot holds the momentum of each of the three workers.
+  const string state_file = snapshot_prefix + "_iter_4.solverstate";
+  SolverState state;
+  ReadProtoFromBinaryFile(state_file, &state);
+  const int num_params = this->solver_->net()->params().size();
+  EXPECT_EQ(3 * num_params, state.history_size());
+  // It restores with any number of workers.
+  for (int hogwild_threads = 1; hogwild_threads <= 4; ++hogwild_threads) {
+    ostringstream threads_proto;
+    threads_proto << "hogwild_threads: " << hogwild_threads << " ";
+    this->InitSolverFromProtoString(
+        solver_proto + threads_proto.str() + net_proto);
+    this->solver_->Restore(state_file.c_str());
+    EXPECT_EQ(4, this->solver_->iter());
+    const vector<shared_ptr<Blob<Dtype> > >& history =
+        static_cast<SGDSolver<Dtype>*>(this->solver_.get())->history();
+    ASSERT_EQ(num_params, static_cast<int>(history.size()));
+    for (int i = 0; i < num_params; ++i) {
+      Blob<Dtype> expected;
+      expected.FromProto(state.history(i));
+      ASSERT_EQ(expected.count(), history[i]->count());
+      for (int j = 0; j < expected.count(); ++j) {
+        EXPECT_EQ(expected.cpu_data()[j], history[i]->cpu_data()[j]);
+      }
+    }
+  }
+}
+
 }  // namespace caffe
@@ -0,0 +1,83 @@
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "boost/thread.hpp"
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/transport.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class TransportTest : public ::testing::Test {
+ protected:
+  // Threads stand in for the processes of a run.
+  static void RunRank(const string uri, int rank, int num_ranks, int count,
+      vector<Dtype>* reduced, vector<Dtype>* broadcast) {
+    shared_ptr<Transport<Dtype> > transport(
+        GetTransport<Dtype>(uri, rank, num_ranks));
+    EXPECT_EQ(rank, transport->rank());
+    EXPECT_EQ(num_ranks, transport->num_ranks());
+    reduced->resize(count);
+    broadcast->resize(count);
+    for (int i = 0; i < count; ++i) {
+      (*reduced)[i] = (rank + 1) * (i % 13);
+      (*broadcast)[i] = rank == 1 ? i % 11 : -1;
+    }
+    transport->AllReduce(&(*reduced)[0], count);
+    transport->Broadcast(&(*broadcast)[0], count, 1);
+  }
+
+  void TestRanks(const string& uri, int num_ranks, int count) {
+    vector<vector<Dtype> > reduced(num_ranks);
+    vector<vector<Dtype> > broadcast(num_ranks);
+    boost::thread_group threads;
+    for (int i = 0; i < num_ranks; ++i) {
+      threads.create_thread(boost::bind(&TransportTest::RunRank, uri, i,
+          num_ranks, count, &reduced[i], &broadcast[i]));
+    }
+    threads.join_all();
+    const Dtype rank_sum = num_ranks * (num_ranks + 1) / 2;
+    for (int i = 0; i < num_ranks; ++i) {
+      ASSERT_EQ(count, static_cast<int>(reduced[i].size()));
+      for (int j = 0; j < count; ++j) {
+        EXPECT_EQ(rank_sum * (j % 13), reduced[i][j]);
+        EXPECT_EQ(j % 11, broadcast[i][j]);
+      }
+    }
+  }
+
+  // A name or port base not in use by another test run.
+  static int RandomId() { return caffe_rng_rand() % 20000; }
+};
+
+TYPED_TEST_CASE(TransportTest, TestDtypes);
+
+TYPED_TEST(TransportTest, TestShm) {
+  // More values than fit in the segment at once.
+  std::ostringstream uri;
+  uri << "shm://caffe_test_transport_" << this->RandomId();
+  this->TestRanks(uri.str(), 3, 600001);
+}
+
+TYPED_TEST(TransportTest, TestTcp) {
+  const int port = 20000 + this->RandomId();
+  for (int num_ranks = 2; num_ranks <= 3; ++num_ranks) {
+    std::ostringstream uri;
+    uri << "tcp://";
+    for (int i = 0; i < num_ranks; ++i) {
+      uri << (i ? "," : "") << "127.0.0.1:" << port + 10 * num_ranks + i;
+    }
+    this->TestRanks(uri.str(), num_ranks, 1001);
+    // Fewer values than ranks leaves segments of the ring empty.
+    this->TestRanks(uri.str(), num_ranks, num_ranks - 1);
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,132 @@
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/data_layers.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class WindowDataLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  WindowDataLayerTest()
+      : seed_(1701),
+        blob_top_data_(new Blob<Dtype>()),
+        blob_top_label_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    blob_top_vec_.push_back(blob_top_data_);
+    blob_top_vec_.push_back(blob_top_label_);
+    // Create a window file of three images, each with foreground and
+    // background windows inside it.
+    MakeTempFilename(&filename_);
+    std::ofstream outfile(filename_.c_str(), std::ofstream::out);
+    LOG(INFO) << "Using temporary file " << filename_;
+    const char* images[] = { "images/cat.jpg 3 360 480",
+                             "images/fish-bike.jpg 3 323 481",
+                             "images/cat.jpg 3 360 480" };
+    for (int i = 0; i < 3; ++i) {
+      outfile << "# " << i << "\n" << EXAMPLES_SOURCE_DIR << images[i]
+              << "\n4\n"
+              << i + 1 << " 0.9 10 20 200 220\n"
+              << i + 1 << " 0.7 " << 50 + i << " 40 300 310\n"
+              << "0 0.1 100 0 250 100\n"
+              << "0 0.2 0 150 120 300\n";
+    }
+    outfile.close();
+  }
+
+  virtual ~WindowDataLayerTest() {
+    delete blob_top_data_;
+    delete blob_top_label_;
+  }
+
+  // Reads num_batches batches with the given number of warp workers and
+  // image cache, after seeding Caffe with seed_.
+  void ReadBatches(int num_workers, int cache_mb, int num_batches,
+      vector<vector<Dtype> >* data, vector<vector<Dtype> >* labels) {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    WindowDataParameter* window_data_param =
+        param.mutable_window_data_param();
+    window_data_param->set_source(filename_.c_str());
+    window_data_param->set_batch_size(8);
+    window_data_param->set_num_workers(num_workers);
+    window_data_param->set_cache_mb(cache_mb);
+    TransformationParameter* transform_param =
+        param.mutable_transform_param();
+    transform_param->set_crop_size(16);
+    transform_param->set_mirror(true);
+    Caffe::set_random_seed(seed_);
+    WindowDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_EQ(8, blob_top_data_->num());
+    EXPECT_EQ(3, blob_top_data_->channels());
+    EXPECT_EQ(16, blob_top_data_->height());
+    EXPECT_EQ(16, blob_top_data_->width());
+    data->clear();
+    labels->clear();
+    for (int iter = 0; iter < num_batches; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      data->push_back(vector<Dtype>(blob_top_data_->cpu_data(),
+          blob_top_data_->cpu_data() + blob_top_data_->count()));
+      labels->push_back(vector<Dtype>(blob_top_label_->cpu_data(),
+          blob_top_label_->cpu_data() + blob_top_label_->count()));
+    }
+  }
+
+  int seed_;
+  string filename_;
+  Blob<Dtype>* const blob_top_data_;
+  Blob<Dtype>* const blob_top_label_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(WindowDataLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(WindowDataLayerTest, TestWorkersMatchSerial) {
+  typedef typename TypeParam::Dtype Dtype;
+  const int num_batches = 3;
+  vector<vector<Dtype> > data, labels;
+  this->ReadBatches(1, 0, num_batches, &data, &labels);
+  // The batches hold foreground and background windows, and are not
+  // blank.
+  for (int iter = 0; iter < num_batches; ++iter) {
+    EXPECT_EQ(0, labels[iter][0]);
+    EXPECT_GT(labels[iter].back(), 0);
+    Dtype sum = 0;
+    for (int j = 0; j < data[iter].size(); ++j) {
+      sum += data[iter][j];
+    }
+    EXPECT_GT(sum, 0);
+  }
+  // Warping on several workers, with or without the image cache, gives the
+  // same batches for the same seed.
+  const int configs[][2] = { { 3, 0 }, { 3, 1 }, { 8, 1 } };
+  for (int c = 0; c < 3; ++c) {
+    vector<vector<Dtype> > parallel_data, parallel_labels;
+    this->ReadBatches(configs[c][0], configs[c][1], num_batches,
+        &parallel_data, &parallel_labels);
+    for (int iter = 0; iter < num_batches; ++iter) {
+      EXPECT_TRUE(labels[iter] == parallel_labels[iter])
+          << "num_workers " << configs[c][0] << " batch " << iter;
+      ASSERT_EQ(data[iter].size(), parallel_data[iter].size());
+      for (int j = 0; j < data[iter].size(); ++j) {
+        EXPECT_EQ(data[iter][j], parallel_data[iter][j])
+            << "num_workers " << configs[c][0] << " batch " << iter
+            << " index " << j;
+      }
+    }
+  }
+}
+
+}  // namespace caffe
@@ -4,6 +4,12 @@
 #include <string>
 #include <direct.h>
 
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <vector>
+
+#include "caffe/util/io.hpp"
+
 namespace caffe { namespace db {
 
 const size_t LMDB_MAP_SIZE = 1099511627776;  // 1 TB
@@ -60,12 +66,150 @@ void LMDBTransaction::Put(const string& key, const string& value) {
   MDB_CHECK(mdb_put(mdb_txn_, *mdb_dbi_, &mdb_key, &mdb_value, 0));
 }
 
+static const char* kPackedDataFile = "/data.bin";
+static const char* kPackedIndexFile = "/index.bin";
+
+void PackedDB::Open(const string& source, Mode mode) {
+  source_ = source;
+  mode_ = mode;
+  const string data_filename = source_ + kPackedDataFile;
+  const string index_filename = source_ + kPackedIndexFile;
+  if (mode == NEW) {
+    CHECK_EQ(_mkdir(source.c_str()), 0) << "mkdir " << source << "failed";
+    std::ofstream data(data_filename.c_str(), ios::out | ios::binary);
+    std::ofstream index(index_filename.c_str(), ios::out | ios::binary);
+    CHECK(data.good() && index.good()) << "Cannot create " << source;
+    num_records_ = 0;
+    end_offset_ = 0;
+  } else if (mode == WRITE) {
+    // Continue appending after the records already in the db.
+    std::ifstream data(data_filename.c_str(), ios::in | ios::binary);
+    std::ifstream index(index_filename.c_str(), ios::in | ios::binary);
+    CHECK(data.good() && index.good()) << "Cannot open packed db " << source;
+    data.seekg(0, ios::end);
+    index.seekg(0, ios::end);
+    end_offset_ = data.tellg();
+    num_records_ = static_cast<size_t>(index.tellg()) / sizeof(uint64_t);
+  } else {
+    MapFiles();
+  }
+  LOG(INFO) << "Opened packed db " << source;
+}
+
+void PackedDB::MapFiles() {
+  data_map_ = MapFileReadOnly(source_ + kPackedDataFile, true,
+      &data_size_, &data_handle_);
+  index_map_ = reinterpret_cast<const uint64_t*>(MapFileReadOnly(
+      source_ + kPackedIndexFile, false, &index_size_, &index_handle_));
+  CHECK_EQ(index_size_ % sizeof(uint64_t), 0)
+      << "Truncated packed db index in " << source_;
+  num_records_ = index_size_ / sizeof(uint64_t);
+  CHECK(num_records_ == 0 || data_map_ != NULL)
+      << "Missing packed db data in " << source_;
+  end_offset_ = data_size_;
+}
+
+void PackedDB::UnmapFiles() {
+  UnmapFile(data_map_, data_size_, data_handle_);
+  UnmapFile(reinterpret_cast<const char*>(index_map_), index_size_,
+      index_handle_);
+  data_map_ = NULL;
+  index_map_ = NULL;
+  data_handle_ = NULL;
+  index_handle_ = NULL;
+  data_size_ = 0;
+  index_size_ = 0;
+}
+
+void PackedDB::Close() {
+  UnmapFiles();
+  num_records_ = 0;
+  end_offset_ = 0;
+}
+
+PackedCursor* PackedDB::NewCursor() {
+  CHECK_EQ(mode_, READ) << "Packed db cursors require READ mode";
+  return new PackedCursor(this);
+}
+
+void PackedDB::Append(const string& records, const vector<uint64_t>& offsets) {
+  // Data goes first, so that an interrupted write never leaves the index
+  // pointing past the end of the data file.
+  std::ofstream data((source_ + kPackedDataFile).c_str(),
+      ios::out | ios::binary | ios::app);
+  data.write(records.data(), records.size());
+  data.close();
+  CHECK(!data.fail()) << "Failed to write packed db data to " << source_;
+  vector<uint64_t> index(offsets.size());
+  for (int i = 0; i < offsets.size(); ++i) {
+    index[i] = end_offset_ + offsets[i];
+  }
+  std::ofstream index_file((source_ + kPackedIndexFile).c_str(),
+      ios::out | ios::binary | ios::app);
+  if (!index.empty()) {
+    index_file.write(reinterpret_cast<const char*>(&index[0]),
+        index.size() * sizeof(uint64_t));
+  }
+  index_file.close();
+  CHECK(!index_file.fail()) << "Failed to write packed db index to " << source_;
+  end_offset_ += records.size();
+  num_records_ += offsets.size();
+}
+
+void PackedTransaction::Put(const string& key, const string& value) {
+  offsets_.push_back(buffer_.size());
+  const uint32_t sizes[2] = { static_cast<uint32_t>(key.size()),
+      static_cast<uint32_t>(value.size()) };
+  buffer_.append(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+  buffer_.append(key);
+  buffer_.append(value);
+}
+
+void PackedTransaction::Commit() {
+  db_->Append(buffer_, offsets_);
+  buffer_.clear();
+  offsets_.clear();
+}
+
+const char* PackedCursor::record(uint32_t sizes[2]) const {
+  CHECK_LT(pos_, db_->num_records_) << "Packed cursor out of range";
+  const uint64_t offset = db_->index_map_[pos_];
+  const size_t header_size = 2 * sizeof(uint32_t);
+  CHECK(offset <= db_->data_size_ &&
+        header_size <= db_->data_size_ - offset) << "Corrupt packed db index";
+  const char* rec = db_->data_map_ + offset;
+  memcpy(sizes, rec, header_size);
+  // Compared one at a time, so the sum cannot overflow.
+  const size_t remaining = db_->data_size_ - offset - header_size;
+  CHECK(sizes[0] <= remaining && sizes[1] <= remaining - sizes[0])
+      << "Packed db record runs past the end of the data file";
+  return rec + header_size;
+}
+
+string PackedCursor::key() {
+  uint32_t sizes[2];
+  const char* rec = record(sizes);
+  return string(rec, sizes[0]);
+}
+
+string PackedCursor::value() {
+  uint32_t sizes[2];
+  const char* rec = record(sizes);
+  return string(rec + sizes[0], sizes[1]);
+}
+
+bool PackedCursor::valid() { return pos_ < db_->num_records_; }
+
+size_t PackedCursor::size() const { return db_->num_records_; }
+
 DB* GetDB(DataParameter::DB backend) {
   switch (backend) {
   case DataParameter_DB_LEVELDB:
     return new LevelDB();
   case DataParameter_DB_LMDB:
     return new LMDB();
+  case DataParameter_DB_PACKED:
+    return new PackedDB();
   default:
     LOG(FATAL) << "Unknown database backend";
   }
@@ -76,6 +220,8 @@ DB* GetDB(const string& backend) {
     return new LevelDB();
   } else if (backend == "lmdb") {
     return new LMDB();
+  } else if (backend == "packed") {
+    return new PackedDB();
   } else {
     LOG(FATAL) << "Unknown database backend";
   }
@@ -7,12 +7,36 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <stdint.h>
+#ifdef _MSC_VER
+// NOGDI keeps wingdi.h from defining ERROR over glog's severity.
+#ifndef NOGDI
+#define NOGDI
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef USE_LIBJPEG
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+#endif
 
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
 
+#include "boost/thread/mutex.hpp"
+
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/io.hpp"
@@ -68,6 +92,473 @@ void WriteProtoToBinaryFile(const Message& proto, const char* filename) {
   CHECK(proto.SerializeToOstream(&output));
 }
 
+// Renames temp_filename over filename, replacing any file already there.
+static void ReplaceFile(const string& temp_filename, const string& filename) {
+#ifdef _MSC_VER
+  CHECK(MoveFileExA(temp_filename.c_str(), filename.c_str(),
+      MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+#else
+  CHECK_EQ(rename(temp_filename.c_str(), filename.c_str()), 0)
+#endif
+      << "Failed to rename " << temp_filename << " to " << filename;
+}
+
+void WriteProtoToBinaryFileAtomically(const Message& proto,
+    const string& filename) {
+  const string temp_filename = filename + ".tmp";
+  {
+    fstream output(temp_filename.c_str(),
+        ios::out | ios::trunc | ios::binary);
+    CHECK(proto.SerializeToOstream(&output))
+        << "Failed to write " << temp_filename;
+    output.close();
+    CHECK(!output.fail()) << "Failed to write " << temp_filename;
+  }
+  ReplaceFile(temp_filename, filename);
+}
+
+const char* MapFileReadOnly(const string& filename, bool sequential,
+    size_t* size, void** handle) {
+  *size = 0;
+  *handle = NULL;
+#ifdef _MSC_VER
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+      NULL, OPEN_EXISTING,
+      sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) { return NULL; }
+  LARGE_INTEGER file_size;
+  CHECK(GetFileSizeEx(file, &file_size)) << "Cannot stat " << filename;
+  if (file_size.QuadPart == 0) {
+    CloseHandle(file);
+    return NULL;
+  }
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  // The mapping object keeps its own reference to the file.
+  CloseHandle(file);
+  CHECK(mapping != NULL) << "Cannot map " << filename;
+  const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CHECK(view != NULL) << "Cannot map " << filename;
+  *size = static_cast<size_t>(file_size.QuadPart);
+  *handle = mapping;
+  return static_cast<const char*>(view);
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) { return NULL; }
+  struct stat file_stat;
+  CHECK_EQ(fstat(fd, &file_stat), 0) << "Cannot stat " << filename;
+  if (file_stat.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  void* addr = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(addr != MAP_FAILED) << "Cannot map " << filename;
+  madvise(addr, file_stat.st_size,
+      sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+  *size = file_stat.st_size;
+  return static_cast<const char*>(addr);
+#endif
+}
+
+void UnmapFile(const char* addr, size_t size, void* handle) {
+  if (addr == NULL) { return; }
+#ifdef _MSC_VER
+  UnmapViewOfFile(addr);
+  CloseHandle(handle);
+#else
+  munmap(const_cast<char*>(addr), size);
+#endif
+}
+
+static const char kRawMagic[] = "CAFFERAW";
+static const size_t kRawMagicSize = sizeof(kRawMagic) - 1;
+
+static uint64_t AlignRawOffset(uint64_t offset) {
+  return (offset + kRawPayloadAlignment - 1) / kRawPayloadAlignment *
+      kRawPayloadAlignment;
+}
+
+uint64_t AddRawPayload(const void* data, size_t size,
+    vector<RawPayload>* payloads) {
+  RawPayload payload;
+  payload.offset = payloads->empty() ? 0 :
+      AlignRawOffset(payloads->back().offset + payloads->back().size);
+  payload.data = data;
+  payload.size = size;
+  payloads->push_back(payload);
+  return payload.offset;
+}
+
+void WriteRawProtoFileAtomically(const Message& header,
+    const vector<RawPayload>& payloads, const string& filename) {
+  const string temp_filename = filename + ".tmp";
+  string header_bytes;
+  CHECK(header.SerializeToString(&header_bytes));
+  const uint64_t header_size = header_bytes.size();
+  const uint64_t payloads_begin =
+      AlignRawOffset(kRawMagicSize + sizeof(header_size) + header_size);
+  {
+    fstream output(temp_filename.c_str(),
+        ios::out | ios::trunc | ios::binary);
+    output.write(kRawMagic, kRawMagicSize);
+    output.write(reinterpret_cast<const char*>(&header_size),
+        sizeof(header_size));
+    output.write(header_bytes.data(), header_size);
+    const char padding[kRawPayloadAlignment] = { 0 };
+    uint64_t position = kRawMagicSize + sizeof(header_size) + header_size;
+    for (int i = 0; i < payloads.size(); ++i) {
+      const uint64_t offset = payloads_begin + payloads[i].offset;
+      CHECK_GE(offset, position) << "Raw payloads out of order";
+      output.write(padding, offset - position);
+      output.write(static_cast<const char*>(payloads[i].data),
+          payloads[i].size);
+      position = offset + payloads[i].size;
+    }
+    output.close();
+    CHECK(!output.fail()) << "Failed to write " << temp_filename;
+  }
+  ReplaceFile(temp_filename, filename);
+}
+
+bool IsRawProtoFile(const string& filename) {
+  std::ifstream input(filename.c_str(), ios::in | ios::binary);
+  char magic[kRawMagicSize];
+  input.read(magic, kRawMagicSize);
+  return input.good() && memcmp(magic, kRawMagic, kRawMagicSize) == 0;
+}
+
+RawProtoFile::RawProtoFile(const string& filename, Message* header)
+    : filename_(filename) {
+  map_ = MapFileReadOnly(filename, false, &size_, &handle_);
+  CHECK(map_ != NULL) << "File not found: " << filename;
+  uint64_t header_size = 0;
+  CHECK(size_ >= kRawMagicSize + sizeof(header_size) &&
+      memcmp(map_, kRawMagic, kRawMagicSize) == 0)
+      << "Not a raw proto file: " << filename;
+  memcpy(&header_size, map_ + kRawMagicSize, sizeof(header_size));
+  const uint64_t header_end = kRawMagicSize + sizeof(header_size) +
+      header_size;
+  CHECK_LE(header_end, size_) << "Truncated raw proto file " << filename;
+  CHECK(header->ParseFromArray(map_ + kRawMagicSize + sizeof(header_size),
+      header_size)) << "Failed to parse the header of " << filename;
+  payloads_begin_ = AlignRawOffset(header_end);
+}
+
+RawProtoFile::~RawProtoFile() {
+  UnmapFile(map_, size_, handle_);
+}
+
+const char* RawProtoFile::payload(uint64_t offset, size_t size) const {
+  // Compared piece by piece, so a corrupt offset cannot wrap around.
+  CHECK(payloads_begin_ <= size_ && offset <= size_ - payloads_begin_ &&
+      size <= size_ - payloads_begin_ - offset)
+      << "Truncated raw proto file " << filename_;
+  return map_ + payloads_begin_ + offset;
+}
+
+// The shape of a blob proto, from the deprecated 4D dimensions if it has
+// them, as in Blob::FromProto.
+static vector<int> BlobProtoShape(const BlobProto& proto) {
+  vector<int> shape;
+  if (proto.has_num() || proto.has_channels() ||
+      proto.has_height() || proto.has_width()) {
+    shape.push_back(proto.num());
+    shape.push_back(proto.channels());
+    shape.push_back(proto.height());
+    shape.push_back(proto.width());
+  } else {
+    for (int i = 0; i < proto.shape().dim_size(); ++i) {
+      shape.push_back(proto.shape().dim(i));
+    }
+  }
+  return shape;
+}
+
+template <typename Dtype>
+void BlobToRawProto(const Blob<Dtype>& blob, bool write_diff,
+    BlobProto* proto, vector<RawPayload>* payloads) {
+  proto->Clear();
+  for (int i = 0; i < blob.num_axes(); ++i) {
+    proto->mutable_shape()->add_dim(blob.shape(i));
+  }
+  proto->set_raw_type(sizeof(Dtype) == sizeof(double) ?
+      BlobProto_RawType_DOUBLE : BlobProto_RawType_FLOAT);
+  const size_t size = blob.count() * sizeof(Dtype);
+  proto->set_raw_data_offset(AddRawPayload(blob.cpu_data(), size, payloads));
+  if (write_diff) {
+    proto->set_raw_diff_offset(
+        AddRawPayload(blob.cpu_diff(), size, payloads));
+  }
+}
+
+// Copies count values of type from a payload to dst.
+template <typename Dtype>
+static void CopyRawValues(const char* payload, BlobProto_RawType type,
+    int count, Dtype* dst) {
+  if (type == BlobProto_RawType_FLOAT) {
+    const float* src = reinterpret_cast<const float*>(payload);
+    for (int i = 0; i < count; ++i) {
+      dst[i] = src[i];
+    }
+  } else {
+    const double* src = reinterpret_cast<const double*>(payload);
+    for (int i = 0; i < count; ++i) {
+      dst[i] = src[i];
+    }
+  }
+}
+
+static size_t RawTypeSize(BlobProto_RawType type) {
+  return type == BlobProto_RawType_FLOAT ? sizeof(float) : sizeof(double);
+}
+
+template <typename Dtype>
+void BlobFromRawProto(const BlobProto& proto, const RawProtoFile& file,
+    bool reshape, Blob<Dtype>* blob) {
+  CHECK(proto.has_raw_data_offset()) << "Blob without a raw payload";
+  if (reshape) {
+    blob->Reshape(BlobProtoShape(proto));
+  } else {
+    CHECK(blob->ShapeEquals(proto)) << "shape mismatch (reshape not set)";
+  }
+  const int count = blob->count();
+  const size_t size = count * RawTypeSize(proto.raw_type());
+  CopyRawValues(file.payload(proto.raw_data_offset(), size),
+      proto.raw_type(), count, blob->mutable_cpu_data());
+  if (proto.has_raw_diff_offset()) {
+    CopyRawValues(file.payload(proto.raw_diff_offset(), size),
+        proto.raw_type(), count, blob->mutable_cpu_diff());
+  }
+}
+
+template void BlobToRawProto<float>(const Blob<float>& blob,
+    bool write_diff, BlobProto* proto, vector<RawPayload>* payloads);
+template void BlobToRawProto<double>(const Blob<double>& blob,
+    bool write_diff, BlobProto* proto, vector<RawPayload>* payloads);
+template void BlobFromRawProto<float>(const BlobProto& proto,
+    const RawProtoFile& file, bool reshape, Blob<float>* blob);
+template void BlobFromRawProto<double>(const BlobProto& proto,
+    const RawProtoFile& file, bool reshape, Blob<double>* blob);
+
+void WriteNetParamsToRawFile(const NetParameter& param,
+    const string& filename) {
+  NetParameter header(param);
+  vector<RawPayload> payloads;
+  for (int i = 0; i < header.layer_size(); ++i) {
+    LayerParameter* layer = header.mutable_layer(i);
+    for (int j = 0; j < layer->blobs_size(); ++j) {
+      // The payloads point into param, which keeps the values.
+      const BlobProto& source = param.layer(i).blobs(j);
+      BlobProto* blob = layer->mutable_blobs(j);
+      blob->clear_data();
+      blob->clear_diff();
+      blob->set_raw_type(BlobProto_RawType_FLOAT);
+      blob->set_raw_data_offset(AddRawPayload(source.data().data(),
+          source.data_size() * sizeof(float), &payloads));
+      if (source.diff_size() > 0) {
+        blob->set_raw_diff_offset(AddRawPayload(source.diff().data(),
+            source.diff_size() * sizeof(float), &payloads));
+      }
+    }
+  }
+  WriteRawProtoFileAtomically(header, payloads, filename);
+}
+
+// Adds count values of type from a payload to values.
+static void AppendRawValues(const char* payload, BlobProto_RawType type,
+    int count, google::protobuf::RepeatedField<float>* values) {
+  values->Resize(count, 0);
+  CopyRawValues(payload, type, count, values->mutable_data());
+}
+
+void ReadNetParamsFromRawFile(const string& filename, NetParameter* param) {
+  RawProtoFile file(filename, param);
+  for (int i = 0; i < param->layer_size(); ++i) {
+    LayerParameter* layer = param->mutable_layer(i);
+    for (int j = 0; j < layer->blobs_size(); ++j) {
+      BlobProto* blob = layer->mutable_blobs(j);
+      const vector<int> shape = BlobProtoShape(*blob);
+      int count = 1;
+      for (int k = 0; k < shape.size(); ++k) {
+        count *= shape[k];
+      }
+      const size_t size = count * RawTypeSize(blob->raw_type());
+      AppendRawValues(file.payload(blob->raw_data_offset(), size),
+          blob->raw_type(), count, blob->mutable_data());
+      if (blob->has_raw_diff_offset()) {
+        AppendRawValues(file.payload(blob->raw_diff_offset(), size),
+            blob->raw_type(), count, blob->mutable_diff());
+      }
+      blob->clear_raw_data_offset();
+      blob->clear_raw_diff_offset();
+      blob->clear_raw_type();
+    }
+  }
+}
+
+#ifdef USE_LIBJPEG
+struct JPEGErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+
+static void JPEGErrorExit(j_common_ptr cinfo) {
+  JPEGErrorManager* err = reinterpret_cast<JPEGErrorManager*>(cinfo->err);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+// Decodes a JPEG with libjpeg, letting the IDCT scale the image down by the
+// largest of 1/8, 1/4 or 1/2 that keeps it at least min_height x min_width.
+// cv_read_flag follows cv::imdecode: > 0 color, 0 gray, < 0 as stored.
+// Returns false (leaving cv_img empty) if libjpeg rejects the stream.
+static bool DecodeJPEGReduced(const char* data, size_t size,
+    int cv_read_flag, int min_height, int min_width, cv::Mat* cv_img) {
+  jpeg_decompress_struct cinfo;
+  JPEGErrorManager jerr;
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = JPEGErrorExit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    cv_img->release();
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, reinterpret_cast<unsigned char*>(
+      const_cast<char*>(data)), static_cast<unsigned long>(size));
+  jpeg_read_header(&cinfo, TRUE);
+  const bool is_color = cv_read_flag > 0 ||
+      (cv_read_flag < 0 && cinfo.num_components > 1);
+  cinfo.out_color_space = is_color ? JCS_RGB : JCS_GRAYSCALE;
+  cinfo.scale_num = 1;
+  for (int denom = 8; denom >= 1; denom /= 2) {
+    cinfo.scale_denom = denom;
+    jpeg_calc_output_dimensions(&cinfo);
+    if (static_cast<int>(cinfo.output_height) >= min_height &&
+        static_cast<int>(cinfo.output_width) >= min_width) {
+      break;
+    }
+  }
+  jpeg_start_decompress(&cinfo);
+  cv_img->create(cinfo.output_height, cinfo.output_width,
+      is_color ? CV_8UC3 : CV_8UC1);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = cv_img->ptr<uchar>(cinfo.output_scanline);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  if (is_color) {
+    cv::cvtColor(*cv_img, *cv_img, CV_RGB2BGR);
+  }
+  return true;
+}
+#endif  // USE_LIBJPEG
+
+#if !defined(USE_LIBJPEG) && CV_MAJOR_VERSION >= 3
+// Reads the frame size from the SOF marker of a JPEG stream. Returns false
+// if the stream ends, or stops looking like a JPEG, before one is found.
+static bool JPEGFrameSize(const unsigned char* bytes, size_t size,
+    int* height, int* width) {
+  size_t pos = 2;
+  while (pos + 4 <= size) {
+    if (bytes[pos] != 0xFF) {
+      return false;
+    }
+    const unsigned char marker = bytes[pos + 1];
+    if (marker == 0xFF) {  // fill byte
+      ++pos;
+      continue;
+    }
+    const size_t length = (bytes[pos + 2] << 8) | bytes[pos + 3];
+    // SOF0-SOF15, except DHT (C4), JPG (C8) and DAC (CC).
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      if (length < 7 || pos + 9 > size) {
+        return false;
+      }
+      *height = (bytes[pos + 5] << 8) | bytes[pos + 6];
+      *width = (bytes[pos + 7] << 8) | bytes[pos + 8];
+      return true;
+    }
+    pos += 2 + length;
+  }
+  return false;
+}
+#endif
+
+// Decodes an in-memory image as cv::imdecode would with cv_read_flag, but
+// when given a minimum size, JPEGs are decoded at the smallest DCT scale
+// covering min_height x min_width. That takes a build with USE_LIBJPEG, or
+// OpenCV 3 or later (through IMREAD_REDUCED_*, for color or gray reads).
+static cv::Mat DecodeBufferToCVMat(const char* data, size_t size,
+    int cv_read_flag, int min_height, int min_width) {
+  cv::Mat cv_img;
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  const bool reduce = (min_height > 0 || min_width > 0) && size > 2 &&
+      bytes[0] == 0xFF && bytes[1] == 0xD8;
+#ifdef USE_LIBJPEG
+  if (reduce && DecodeJPEGReduced(data, size, cv_read_flag, min_height,
+                                  min_width, &cv_img)) {
+    return cv_img;
+  }
+#elif CV_MAJOR_VERSION >= 3
+  int jpeg_height, jpeg_width;
+  if (reduce && cv_read_flag >= 0 &&
+      JPEGFrameSize(bytes, size, &jpeg_height, &jpeg_width)) {
+    int log_denom = 3;
+    for (; log_denom > 0; --log_denom) {
+      const int denom = 1 << log_denom;
+      if ((jpeg_height + denom - 1) / denom >= min_height &&
+          (jpeg_width + denom - 1) / denom >= min_width) {
+        break;
+      }
+    }
+    if (log_denom > 0) {
+      const int kColorFlags[] = { cv::IMREAD_REDUCED_COLOR_2,
+          cv::IMREAD_REDUCED_COLOR_4, cv::IMREAD_REDUCED_COLOR_8 };
+      const int kGrayFlags[] = { cv::IMREAD_REDUCED_GRAYSCALE_2,
+          cv::IMREAD_REDUCED_GRAYSCALE_4, cv::IMREAD_REDUCED_GRAYSCALE_8 };
+      cv_read_flag = cv_read_flag > 0 ? kColorFlags[log_denom - 1] :
+          kGrayFlags[log_denom - 1];
+    }
+  }
+#endif
+  std::vector<char> vec_data(data, data + size);
+  cv_img = cv::imdecode(vec_data, cv_read_flag);
+  return cv_img;
+}
+
+cv::Mat ReadImageToCVMat(const string& filename,
+    const int height, const int width, const bool is_color,
+    const int min_height, const int min_width) {
+  if (min_height <= 0 && min_width <= 0) {
+    return ReadImageToCVMat(filename, height, width, is_color);
+  }
+  cv::Mat cv_img;
+  std::ifstream file(filename.c_str(), ios::in | ios::binary);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open or find file " << filename;
+    return cv_img;
+  }
+  std::vector<char> buffer((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+  int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
+    CV_LOAD_IMAGE_GRAYSCALE);
+  cv::Mat cv_img_origin = buffer.empty() ? cv::Mat() :
+      DecodeBufferToCVMat(&buffer[0], buffer.size(), cv_read_flag,
+                          min_height, min_width);
+  if (!cv_img_origin.data) {
+    LOG(ERROR) << "Could not decode file " << filename;
+    return cv_img_origin;
+  }
+  if (height > 0 && width > 0) {
+    cv::resize(cv_img_origin, cv_img, cv::Size(width, height));
+  } else {
+    cv_img = cv_img_origin;
+  }
+  return cv_img;
+}
+
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width, const bool is_color) {
   cv::Mat cv_img;
@@ -112,31 +603,65 @@ static bool matchExt(const std::string & fn,
     return true;
   return false;
 }
+// Stores cv_img in datum, re-encoded as encoding if that is not empty.
+static void CVMatToDatumEncoded(const cv::Mat& cv_img, const int label,
+    const std::string & encoding, Datum* datum) {
+  if (encoding.size()) {
+    std::vector<uchar> buf;
+    cv::imencode("."+encoding, cv_img, buf);
+    datum->set_data(std::string(reinterpret_cast<char*>(&buf[0]),
+                    buf.size()));
+    datum->set_label(label);
+    datum->set_encoded(true);
+    return;
+  }
+  CVMatToDatum(cv_img, datum);
+  datum->set_label(label);
+}
+
 bool ReadImageToDatum(const string& filename, const int label,
     const int height, const int width, const bool is_color,
     const std::string & encoding, Datum* datum) {
   cv::Mat cv_img = ReadImageToCVMat(filename, height, width, is_color);
   if (cv_img.data) {
-    if (encoding.size()) {
-      if ( (cv_img.channels() == 3) == is_color && !height && !width &&
-          matchExt(filename, encoding) )
-        return ReadFileToDatum(filename, label, datum);
-      std::vector<uchar> buf;
-      cv::imencode("."+encoding, cv_img, buf);
-      datum->set_data(std::string(reinterpret_cast<char*>(&buf[0]),
-                      buf.size()));
-      datum->set_label(label);
-      datum->set_encoded(true);
-      return true;
-    }
-    CVMatToDatum(cv_img, datum);
-    datum->set_label(label);
+    if ( encoding.size() && (cv_img.channels() == 3) == is_color &&
+        !height && !width && matchExt(filename, encoding) )
+      return ReadFileToDatum(filename, label, datum);
+    CVMatToDatumEncoded(cv_img, label, encoding, datum);
     return true;
   } else {
     return false;
   }
 }
 
+bool DecodeImageToDatum(const string& contents, const string& filename,
+    const int label, const int height, const int width, const bool is_color,
+    const std::string & encoding, Datum* datum) {
+  if (contents.empty()) {
+    return false;
+  }
+  cv::Mat cv_img_origin = DecodeImageToCVMat(contents, is_color, 0, 0);
+  if (!cv_img_origin.data) {
+    LOG(ERROR) << "Could not decode file " << filename;
+    return false;
+  }
+  if ( encoding.size() && (cv_img_origin.channels() == 3) == is_color &&
+      !height && !width && matchExt(filename, encoding) ) {
+    datum->set_data(contents);
+    datum->set_label(label);
+    datum->set_encoded(true);
+    return true;
+  }
+  cv::Mat cv_img;
+  if (height > 0 && width > 0) {
+    cv::resize(cv_img_origin, cv_img, cv::Size(width, height));
+  } else {
+    cv_img = cv_img_origin;
+  }
+  CVMatToDatumEncoded(cv_img, label, encoding, datum);
+  return true;
+}
+
 bool ReadFileToDatum(const string& filename, const int label,
     Datum* datum) {
   std::streampos size;
@@ -157,30 +682,45 @@ bool ReadFileToDatum(const string& filename, const int label,
   }
 }
 
-cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
+cv::Mat DecodeDatumToCVMatNative(const Datum& datum,
+    const int min_height, const int min_width) {
   cv::Mat cv_img;
   CHECK(datum.encoded()) << "Datum not encoded";
   const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
-  cv_img = cv::imdecode(vec_data, -1);
+  cv_img = DecodeBufferToCVMat(data.data(), data.size(), -1,
+                               min_height, min_width);
   if (!cv_img.data) {
     LOG(ERROR) << "Could not decode datum ";
   }
   return cv_img;
 }
-cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color) {
+cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color,
+    const int min_height, const int min_width) {
   cv::Mat cv_img;
   CHECK(datum.encoded()) << "Datum not encoded";
   const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
   int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
     CV_LOAD_IMAGE_GRAYSCALE);
-  cv_img = cv::imdecode(vec_data, cv_read_flag);
+  cv_img = DecodeBufferToCVMat(data.data(), data.size(), cv_read_flag,
+                               min_height, min_width);
   if (!cv_img.data) {
     LOG(ERROR) << "Could not decode datum ";
   }
   return cv_img;
 }
+cv::Mat DecodeImageToCVMat(const string& buffer, const bool is_color,
+    const int min_height, const int min_width) {
+  int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
+    CV_LOAD_IMAGE_GRAYSCALE);
+  return DecodeBufferToCVMat(buffer.data(), buffer.size(), cv_read_flag,
+                             min_height, min_width);
+}
+cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
+  return DecodeDatumToCVMatNative(datum, 0, 0);
+}
+cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color) {
+  return DecodeDatumToCVMat(datum, is_color, 0, 0);
+}
 
 // If Datum is encoded will decoded using DecodeDatumToCVMat and CVMatToDatum
 // If Datum is not encoded will do nothing
@@ -210,6 +750,7 @@ void CVMatToDatum(const cv::Mat& cv_img, Datum* datum) {
   datum->set_width(cv_img.cols);
   datum->clear_data();
   datum->clear_float_data();
+  datum->clear_data_type();
   datum->set_encoded(false);
   int datum_channels = datum->channels();
   int datum_height = datum->height();
@@ -229,6 +770,149 @@ void CVMatToDatum(const cv::Mat& cv_img, Datum* datum) {
   datum->set_data(buffer);
 }
 
+// IEEE 754 binary16 <-> binary32, rounding to nearest even. Overflow goes
+// to infinity and values below the smallest denormal to zero.
+static uint16_t FloatToHalf(const float value) {
+  uint32_t f;
+  memcpy(&f, &value, sizeof(f));
+  const uint16_t sign = (f >> 16) & 0x8000;
+  const int float_exponent = (f >> 23) & 0xff;
+  uint32_t mantissa = f & 0x7fffff;
+  if (float_exponent == 0xff) {
+    // infinity, or NaN kept quiet
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  const int exponent = float_exponent - 127 + 15;
+  if (exponent >= 0x1f) {
+    return sign | 0x7c00;
+  }
+  uint32_t half;
+  uint32_t rest;
+  uint32_t halfway;
+  if (exponent <= 0) {
+    if (exponent < -10) {
+      return sign;
+    }
+    // denormal: shift the mantissa, implicit bit included, into place
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    half = mantissa >> shift;
+    rest = mantissa & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+  } else {
+    half = (exponent << 10) | (mantissa >> 13);
+    rest = mantissa & 0x1fff;
+    halfway = 0x1000;
+  }
+  // A carry out of the mantissa correctly bumps the exponent.
+  if (rest > halfway || (rest == halfway && (half & 1))) {
+    ++half;
+  }
+  return sign | half;
+}
+
+static float HalfToFloat(const uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  int exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t f;
+  if (exponent == 0x1f) {
+    f = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent == 0 && mantissa == 0) {
+    f = sign;
+  } else {
+    if (exponent == 0) {
+      // denormal: normalize the mantissa
+      exponent = 1;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        --exponent;
+      }
+      mantissa &= 0x3ff;
+    }
+    f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+  float value;
+  memcpy(&value, &f, sizeof(value));
+  return value;
+}
+
+int DatumValueCount(const Datum& datum) {
+  switch (datum.data_type()) {
+  case Datum_DataType_FLOAT16:
+    return datum.data().size() / sizeof(uint16_t);
+  case Datum_DataType_FLOAT32:
+    return datum.data().size() / sizeof(float);
+  default:
+    return datum.data().size() ? datum.data().size()
+                               : datum.float_data_size();
+  }
+}
+
+template <typename Dtype>
+void DatumToValues(const Datum& datum, const int index, const int count,
+    Dtype* dst) {
+  CHECK(!datum.encoded()) << "Datum values need decoding first";
+  CHECK_GE(index, 0);
+  CHECK_LE(index + count, DatumValueCount(datum));
+  const char* data = datum.data().data();
+  switch (datum.data_type()) {
+  case Datum_DataType_FLOAT16:
+    for (int i = 0; i < count; ++i) {
+      uint16_t half;
+      memcpy(&half, data + (index + i) * sizeof(half), sizeof(half));
+      dst[i] = HalfToFloat(half);
+    }
+    break;
+  case Datum_DataType_FLOAT32:
+    for (int i = 0; i < count; ++i) {
+      float value;
+      memcpy(&value, data + (index + i) * sizeof(value), sizeof(value));
+      dst[i] = value;
+    }
+    break;
+  default:
+    if (datum.data().size()) {
+      const uint8_t* pixels = reinterpret_cast<const uint8_t*>(data) + index;
+      for (int i = 0; i < count; ++i) {
+        dst[i] = pixels[i];
+      }
+    } else {
+      const float* values = datum.float_data().data() + index;
+      for (int i = 0; i < count; ++i) {
+        dst[i] = values[i];
+      }
+    }
+  }
+}
+
+template void DatumToValues<float>(const Datum& datum, const int index,
+    const int count, float* dst);
+template void DatumToValues<double>(const Datum& datum, const int index,
+    const int count, double* dst);
+
+void FloatsToDatum(const float* values, const int count,
+    const Datum_DataType type, Datum* datum) {
+  datum->clear_float_data();
+  datum->set_encoded(false);
+  datum->set_data_type(type);
+  string* data = datum->mutable_data();
+  switch (type) {
+  case Datum_DataType_FLOAT16:
+    data->resize(count * sizeof(uint16_t));
+    for (int i = 0; i < count; ++i) {
+      const uint16_t half = FloatToHalf(values[i]);
+      memcpy(&(*data)[i * sizeof(half)], &half, sizeof(half));
+    }
+    break;
+  case Datum_DataType_FLOAT32:
+    data->assign(reinterpret_cast<const char*>(values), count * sizeof(float));
+    break;
+  default:
+    LOG(FATAL) << "FloatsToDatum stores FLOAT16 or FLOAT32 data only";
+  }
+}
+
 // Verifies format of data stored in HDF5 file and reshapes blob accordingly.
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
@@ -304,4 +988,16 @@ void hdf5_save_nd_dataset<double>(
   CHECK_GE(status, 0) << "Failed to make double dataset " << dataset_name;
 }
 
+template <>
+hid_t hdf5_native_type<float>() { return H5T_NATIVE_FLOAT; }
+
+template <>
+hid_t hdf5_native_type<double>() { return H5T_NATIVE_DOUBLE; }
+
+static boost::mutex hdf5_io_mutex;
+
+boost::mutex& hdf5_mutex() {
+  return hdf5_io_mutex;
+}
+
 }  // namespace caffe
@@ -1,5 +1,6 @@
 #include <boost/math/special_functions/next.hpp>
 #include <boost/random.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <limits>
 
@@ -221,7 +222,12 @@ void caffe_abs<double>(const int n, const double* a, double* y) {
     vdAbs(n, a, y);
 }
 
+// Guards Caffe's random generator, which the replicas of a data-parallel
+// solver draw from at the same time.
+static boost::mutex rng_mutex;
+
 unsigned int caffe_rng_rand() {
+  boost::mutex::scoped_lock lock(rng_mutex);
   return (*caffe_rng())();
 }
 
@@ -239,6 +245,7 @@ double caffe_nextafter(const double b);
 
 template <typename Dtype>
 void caffe_rng_uniform(const int n, const Dtype a, const Dtype b, Dtype* r) {
+  boost::mutex::scoped_lock lock(rng_mutex);
   CHECK_GE(n, 0);
   CHECK(r);
   CHECK_LE(a, b);
@@ -261,6 +268,7 @@ void caffe_rng_uniform<double>(const int n, const double a, const double b,
 template <typename Dtype>
 void caffe_rng_gaussian(const int n, const Dtype a,
                         const Dtype sigma, Dtype* r) {
+  boost::mutex::scoped_lock lock(rng_mutex);
   CHECK_GE(n, 0);
   CHECK(r);
   CHECK_GT(sigma, 0);
@@ -282,6 +290,7 @@ void caffe_rng_gaussian<double>(const int n, const double mu,
 
 template <typename Dtype>
 void caffe_rng_bernoulli(const int n, const Dtype p, int* r) {
+  boost::mutex::scoped_lock lock(rng_mutex);
   CHECK_GE(n, 0);
   CHECK(r);
   CHECK_GE(p, 0);
@@ -302,6 +311,7 @@ void caffe_rng_bernoulli<float>(const int n, const float p, int* r);
 
 template <typename Dtype>
 void caffe_rng_bernoulli(const int n, const Dtype p, unsigned int* r) {
+  boost::mutex::scoped_lock lock(rng_mutex);
   CHECK_GE(n, 0);
   CHECK(r);
   CHECK_GE(p, 0);
@@ -389,4 +399,119 @@ void caffe_cpu_scale<double>(const int n, const double alpha, const double *x,
   cblas_dscal(n, alpha, y, 1);
 }
 
+// The regularized gradient of one weight; the sign is computed without
+// branches so the update loops vectorize.
+template <typename Dtype>
+static inline Dtype regularized_gradient(const Dtype w, const Dtype g,
+    const Dtype l2_decay, const Dtype l1_decay) {
+  const Dtype sign = static_cast<Dtype>((Dtype(0) < w) - (w < Dtype(0)));
+  return g + l2_decay * w + l1_decay * sign;
+}
+
+template <typename Dtype>
+void caffe_cpu_sgd_update(const int n, const Dtype rate, const Dtype momentum,
+    const Dtype l2_decay, const Dtype l1_decay, const Dtype* diff,
+    Dtype* history, Dtype* data) {
+  for (int i = 0; i < n; ++i) {
+    const Dtype w = data[i];
+    const Dtype g = regularized_gradient(w, diff[i], l2_decay, l1_decay);
+    const Dtype h = momentum * history[i] + rate * g;
+    history[i] = h;
+    data[i] = w - h;
+  }
+}
+
+template void caffe_cpu_sgd_update<float>(const int n, const float rate,
+    const float momentum, const float l2_decay, const float l1_decay,
+    const float* diff, float* history, float* data);
+template void caffe_cpu_sgd_update<double>(const int n, const double rate,
+    const double momentum, const double l2_decay, const double l1_decay,
+    const double* diff, double* history, double* data);
+
+template <typename Dtype>
+void caffe_cpu_nesterov_update(const int n, const Dtype rate,
+    const Dtype momentum, const Dtype l2_decay, const Dtype l1_decay,
+    const Dtype* diff, Dtype* history, Dtype* data) {
+  for (int i = 0; i < n; ++i) {
+    const Dtype w = data[i];
+    const Dtype g = regularized_gradient(w, diff[i], l2_decay, l1_decay);
+    const Dtype h_prev = history[i];
+    const Dtype h = momentum * h_prev + rate * g;
+    history[i] = h;
+    data[i] = w - ((Dtype(1) + momentum) * h - momentum * h_prev);
+  }
+}
+
+template void caffe_cpu_nesterov_update<float>(const int n, const float rate,
+    const float momentum, const float l2_decay, const float l1_decay,
+    const float* diff, float* history, float* data);
+template void caffe_cpu_nesterov_update<double>(const int n,
+    const double rate, const double momentum, const double l2_decay,
+    const double l1_decay, const double* diff, double* history, double* data);
+
+template <typename Dtype>
+void caffe_cpu_adagrad_update(const int n, const Dtype rate,
+    const Dtype delta, const Dtype l2_decay, const Dtype l1_decay,
+    const Dtype* diff, Dtype* history, Dtype* data) {
+  for (int i = 0; i < n; ++i) {
+    const Dtype w = data[i];
+    const Dtype g = regularized_gradient(w, diff[i], l2_decay, l1_decay);
+    const Dtype h = history[i] + g * g;
+    history[i] = h;
+    data[i] = w - rate * g / (std::sqrt(h) + delta);
+  }
+}
+
+template void caffe_cpu_adagrad_update<float>(const int n, const float rate,
+    const float delta, const float l2_decay, const float l1_decay,
+    const float* diff, float* history, float* data);
+template void caffe_cpu_adagrad_update<double>(const int n, const double rate,
+    const double delta, const double l2_decay, const double l1_decay,
+    const double* diff, double* history, double* data);
+
+template <typename Dtype>
+void caffe_cpu_rmsprop_update(const int n, const Dtype rate,
+    const Dtype decay, const Dtype delta, const Dtype l2_decay,
+    const Dtype l1_decay, const Dtype* diff, Dtype* history, Dtype* data) {
+  for (int i = 0; i < n; ++i) {
+    const Dtype w = data[i];
+    const Dtype g = regularized_gradient(w, diff[i], l2_decay, l1_decay);
+    const Dtype h = decay * history[i] + (Dtype(1) - decay) * g * g;
+    history[i] = h;
+    data[i] = w - rate * g / (std::sqrt(h) + delta);
+  }
+}
+
+template void caffe_cpu_rmsprop_update<float>(const int n, const float rate,
+    const float decay, const float delta, const float l2_decay,
+    const float l1_decay, const float* diff, float* history, float* data);
+template void caffe_cpu_rmsprop_update<double>(const int n,
+    const double rate, const double decay, const double delta,
+    const double l2_decay, const double l1_decay, const double* diff,
+    double* history, double* data);
+
+template <typename Dtype>
+void caffe_cpu_adam_update(const int n, const Dtype rate, const Dtype beta1,
+    const Dtype beta2, const Dtype delta, const Dtype l2_decay,
+    const Dtype l1_decay, const Dtype* diff, Dtype* m, Dtype* v, Dtype* data) {
+  for (int i = 0; i < n; ++i) {
+    const Dtype w = data[i];
+    const Dtype g = regularized_gradient(w, diff[i], l2_decay, l1_decay);
+    const Dtype m_i = beta1 * m[i] + (Dtype(1) - beta1) * g;
+    const Dtype v_i = beta2 * v[i] + (Dtype(1) - beta2) * g * g;
+    m[i] = m_i;
+    v[i] = v_i;
+    data[i] = w - rate * m_i / (std::sqrt(v_i) + delta);
+  }
+}
+
+template void caffe_cpu_adam_update<float>(const int n, const float rate,
+    const float beta1, const float beta2, const float delta,
+    const float l2_decay, const float l1_decay, const float* diff, float* m,
+    float* v, float* data);
+template void caffe_cpu_adam_update<double>(const int n, const double rate,
+    const double beta1, const double beta2, const double delta,
+    const double l2_decay, const double l1_decay, const double* diff,
+    double* m, double* v, double* data);
+
 }  // namespace caffe
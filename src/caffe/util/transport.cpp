@@ -0,0 +1,351 @@
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "boost/algorithm/string.hpp"
+#include "boost/asio.hpp"
+#include "boost/bind.hpp"
+#include "boost/interprocess/managed_shared_memory.hpp"
+#include "boost/interprocess/sync/interprocess_condition.hpp"
+#include "boost/interprocess/sync/interprocess_mutex.hpp"
+#include "boost/interprocess/sync/scoped_lock.hpp"
+#include "boost/thread.hpp"
+
+#include "caffe/common.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/transport.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+Transport<Dtype>::Transport(int rank, int num_ranks)
+    : rank_(rank), num_ranks_(num_ranks) {
+  CHECK_GT(num_ranks, 0);
+  CHECK_GE(rank, 0);
+  CHECK_LT(rank, num_ranks);
+}
+
+namespace bip = boost::interprocess;
+
+// What the ranks of a ShmTransport share, besides their values.
+struct ShmHeader {
+  explicit ShmHeader(int num_ranks)
+      : num_ranks(num_ranks), attached(0), arrived(0), generation(0) { }
+  bip::interprocess_mutex mutex;
+  bip::interprocess_condition condition;
+  const int num_ranks;
+  int attached;
+  // The barrier: ranks arrived at it, and how many times it opened.
+  int arrived;
+  int generation;
+};
+
+/**
+ * @brief A Transport between processes of one machine, through a shared
+ *        memory segment.
+ *
+ * The segment holds one slot of kChunkSize values per rank, and one for
+ * the results. Values go through it a chunk at a time: each rank copies
+ * its chunk into its slot, sums its own part of the chunk over all the
+ * slots, and copies the whole sum back out.
+ */
+template <typename Dtype>
+class ShmTransport : public Transport<Dtype> {
+ public:
+  ShmTransport(const string& name, int rank, int num_ranks);
+  virtual ~ShmTransport();
+
+  virtual void AllReduce(Dtype* data, int count);
+  virtual void Broadcast(Dtype* data, int count, int root);
+
+ protected:
+  static const int kChunkSize = 1 << 18;
+
+  // Blocks until all ranks have called it.
+  void Barrier();
+  inline Dtype* slot(int i) { return values_ + i * kChunkSize; }
+
+  const string name_;
+  shared_ptr<bip::managed_shared_memory> segment_;
+  ShmHeader* header_;
+  Dtype* values_;
+};
+
+template <typename Dtype>
+ShmTransport<Dtype>::ShmTransport(const string& name, int rank,
+    int num_ranks)
+    : Transport<Dtype>(rank, num_ranks), name_(name) {
+  const int num_values = (num_ranks + 1) * kChunkSize;
+  const size_t size = sizeof(ShmHeader) + num_values * sizeof(Dtype)
+      + (1 << 16);
+  segment_.reset(new bip::managed_shared_memory(bip::open_or_create,
+      name.c_str(), size));
+  header_ = segment_->find_or_construct<ShmHeader>("header")(num_ranks);
+  values_ = segment_->find_or_construct<Dtype>("values")[num_values](0);
+  CHECK_EQ(header_->num_ranks, num_ranks) << "Shared memory " << name
+      << " is in use by a run with another number of ranks";
+  {
+    bip::scoped_lock<bip::interprocess_mutex> lock(header_->mutex);
+    CHECK_LT(header_->attached, num_ranks) << "Shared memory " << name
+        << " is in use by another run, or left over from one";
+    ++header_->attached;
+  }
+  // The last rank to leave removes the segment, so all must have opened it.
+  Barrier();
+}
+
+template <typename Dtype>
+ShmTransport<Dtype>::~ShmTransport() {
+  bool last;
+  {
+    bip::scoped_lock<bip::interprocess_mutex> lock(header_->mutex);
+    last = --header_->attached == 0;
+  }
+  segment_.reset();
+  if (last) {
+    bip::shared_memory_object::remove(name_.c_str());
+  }
+}
+
+template <typename Dtype>
+void ShmTransport<Dtype>::Barrier() {
+  bip::scoped_lock<bip::interprocess_mutex> lock(header_->mutex);
+  const int generation = header_->generation;
+  if (++header_->arrived == this->num_ranks_) {
+    header_->arrived = 0;
+    ++header_->generation;
+    header_->condition.notify_all();
+    return;
+  }
+  while (header_->generation == generation) {
+    header_->condition.wait(lock);
+  }
+}
+
+template <typename Dtype>
+void ShmTransport<Dtype>::AllReduce(Dtype* data, int count) {
+  const int num_ranks = this->num_ranks_;
+  Dtype* sum = slot(num_ranks);
+  for (int offset = 0; offset < count; offset += kChunkSize) {
+    const int n = std::min<int>(kChunkSize, count - offset);
+    caffe_copy(n, data + offset, slot(this->rank_));
+    Barrier();
+    // Every value is summed by one rank in rank order, so all ranks read
+    // the same results.
+    const int begin = static_cast<int64_t>(n) * this->rank_ / num_ranks;
+    const int end = static_cast<int64_t>(n) * (this->rank_ + 1) / num_ranks;
+    if (begin < end) {
+      caffe_copy(end - begin, slot(0) + begin, sum + begin);
+      for (int i = 1; i < num_ranks; ++i) {
+        caffe_axpy(end - begin, Dtype(1), slot(i) + begin, sum + begin);
+      }
+    }
+    Barrier();
+    caffe_copy(n, sum, data + offset);
+    // The slots are free again once everyone has read the sum.
+    Barrier();
+  }
+}
+
+template <typename Dtype>
+void ShmTransport<Dtype>::Broadcast(Dtype* data, int count, int root) {
+  Dtype* values = slot(this->num_ranks_);
+  for (int offset = 0; offset < count; offset += kChunkSize) {
+    const int n = std::min<int>(kChunkSize, count - offset);
+    if (this->rank_ == root) {
+      caffe_copy(n, data + offset, values);
+    }
+    Barrier();
+    if (this->rank_ != root) {
+      caffe_copy(n, values, data + offset);
+    }
+    Barrier();
+  }
+}
+
+using boost::asio::ip::tcp;
+
+/**
+ * @brief A Transport over TCP, with the ranks connected in a ring.
+ *
+ * AllReduce is the ring all-reduce: the values are cut into one segment per
+ * rank, and in num_ranks - 1 steps each rank adds the segment its previous
+ * rank sends into its own and passes it on, until every segment is summed
+ * on one rank; in num_ranks - 1 more steps the sums go around the ring.
+ * Each rank thus sends and receives about twice its values, whatever the
+ * number of ranks.
+ */
+template <typename Dtype>
+class TcpTransport : public Transport<Dtype> {
+ public:
+  TcpTransport(const vector<string>& endpoints, int rank);
+
+  virtual void AllReduce(Dtype* data, int count);
+  virtual void Broadcast(Dtype* data, int count, int root);
+
+ protected:
+  // Sends send_size bytes to the next rank while receiving recv_size bytes
+  // from the previous one, so neither side waits for the other to read.
+  void Exchange(const void* send, size_t send_size, void* recv,
+      size_t recv_size);
+  // The values of segment i of num_ranks_ segments of count values.
+  inline int segment_begin(int i, int count) const {
+    return static_cast<int64_t>(count) * i / this->num_ranks_;
+  }
+
+  boost::asio::io_service io_service_;
+  tcp::socket next_;
+  tcp::socket prev_;
+  vector<Dtype> buffer_;
+};
+
+static void SplitEndpoint(const string& endpoint, string* host,
+    string* port) {
+  const size_t colon = endpoint.rfind(':');
+  CHECK(colon != string::npos && colon > 0 && colon + 1 < endpoint.size())
+      << "Expected HOST:PORT, got " << endpoint;
+  *host = endpoint.substr(0, colon);
+  *port = endpoint.substr(colon + 1);
+}
+
+static void SetError(boost::system::error_code* result,
+    const boost::system::error_code& error) {
+  *result = error;
+}
+
+template <typename Dtype>
+TcpTransport<Dtype>::TcpTransport(const vector<string>& endpoints, int rank)
+    : Transport<Dtype>(rank, endpoints.size()),
+      next_(io_service_), prev_(io_service_) {
+  const int num_ranks = this->num_ranks_;
+  if (num_ranks == 1) {
+    return;
+  }
+  string host, port;
+  SplitEndpoint(endpoints[rank], &host, &port);
+  tcp::acceptor acceptor(io_service_,
+      tcp::endpoint(tcp::v4(), atoi(port.c_str())));
+  // The next rank may not be listening yet.
+  const int next_rank = (rank + 1) % num_ranks;
+  SplitEndpoint(endpoints[next_rank], &host, &port);
+  tcp::resolver resolver(io_service_);
+  const int kMaxAttempts = 600;
+  for (int attempt = 1; ; ++attempt) {
+    boost::system::error_code error;
+    tcp::resolver::iterator it =
+        resolver.resolve(tcp::resolver::query(host, port), error);
+    if (!error) {
+      boost::asio::connect(next_, it, error);
+    }
+    if (!error) {
+      break;
+    }
+    next_.close();
+    CHECK_LT(attempt, kMaxAttempts) << "Failed to connect to rank "
+        << next_rank << " at " << endpoints[next_rank] << ": "
+        << error.message();
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  }
+  acceptor.accept(prev_);
+  next_.set_option(tcp::no_delay(true));
+  prev_.set_option(tcp::no_delay(true));
+  int32_t prev_rank = rank;
+  Exchange(&prev_rank, sizeof(prev_rank), &prev_rank, sizeof(prev_rank));
+  CHECK_EQ(prev_rank, (rank + num_ranks - 1) % num_ranks)
+      << "The endpoints differ between ranks";
+}
+
+template <typename Dtype>
+void TcpTransport<Dtype>::Exchange(const void* send, size_t send_size,
+    void* recv, size_t recv_size) {
+  boost::system::error_code write_error, read_error;
+  boost::asio::async_write(next_, boost::asio::buffer(send, send_size),
+      boost::bind(&SetError, &write_error, boost::asio::placeholders::error));
+  boost::asio::async_read(prev_, boost::asio::buffer(recv, recv_size),
+      boost::bind(&SetError, &read_error, boost::asio::placeholders::error));
+  io_service_.reset();
+  io_service_.run();
+  CHECK(!write_error) << "Failed to send to the next rank: "
+      << write_error.message();
+  CHECK(!read_error) << "Failed to receive from the previous rank: "
+      << read_error.message();
+}
+
+template <typename Dtype>
+void TcpTransport<Dtype>::AllReduce(Dtype* data, int count) {
+  const int num_ranks = this->num_ranks_;
+  const int rank = this->rank_;
+  if (num_ranks == 1) {
+    return;
+  }
+  buffer_.resize(count / num_ranks + 1);
+  // Reduce-scatter: afterwards segment rank + 1 holds the sum here.
+  for (int step = 0; step < num_ranks - 1; ++step) {
+    const int send = (rank - step + num_ranks) % num_ranks;
+    const int recv = (rank - step - 1 + num_ranks) % num_ranks;
+    const int send_begin = segment_begin(send, count);
+    const int recv_begin = segment_begin(recv, count);
+    const int recv_count = segment_begin(recv + 1, count) - recv_begin;
+    Exchange(data + send_begin,
+        (segment_begin(send + 1, count) - send_begin) * sizeof(Dtype),
+        &buffer_[0], recv_count * sizeof(Dtype));
+    caffe_axpy(recv_count, Dtype(1), &buffer_[0], data + recv_begin);
+  }
+  // All-gather: pass the sums around.
+  for (int step = 0; step < num_ranks - 1; ++step) {
+    const int send = (rank + 1 - step + num_ranks) % num_ranks;
+    const int recv = (rank - step + num_ranks) % num_ranks;
+    const int send_begin = segment_begin(send, count);
+    const int recv_begin = segment_begin(recv, count);
+    Exchange(data + send_begin,
+        (segment_begin(send + 1, count) - send_begin) * sizeof(Dtype),
+        data + recv_begin,
+        (segment_begin(recv + 1, count) - recv_begin) * sizeof(Dtype));
+  }
+}
+
+template <typename Dtype>
+void TcpTransport<Dtype>::Broadcast(Dtype* data, int count, int root) {
+  const int num_ranks = this->num_ranks_;
+  if (num_ranks == 1) {
+    return;
+  }
+  const size_t size = count * sizeof(Dtype);
+  if (this->rank_ != root) {
+    boost::asio::read(prev_, boost::asio::buffer(data, size));
+  }
+  if ((this->rank_ + 1) % num_ranks != root) {
+    boost::asio::write(next_, boost::asio::buffer(data, size));
+  }
+}
+
+template <typename Dtype>
+Transport<Dtype>* GetTransport(const string& uri, int rank, int num_ranks) {
+  if (uri.compare(0, 6, "shm://") == 0) {
+    CHECK_GT(num_ranks, 0) << "shm:// needs the number of ranks";
+    return new ShmTransport<Dtype>(uri.substr(6), rank, num_ranks);
+  } else if (uri.compare(0, 6, "tcp://") == 0) {
+    const string list = uri.substr(6);
+    vector<string> endpoints;
+    boost::split(endpoints, list, boost::is_any_of(","));
+    CHECK(num_ranks == 0 || num_ranks == endpoints.size())
+        << "Expected " << num_ranks << " endpoints in " << uri;
+    return new TcpTransport<Dtype>(endpoints, rank);
+  }
+  LOG(FATAL) << "Unknown transport " << uri;
+  return NULL;
+}
+
+INSTANTIATE_CLASS(Transport);
+INSTANTIATE_CLASS(ShmTransport);
+INSTANTIATE_CLASS(TcpTransport);
+template Transport<float>* GetTransport(const string& uri, int rank,
+    int num_ranks);
+template Transport<double>* GetTransport(const string& uri, int rank,
+    int num_ranks);
+
+}  // namespace caffe
@@ -24,12 +24,21 @@ DEFINE_string(solver, "",
 DEFINE_string(model, "",
     "The model definition protocol buffer text file..");
 DEFINE_string(snapshot, "",
-    "Optional; the snapshot solver state to resume training.");
+    "Optional; the snapshot solver state to resume training. With a "
+    "transport, every rank must be given it, but only rank 0 reads it.");
 DEFINE_string(weights, "",
     "Optional; the pretrained weights to initialize finetuning. "
     "Cannot be set simultaneously with snapshot.");
 DEFINE_int32(iterations, 50,
     "The number of iterations to run.");
+DEFINE_string(transport, "",
+    "Optional; train together with other processes through shm://NAME or "
+    "tcp://HOST:PORT,HOST:PORT,... (one endpoint per rank).");
+DEFINE_int32(rank, 0,
+    "The rank of this process when training with a transport.");
+DEFINE_int32(num_ranks, 0,
+    "The number of processes training with a transport; tcp:// takes it "
+    "from the endpoints.");
 
 // A simple registry for caffe commands.
 typedef int (*BrewFunction)();
@@ -118,16 +127,32 @@ int train() {
     Caffe::set_mode(Caffe::CPU);
   }
 
+  shared_ptr<caffe::Transport<float> > transport;
+  if (FLAGS_transport.size()) {
+    transport.reset(caffe::GetTransport<float>(FLAGS_transport, FLAGS_rank,
+        FLAGS_num_ranks));
+    // The ranks should not draw the same random data and transformations,
+    // nor read the same records.
+    if (solver_param.random_seed() >= 0) {
+      solver_param.set_random_seed(solver_param.random_seed() + FLAGS_rank);
+    }
+    solver_param.set_data_shard(transport->rank());
+    solver_param.set_num_data_shards(transport->num_ranks());
+  }
+
   LOG(INFO) << "Starting Optimization";
   shared_ptr<caffe::Solver<float> >
     solver(caffe::GetSolver<float>(solver_param));
 
+  if (FLAGS_weights.size()) {
+    CopyLayers(&*solver, FLAGS_weights);
+  }
+  if (transport) {
+    solver->set_transport(transport);
+  }
   if (FLAGS_snapshot.size()) {
     LOG(INFO) << "Resuming from " << FLAGS_snapshot;
     solver->Solve(FLAGS_snapshot);
-  } else if (FLAGS_weights.size()) {
-    CopyLayers(&*solver, FLAGS_weights);
-    solver->Solve();
   } else {
     solver->Solve();
   }
@@ -231,6 +256,14 @@ int time() {
   caffe_net.Backward();
 
   const vector<shared_ptr<Layer<float> > >& layers = caffe_net.layers();
+  // Only time the data pipeline over the benchmark iterations.
+  for (int i = 0; i < layers.size(); ++i) {
+    caffe::PrefetchStatsRecorder* recorder =
+        dynamic_cast<caffe::PrefetchStatsRecorder*>(layers[i].get());
+    if (recorder) {
+      recorder->ResetPrefetchStats();
+    }
+  }
   const vector<vector<Blob<float>*> >& bottom_vecs = caffe_net.bottom_vecs();
   const vector<vector<Blob<float>*> >& top_vecs = caffe_net.top_vecs();
   const vector<vector<bool> >& bottom_need_backward =
@@ -280,6 +313,15 @@ int time() {
       "\tbackward: " << backward_time_per_layer[i] / 1000 /
       FLAGS_iterations << " ms.";
   }
+  for (int i = 0; i < layers.size(); ++i) {
+    const caffe::PrefetchStatsRecorder* recorder =
+        dynamic_cast<const caffe::PrefetchStatsRecorder*>(layers[i].get());
+    if (recorder) {
+      LOG(INFO) << std::setfill(' ') << std::setw(10)
+          << layers[i]->layer_param().name() << "\tdata pipeline: "
+          << recorder->prefetch_stats().ToString() << ".";
+    }
+  }
   total_timer.Stop();
   LOG(INFO) << "Average Forward pass: " << forward_time / 1000 /
     FLAGS_iterations << " ms.";
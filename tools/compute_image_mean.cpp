@@ -5,10 +5,12 @@
 #include <vector>
 
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 
@@ -19,7 +21,103 @@ using std::pair;
 using boost::scoped_ptr;
 
 DEFINE_string(backend, "lmdb",
-        "The backend {leveldb, lmdb} containing the images");
+        "The backend {leveldb, lmdb, packed} containing the images");
+DEFINE_int32(threads, 0,
+        "Number of threads decoding and summing images (0: one per core)");
+DEFINE_int32(sample_every, 1,
+        "Only use every k-th record of the db, for a quick estimate");
+DEFINE_bool(channel_mean_only, false,
+        "Only compute the per-channel mean values; images may then differ "
+        "in size, and OUTPUT_FILE holds a 1 x channels x 1 x 1 blob");
+
+namespace {
+
+// Per-thread running sums, kept in double so millions of images add up
+// without losing precision.
+struct MeanAccumulator {
+  MeanAccumulator() : count(0), channel_pixels(0) { }
+  vector<double> sum;
+  vector<double> channel_sum;
+  int count;
+  int64_t channel_pixels;
+};
+
+void AccumulateImages(BlockingQueue<string*>* values, int data_size,
+    int channels, MeanAccumulator* acc) {
+  if (!FLAGS_channel_mean_only) {
+    acc->sum.assign(data_size, 0.);
+  }
+  acc->channel_sum.assign(channels, 0.);
+  vector<float> float_values;
+  while (true) {
+    string* value;
+    values->pop(&value);
+    if (value == NULL) {
+      break;
+    }
+    Datum datum;
+    datum.ParseFromString(*value);
+    delete value;
+    DecodeDatumNative(&datum);
+
+    const std::string& data = datum.data();
+    const int size_in_datum = DatumValueCount(datum);
+    CHECK_EQ(datum.channels(), channels) << "Incorrect number of channels";
+    const int dim = datum.height() * datum.width();
+    CHECK_EQ(size_in_datum, FLAGS_channel_mean_only ? channels * dim :
+        data_size) << "Incorrect data field size " << size_in_datum;
+    const uint8_t* pixels = NULL;
+    if (datum.data_type() == Datum_DataType_UINT8 && data.size() != 0) {
+      pixels = reinterpret_cast<const uint8_t*>(data.data());
+    } else {
+      // float_data, or float16/float32 values packed in data
+      float_values.resize(size_in_datum);
+      DatumToValues(datum, 0, size_in_datum, &float_values[0]);
+    }
+    if (FLAGS_channel_mean_only) {
+      for (int c = 0; c < channels; ++c) {
+        double channel_sum = 0;
+        if (pixels) {
+          for (int i = 0; i < dim; ++i) {
+            channel_sum += pixels[c * dim + i];
+          }
+        } else {
+          for (int i = 0; i < dim; ++i) {
+            channel_sum += float_values[c * dim + i];
+          }
+        }
+        acc->channel_sum[c] += channel_sum;
+      }
+      acc->channel_pixels += dim;
+    } else {
+      double* sum = &acc->sum[0];
+      if (pixels) {
+        for (int i = 0; i < size_in_datum; ++i) {
+          sum[i] += pixels[i];
+        }
+      } else {
+        for (int i = 0; i < size_in_datum; ++i) {
+          sum[i] += float_values[i];
+        }
+      }
+    }
+    ++acc->count;
+  }
+}
+
+// Moves the cursor k records forward, in one jump for indexed dbs.
+void Skip(db::Cursor* cursor, int k) {
+  db::PackedCursor* packed_cursor = dynamic_cast<db::PackedCursor*>(cursor);
+  if (packed_cursor) {
+    packed_cursor->Seek(packed_cursor->position() + k);
+    return;
+  }
+  for (int i = 0; i < k && cursor->valid(); ++i) {
+    cursor->Next();
+  }
+}
+
+}  // namespace
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -39,6 +137,7 @@ int main(int argc, char** argv) {
     gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/compute_image_mean");
     return 1;
   }
+  CHECK_GE(FLAGS_sample_every, 1);
 
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open(argv[1], db::READ);
@@ -54,66 +153,87 @@ int main(int argc, char** argv) {
     LOG(INFO) << "Decoding Datum";
   }
 
+  const int channels = datum.channels();
   sum_blob.set_num(1);
-  sum_blob.set_channels(datum.channels());
-  sum_blob.set_height(datum.height());
-  sum_blob.set_width(datum.width());
+  sum_blob.set_channels(channels);
+  sum_blob.set_height(FLAGS_channel_mean_only ? 1 : datum.height());
+  sum_blob.set_width(FLAGS_channel_mean_only ? 1 : datum.width());
   const int data_size = datum.channels() * datum.height() * datum.width();
-  int size_in_datum = std::max<int>(datum.data().size(),
-                                    datum.float_data_size());
-  for (int i = 0; i < size_in_datum; ++i) {
-    sum_blob.add_data(0.);
+
+  int num_threads = FLAGS_threads;
+  if (num_threads <= 0) {
+    num_threads = std::max<int>(1, boost::thread::hardware_concurrency());
   }
-  LOG(INFO) << "Starting Iteration";
+  LOG(INFO) << "Starting Iteration with " << num_threads << " threads";
+  if (FLAGS_sample_every > 1) {
+    LOG(INFO) << "Sampling every " << FLAGS_sample_every << " records";
+  }
+  BlockingQueue<string*> values(4 * num_threads);
+  vector<MeanAccumulator> accumulators(num_threads);
+  boost::thread_group threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.create_thread(boost::bind(&AccumulateImages, &values, data_size,
+        channels, &accumulators[i]));
+  }
+  // This thread only reads the db; parsing, decoding and summing happen on
+  // the workers.
+  int num_read = 0;
   while (cursor->valid()) {
-    Datum datum;
-    datum.ParseFromString(cursor->value());
-    DecodeDatumNative(&datum);
-
-    const std::string& data = datum.data();
-    size_in_datum = std::max<int>(datum.data().size(),
-        datum.float_data_size());
-    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
-        size_in_datum;
-    if (data.size() != 0) {
-      CHECK_EQ(data.size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) + (uint8_t)data[i]);
-      }
-    } else {
-      CHECK_EQ(datum.float_data_size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) +
-            static_cast<float>(datum.float_data(i)));
-      }
-    }
-    ++count;
-    if (count % 10000 == 0) {
-      LOG(INFO) << "Processed " << count << " files.";
+    values.push(new string(cursor->value()));
+    if (++num_read % 10000 == 0) {
+      LOG(INFO) << "Processed " << num_read << " files.";
     }
-    cursor->Next();
+    Skip(cursor.get(), FLAGS_sample_every);
   }
-
-  if (count % 10000 != 0) {
-    LOG(INFO) << "Processed " << count << " files.";
+  for (int i = 0; i < num_threads; ++i) {
+    values.push(NULL);
+  }
+  threads.join_all();
+
+  // Reduce the per-thread sums.
+  vector<double> sum(FLAGS_channel_mean_only ? 0 : data_size, 0.);
+  vector<double> channel_sum(channels, 0.);
+  int64_t channel_pixels = 0;
+  for (int t = 0; t < num_threads; ++t) {
+    const MeanAccumulator& acc = accumulators[t];
+    count += acc.count;
+    for (int i = 0; i < sum.size(); ++i) {
+      sum[i] += acc.sum[i];
+    }
+    for (int c = 0; c < channels; ++c) {
+      channel_sum[c] += acc.channel_sum[c];
+    }
+    channel_pixels += acc.channel_pixels;
   }
-  for (int i = 0; i < sum_blob.data_size(); ++i) {
-    sum_blob.set_data(i, sum_blob.data(i) / count);
+  LOG(INFO) << "Processed " << count << " files.";
+  CHECK_GT(count, 0) << "No images in " << argv[1];
+
+  std::vector<double> mean_values(channels, 0.0);
+  if (FLAGS_channel_mean_only) {
+    for (int c = 0; c < channels; ++c) {
+      mean_values[c] = channel_sum[c] / channel_pixels;
+      sum_blob.add_data(mean_values[c]);
+    }
+  } else {
+    for (int i = 0; i < data_size; ++i) {
+      sum_blob.add_data(sum[i] / count);
+    }
+    const int dim = data_size / channels;
+    for (int c = 0; c < channels; ++c) {
+      for (int i = 0; i < dim; ++i) {
+        mean_values[c] += sum[dim * c + i];
+      }
+      mean_values[c] /= static_cast<double>(dim) * count;
+    }
   }
   // Write to disk
   if (argc == 3) {
     LOG(INFO) << "Write to " << argv[2];
     WriteProtoToBinaryFile(sum_blob, argv[2]);
   }
-  const int channels = sum_blob.channels();
-  const int dim = sum_blob.height() * sum_blob.width();
-  std::vector<float> mean_values(channels, 0.0);
   LOG(INFO) << "Number of channels: " << channels;
   for (int c = 0; c < channels; ++c) {
-    for (int i = 0; i < dim; ++i) {
-      mean_values[c] += sum_blob.data(dim * c + i);
-    }
-    LOG(INFO) << "mean_value channel [" << c << "]:" << mean_values[c] / dim;
+    LOG(INFO) << "mean_value channel [" << c << "]:" << mean_values[c];
   }
   return 0;
 }
@@ -7,18 +7,28 @@
 // should be a list of files as well as their labels, in the format as
 //   subfolder1/file1.JPEG 7
 //   ....
+//
+// Conversion is pipelined: a reader thread loads the files, --threads workers
+// decode, resize and encode them, and the main thread writes the results to
+// the db in list order. With --resume, an interrupted conversion continues
+// after the last image committed to DB_NAME.
 
 #include <algorithm>
+#include <cstdlib>
 #include <fstream>  // NOLINT(readability/streams)
+#include <iterator>
+#include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/rng.hpp"
@@ -31,8 +41,11 @@ DEFINE_bool(gray, false,
     "When this option is on, treat images as grayscale ones");
 DEFINE_bool(shuffle, false,
     "Randomly shuffle the order of images and their labels");
+DEFINE_int32(shuffle_seed, -1,
+    "Optional: seed for --shuffle, making the order reproducible (needed "
+    "by --resume)");
 DEFINE_string(backend, "lmdb",
-        "The backend {lmdb, leveldb} for storing the result");
+        "The backend {lmdb, leveldb, packed} for storing the result");
 DEFINE_int32(resize_width, 0, "Width images are resized to");
 DEFINE_int32(resize_height, 0, "Height images are resized to");
 DEFINE_bool(check_size, false,
@@ -41,6 +54,147 @@ DEFINE_bool(encoded, false,
     "When this option is on, the encoded image will be save in datum");
 DEFINE_string(encode_type, "",
     "Optional: What type should we encode the image as ('png','jpg',...).");
+DEFINE_int32(threads, 0,
+    "Number of decode/resize/encode workers (0: one per core)");
+DEFINE_int32(commit_size, 1000, "Number of images per db transaction");
+DEFINE_bool(resume, false,
+    "Append to an existing DB_NAME, continuing after its last image");
+
+namespace {
+
+// A file read from disk, on its way to a worker. line_id < 0 tells the
+// worker to stop.
+struct Job {
+  int line_id;
+  string contents;
+  bool read_ok;
+};
+
+// A converted image, on its way to the writer.
+struct Result {
+  bool ok;
+  string value;
+  int data_size;
+};
+
+// Holds results until the writer can take them in list order, and keeps the
+// reader from running more than window images ahead of the writer.
+class OrderedResults {
+ public:
+  OrderedResults(int next, int window) : next_(next), window_(window) { }
+
+  void WaitForRoom(int line_id) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (line_id >= next_ + window_) {
+      room_.wait(lock);
+    }
+  }
+  void Put(int line_id, const Result& result) {
+    boost::mutex::scoped_lock lock(mutex_);
+    results_[line_id] = result;
+    lock.unlock();
+    ready_.notify_all();
+  }
+  // Blocks until the result for the next line is in, and returns it.
+  Result TakeNext() {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<int, Result>::iterator it;
+    while ((it = results_.find(next_)) == results_.end()) {
+      ready_.wait(lock);
+    }
+    Result result = it->second;
+    results_.erase(it);
+    ++next_;
+    lock.unlock();
+    room_.notify_all();
+    return result;
+  }
+
+ private:
+  int next_;
+  const int window_;
+  std::map<int, Result> results_;
+  boost::mutex mutex_;
+  boost::condition_variable ready_, room_;
+};
+
+void ReadFiles(const string& root_folder,
+    const std::vector<std::pair<std::string, int> >& lines, int first,
+    int num_workers, OrderedResults* results, BlockingQueue<Job*>* jobs) {
+  for (int line_id = first; line_id < lines.size(); ++line_id) {
+    results->WaitForRoom(line_id);
+    Job* job = new Job();
+    job->line_id = line_id;
+    std::ifstream file((root_folder + lines[line_id].first).c_str(),
+                       std::ios::in | std::ios::binary);
+    job->read_ok = file.is_open();
+    if (job->read_ok) {
+      job->contents.assign((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+    } else {
+      LOG(ERROR) << "Could not open or find file "
+          << root_folder + lines[line_id].first;
+    }
+    jobs->push(job);
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    Job* stop = new Job();
+    stop->line_id = -1;
+    jobs->push(stop);
+  }
+}
+
+void ConvertImages(const std::vector<std::pair<std::string, int> >& lines,
+    int resize_height, int resize_width, bool is_color, bool encoded,
+    const string& encode_type, BlockingQueue<Job*>* jobs,
+    OrderedResults* results) {
+  while (true) {
+    Job* job;
+    jobs->pop(&job);
+    if (job->line_id < 0) {
+      delete job;
+      break;
+    }
+    const string& filename = lines[job->line_id].first;
+    std::string enc = encode_type;
+    if (encoded && !enc.size()) {
+      // Guess the encoding type from the file name
+      size_t p = filename.rfind('.');
+      if ( p == filename.npos )
+        LOG(WARNING) << "Failed to guess the encoding of '" << filename << "'";
+      enc = filename.substr(p);
+      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    }
+    Datum datum;
+    Result result;
+    result.ok = job->read_ok &&
+        DecodeImageToDatum(job->contents, filename, lines[job->line_id].second,
+            resize_height, resize_width, is_color, enc, &datum);
+    if (result.ok) {
+      result.data_size = datum.data().size();
+      CHECK(datum.SerializeToString(&result.value));
+    }
+    results->Put(job->line_id, result);
+    delete job;
+  }
+}
+
+// Returns the line after the highest one already stored in an existing db.
+int FindResumeLine(const string& source, int* num_stored) {
+  scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
+  db->Open(source, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  int last_line = -1;
+  *num_stored = 0;
+  for (; cursor->valid(); cursor->Next()) {
+    // Keys are "%08d_<filename>", the number being the line in LISTFILE.
+    last_line = std::max(last_line, atoi(cursor->key().c_str()));
+    ++(*num_stored);
+  }
+  return last_line + 1;
+}
+
+}  // namespace
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -66,6 +220,9 @@ int main(int argc, char** argv) {
   const bool check_size = FLAGS_check_size;
   const bool encoded = FLAGS_encoded;
   const string encode_type = FLAGS_encode_type;
+  CHECK_GT(FLAGS_commit_size, 0);
+  CHECK(!(FLAGS_resume && FLAGS_shuffle && FLAGS_shuffle_seed < 0))
+      << "--resume with --shuffle needs the --shuffle_seed of the first run";
 
   std::ifstream infile(argv[2]);
   std::vector<std::pair<std::string, int> > lines;
@@ -77,6 +234,9 @@ int main(int argc, char** argv) {
   if (FLAGS_shuffle) {
     // randomly shuffle data
     LOG(INFO) << "Shuffling data";
+    if (FLAGS_shuffle_seed >= 0) {
+      Caffe::set_random_seed(FLAGS_shuffle_seed);
+    }
     shuffle(lines.begin(), lines.end());
   }
   LOG(INFO) << "A total of " << lines.size() << " images.";
@@ -87,44 +247,54 @@ int main(int argc, char** argv) {
   int resize_height = std::max<int>(0, FLAGS_resize_height);
   int resize_width = std::max<int>(0, FLAGS_resize_width);
 
-  // Create new DB
+  // Create new DB, or reopen the one being resumed
+  int first_line = 0;
+  int count = 0;
+  if (FLAGS_resume) {
+    first_line = FindResumeLine(argv[3], &count);
+    LOG(INFO) << "Resuming after " << count << " stored images, at line "
+        << first_line;
+  }
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
-  db->Open(argv[3], db::NEW);
+  db->Open(argv[3], FLAGS_resume ? db::WRITE : db::NEW);
   scoped_ptr<db::Transaction> txn(db->NewTransaction());
 
-  // Storing to db
+  int num_workers = FLAGS_threads;
+  if (num_workers <= 0) {
+    num_workers = std::max<int>(1, boost::thread::hardware_concurrency());
+  }
+  LOG(INFO) << "Converting with " << num_workers << " worker threads.";
+  // Bound the images in flight so memory stays flat however long the list.
+  const int window = 16 * num_workers;
+  BlockingQueue<Job*> jobs(2 * num_workers);
+  OrderedResults results(first_line, window);
   std::string root_folder(argv[1]);
-  Datum datum;
-  int count = 0;
+  boost::thread_group threads;
+  threads.create_thread(boost::bind(&ReadFiles, boost::cref(root_folder),
+      boost::cref(lines), first_line, num_workers, &results, &jobs));
+  for (int i = 0; i < num_workers; ++i) {
+    threads.create_thread(boost::bind(&ConvertImages, boost::cref(lines),
+        resize_height, resize_width, is_color, encoded,
+        boost::cref(encode_type), &jobs, &results));
+  }
+
+  // Storing to db, in list order
   const int kMaxKeyLength = 256;
   char key_cstr[kMaxKeyLength];
   int data_size = 0;
   bool data_size_initialized = false;
+  int pending = 0;
 
-  for (int line_id = 0; line_id < lines.size(); ++line_id) {
-    bool status;
-    std::string enc = encode_type;
-    if (encoded && !enc.size()) {
-      // Guess the encoding type from the file name
-      string fn = lines[line_id].first;
-      size_t p = fn.rfind('.');
-      if ( p == fn.npos )
-        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
-      enc = fn.substr(p);
-      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
-    }
-    status = ReadImageToDatum(root_folder + lines[line_id].first,
-        lines[line_id].second, resize_height, resize_width, is_color,
-        enc, &datum);
-    if (status == false) continue;
+  for (int line_id = first_line; line_id < lines.size(); ++line_id) {
+    Result result = results.TakeNext();
+    if (!result.ok) continue;
     if (check_size) {
       if (!data_size_initialized) {
-        data_size = datum.channels() * datum.height() * datum.width();
+        data_size = result.data_size;
         data_size_initialized = true;
       } else {
-        const std::string& data = datum.data();
-        CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
-            << data.size();
+        CHECK_EQ(result.data_size, data_size) << "Incorrect data field size "
+            << result.data_size;
       }
     }
     // sequential
@@ -132,21 +302,22 @@ int main(int argc, char** argv) {
         lines[line_id].first.c_str());
 
     // Put in db
-    string out;
-    CHECK(datum.SerializeToString(&out));
-    txn->Put(string(key_cstr, length), out);
+    txn->Put(string(key_cstr, length), result.value);
+    ++count;
 
-    if (++count % 1000 == 0) {
+    if (++pending == FLAGS_commit_size) {
       // Commit db
       txn->Commit();
       txn.reset(db->NewTransaction());
+      pending = 0;
       LOG(ERROR) << "Processed " << count << " files.";
     }
   }
   // write the last batch
-  if (count % 1000 != 0) {
+  if (pending != 0) {
     txn->Commit();
     LOG(ERROR) << "Processed " << count << " files.";
   }
+  threads.join_all();
   return 0;
 }
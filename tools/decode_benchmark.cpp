@@ -0,0 +1,92 @@
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "boost/scoped_ptr.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/io.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+
+using boost::scoped_ptr;
+
+DEFINE_string(backend, "lmdb",
+        "The backend {leveldb, lmdb, packed} containing the images");
+DEFINE_int32(min_size, 227,
+        "Smallest side the reduced decode must cover (e.g. the crop size)");
+DEFINE_int32(num, 1000, "Number of encoded images to decode");
+DEFINE_bool(gray, false,
+        "When this option is on, decode images as grayscale");
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Time full-resolution against reduced-resolution"
+        " decoding of the encoded images in a db\n"
+        "Usage:\n"
+        "    decode_benchmark [FLAGS] INPUT_DB\n");
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc != 2) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/decode_benchmark");
+    return 1;
+  }
+#if !defined(USE_LIBJPEG) && CV_MAJOR_VERSION < 3
+  LOG(WARNING) << "Built without USE_LIBJPEG or OpenCV 3: reduced decoding "
+      << "falls back to full resolution.";
+#endif
+
+  scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
+  db->Open(argv[1], db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+
+  // Load the encoded images up front so only decoding is timed.
+  std::vector<Datum> datums;
+  for (; cursor->valid() && datums.size() < FLAGS_num; cursor->Next()) {
+    Datum datum;
+    datum.ParseFromString(cursor->value());
+    if (datum.encoded()) {
+      datums.push_back(datum);
+    }
+  }
+  CHECK(!datums.empty()) << "No encoded images found in " << argv[1];
+  LOG(INFO) << "Decoding " << datums.size() << " images";
+
+  const bool is_color = !FLAGS_gray;
+  CPUTimer timer;
+  double full_pixels = 0;
+  timer.Start();
+  for (int i = 0; i < datums.size(); ++i) {
+    cv::Mat cv_img = DecodeDatumToCVMat(datums[i], is_color);
+    full_pixels += cv_img.total();
+  }
+  const double full_ms = timer.MilliSeconds();
+
+  double reduced_pixels = 0;
+  timer.Start();
+  for (int i = 0; i < datums.size(); ++i) {
+    cv::Mat cv_img = DecodeDatumToCVMat(datums[i], is_color,
+        FLAGS_min_size, FLAGS_min_size);
+    reduced_pixels += cv_img.total();
+  }
+  const double reduced_ms = timer.MilliSeconds();
+
+  LOG(INFO) << "Full decode:    " << full_ms / datums.size()
+      << " ms/image, " << full_pixels / datums.size() << " pixels/image.";
+  LOG(INFO) << "Reduced decode: " << reduced_ms / datums.size()
+      << " ms/image, " << reduced_pixels / datums.size() << " pixels/image.";
+  LOG(INFO) << "Speedup: " << full_ms / std::max(reduced_ms, 1e-3) << "x";
+  return 0;
+}
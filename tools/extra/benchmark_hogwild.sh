@@ -0,0 +1,37 @@
+#!/bin/bash
+# Usage: benchmark_hogwild.sh SOLVER
+# Run from the caffe root. Trains with SOLVER, which sets hogwild_threads,
+# and with the same solver as plain single-threaded SGD (its hogwild_ fields
+# left out), logging to SOLVER_NAME.sgd.log and SOLVER_NAME.hogwild.log.
+# Prints for each run the test accuracy and loss against the iterations and
+# the seconds since the start (see parse_log.sh), which compares both the
+# throughput and the convergence of the two.
+
+# get the dirname of the script
+DIR="$( cd "$(dirname "$0")" ; pwd -P )"
+CAFFE=${CAFFE:-./build/tools/caffe}
+
+if [ "$#" -lt 1 ]
+then
+echo "Usage: benchmark_hogwild.sh /path/to/solver.prototxt"
+exit 1
+fi
+SOLVER=$1
+NAME=`basename $SOLVER .prototxt`
+grep -v 'hogwild_' $SOLVER > $NAME.sgd.prototxt
+
+for RUN in sgd hogwild
+do
+  if [ $RUN = sgd ]
+  then
+    RUN_SOLVER=$NAME.sgd.prototxt
+  else
+    RUN_SOLVER=$SOLVER
+  fi
+  GLOG_logtostderr=1 $CAFFE train --solver=$RUN_SOLVER 2> $NAME.$RUN.log
+  bash $DIR/parse_log.sh $NAME.$RUN.log
+  echo "$RUN:"
+  cat $NAME.$RUN.log.test
+  echo
+done
+rm -f $NAME.sgd.prototxt
@@ -1,19 +1,24 @@
 #include <stdio.h>  // for snprintf
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
 
 #include "boost/algorithm/string.hpp"
+#include "boost/thread.hpp"
 #include "google/protobuf/text_format.h"
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/vision_layers.hpp"
 
 using caffe::Blob;
+using caffe::BlockingQueue;
 using caffe::Caffe;
 using caffe::Datum;
 using caffe::Net;
@@ -21,6 +26,192 @@ using boost::shared_ptr;
 using std::string;
 namespace db = caffe::db;
 
+namespace {
+
+// The features of one blob for one mini-batch, copied out of the net so the
+// next Forward can run while they are written.
+template <typename Dtype>
+struct FeatureBatch {
+  int feature_id;
+  int num, channels, height, width;
+  std::vector<Dtype> data;
+};
+
+// Stores the feature vectors of one blob, one row per input. Write and Close
+// are both called on the writer thread.
+template <typename Dtype>
+class FeatureWriter {
+ public:
+  virtual ~FeatureWriter() { }
+  virtual void Write(const FeatureBatch<Dtype>& batch) = 0;
+  virtual void Close() = 0;
+};
+
+// Writes each row as a Datum into a leveldb/lmdb/packed db, keyed by its row
+// index. The values go to float_data, or with pack_values, into data as
+// data_type (FLOAT16 or FLOAT32). Transactions are begun by Write, on the
+// writer thread, since an LMDB write transaction belongs to the thread that
+// began it.
+template <typename Dtype>
+class DBFeatureWriter : public FeatureWriter<Dtype> {
+ public:
+  DBFeatureWriter(const string& backend, const string& name, bool pack_values,
+      caffe::Datum_DataType data_type)
+      : name_(name), count_(0), pack_values_(pack_values),
+        data_type_(data_type) {
+    db_.reset(db::GetDB(backend));
+    db_->Open(name, db::NEW);
+  }
+  virtual void Write(const FeatureBatch<Dtype>& batch) {
+    const int kMaxKeyStrLength = 100;
+    char key_str[kMaxKeyStrLength];
+    const int dim = batch.channels * batch.height * batch.width;
+    Datum datum;
+    datum.set_channels(batch.channels);
+    datum.set_height(batch.height);
+    datum.set_width(batch.width);
+    google::protobuf::RepeatedField<float>* float_data = NULL;
+    if (pack_values_) {
+      values_.resize(dim);
+    } else {
+      float_data = datum.mutable_float_data();
+      float_data->Resize(dim, 0);
+    }
+    string out;
+    for (int n = 0; n < batch.num; ++n) {
+      // Fill the repeated field in one pass instead of add_float_data per
+      // element.
+      const Dtype* row = &batch.data[n * dim];
+      float* dst = pack_values_ ? &values_[0] : float_data->mutable_data();
+      for (int d = 0; d < dim; ++d) {
+        dst[d] = static_cast<float>(row[d]);
+      }
+      if (pack_values_) {
+        caffe::FloatsToDatum(dst, dim, data_type_, &datum);
+      }
+      int length = snprintf(key_str, kMaxKeyStrLength, "%d", count_);
+      CHECK(datum.SerializeToString(&out));
+      if (!txn_) {
+        txn_.reset(db_->NewTransaction());
+      }
+      txn_->Put(std::string(key_str, length), out);
+      if (++count_ % 1000 == 0) {
+        txn_->Commit();
+        txn_.reset();
+        LOG(ERROR)<< "Extracted features of " << count_ <<
+            " query images into " << name_;
+      }
+    }
+  }
+  virtual void Close() {
+    if (txn_) {
+      txn_->Commit();
+      txn_.reset();
+    }
+    db_->Close();
+  }
+
+ private:
+  string name_;
+  int count_;
+  bool pack_values_;
+  caffe::Datum_DataType data_type_;
+  std::vector<float> values_;
+  shared_ptr<db::DB> db_;
+  shared_ptr<db::Transaction> txn_;
+};
+
+// Writes the rows back to back as native Dtype values. With npy, the file
+// starts with a NumPy .npy (version 1.0) header holding the final shape
+// (N, C, H, W), so it can be loaded with numpy.load(..., mmap_mode='r').
+template <typename Dtype>
+class RawFeatureWriter : public FeatureWriter<Dtype> {
+ public:
+  RawFeatureWriter(const string& name, bool npy)
+      : name_(name), npy_(npy), num_(0), channels_(0), height_(0),
+        width_(0) {
+    file_.open(name.c_str(), std::ios::out | std::ios::binary);
+    CHECK(file_.is_open()) << "Failed to open " << name;
+    if (npy_) {
+      // Reserve the header; the shape is only known at Close.
+      file_ << string(kHeaderSize, ' ');
+    }
+  }
+  virtual void Write(const FeatureBatch<Dtype>& batch) {
+    if (num_ == 0) {
+      channels_ = batch.channels;
+      height_ = batch.height;
+      width_ = batch.width;
+    }
+    CHECK_EQ(channels_ * height_ * width_,
+             batch.channels * batch.height * batch.width)
+        << "Feature size changed while writing " << name_;
+    file_.write(reinterpret_cast<const char*>(&batch.data[0]),
+                batch.data.size() * sizeof(Dtype));
+    CHECK(file_.good()) << "Failed to write " << name_;
+    num_ += batch.num;
+  }
+  virtual void Close() {
+    if (npy_) {
+      file_.seekp(0);
+      file_ << NpyHeader();
+    }
+    file_.close();
+    LOG(ERROR)<< "Wrote " << num_ << " x " << channels_ << " x " << height_
+        << " x " << width_ << (sizeof(Dtype) == 4 ? " float32" : " float64")
+        << " features to " << name_;
+  }
+
+ private:
+  static const int kHeaderSize = 128;
+
+  string NpyHeader() const {
+    char dict[kHeaderSize];
+    int length = snprintf(dict, kHeaderSize, "{'descr': '<f%d', "
+        "'fortran_order': False, 'shape': (%d, %d, %d, %d), }",
+        static_cast<int>(sizeof(Dtype)), num_, channels_, height_, width_);
+    // magic (6) + version (2) + header length (2) + dict, padded with spaces
+    // and ended by a newline.
+    const int dict_size = kHeaderSize - 10;
+    CHECK_LT(length, dict_size);
+    string header("\x93NUMPY\x01\x00", 8);
+    header += static_cast<char>(dict_size & 0xff);
+    header += static_cast<char>(dict_size >> 8);
+    header += string(dict, length);
+    header += string(dict_size - length - 1, ' ');
+    header += '\n';
+    return header;
+  }
+
+  string name_;
+  bool npy_;
+  std::ofstream file_;
+  int num_, channels_, height_, width_;
+};
+
+// Takes feature batches off the queue and writes them, until a NULL batch,
+// then closes the writers. Written batches go back to the free queue to be
+// filled again.
+template <typename Dtype>
+void WriteFeatures(std::vector<shared_ptr<FeatureWriter<Dtype> > >* writers,
+    BlockingQueue<FeatureBatch<Dtype>*>* full_batches,
+    BlockingQueue<FeatureBatch<Dtype>*>* free_batches) {
+  while (true) {
+    FeatureBatch<Dtype>* batch;
+    full_batches->pop(&batch);
+    if (batch == NULL) {
+      break;
+    }
+    writers->at(batch->feature_id)->Write(*batch);
+    free_batches->push(batch);
+  }
+  for (int i = 0; i < writers->size(); ++i) {
+    writers->at(i)->Close();
+  }
+}
+
+}  // namespace
+
 template<typename Dtype>
 int feature_extraction_pipeline(int argc, char** argv);
 
@@ -44,7 +235,11 @@ int feature_extraction_pipeline(int argc, char** argv) {
     "Note: you can extract multiple features in one pass by specifying"
     " multiple feature blob names and dataset names seperated by ','."
     " The names cannot contain white space characters and the number of blobs"
-    " and datasets must be equal.";
+    " and datasets must be equal.\n"
+    "db_type is leveldb, lmdb or packed for a db of Datum, or raw / npy for"
+    " a single file of contiguous feature rows (npy adds a NumPy header)."
+    " A db type may end in /fp16 or /fp32 to pack the Datum values into"
+    " data as float16 or float32 instead of float_data.";
     return 1;
   }
   int arg_pos = num_required_args;
@@ -112,77 +307,81 @@ int feature_extraction_pipeline(int argc, char** argv) {
       " the number of blob names and dataset names must be equal";
   size_t num_features = blob_names.size();
 
+  std::vector<shared_ptr<Blob<Dtype> > > feature_blobs;
   for (size_t i = 0; i < num_features; i++) {
     CHECK(feature_extraction_net->has_blob(blob_names[i]))
         << "Unknown feature blob name " << blob_names[i]
         << " in the network " << feature_extraction_proto;
+    feature_blobs.push_back(
+        feature_extraction_net->blob_by_name(blob_names[i]));
   }
 
   int num_mini_batches = atoi(argv[++arg_pos]);
 
-  std::vector<shared_ptr<db::DB> > feature_dbs;
-  std::vector<shared_ptr<db::Transaction> > txns;
+  std::string db_type(argv[++arg_pos]);
+  bool pack_values = false;
+  caffe::Datum_DataType data_type = Datum::FLOAT32;
+  const size_t slash = db_type.find('/');
+  if (slash != std::string::npos) {
+    const std::string value_type = db_type.substr(slash + 1);
+    CHECK(value_type == "fp16" || value_type == "fp32")
+        << "Unknown value type " << value_type;
+    pack_values = true;
+    data_type = value_type == "fp16" ? Datum::FLOAT16 : Datum::FLOAT32;
+    db_type = db_type.substr(0, slash);
+  }
+  std::vector<shared_ptr<FeatureWriter<Dtype> > > writers;
   for (size_t i = 0; i < num_features; ++i) {
     LOG(INFO)<< "Opening dataset " << dataset_names[i];
-    shared_ptr<db::DB> db(db::GetDB(argv[++arg_pos]));
-    db->Open(dataset_names.at(i), db::NEW);
-    feature_dbs.push_back(db);
-    shared_ptr<db::Transaction> txn(db->NewTransaction());
-    txns.push_back(txn);
+    if (db_type == "raw" || db_type == "npy") {
+      CHECK(!pack_values) << "raw and npy files hold the blob's own values";
+      writers.push_back(shared_ptr<FeatureWriter<Dtype> >(
+          new RawFeatureWriter<Dtype>(dataset_names[i], db_type == "npy")));
+    } else {
+      writers.push_back(shared_ptr<FeatureWriter<Dtype> >(
+          new DBFeatureWriter<Dtype>(db_type, dataset_names[i], pack_values,
+              data_type)));
+    }
   }
 
   LOG(ERROR)<< "Extacting Features";
 
-  Datum datum;
-  const int kMaxKeyStrLength = 100;
-  char key_str[kMaxKeyStrLength];
-  std::vector<Blob<float>*> input_vec;
-  std::vector<int> image_indices(num_features, 0);
+  // The main thread runs the net and copies each feature blob out with a
+  // single copy; a writer thread serializes and stores it meanwhile. Two
+  // batches per blob are in flight, so Forward never waits on a write unless
+  // the writer falls a whole batch behind.
+  const int kBatchesPerFeature = 2;
+  BlockingQueue<FeatureBatch<Dtype>*> full_batches, free_batches;
+  std::vector<shared_ptr<FeatureBatch<Dtype> > > batches;
+  for (int i = 0; i < kBatchesPerFeature * num_features; ++i) {
+    batches.push_back(shared_ptr<FeatureBatch<Dtype> >(
+        new FeatureBatch<Dtype>()));
+    free_batches.push(batches.back().get());
+  }
+  boost::thread writer(&WriteFeatures<Dtype>, &writers, &full_batches,
+      &free_batches);
+
+  std::vector<Blob<Dtype>*> input_vec;
   for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index) {
     feature_extraction_net->Forward(input_vec);
     for (int i = 0; i < num_features; ++i) {
-      const shared_ptr<Blob<Dtype> > feature_blob = feature_extraction_net
-          ->blob_by_name(blob_names[i]);
-      int batch_size = feature_blob->num();
-      int dim_features = feature_blob->count() / batch_size;
-      const Dtype* feature_blob_data;
-      for (int n = 0; n < batch_size; ++n) {
-        datum.set_height(feature_blob->height());
-        datum.set_width(feature_blob->width());
-        datum.set_channels(feature_blob->channels());
-        datum.clear_data();
-        datum.clear_float_data();
-        feature_blob_data = feature_blob->cpu_data() +
-            feature_blob->offset(n);
-        for (int d = 0; d < dim_features; ++d) {
-          datum.add_float_data(feature_blob_data[d]);
-        }
-        int length = snprintf(key_str, kMaxKeyStrLength, "%d",
-            image_indices[i]);
-        string out;
-        CHECK(datum.SerializeToString(&out));
-        txns.at(i)->Put(std::string(key_str, length), out);
-        ++image_indices[i];
-        if (image_indices[i] % 1000 == 0) {
-          txns.at(i)->Commit();
-          txns.at(i).reset(feature_dbs.at(i)->NewTransaction());
-          LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-              " query images for feature blob " << blob_names[i];
-        }
-      }  // for (int n = 0; n < batch_size; ++n)
-    }  // for (int i = 0; i < num_features; ++i)
-  }  // for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index)
-  // write the last batch
-  for (int i = 0; i < num_features; ++i) {
-    if (image_indices[i] % 1000 != 0) {
-      txns.at(i)->Commit();
+      const Blob<Dtype>& feature_blob = *feature_blobs[i];
+      FeatureBatch<Dtype>* batch;
+      free_batches.pop(&batch);
+      batch->feature_id = i;
+      batch->num = feature_blob.num();
+      batch->channels = feature_blob.channels();
+      batch->height = feature_blob.height();
+      batch->width = feature_blob.width();
+      batch->data.resize(feature_blob.count());
+      memcpy(&batch->data[0], feature_blob.cpu_data(),
+             feature_blob.count() * sizeof(Dtype));
+      full_batches.push(batch);
     }
-    LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-        " query images for feature blob " << blob_names[i];
-    feature_dbs.at(i)->Close();
-  }
+  }  // for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index)
+  full_batches.push(NULL);
+  writer.join();
 
   LOG(ERROR)<< "Successfully extracted the features!";
   return 0;
 }
-
@@ -1,12 +1,17 @@
 // This is a script to upgrade "V0" network prototxts to the new format.
 // Usage:
-//    upgrade_net_proto_binary v0_net_proto_file_in net_proto_file_out
+//    upgrade_net_proto_binary [--raw] v0_net_proto_file_in net_proto_file_out
+//
+// The input may also be a raw proto weight file; --raw writes the output as
+// one, which loads without parsing the weights.
 
 #include <cstring>
 #include <fstream>  // NOLINT(readability/streams)
 #include <iostream>  // NOLINT(readability/streams)
 #include <string>
 
+#include "gflags/gflags.h"
+
 #include "caffe/caffe.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/upgrade_proto.hpp"
@@ -15,17 +20,26 @@ using std::ofstream;
 
 using namespace caffe;  // NOLINT(build/namespaces)
 
+DEFINE_bool(raw, false,
+    "Write the output as a raw proto file instead of a binary proto");
+
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   if (argc != 3) {
-    LOG(ERROR) << "Usage: "
-        << "upgrade_net_proto_binary v0_net_proto_file_in net_proto_file_out";
+    LOG(ERROR) << "Usage: upgrade_net_proto_binary [--raw] "
+        << "v0_net_proto_file_in net_proto_file_out";
     return 1;
   }
 
   NetParameter net_param;
   string input_filename(argv[1]);
-  if (!ReadProtoFromBinaryFile(input_filename, &net_param)) {
+  if (IsRawProtoFile(input_filename)) {
+    ReadNetParamsFromRawFile(input_filename, &net_param);
+  } else if (!ReadProtoFromBinaryFile(input_filename, &net_param)) {
     LOG(ERROR) << "Failed to parse input binary file as NetParameter: "
                << input_filename;
     return 2;
@@ -42,8 +56,12 @@ int main(int argc, char** argv) {
     LOG(ERROR) << "File already in V1 proto format: " << argv[1];
   }
 
-  WriteProtoToBinaryFile(net_param, argv[2]);
-
-  LOG(ERROR) << "Wrote upgraded NetParameter binary proto to " << argv[2];
+  if (FLAGS_raw) {
+    WriteNetParamsToRawFile(net_param, argv[2]);
+    LOG(ERROR) << "Wrote upgraded NetParameter raw proto to " << argv[2];
+  } else {
+    WriteProtoToBinaryFile(net_param, argv[2]);
+    LOG(ERROR) << "Wrote upgraded NetParameter binary proto to " << argv[2];
+  }
   return !success;
 }